@@ -46,6 +46,12 @@ SPINLOCK_INLINE
 spinlock_data_t spinlock_data_get(volatile spinlock_data_t *sd);
 SPINLOCK_INLINE
 spinlock_data_t spinlock_data_testandset(volatile spinlock_data_t *sd);
+SPINLOCK_INLINE
+spinlock_data_t spinlock_data_swap(volatile spinlock_data_t *sd,
+				   spinlock_data_t val);
+SPINLOCK_INLINE
+bool spinlock_data_cas(volatile spinlock_data_t *sd,
+		       spinlock_data_t oldval, spinlock_data_t newval);
 
 ////////////////////////////////////////////////////////////
 
@@ -118,5 +124,69 @@ spinlock_data_testandset(volatile spinlock_data_t *sd)
 	return x;
 }
 
+/*
+ * Atomically store VAL into a spinlock_data_t and return the old
+ * value. Uses LL/SC as above, retrying until the SC succeeds.
+ */
+SPINLOCK_INLINE
+spinlock_data_t
+spinlock_data_swap(volatile spinlock_data_t *sd, spinlock_data_t val)
+{
+	spinlock_data_t x;
+	spinlock_data_t y;
+
+	do {
+		y = val;
+		__asm volatile(
+			".set push;"		/* save assembler mode */
+			".set mips32;"		/* allow MIPS32 instructions */
+			".set volatile;"	/* avoid unwanted optimization */
+			"ll %0, 0(%2);"		/*   x = *sd */
+			"sc %1, 0(%2);"		/*   *sd = y; y = success? */
+			".set pop"		/* restore assembler mode */
+			: "=&r" (x), "+r" (y) : "r" (sd));
+	} while (y == 0);
+	return x;
+}
+
+/*
+ * Compare-and-swap a spinlock_data_t: if it contains OLDVAL, store
+ * NEWVAL and return true; otherwise return false. The comparison has
+ * to be inside the LL/SC pair, so it's done in the asm with a branch
+ * around the SC.
+ */
+SPINLOCK_INLINE
+bool
+spinlock_data_cas(volatile spinlock_data_t *sd,
+		  spinlock_data_t oldval, spinlock_data_t newval)
+{
+	spinlock_data_t x;
+	spinlock_data_t y;
+
+	while (1) {
+		__asm volatile(
+			".set push;"		/* save assembler mode */
+			".set mips32;"		/* allow MIPS32 instructions */
+			".set volatile;"	/* avoid unwanted optimization */
+			".set noreorder;"	/* we fill the delay slot */
+			"ll %0, 0(%2);"		/*   x = *sd */
+			"bne %0, %3, 1f;"	/*   if (x != oldval) skip */
+			"move %1, $0;"		/*   (delay slot) y = 0 */
+			"move %1, %4;"		/*   y = newval */
+			"sc %1, 0(%2);"		/*   *sd = y; y = success? */
+			"1:"
+			".set pop"		/* restore assembler mode */
+			: "=&r" (x), "=&r" (y)
+			: "r" (sd), "r" (oldval), "r" (newval));
+		if (x != oldval) {
+			return false;
+		}
+		if (y != 0) {
+			return true;
+		}
+		/* SC failed; try again */
+	}
+}
+
 
 #endif /* _MIPS_SPINLOCK_H_ */
@@ -148,6 +148,11 @@ syscall(struct trapframe *tf)
 		retval = (int32_t)tf->tf_a1;
 		break;
 
+	case SYS_poll:
+		err = sys_poll((userptr_t)tf->tf_a0, (unsigned)tf->tf_a1,
+			       (int)tf->tf_a2, &retval);
+		break;
+
 	case SYS_chdir:
 		err = sys_chdir((userptr_t)tf->tf_a0);
 		break;
@@ -217,6 +222,10 @@ syscall(struct trapframe *tf)
 		err = sys_fork(tf, (pid_t *)&retval);
 		break;
 
+	case SYS_vfork:
+		err = sys_vfork(tf, (pid_t *)&retval);
+		break;
+
 	case SYS_getpid:
 		err = sys_getpid((pid_t *)&retval);
 		break;
@@ -225,12 +234,21 @@ syscall(struct trapframe *tf)
 		err = sys_waitpid((pid_t)tf->tf_a0, (int*)tf->tf_a1, (int)tf->tf_a2, (pid_t *)&retval);
 		break;
 
+	case SYS_wait4:
+		err = sys_wait4((pid_t)tf->tf_a0, (userptr_t)tf->tf_a1, (int)tf->tf_a2,
+				(userptr_t)tf->tf_a3, (pid_t *)&retval);
+		break;
+
 	/* Memory management system calls */
 
 	case SYS_sbrk:
 		err = sys_sbrk(tf->tf_a0, &retval);
 		break;
 
+	case SYS_mprotect:
+		err = sys_mprotect((userptr_t)tf->tf_a0, tf->tf_a1, tf->tf_a2);
+		break;
+
 	default:
 		kprintf("Unknown syscall %d\n", callno);
 		err = ENOSYS;
@@ -9,6 +9,7 @@
 #include <addrspace.h>
 #include <pagetable.h>
 #include <coremap.h>
+#include <textcache.h>
 
 static
 void
@@ -32,6 +33,7 @@ vm_bootstrap(void)
 
         // We can now use kmalloc
         tlbshootdown_init();
+        textcache_bootstrap();
 }
 
 vaddr_t
@@ -49,6 +51,10 @@ alloc_kpages(unsigned npages)
         }
 
         start = cm_capture_slots_for_kernel(npages);
+        if (start == CM_NOSLOT) {
+                cm_lower_page_count(npages);
+                return 0;
+        }
 
         for (i = 0; i < npages; i++) {
                 curr = start + i;
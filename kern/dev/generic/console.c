@@ -55,9 +55,12 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <wchan.h>
 #include <generic/console.h>
 #include <vfs.h>
 #include <device.h>
+#include <pollq.h>
+#include <kern/poll.h>
 #include "autoconf.h"
 
 /*
@@ -109,15 +112,87 @@ flush_delay_buf(void)
 
 //////////////////////////////////////////////////
 
+/*
+ * Send the next buffered character, if the device isn't busy with
+ * one already. Call with cs_lock held.
+ */
+static
+void
+con_kick(struct con_softc *cs)
+{
+	int ch;
+
+	KASSERT(spinlock_do_i_hold(&cs->cs_lock));
+
+	if (cs->cs_sending || cs->cs_outchars_head == cs->cs_outchars_tail) {
+		return;
+	}
+
+	ch = cs->cs_outchars[cs->cs_outchars_tail];
+	cs->cs_outchars_tail =
+		(cs->cs_outchars_tail + 1) % CONSOLE_OUTPUT_BUFFER_SIZE;
+	cs->cs_sending = true;
+	cs->cs_send(cs->cs_devdata, ch);
+}
+
+/*
+ * Add a character to the output buffer, waiting for space if it's
+ * full. Call with cs_lock held, and no other spinlocks.
+ *
+ * As with the input buffer, head == tail means the buffer is empty,
+ * so one slot is always left unused.
+ */
+static
+void
+con_enqueue(struct con_softc *cs, int ch)
+{
+	unsigned nexthead;
+
+	KASSERT(spinlock_do_i_hold(&cs->cs_lock));
+
+	nexthead = (cs->cs_outchars_head + 1) % CONSOLE_OUTPUT_BUFFER_SIZE;
+	while (nexthead == cs->cs_outchars_tail) {
+		wchan_sleep(cs->cs_wwchan, &cs->cs_lock);
+		nexthead = (cs->cs_outchars_head + 1) %
+			CONSOLE_OUTPUT_BUFFER_SIZE;
+	}
+
+	cs->cs_outchars[cs->cs_outchars_head] = ch;
+	cs->cs_outchars_head = nexthead;
+
+	con_kick(cs);
+}
+
+//////////////////////////////////////////////////
+
 /*
  * Print a character, using polling instead of interrupts to wait for
  * I/O completion.
+ *
+ * Anything still in the output buffer goes first, so that output
+ * stays in order; this matters for panic messages in particular.
+ * If we got here while holding cs_lock, though, the buffer may be
+ * in an inconsistent state, so leave it alone.
  */
 static
 void
 putch_polled(struct con_softc *cs, int ch)
 {
+	if (spinlock_do_i_hold(&cs->cs_lock)) {
+		cs->cs_sendpolled(cs->cs_devdata, ch);
+		return;
+	}
+
+	spinlock_acquire(&cs->cs_lock);
+	while (cs->cs_outchars_head != cs->cs_outchars_tail) {
+		cs->cs_sendpolled(cs->cs_devdata,
+				  cs->cs_outchars[cs->cs_outchars_tail]);
+		cs->cs_outchars_tail =
+			(cs->cs_outchars_tail + 1) % CONSOLE_OUTPUT_BUFFER_SIZE;
+	}
 	cs->cs_sendpolled(cs->cs_devdata, ch);
+	wchan_wakeall(cs->cs_wwchan, &cs->cs_lock);
+	spinlock_release(&cs->cs_lock);
 }
 
 //////////////////////////////////////////////////
@@ -129,8 +204,9 @@ static
 void
 putch_intr(struct con_softc *cs, int ch)
 {
-	P(cs->cs_wsem);
-	cs->cs_send(cs->cs_devdata, ch);
+	spinlock_acquire(&cs->cs_lock);
+	con_enqueue(cs, ch);
+	spinlock_release(&cs->cs_lock);
 }
 
 /*
@@ -142,10 +218,14 @@ getch_intr(struct con_softc *cs)
 {
 	unsigned char ret;
 
-	P(cs->cs_rsem);
+	spinlock_acquire(&cs->cs_lock);
+	while (cs->cs_gotchars_head == cs->cs_gotchars_tail) {
+		wchan_sleep(cs->cs_rwchan, &cs->cs_lock);
+	}
 	ret = cs->cs_gotchars[cs->cs_gotchars_tail];
 	cs->cs_gotchars_tail =
 		(cs->cs_gotchars_tail + 1) % CONSOLE_INPUT_BUFFER_SIZE;
+	spinlock_release(&cs->cs_lock);
 	return ret;
 }
 
@@ -153,10 +233,7 @@ getch_intr(struct con_softc *cs)
  * Called from underlying device when a read-ready interrupt occurs.
  *
  * Note: if gotchars_head == gotchars_tail, the buffer is empty. Thus
- * if gotchars_head+1 == gotchars_tail, the buffer is full. A slightly
- * tidier way to implement this check (that avoids wasting a slot,
- * too) would be with a second semaphore used with a nonblocking P,
- * but we don't have that in OS/161.
+ * if gotchars_head+1 == gotchars_tail, the buffer is full.
  */
 void
 con_input(void *vcs, int ch)
@@ -164,27 +241,40 @@ con_input(void *vcs, int ch)
 	struct con_softc *cs = vcs;
 	unsigned nexthead;
 
+	spinlock_acquire(&cs->cs_lock);
+
 	nexthead = (cs->cs_gotchars_head + 1) % CONSOLE_INPUT_BUFFER_SIZE;
 	if (nexthead == cs->cs_gotchars_tail) {
 		/* overflow; drop character */
+		spinlock_release(&cs->cs_lock);
 		return;
 	}
 
 	cs->cs_gotchars[cs->cs_gotchars_head] = ch;
 	cs->cs_gotchars_head = nexthead;
 
-	V(cs->cs_rsem);
+	wchan_wakeall(cs->cs_rwchan, &cs->cs_lock);
+	spinlock_release(&cs->cs_lock);
+
+	pollq_wakeup(&cs->cs_pollq);
 }
 
 /*
  * Called from underlying device when a write-done interrupt occurs.
+ * Send the next buffered character, if there is one.
  */
 void
 con_start(void *vcs)
 {
 	struct con_softc *cs = vcs;
 
-	V(cs->cs_wsem);
+	spinlock_acquire(&cs->cs_lock);
+	cs->cs_sending = false;
+	con_kick(cs);
+	wchan_wakeall(cs->cs_wwchan, &cs->cs_lock);
+	spinlock_release(&cs->cs_lock);
+
+	pollq_wakeup(&cs->cs_pollq);
 }
 
 //////////////////////////////////////////////////
@@ -240,15 +330,75 @@ con_eachopen(struct device *dev, int openflags)
 	return 0;
 }
 
+/*
+ * Copy buffered input into BUF, waiting until there is some. Stops
+ * after a newline, which is what a carriage return reads as.
+ */
+static
+size_t
+con_read(struct con_softc *cs, char *buf, size_t len)
+{
+	size_t n;
+	char ch;
+
+	spinlock_acquire(&cs->cs_lock);
+
+	while (cs->cs_gotchars_head == cs->cs_gotchars_tail) {
+		wchan_sleep(cs->cs_rwchan, &cs->cs_lock);
+	}
+
+	n = 0;
+	while (n < len && cs->cs_gotchars_head != cs->cs_gotchars_tail) {
+		ch = cs->cs_gotchars[cs->cs_gotchars_tail];
+		cs->cs_gotchars_tail =
+			(cs->cs_gotchars_tail + 1) % CONSOLE_INPUT_BUFFER_SIZE;
+		if (ch=='\r') {
+			ch = '\n';
+		}
+		buf[n++] = ch;
+		if (ch=='\n') {
+			break;
+		}
+	}
+
+	spinlock_release(&cs->cs_lock);
+	return n;
+}
+
+/*
+ * Put BUF in the output buffer, turning newlines into CRLF.
+ */
+static
+void
+con_write(struct con_softc *cs, const char *buf, size_t len)
+{
+	size_t i;
+
+	spinlock_acquire(&cs->cs_lock);
+	for (i=0; i<len; i++) {
+		if (buf[i]=='\n') {
+			con_enqueue(cs, '\r');
+		}
+		con_enqueue(cs, buf[i]);
+	}
+	spinlock_release(&cs->cs_lock);
+}
+
+/*
+ * Move data between the user and the console buffers a chunk at a
+ * time, rather than a character at a time.
+ */
+#define CON_IO_CHUNK 128
+
 static
 int
 con_io(struct device *dev, struct uio *uio)
 {
-	int result;
-	char ch;
+	struct con_softc *cs = dev->d_data;
+	char buf[CON_IO_CHUNK];
 	struct lock *lk;
-
-	(void)dev;  // unused
+	size_t n;
+	int result;
 
 	if (uio->uio_rw==UIO_READ) {
 		lk = con_userlock_read;
@@ -260,35 +410,54 @@ con_io(struct device *dev, struct uio *uio)
 	KASSERT(lk != NULL);
 	lock_acquire(lk);
 
+	result = 0;
 	while (uio->uio_resid > 0) {
+		n = uio->uio_resid < sizeof(buf) ? uio->uio_resid : sizeof(buf);
+
 		if (uio->uio_rw==UIO_READ) {
-			ch = getch();
-			if (ch=='\r') {
-				ch = '\n';
-			}
-			result = uiomove(&ch, 1, uio);
-			if (result) {
-				lock_release(lk);
-				return result;
-			}
-			if (ch=='\n') {
+			n = con_read(cs, buf, n);
+			result = uiomove(buf, n, uio);
+			if (result || buf[n-1]=='\n') {
 				break;
 			}
 		}
 		else {
-			result = uiomove(&ch, 1, uio);
+			result = uiomove(buf, n, uio);
 			if (result) {
-				lock_release(lk);
-				return result;
-			}
-			if (ch=='\n') {
-				putch('\r');
+				break;
 			}
-			putch(ch);
+			con_write(cs, buf, n);
 		}
 	}
 	lock_release(lk);
-	return 0;
+	return result;
+}
+
+/*
+ * Input is ready if there's any buffered; output if there's room in
+ * the output buffer.
+ */
+static
+int
+con_poll(struct device *dev, int events, struct poller *pl)
+{
+	struct con_softc *cs = dev->d_data;
+	int revents;
+
+	poll_register(pl, &cs->cs_pollq);
+
+	revents = 0;
+	spinlock_acquire(&cs->cs_lock);
+	if (cs->cs_gotchars_head != cs->cs_gotchars_tail) {
+		revents |= POLLIN;
+	}
+	if ((cs->cs_outchars_head + 1) % CONSOLE_OUTPUT_BUFFER_SIZE !=
+	    cs->cs_outchars_tail) {
+		revents |= POLLOUT;
+	}
+	spinlock_release(&cs->cs_lock);
+
+	return revents & events;
 }
 
 static
@@ -306,6 +475,7 @@ static const struct device_ops console_devops = {
 	.devop_eachopen = con_eachopen,
 	.devop_io = con_io,
 	.devop_ioctl = con_ioctl,
+	.devop_poll = con_poll,
 };
 
 static
@@ -343,7 +513,7 @@ attach_console_to_vfs(struct con_softc *cs)
 int
 config_con(struct con_softc *cs, int unit)
 {
-	struct semaphore *rsem, *wsem;
+	struct wchan *rwc, *wwc;
 	struct lock *rlk, *wlk;
 
 	/*
@@ -359,33 +529,38 @@ config_con(struct con_softc *cs, int unit)
 	}
 	KASSERT(the_console==NULL);
 
-	rsem = sem_create("console read", 0);
-	if (rsem == NULL) {
+	rwc = wchan_create("console read");
+	if (rwc == NULL) {
 		return ENOMEM;
 	}
-	wsem = sem_create("console write", 1);
-	if (wsem == NULL) {
-		sem_destroy(rsem);
+	wwc = wchan_create("console write");
+	if (wwc == NULL) {
+		wchan_destroy(rwc);
 		return ENOMEM;
 	}
 	rlk = lock_create("console-lock-read");
 	if (rlk == NULL) {
-		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(rwc);
+		wchan_destroy(wwc);
 		return ENOMEM;
 	}
 	wlk = lock_create("console-lock-write");
 	if (wlk == NULL) {
 		lock_destroy(rlk);
-		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(rwc);
+		wchan_destroy(wwc);
 		return ENOMEM;
 	}
 
-	cs->cs_rsem = rsem;
-	cs->cs_wsem = wsem;
+	spinlock_init(&cs->cs_lock);
+	cs->cs_rwchan = rwc;
+	cs->cs_wwchan = wwc;
 	cs->cs_gotchars_head = 0;
 	cs->cs_gotchars_tail = 0;
+	cs->cs_outchars_head = 0;
+	cs->cs_outchars_tail = 0;
+	cs->cs_sending = false;
+	pollq_init(&cs->cs_pollq);
 
 	the_console = cs;
 	con_userlock_read = rlk;
@@ -35,9 +35,16 @@
  *
  * devdata, send, and sendpolled are provided by the underlying
  * device, and are to be initialized by the attach routine.
+ *
+ * Output goes through a ring buffer that the write-done interrupt
+ * drains, so writers only wait when it's full.
  */
 
+#include <spinlock.h>
+#include <pollq.h>
+
 #define CONSOLE_INPUT_BUFFER_SIZE 32
+#define CONSOLE_OUTPUT_BUFFER_SIZE 1024
 
 struct con_softc {
 	/* initialized by attach routine */
@@ -46,11 +53,18 @@ struct con_softc {
 	void (*cs_sendpolled)(void *devdata, int ch);
 
 	/* initialized by config routine */
-	struct semaphore *cs_rsem;
-	struct semaphore *cs_wsem;
+	struct spinlock cs_lock;	/* protects the buffers below */
+	struct wchan *cs_rwchan;	/* readers waiting for input */
+	struct wchan *cs_wwchan;	/* writers waiting for buffer space */
 	unsigned char cs_gotchars[CONSOLE_INPUT_BUFFER_SIZE];
 	unsigned cs_gotchars_head;	/* next slot to put a char in */
 	unsigned cs_gotchars_tail;	/* next slot to take a char out */
+	unsigned char cs_outchars[CONSOLE_OUTPUT_BUFFER_SIZE];
+	unsigned cs_outchars_head;	/* next slot to put a char in */
+	unsigned cs_outchars_tail;	/* next slot to send */
+	bool cs_sending;		/* device is busy with a char */
+	struct pollq cs_pollq;		/* woken when input arrives or
+					   output space frees up */
 };
 
 /*
@@ -52,6 +52,7 @@
 #include <lamebus/emu.h>
 #include <platform/bus.h>
 #include <vfs.h>
+#include <textcache.h>
 #include <emufs.h>
 #include "autoconf.h"
 
@@ -598,6 +599,7 @@ emufs_write(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
+	result = 0;
 	while (uio->uio_resid > 0) {
 		amt = uio->uio_resid;
 		if (amt > EMU_MAXIO) {
@@ -608,7 +610,7 @@ emufs_write(struct vnode *v, struct uio *uio)
 
 		result = emu_write(ev->ev_emu, ev->ev_handle, amt, uio);
 		if (result) {
-			return result;
+			break;
 		}
 
 		if (uio->uio_resid == oldresid) {
@@ -617,7 +619,12 @@ emufs_write(struct vnode *v, struct uio *uio)
 		}
 	}
 
-	return 0;
+	/* Don't leave processes running the old contents */
+	if (v->vn_textmaps > 0) {
+		textcache_invalidate(v);
+	}
+
+	return result;
 }
 
 /*
@@ -720,7 +727,13 @@ int
 emufs_truncate(struct vnode *v, off_t len)
 {
 	struct emufs_vnode *ev = v->vn_data;
-	return emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	int result;
+
+	result = emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	if (v->vn_textmaps > 0) {
+		textcache_invalidate(v);
+	}
+	return result;
 }
 
 /*
@@ -1085,6 +1098,7 @@ static const struct vnode_ops emufs_fileops = {
 	.vop_mmap = emufs_mmap,
 	.vop_truncate = emufs_truncate,
 	.vop_namefile = emufs_uio_op_notdir,
+	.vop_poll = vopnop_poll_ready,
 
 	.vop_creat = emufs_creat_notdir,
 	.vop_symlink = emufs_symlink_notdir,
@@ -1119,6 +1133,7 @@ static const struct vnode_ops emufs_dirops = {
 	.vop_mmap = emufs_void_op_isdir,
 	.vop_truncate = emufs_truncate_isdir,
 	.vop_namefile = emufs_namefile,
+	.vop_poll = vopnop_poll_ready,
 
 	.vop_creat = emufs_creat,
 	.vop_symlink = emufs_symlink,
@@ -1271,6 +1286,8 @@ static const struct fs_ops emufs_fsops = {
 	/* we don't do block I/O */
 	.fsop_readblock = NULL,
 	.fsop_writeblock = NULL,
+	.fsop_readblocks = NULL,
+	.fsop_writeblocks = NULL,
 };
 
 /*
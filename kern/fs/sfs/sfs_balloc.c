@@ -104,7 +104,7 @@ sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock, struct buf **bufret)
 	/* Create the record
 	 * (OK that this is after bitmap_alloc since we still have
 	 * the freemap lock, so it won't be flushed yet) */
-	record = kmalloc(sizeof(struct sfs_record));
+	record = sfs_record_alloc();
 	if (record == NULL) {
 		bitmap_unmark(sfs->sfs_freemap, *diskblock);
 		sfs->sfs_freemapdirty = false;
@@ -115,7 +115,8 @@ sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock, struct buf **bufret)
 	record->freemap_update.block = *diskblock;
 	sfs_current_transaction_add_record(sfs, record, R_FREEMAP_CAPTURE);
 
-	new_lsn = curthread->t_tx->tx_highest_lsn;
+	/* The freemap isn't a buffer we hold; it needs a real LSN now */
+	new_lsn = sfs_current_transaction_lsn(sfs);
 	sfs->sfs_freemap_lowest_lsn = (sfs->sfs_freemap_lowest_lsn == 0 ? new_lsn : sfs->sfs_freemap_lowest_lsn);
 	sfs->sfs_freemap_highest_lsn = new_lsn;
 
@@ -148,7 +149,7 @@ sfs_bfree_prelocked(struct sfs_fs *sfs, daddr_t diskblock)
 	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
 
 	/* Create the record */
-	record = kmalloc(sizeof(struct sfs_record));
+	record = sfs_record_alloc();
 	if (record == NULL) {
 		panic("Out of memory when making record\n");
 	}
@@ -156,7 +157,7 @@ sfs_bfree_prelocked(struct sfs_fs *sfs, daddr_t diskblock)
 	record->freemap_update.block = diskblock;
 	sfs_current_transaction_add_record(sfs, record, R_FREEMAP_RELEASE);
 
-	new_lsn = curthread->t_tx->tx_highest_lsn;
+	new_lsn = sfs_current_transaction_lsn(sfs);
 	sfs->sfs_freemap_lowest_lsn = (sfs->sfs_freemap_lowest_lsn == 0 ? new_lsn : sfs->sfs_freemap_lowest_lsn);
 	sfs->sfs_freemap_highest_lsn = new_lsn;
 
@@ -426,7 +426,7 @@ sfs_blockobj_set(struct sfs_blockobj *bo, uint32_t offset, uint32_t newval)
 			      sfs->sfs_sb.sb_volname,
 			      indirlevel);
 		}
-		buffer_update_lsns(bo->bo_inode.i_sv->sv_dinobuf, curthread->t_tx->tx_highest_lsn);
+		sfs_current_transaction_tag(bo->bo_inode.i_sv->sv_dinobuf);
 		sfs_dinode_mark_dirty(bo->bo_inode.i_sv);
 	}
 	else {
@@ -455,7 +455,7 @@ sfs_blockobj_set(struct sfs_blockobj *bo, uint32_t offset, uint32_t newval)
 
 		idptr[offset] = newval;
 
-		buffer_update_lsns(bo->bo_idblock.id_buf, curthread->t_tx->tx_highest_lsn);
+		sfs_current_transaction_tag(bo->bo_idblock.id_buf);
 		buffer_mark_dirty(bo->bo_idblock.id_buf);
 	}
 }
@@ -600,8 +600,8 @@ sfs_bmap_subtree(struct sfs_fs *sfs, struct sfs_blockobj *inodeobj,
  * file. If DOALLOC is set, and no such block exists, one will be
  * allocated.
  *
- * Locking: must hold vnode lock. May get/release buffer cache locks
- * and (via sfs_balloc) sfs_freemaplock.
+ * Locking: must hold vnode lock, for writing if DOALLOC is set. May
+ * get/release buffer cache locks and (via sfs_balloc) sfs_freemaplock.
  *
  * Requires up to 2 buffers.
  */
@@ -615,7 +615,8 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	struct sfs_blockobj inodeobj;
 	int result;
 
-	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(rwlock_do_i_hold(sv->sv_lock));
+	KASSERT(!doalloc || rwlock_do_i_hold_write(sv->sv_lock));
 
 	/* Figure out where to start */
 	result = sfs_get_indirection(fileblock, &subtree, &offset);
@@ -1003,7 +1004,7 @@ sfs_discard_subtree(struct sfs_vnode *sv, uint32_t *rootptr, unsigned indir,
 					sfs_current_transaction_add_record(sfs, record, R_META_UPDATE);
 
 					*rootptr = 0;
-					buffer_update_lsns(sv->sv_dinobuf, curthread->t_tx->tx_highest_lsn);
+					sfs_current_transaction_tag(sv->sv_dinobuf);
 					sfs_dinode_mark_dirty(sv);
 				}
 				if (indir != 1) {
@@ -1032,7 +1033,7 @@ sfs_discard_subtree(struct sfs_vnode *sv, uint32_t *rootptr, unsigned indir,
 				 * has been modified
 				 */
 
-				buffer_update_lsns(layers[1].buf, curthread->t_tx->tx_highest_lsn);
+				sfs_current_transaction_tag(layers[1].buf);
 				buffer_mark_dirty(layers[1].buf);
 				if (indir != 1) {
 					layers[2].hasnonzero = true;
@@ -1087,7 +1088,7 @@ sfs_discard_subtree(struct sfs_vnode *sv, uint32_t *rootptr, unsigned indir,
 				sfs_current_transaction_add_record(sfs, record, R_META_UPDATE);
 
 				*rootptr = 0;
-				buffer_update_lsns(sv->sv_dinobuf, curthread->t_tx->tx_highest_lsn);
+				sfs_current_transaction_tag(sv->sv_dinobuf);
 				sfs_dinode_mark_dirty(sv);
 			}
 			if (indir == 3) {
@@ -1117,7 +1118,7 @@ sfs_discard_subtree(struct sfs_vnode *sv, uint32_t *rootptr, unsigned indir,
 			 * has been modified
 			 */
 
-			buffer_update_lsns(layers[2].buf, curthread->t_tx->tx_highest_lsn);
+			sfs_current_transaction_tag(layers[2].buf);
 			buffer_mark_dirty(layers[2].buf);
 			if (indir == 3) {
 				layers[3].hasnonzero = true;
@@ -1162,7 +1163,7 @@ sfs_discard_subtree(struct sfs_vnode *sv, uint32_t *rootptr, unsigned indir,
 
 		*rootptr = 0;
 
-		buffer_update_lsns(sv->sv_dinobuf, curthread->t_tx->tx_highest_lsn);
+		sfs_current_transaction_tag(sv->sv_dinobuf);
 		sfs_dinode_mark_dirty(sv);
 		buffer_release_and_invalidate(layers[3].buf);
 	}
@@ -1172,7 +1173,7 @@ sfs_discard_subtree(struct sfs_vnode *sv, uint32_t *rootptr, unsigned indir,
 		 * modified
 		 */
 
-		buffer_update_lsns(layers[3].buf, curthread->t_tx->tx_highest_lsn);
+		sfs_current_transaction_tag(layers[3].buf);
 		buffer_mark_dirty(layers[3].buf);
 		buffer_release(layers[3].buf);
 	}
@@ -1231,7 +1232,7 @@ sfs_discard(struct sfs_vnode *sv,
 
 			inodeptr->sfi_direct[i] = 0;
 
-			buffer_update_lsns(sv->sv_dinobuf, curthread->t_tx->tx_highest_lsn);
+			sfs_current_transaction_tag(sv->sv_dinobuf);
 			sfs_dinode_mark_dirty(sv);
 		}
 	}
@@ -1275,6 +1276,38 @@ sfs_discard(struct sfs_vnode *sv,
 	return 0;
 }
 
+/*
+ * Discard the blocks of a file from STARTFILEBLOCK through
+ * ENDFILEBLOCK - 1 without changing its length. Used to give back
+ * blocks allocated for a write that then failed.
+ *
+ * Locking: must hold vnode lock, for writing. Acquires/releases
+ * buffer locks and sfs_freemaplock.
+ *
+ * Requires up to 4 buffers.
+ */
+int
+sfs_idiscard(struct sfs_vnode *sv,
+	     uint32_t startfileblock, uint32_t endfileblock)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	int result;
+
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
+
+	result = sfs_dinode_load(sv);
+	if (result) {
+		return result;
+	}
+
+	sfs_lock_freemap(sfs);
+	result = sfs_discard(sv, startfileblock, endfileblock);
+	sfs_unlock_freemap(sfs);
+
+	sfs_dinode_unload(sv);
+	return result;
+}
+
 /*
  * Truncate a file (or directory).
  *
@@ -1295,7 +1328,7 @@ sfs_itrunc(struct sfs_vnode *sv, off_t newlen)
 	off_t pos;
 	size_t len;
 
-	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
 
 	result = sfs_dinode_load(sv);
 	if (result) {
@@ -1337,7 +1370,7 @@ sfs_itrunc(struct sfs_vnode *sv, off_t newlen)
 
 	/* Set the file size */
 	inodeptr->sfi_size = newlen;
-	buffer_update_lsns(sv->sv_dinobuf, curthread->t_tx->tx_highest_lsn);
+	sfs_current_transaction_tag(sv->sv_dinobuf);
 
 	/* Mark the inode dirty */
 	sfs_dinode_mark_dirty(sv);
@@ -3,6 +3,7 @@
 #include <synch.h>
 #include <types.h>
 #include <thread.h>
+#include <wchan.h>
 #include "sfs_transaction.h"
 #include "sfs_checkpoint.h"
 
@@ -36,6 +37,11 @@ checkpoint(struct sfs_fs *fs)
 			continue;
 		}
 
+		/* Nothing in the journal yet (it's all staged) */
+		if (tx->tx_lowest_lsn == 0) {
+			continue;
+		}
+
 		if (tx->tx_committed && tx->tx_highest_lsn < min_buf_lowest_lsn) {
 			sfs_transaction_destroy(tx);
 		}
@@ -52,24 +58,102 @@ checkpoint(struct sfs_fs *fs)
 	}
 }
 
+/*
+ * Is the journal full enough to be worth checkpointing?
+ */
+static
+bool
+checkpoint_needed(struct sfs_fs *fs)
+{
+	uint32_t used;
+
+	used = sfs_jphys_getoccupancy(fs);
+	return used * CHECKPOINT_THRESH_DENOM >=
+		fs->sfs_sb.sb_journalblocks * CHECKPOINT_THRESH_NUM;
+}
+
+/*
+ * Wake the checkpointing thread to reconsider. Called when the
+ * journal head moves past the threshold and when the oldest dirty
+ * buffer gets written out. Uses only a spinlock, so it is safe to
+ * call with the journal or buffer cache locked.
+ */
+void
+checkpoint_poke(struct sfs_fs *fs)
+{
+	spinlock_acquire(&fs->sfs_checkpoint_lock);
+	fs->sfs_checkpoint_kick = true;
+	wchan_wakeall(fs->sfs_checkpoint_wchan, &fs->sfs_checkpoint_lock);
+	spinlock_release(&fs->sfs_checkpoint_lock);
+}
+
+/*
+ * Buffer cache callback: the syncer (or anyone) wrote out this fs's
+ * oldest buffer, so a checkpoint may now be able to trim further.
+ */
+void
+checkpoint_buffers_advanced(struct fs *absfs)
+{
+	checkpoint_poke(absfs->fs_data);
+}
+
+/*
+ * The checkpointing thread sleeps until poked, and checkpoints when
+ * the journal is more than CHECKPOINT_THRESH_NUM/DENOM full. If a
+ * checkpoint can't get the journal back under the threshold (because
+ * old buffers are still dirty), the next poke comes when the syncer
+ * writes the oldest of them out.
+ */
 void
 checkpoint_thread(void *data1, unsigned long data2)
 {
 	struct sfs_fs *fs;
+	bool exiting;
 
 	(void)data2;
 
 	fs = (struct sfs_fs *) data1;
-	/* we checkpoint when the journal is > 1/4 full */
 
 	while (1) {
-		if (fs->sfs_checkpoint_exit) {
+		spinlock_acquire(&fs->sfs_checkpoint_lock);
+		while (!fs->sfs_checkpoint_kick && !fs->sfs_checkpoint_exit) {
+			wchan_sleep(fs->sfs_checkpoint_wchan,
+				    &fs->sfs_checkpoint_lock);
+		}
+		fs->sfs_checkpoint_kick = false;
+		exiting = fs->sfs_checkpoint_exit;
+		spinlock_release(&fs->sfs_checkpoint_lock);
+
+		if (exiting) {
 			checkpoint(fs);
 			/* tell unmounter that we got the message */
+			spinlock_acquire(&fs->sfs_checkpoint_lock);
 			fs->sfs_checkpoint_exit = 0;
+			wchan_wakeall(fs->sfs_checkpoint_wchan,
+				      &fs->sfs_checkpoint_lock);
+			spinlock_release(&fs->sfs_checkpoint_lock);
 			thread_exit();
 		}
-		checkpoint(fs);
-		thread_yield();
+
+		if (checkpoint_needed(fs)) {
+			checkpoint(fs);
+		}
+	}
+}
+
+/*
+ * Tell the checkpointing thread to do one last checkpoint and exit,
+ * and wait for it to do so.
+ */
+void
+checkpoint_stop(struct sfs_fs *fs)
+{
+	spinlock_acquire(&fs->sfs_checkpoint_lock);
+	fs->sfs_checkpoint_exit = 1;
+	wchan_wakeall(fs->sfs_checkpoint_wchan, &fs->sfs_checkpoint_lock);
+	while (fs->sfs_checkpoint_exit) {
+		wchan_sleep(fs->sfs_checkpoint_wchan,
+			    &fs->sfs_checkpoint_lock);
 	}
+	spinlock_release(&fs->sfs_checkpoint_lock);
 }
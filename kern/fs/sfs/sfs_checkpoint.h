@@ -1 +1,10 @@
+/*
+ * Checkpoint once the journal holds this fraction of its capacity.
+ */
+#define CHECKPOINT_THRESH_NUM	1
+#define CHECKPOINT_THRESH_DENOM	4
+
 void checkpoint_thread(void *data1, unsigned long data2);
+void checkpoint_poke(struct sfs_fs *fs);
+void checkpoint_buffers_advanced(struct fs *absfs);
+void checkpoint_stop(struct sfs_fs *fs);
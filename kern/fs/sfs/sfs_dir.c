@@ -95,7 +95,7 @@ sfs_dir_nentries(struct sfs_vnode *sv, int *ret)
 	struct sfs_dinode *inodeptr;
 	int result;
 
-	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(rwlock_do_i_hold(sv->sv_lock));
 	KASSERT(sv->sv_type == SFS_TYPE_DIR);
 
 	result = sfs_dinode_load(sv);
@@ -132,7 +132,7 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 	struct sfs_direntry tsd;
 	int found, nentries, i, result;
 
-	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(rwlock_do_i_hold(sv->sv_lock));
 
 	result = sfs_dir_nentries(sv, &nentries);
 	if (result) {
@@ -193,7 +193,7 @@ sfs_dir_findino(struct sfs_vnode *sv, uint32_t ino,
 	int nentries;
 	int i, result;
 
-	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(rwlock_do_i_hold(sv->sv_lock));
 
 	result = sfs_dir_nentries(sv, &nentries);
 	if (result) {
@@ -239,7 +239,7 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	int result;
 	struct sfs_direntry sd;
 
-	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
 
 	/* Look up the name. We want to make sure it *doesn't* exist. */
 	result = sfs_dir_findname(sv, name, NULL, NULL, &emptyslot);
@@ -288,7 +288,7 @@ sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 {
 	struct sfs_direntry sd;
 
-	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
 
 	/* Initialize a suitable directory entry... */
 	bzero(&sd, sizeof(sd));
@@ -318,7 +318,7 @@ sfs_dir_checkempty(struct sfs_vnode *sv)
 	int nentries;
 	int i, result;
 
-	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(rwlock_do_i_hold(sv->sv_lock));
 
 	result = sfs_dir_nentries(sv, &nentries);
 	if (result) {
@@ -367,7 +367,7 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name, struct sfs_vnode **ret,
 	int result, result2;
 	int emptyslot = -1;
 
-	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(rwlock_do_i_hold(sv->sv_lock));
 
 	result = sfs_dir_findname(sv, name, &ino, slot, &emptyslot);
 	if (result == ENOENT) {
@@ -42,6 +42,7 @@
 #include <array.h>
 #include <bitmap.h>
 #include <synch.h>
+#include <wchan.h>
 #include <uio.h>
 #include <vfs.h>
 #include <buf.h>
@@ -62,16 +63,9 @@
 #define TXID_TINLINE INLINE
 #endif
 
-#ifndef BLOCK_INLINE
-#define BLOCK_INLINE INLINE
-#endif
-
 DECLARRAY(txid_t, TXID_TINLINE);
 DEFARRAY(txid_t, TXID_TINLINE);
 
-DECLARRAY(block, BLOCK_INLINE);
-DEFARRAY(block, BLOCK_INLINE);
-
 /*
  * Routine for doing I/O (reads or writes) on the free block bitmap.
  * We always do the whole bitmap at once; writing individual sectors
@@ -255,8 +249,11 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	// TODO: is it as simple as moving up jphys flusing to here?
-	result = sfs_jphys_flushall(sfs);
+	/*
+	 * Force out the journal. Concurrent syncs and fsyncs share
+	 * the flush rather than each writing it.
+	 */
+	result = sfs_transaction_force(sfs, sfs_jphys_peeknextlsn(sfs) - 1);
 	if (result) {
 		return result;
 	}
@@ -352,6 +349,9 @@ static
 void
 sfs_fs_destroy(struct sfs_fs *sfs)
 {
+	buffer_lsn_unregister(&sfs->sfs_absfs);
+	wchan_destroy(sfs->sfs_checkpoint_wchan);
+	spinlock_cleanup(&sfs->sfs_checkpoint_lock);
 	sfs_jphys_destroy(sfs->sfs_jphys);
 	lock_destroy(sfs->sfs_renamelock);
 	lock_destroy(sfs->sfs_freemaplock);
@@ -387,10 +387,7 @@ sfs_unmount(struct fs *fs)
 	}
 
 	/* Wait for the checkpointing thread to exit, which will do one last checkpoint */
-	sfs->sfs_checkpoint_exit = 1;
-	while (sfs->sfs_checkpoint_exit) {
-		continue;
-	}
+	checkpoint_stop(sfs);
 
 	result = sfs_jphys_flushall(sfs);
 	if (result) {
@@ -432,6 +429,8 @@ static const struct fs_ops sfs_fsops = {
 	.fsop_unmount = sfs_unmount,
 	.fsop_readblock = sfs_readblock,
 	.fsop_writeblock = sfs_writeblock,
+	.fsop_readblocks = sfs_readblocks,
+	.fsop_writeblocks = sfs_writeblocks,
 	.fsop_attachbuf = sfs_attachbuf,
 	.fsop_detachbuf = sfs_detachbuf,
 };
@@ -513,10 +512,27 @@ sfs_fs_create(void)
 		goto cleanup_transaction_set;
 	}
 
+	/* checkpointing */
+	spinlock_init(&sfs->sfs_checkpoint_lock);
+	sfs->sfs_checkpoint_wchan = wchan_create("sfs checkpoint");
+	if (sfs->sfs_checkpoint_wchan == NULL) {
+		goto cleanup_jphys;
+	}
+	sfs->sfs_checkpoint_kick = false;
 	sfs->sfs_checkpoint_exit = 0;
 
+	if (buffer_lsn_register(&sfs->sfs_absfs, checkpoint_buffers_advanced,
+				sfs_transaction_settle)) {
+		goto cleanup_wchan;
+	}
+
 	return sfs;
 
+cleanup_wchan:
+	wchan_destroy(sfs->sfs_checkpoint_wchan);
+cleanup_jphys:
+	spinlock_cleanup(&sfs->sfs_checkpoint_lock);
+	sfs_jphys_destroy(sfs->sfs_jphys);
 cleanup_transaction_set:
 	sfs_transaction_set_destroy(sfs->sfs_transaction_set);
 cleanup_renamelock:
@@ -533,226 +549,278 @@ fail:
 	return NULL;
 }
 
+/*
+ * Recovery.
+ *
+ * One forward scan over the journal builds in-memory indexes:
+ *    - the set of committed transactions;
+ *    - the freemap records, in journal order;
+ *    - one entry per (block, record) for records that change disk
+ *      blocks, with cluster writes split into their blocks.
+ *
+ * The block entries are then sorted by block and, within a block, by
+ * journal position. That gives us each block's history in one place:
+ * its last entry says whether it ended up as user data (in which case
+ * none of its records are applied, as the metadata ones are stale and
+ * the user data ones have nothing to restore), and otherwise we redo
+ * its records in order and then undo the uncommitted ones in reverse.
+ * Blocks are independent, so doing this block by block in ascending
+ * order is equivalent to a full redo pass followed by a full undo
+ * pass, but touches each block once and visits the disk in order.
+ *
+ * The freemap is in memory, so its records are just redone and undone
+ * in journal order.
+ */
+struct sfs_recov_entry {
+	uint32_t re_block;		/* block (or freemap bit) affected */
+	unsigned re_seq;		/* position in the journal */
+	txid_t re_txid;
+	enum sfs_record_type re_type;
+	uint32_t re_checksum;		/* R_USER_BLOCK_WRITE */
+	void *re_data;			/* R_META_UPDATE: encoded record */
+	size_t re_len;
+};
+
+#ifndef RECOV_INLINE
+#define RECOV_INLINE INLINE
+#endif
+
+DECLARRAY(sfs_recov_entry, RECOV_INLINE);
+DEFARRAY(sfs_recov_entry, RECOV_INLINE);
+
 static
-bool
-sfs_skip_user_block_record(struct sfs_record record, enum sfs_record_type record_type, struct blockarray *user_blocks)
+struct sfs_recov_entry *
+sfs_recov_entry_create(struct sfs_recov_entryarray *entries,
+		       enum sfs_record_type type, txid_t txid,
+		       uint32_t block, unsigned seq)
 {
-	daddr_t block;
-
-        switch (record_type) {
-        case R_FREEMAP_CAPTURE:
-        case R_FREEMAP_RELEASE:
-        case R_TX_BEGIN:
-        case R_TX_COMMIT:
-	        return false;
-        case R_META_UPDATE:
-		block = record.meta_update.block;
-		break;
-        case R_USER_BLOCK_WRITE:
-		block = record.user_block_write.block;
-		break;
-        default:
-                panic("Unsupported record type\n");
-        }
+	struct sfs_recov_entry *re;
+	int err;
 
-	if (blockarray_contains(user_blocks, (void *)block)) {
-		return true;
+	re = kmalloc(sizeof(*re));
+	if (re == NULL) {
+		panic("Out of memory while reading journal\n");
 	}
-
-	return false;
+	re->re_block = block;
+	re->re_seq = seq;
+	re->re_txid = txid;
+	re->re_type = type;
+	re->re_checksum = 0;
+	re->re_data = NULL;
+	re->re_len = 0;
+
+	err = sfs_recov_entryarray_add(entries, re, NULL);
+	if (err) {
+		panic("Out of memory while reading journal\n");
+	}
+	return re;
 }
 
 static
 void
-sfs_undo_unsuccessful_transactions(struct sfs_fs *sfs, struct txid_tarray *commited_txs, struct blockarray *user_blocks)
+sfs_recov_entryarray_destroyall(struct sfs_recov_entryarray *entries)
 {
-	int err;
-	struct sfs_jiter *ji;
-	enum sfs_record_type record_type;
-	void *record_ptr;
-	size_t record_len;
-	struct sfs_record record;
+	struct sfs_recov_entry *re;
+	unsigned i;
 
-	err = sfs_jiter_revcreate(sfs, &ji);
-	if (err) {
-		panic("Error while reading journal\n");
+	for (i = 0; i < sfs_recov_entryarray_num(entries); i++) {
+		re = sfs_recov_entryarray_get(entries, i);
+		kfree(re->re_data);
+		kfree(re);
 	}
+	sfs_recov_entryarray_setsize(entries, 0);
+	sfs_recov_entryarray_destroy(entries);
+}
 
-	while (!sfs_jiter_done(ji)) {
-		record_type = sfs_jiter_type(ji);
-		record_ptr = sfs_jiter_rec(ji, &record_len);
-		memcpy(&record, record_ptr, record_len);
+/*
+ * Ordering for the block entries: by block, then journal position.
+ */
+static
+bool
+sfs_recov_entry_less(struct sfs_recov_entry *a, struct sfs_recov_entry *b)
+{
+	if (a->re_block != b->re_block) {
+		return a->re_block < b->re_block;
+	}
+	return a->re_seq < b->re_seq;
+}
 
-		if (!txid_tarray_contains(commited_txs, (void*)record.r_txid) &&
-		    !sfs_skip_user_block_record(record, record_type, user_blocks)) {
-			sfs_record_undo(sfs, record, record_type);
+/*
+ * Heapsort the block entries in place (no extra memory, n log n).
+ */
+static
+void
+sfs_recov_siftdown(struct sfs_recov_entryarray *entries, unsigned root,
+		   unsigned n)
+{
+	struct sfs_recov_entry *tmp;
+	unsigned child;
+
+	while ((child = 2 * root + 1) < n) {
+		if (child + 1 < n &&
+		    sfs_recov_entry_less(sfs_recov_entryarray_get(entries, child),
+			sfs_recov_entryarray_get(entries, child + 1))) {
+			child++;
 		}
-
-		err = sfs_jiter_prev(sfs, ji);
-		if (err) {
-			panic("Error while reading journal\n");
+		if (!sfs_recov_entry_less(sfs_recov_entryarray_get(entries, root),
+			sfs_recov_entryarray_get(entries, child))) {
+			return;
 		}
+		tmp = sfs_recov_entryarray_get(entries, root);
+		sfs_recov_entryarray_set(entries, root,
+			sfs_recov_entryarray_get(entries, child));
+		sfs_recov_entryarray_set(entries, child, tmp);
+		root = child;
 	}
-
-	sfs_jiter_destroy(ji);
 }
 
 static
 void
-sfs_redo_records(struct sfs_fs *sfs, struct blockarray *user_blocks)
+sfs_recov_sort(struct sfs_recov_entryarray *entries)
 {
-	int err;
-	struct sfs_jiter *ji;
-	enum sfs_record_type record_type;
-	void *record_ptr;
-	size_t record_len;
-	struct sfs_record record;
+	struct sfs_recov_entry *tmp;
+	unsigned n, i;
 
-	err = sfs_jiter_fwdcreate(sfs, &ji);
-	if (err) {
-		panic("Error while reading journal\n");
+	n = sfs_recov_entryarray_num(entries);
+	for (i = n / 2; i-- > 0; ) {
+		sfs_recov_siftdown(entries, i, n);
 	}
-
-	while (!sfs_jiter_done(ji)) {
-		record_type = sfs_jiter_type(ji);
-		record_ptr = sfs_jiter_rec(ji, &record_len);
-		memcpy(&record, record_ptr, record_len);
-
-		if (!sfs_skip_user_block_record(record, record_type, user_blocks)) {
-			sfs_record_redo(sfs, record, record_type);
-		}
-
-		err = sfs_jiter_next(sfs, ji);
-		if (err) {
-			panic("Error while reading journal\n");
-		}
+	for (i = n; i-- > 1; ) {
+		tmp = sfs_recov_entryarray_get(entries, 0);
+		sfs_recov_entryarray_set(entries, 0,
+			sfs_recov_entryarray_get(entries, i));
+		sfs_recov_entryarray_set(entries, i, tmp);
+		sfs_recov_siftdown(entries, 0, i);
 	}
-
-	sfs_jiter_destroy(ji);
 }
 
 /*
- * Returns an array of records to be skipped
+ * Rebuild the full record for an entry.
  */
 static
-struct blockarray *
-sfs_find_user_blocks(struct sfs_fs *sfs)
+void
+sfs_recov_entry_record(struct sfs_recov_entry *re, struct sfs_record *record)
 {
 	int err;
-	struct sfs_jiter *ji;
-
-	enum sfs_record_type record_type;
-	void *record_ptr;
-	size_t record_len;
-	struct sfs_record record;
-
-	daddr_t block;
-	bool user_block, meta_block;
-	struct blockarray *blocks;
-	struct blockarray *user_blocks;
-
-	blocks = blockarray_create();
-	if (blocks == NULL) {
-		panic("Error while reading journal\n");
-	}
-
-	user_blocks = blockarray_create();
-	if (blocks == NULL) {
-		panic("Error while reading journal\n");
-	}
 
-	err = sfs_jiter_revcreate(sfs, &ji);
-	if (err) {
-		panic("Error while reading journal\n");
+	if (re->re_type == R_META_UPDATE) {
+		err = sfs_record_decode(re->re_data, re->re_len,
+					R_META_UPDATE, record);
+		KASSERT(err == 0);
+		return;
 	}
 
-	while (!sfs_jiter_done(ji)) {
-		record_type = sfs_jiter_type(ji);
-		record_ptr = sfs_jiter_rec(ji, &record_len);
-		memcpy(&record, record_ptr, record_len);
-
-		block = 0;
-		meta_block = false;
-		user_block = false;
-
-		if (record_type == R_META_UPDATE) {
-			block = record.meta_update.block;
-			meta_block = true;
-		}
-
-		if (record_type == R_USER_BLOCK_WRITE) {
-			block = record.user_block_write.block;
-			user_block = true;
-		}
-
-		// If we haven't seen the block before, add it to the block list
-		// so we only record its final state once. Then, add it to the user
-		// block array only if it is a user block, i.e. only if it ends up
-		// as a user block.
-		if (user_block || meta_block) {
-			if (!blockarray_contains(blocks, (void *)block)) {
-				err = blockarray_add(blocks, (void *)block, NULL);
-				if (err) {
-					panic("Error while reading journal\n");
-				}
-
-				if (user_block) {
-					KASSERT(!blockarray_contains(user_blocks, (void *)block));
-
-					err = blockarray_add(user_blocks, (void *)block, NULL);
-					if (err) {
-						panic("Error while reading journal\n");
-					}
-				}
-			}
-		}
-
-		err = sfs_jiter_prev(sfs, ji);
-		if (err) {
-			panic("Error while reading journal\n");
-		}
+	bzero(record, sizeof(*record));
+	record->r_txid = re->re_txid;
+	switch (re->re_type) {
+	    case R_FREEMAP_CAPTURE:
+	    case R_FREEMAP_RELEASE:
+		record->freemap_update.block = re->re_block;
+		break;
+	    case R_USER_BLOCK_WRITE:
+		record->user_block_write.block = re->re_block;
+		record->user_block_write.checksum = re->re_checksum;
+		break;
+	    default:
+		panic("Unsupported record type\n");
 	}
-
-	blockarray_destroy(blocks);
-	sfs_jiter_destroy(ji);
-	return user_blocks;
 }
 
-// Returns an array of transaction id's that have commit records
+/*
+ * The single pass over the journal. Fills in BLOCKENTRIES and
+ * FREEMAPENTRIES and returns the set of committed transactions.
+ */
 static
-struct txid_tarray *
-sfs_check_records(struct sfs_fs *sfs)
+struct bitmap *
+sfs_recov_scan(struct sfs_fs *sfs, struct sfs_recov_entryarray *blockentries,
+	       struct sfs_recov_entryarray *freemapentries)
 {
 	int err;
 	struct sfs_jiter *ji;
 	enum sfs_record_type record_type;
-	struct txid_tarray *commited_txs;
-
 	void *record_ptr;
 	size_t record_len;
-	struct sfs_record record;
-
-	commited_txs = txid_tarray_create();
-	if (commited_txs == NULL) {
+	struct sfs_record record, block_record;
+	struct sfs_recov_entry *re;
+	struct txid_tarray *commited_list;
+	struct bitmap *commited_txs;
+	txid_t txid, max_txid;
+	unsigned seq, i;
+
+	commited_list = txid_tarray_create();
+	if (commited_list == NULL) {
 		panic("Error while reading journal\n");
 	}
+	max_txid = 0;
 
 	err = sfs_jiter_fwdcreate(sfs, &ji);
 	if (err) {
 		panic("Error while reading journal\n");
 	}
 
-	while (!sfs_jiter_done(ji)) {
+	for (seq = 0; !sfs_jiter_done(ji); seq++) {
 		record_type = sfs_jiter_type(ji);
+		record_ptr = sfs_jiter_rec(ji, &record_len);
+		err = sfs_record_decode(record_ptr, record_len, record_type, &record);
+		if (err) {
+			panic("Error while reading journal\n");
+		}
+		if (record.r_txid > max_txid) {
+			max_txid = record.r_txid;
+		}
 
-		if (record_type == R_TX_COMMIT) {
-			record_ptr = sfs_jiter_rec(ji, &record_len);
-			memcpy(&record, record_ptr, record_len);
-
-			err = txid_tarray_add(commited_txs, (void*)record.r_txid, NULL);
+		switch (record_type) {
+		    case R_TX_BEGIN:
+			break;
+		    case R_TX_COMMIT:
+			err = txid_tarray_add(commited_list,
+					      (void *)record.r_txid, NULL);
 			if (err) {
 				panic("Error while reading journal\n");
 			}
+			break;
+		    case R_FREEMAP_CAPTURE:
+		    case R_FREEMAP_RELEASE:
+			sfs_recov_entry_create(freemapentries, record_type,
+					       record.r_txid,
+					       record.freemap_update.block,
+					       seq);
+			break;
+		    case R_META_UPDATE:
+			re = sfs_recov_entry_create(blockentries, record_type,
+						    record.r_txid,
+						    record.meta_update.block,
+						    seq);
+			/* Keep the compact encoding, not the decoded copy */
+			re->re_data = kmalloc(record_len);
+			if (re->re_data == NULL) {
+				panic("Out of memory while reading journal\n");
+			}
+			memcpy(re->re_data, record_ptr, record_len);
+			re->re_len = record_len;
+			break;
+		    case R_USER_BLOCK_WRITE:
+			re = sfs_recov_entry_create(blockentries, record_type,
+						    record.r_txid,
+						    record.user_block_write.block,
+						    seq);
+			re->re_checksum = record.user_block_write.checksum;
+			break;
+		    case R_USER_CLUSTER_WRITE:
+			/* Index each block as if it had its own record */
+			for (i = 0; i < record.user_cluster_write.nblocks; i++) {
+				sfs_record_user_cluster_block(&record, i,
+							      &block_record);
+				re = sfs_recov_entry_create(blockentries,
+					R_USER_BLOCK_WRITE, record.r_txid,
+					block_record.user_block_write.block,
+					seq);
+				re->re_checksum =
+					block_record.user_block_write.checksum;
+			}
+			break;
+		    default:
+			panic("Unsupported record type\n");
 		}
 
 		err = sfs_jiter_next(sfs, ji);
@@ -762,63 +830,59 @@ sfs_check_records(struct sfs_fs *sfs)
 	}
 
 	sfs_jiter_destroy(ji);
+
+	/*
+	 * Turn the commit list into a bitmap indexed by txid, sized to
+	 * cover every txid seen so lookups need no range check.
+	 */
+	commited_txs = bitmap_create(max_txid + 1);
+	if (commited_txs == NULL) {
+		panic("Out of memory while reading journal\n");
+	}
+	for (i = 0; i < txid_tarray_num(commited_list); i++) {
+		txid = (txid_t)txid_tarray_get(commited_list, i);
+		if (!bitmap_isset(commited_txs, txid)) {
+			bitmap_mark(commited_txs, txid);
+		}
+	}
+	txid_tarray_setsize(commited_list, 0);
+	txid_tarray_destroy(commited_list);
+
 	return commited_txs;
 }
 
+/*
+ * Apply the records for the run of entries [START, END), which all
+ * concern the same block: redo forward, then undo the uncommitted
+ * ones backward. Skip the whole run if the block ended as user data.
+ */
 static
 void
-sfs_filter_reused_blocks(struct sfs_fs *sfs, struct txid_tarray *commited_txs)
+sfs_recov_apply_block(struct sfs_fs *sfs, struct sfs_recov_entryarray *entries,
+		      unsigned start, unsigned end, struct bitmap *commited_txs)
 {
-	return;
-	int err;
-	struct sfs_jiter *ji;
-	enum sfs_record_type record_type;
-	struct blockarray *uncommitted_allocated_blocks;
-
-	void *record_ptr;
-	size_t record_len;
+	struct sfs_recov_entry *re;
 	struct sfs_record record;
+	unsigned i;
 
-	uncommitted_allocated_blocks = blockarray_create();
-	if (commited_txs == NULL) {
-		panic("Error while reading journal\n");
+	re = sfs_recov_entryarray_get(entries, end - 1);
+	if (re->re_type == R_USER_BLOCK_WRITE) {
+		return;
 	}
 
-	err = sfs_jiter_fwdcreate(sfs, &ji);
-	if (err) {
-		panic("Error while reading journal\n");
+	for (i = start; i < end; i++) {
+		re = sfs_recov_entryarray_get(entries, i);
+		sfs_recov_entry_record(re, &record);
+		sfs_record_redo(sfs, record, re->re_type);
 	}
 
-	while (!sfs_jiter_done(ji)) {
-		record_type = sfs_jiter_type(ji);
-
-		if (record_type == R_FREEMAP_RELEASE) {
-			record_ptr = sfs_jiter_rec(ji, &record_len);
-			memcpy(&record, record_ptr, record_len);
-
-			if (!txid_tarray_contains(commited_txs, (void*)record.r_txid)) {
-				err = blockarray_add(uncommitted_allocated_blocks, (void*)record.freemap_update.block, NULL);
-				if (err) {
-					panic("Error while reading journal\n");
-				}
-			}
-		} else if (record_type == R_FREEMAP_CAPTURE) {
-			record_ptr = sfs_jiter_rec(ji, &record_len);
-			memcpy(&record, record_ptr, record_len);
-
-			if (txid_tarray_contains(commited_txs, (void*)record.r_txid) &&blockarray_contains(uncommitted_allocated_blocks, (void*)record.freemap_update.block)) {
-				blockarray_delete(uncommitted_allocated_blocks, (void*)record.r_txid);
-			}
-
-		}
-
-		err = sfs_jiter_next(sfs, ji);
-		if (err) {
-			panic("Error while reading journal\n");
+	for (i = end; i-- > start; ) {
+		re = sfs_recov_entryarray_get(entries, i);
+		if (!bitmap_isset(commited_txs, re->re_txid)) {
+			sfs_recov_entry_record(re, &record);
+			sfs_record_undo(sfs, record, re->re_type);
 		}
 	}
-
-	sfs_jiter_destroy(ji);
 }
 
 static
@@ -827,29 +891,54 @@ sfs_recover(struct fs *fs)
 {
 	int err;
 	struct sfs_fs *sfs = fs->fs_data;
-	struct txid_tarray *commited_txs;
-	struct blockarray *user_blocks;
-
-	// Pass 1: (forward) note which transactions committed successfully
-	commited_txs = sfs_check_records(sfs);
-
-	// Pass 2: (forward) Remove from the array of committed transactions
-	// any that allocate a block that a previous uncommitted transaction freed
-	sfs_filter_reused_blocks(sfs, commited_txs);
+	struct bitmap *commited_txs;
+	struct sfs_recov_entryarray *blockentries, *freemapentries;
+	struct sfs_recov_entry *re;
+	struct sfs_record record;
+	unsigned i, j, n;
 
-	// Pass 3: (reverse) note which blocks ended as user data
-	user_blocks = sfs_find_user_blocks(sfs);
+	blockentries = sfs_recov_entryarray_create();
+	freemapentries = sfs_recov_entryarray_create();
+	if (blockentries == NULL || freemapentries == NULL) {
+		panic("Out of memory while reading journal\n");
+	}
 
-	// Pass 4: (forward) redo every record, skipping writes to eventual user data
-	sfs_redo_records(sfs, user_blocks);
+	// Scan the journal once, building the indexes
+	commited_txs = sfs_recov_scan(sfs, blockentries, freemapentries);
+
+	// Redo and undo block records, one block at a time in block order
+	sfs_recov_sort(blockentries);
+	n = sfs_recov_entryarray_num(blockentries);
+	for (i = 0; i < n; i = j) {
+		re = sfs_recov_entryarray_get(blockentries, i);
+		for (j = i + 1; j < n; j++) {
+			if (sfs_recov_entryarray_get(blockentries, j)->re_block
+			    != re->re_block) {
+				break;
+			}
+		}
+		sfs_recov_apply_block(sfs, blockentries, i, j, commited_txs);
+	}
 
-	// Pass 5: (reverse) undo transactions without a commit record, skipping
-	// writes to eventual user data
-	sfs_undo_unsuccessful_transactions(sfs, commited_txs, user_blocks);
+	// Redo the freemap records, then undo the uncommitted ones
+	n = sfs_recov_entryarray_num(freemapentries);
+	for (i = 0; i < n; i++) {
+		re = sfs_recov_entryarray_get(freemapentries, i);
+		sfs_recov_entry_record(re, &record);
+		sfs_record_redo(sfs, record, re->re_type);
+	}
+	for (i = n; i-- > 0; ) {
+		re = sfs_recov_entryarray_get(freemapentries, i);
+		if (!bitmap_isset(commited_txs, re->re_txid)) {
+			sfs_recov_entry_record(re, &record);
+			sfs_record_undo(sfs, record, re->re_type);
+		}
+	}
 
 	// Cleanup
-	txid_tarray_destroy(commited_txs);
-	blockarray_destroy(user_blocks);
+	bitmap_destroy(commited_txs);
+	sfs_recov_entryarray_destroyall(blockentries);
+	sfs_recov_entryarray_destroyall(freemapentries);
 
 	// Sync our changes to disk
 	err = sync_fs_buffers(fs);
@@ -907,6 +996,11 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		return ENXIO;
 	}
 
+	result = sfs_transaction_init();
+	if (result) {
+		return result;
+	}
+
 	sfs = sfs_fs_create();
 	if (sfs == NULL) {
 		return ENOMEM;
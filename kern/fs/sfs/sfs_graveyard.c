@@ -41,7 +41,7 @@ graveyard_add(struct sfs_fs *sfs, uint32_t ino)
 
         graveyard = graveyard_get(sfs);
 
-        lock_acquire(graveyard->sv_lock);
+        rwlock_acquire_write(graveyard->sv_lock);
 
         slot = -1;
         err = sfs_dir_findname(graveyard, "", NULL, NULL, &slot);
@@ -61,7 +61,7 @@ graveyard_add(struct sfs_fs *sfs, uint32_t ino)
                 panic("Could not add inode to graveyard\n");
         }
 
-        lock_release(graveyard->sv_lock);
+        rwlock_release_write(graveyard->sv_lock);
         sfs_reclaim(&graveyard->sv_absvn);
 }
 
@@ -84,7 +84,7 @@ graveyard_remove(struct sfs_fs *sfs, uint32_t ino)
 
         graveyard = graveyard_get(sfs);
 
-        lock_acquire(graveyard->sv_lock);
+        rwlock_acquire_write(graveyard->sv_lock);
 
         err = sfs_dir_findname(graveyard, (const char *)&sd.sfd_name, &entry, &slot, NULL);
         if (err || slot < 0) {
@@ -103,7 +103,7 @@ graveyard_remove(struct sfs_fs *sfs, uint32_t ino)
                 panic("Could not remove inode from graveyard");
         }
 
-        lock_release(graveyard->sv_lock);
+        rwlock_release_write(graveyard->sv_lock);
         sfs_reclaim(&graveyard->sv_absvn);
 }
 
@@ -116,7 +116,7 @@ graveyard_flush(struct sfs_fs *sfs)
         struct sfs_vnode *sv;
 
         graveyard = graveyard_get(sfs);
-        lock_acquire(graveyard->sv_lock);
+        rwlock_acquire_write(graveyard->sv_lock);
 
         err = sfs_dir_nentries(graveyard, &nentries);
         if (err) {
@@ -136,12 +136,12 @@ graveyard_flush(struct sfs_fs *sfs)
                                 panic("Could not load vnode for graveyard entry");
                         }
 
-                        lock_release(graveyard->sv_lock);
+                        rwlock_release_write(graveyard->sv_lock);
                         sfs_reclaim(&sv->sv_absvn);
-                        lock_acquire(graveyard->sv_lock);
+                        rwlock_acquire_write(graveyard->sv_lock);
                 }
         }
 
-        lock_release(graveyard->sv_lock);
+        rwlock_release_write(graveyard->sv_lock);
         sfs_reclaim(&graveyard->sv_absvn);
 }
@@ -58,15 +58,22 @@ sfs_vnode_create(uint32_t ino, unsigned type)
 	if (sv == NULL) {
 		return NULL;
 	}
-	sv->sv_lock = lock_create("sfs_vnode");
+	sv->sv_lock = rwlock_create("sfs_vnode", false);
 	if (sv->sv_lock == NULL) {
 		kfree(sv);
 		return NULL;
 	}
+	sv->sv_dinolock = lock_create("sfs_dinode");
+	if (sv->sv_dinolock == NULL) {
+		rwlock_destroy(sv->sv_lock);
+		kfree(sv);
+		return NULL;
+	}
 	sv->sv_ino = ino;
 	sv->sv_type = type;
 	sv->sv_dinobuf = NULL;
 	sv->sv_dinobufcount = 0;
+	sv->sv_dinoholder = NULL;
 	return sv;
 }
 
@@ -77,7 +84,9 @@ static
 void
 sfs_vnode_destroy(struct sfs_vnode *victim)
 {
-	lock_destroy(victim->sv_lock);
+	KASSERT(victim->sv_dinobuf == NULL);
+	lock_destroy(victim->sv_dinolock);
+	rwlock_destroy(victim->sv_lock);
 	kfree(victim);
 }
 
@@ -91,7 +100,13 @@ sfs_vnode_destroy(struct sfs_vnode *victim)
  * sometimes more than once, so for now it needs to be recursive and
  * we count how many times it's been loaded.
  *
- * Locking: must hold the vnode lock.
+ * Since several readers can hold the vnode lock at once, and the
+ * buffer belongs to the thread that got it, the loaded inode belongs
+ * to one thread at a time: sv_dinolock is held from the outermost
+ * load to the matching unload. Readers should therefore keep the
+ * inode loaded only as long as they need it.
+ *
+ * Locking: must hold the vnode lock. Gets sv_dinolock.
  */
 int
 sfs_dinode_load(struct sfs_vnode *sv)
@@ -99,20 +114,27 @@ sfs_dinode_load(struct sfs_vnode *sv)
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	int result;
 
-	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(rwlock_do_i_hold(sv->sv_lock));
 
-	if (sv->sv_dinobufcount == 0) {
-		KASSERT(sv->sv_dinobuf == NULL);
-		result = buffer_read(&sfs->sfs_absfs, sv->sv_ino,SFS_BLOCKSIZE,
-				     &sv->sv_dinobuf);
-		if (result) {
-			return result;
-		}
-	}
-	else {
+	/* Only we ever set sv_dinoholder to ourselves, so no race. */
+	if (sv->sv_dinoholder == curthread) {
+		KASSERT(sv->sv_dinobufcount > 0);
 		KASSERT(sv->sv_dinobuf != NULL);
+		sv->sv_dinobufcount++;
+		return 0;
+	}
+
+	lock_acquire(sv->sv_dinolock);
+	KASSERT(sv->sv_dinobufcount == 0);
+	KASSERT(sv->sv_dinobuf == NULL);
+	result = buffer_read(&sfs->sfs_absfs, sv->sv_ino, SFS_BLOCKSIZE,
+			     &sv->sv_dinobuf);
+	if (result) {
+		lock_release(sv->sv_dinolock);
+		return result;
 	}
-	sv->sv_dinobufcount++;
+	sv->sv_dinoholder = curthread;
+	sv->sv_dinobufcount = 1;
 
 	return 0;
 }
@@ -124,13 +146,15 @@ sfs_dinode_load(struct sfs_vnode *sv)
  * Ideally this should be exactly once per operation when the
  * operation starts and ends, but we aren't there yet. (XXX)
  *
- * Locking: must hold the vnode lock.
+ * Locking: must hold the vnode lock. Releases sv_dinolock when the
+ * last load is undone.
  */
 void
 sfs_dinode_unload(struct sfs_vnode *sv)
 {
-	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(rwlock_do_i_hold(sv->sv_lock));
 
+	KASSERT(sv->sv_dinoholder == curthread);
 	KASSERT(sv->sv_dinobuf != NULL);
 	KASSERT(sv->sv_dinobufcount > 0);
 
@@ -138,6 +162,8 @@ sfs_dinode_unload(struct sfs_vnode *sv)
 	if (sv->sv_dinobufcount == 0) {
 		buffer_release(sv->sv_dinobuf);
 		sv->sv_dinobuf = NULL;
+		sv->sv_dinoholder = NULL;
+		lock_release(sv->sv_dinolock);
 	}
 }
 
@@ -151,9 +177,9 @@ sfs_dinode_unload(struct sfs_vnode *sv)
 struct sfs_dinode *
 sfs_dinode_map(struct sfs_vnode *sv)
 {
-	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(rwlock_do_i_hold(sv->sv_lock));
 
-	KASSERT(sv->sv_dinobuf != NULL);
+	KASSERT(sv->sv_dinoholder == curthread);
 	return buffer_map(sv->sv_dinobuf);
 }
 
@@ -161,14 +187,14 @@ sfs_dinode_map(struct sfs_vnode *sv)
  * Mark the on-disk inode dirty after scribbling in it with
  * sfs_dinode_map.
  *
- * Locking: must hold the vnode lock.
+ * Locking: must hold the vnode lock for writing.
  */
 void
 sfs_dinode_mark_dirty(struct sfs_vnode *sv)
 {
-	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
 
-	KASSERT(sv->sv_dinobuf != NULL);
+	KASSERT(sv->sv_dinoholder == curthread);
 	buffer_mark_dirty(sv->sv_dinobuf);
 }
 
@@ -193,7 +219,7 @@ sfs_reclaim(struct vnode *v)
 	bool buffers_needed;
 	int result;
 
-	lock_acquire(sv->sv_lock);
+	rwlock_acquire_write(sv->sv_lock);
 	lock_acquire(sfs->sfs_vnlock);
 
 	/*
@@ -210,7 +236,7 @@ sfs_reclaim(struct vnode *v)
 
 		spinlock_release(&v->vn_countlock);
 		lock_release(sfs->sfs_vnlock);
-		lock_release(sv->sv_lock);
+		rwlock_release_write(sv->sv_lock);
 		return EBUSY;
 	}
 	spinlock_release(&v->vn_countlock);
@@ -234,7 +260,7 @@ sfs_reclaim(struct vnode *v)
 		 * there's essentially no helping it...
 		 */
 		lock_release(sfs->sfs_vnlock);
-		lock_release(sv->sv_lock);
+		rwlock_release_write(sv->sv_lock);
 		if (buffers_needed) {
 			unreserve_buffers(SFS_BLOCKSIZE);
 		}
@@ -248,7 +274,7 @@ sfs_reclaim(struct vnode *v)
 		if (result) {
 			sfs_dinode_unload(sv);
 			lock_release(sfs->sfs_vnlock);
-			lock_release(sv->sv_lock);
+			rwlock_release_write(sv->sv_lock);
 			if (buffers_needed) {
 				unreserve_buffers(SFS_BLOCKSIZE);
 			}
@@ -291,7 +317,7 @@ sfs_reclaim(struct vnode *v)
 	vnode_cleanup(&sv->sv_absvn);
 
 	lock_release(sfs->sfs_vnlock);
-	lock_release(sv->sv_lock);
+	rwlock_release_write(sv->sv_lock);
 
 	sfs_vnode_destroy(sv);
 
@@ -407,6 +433,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 		dino->sfi_type = forcetype;
 		buffer_mark_dirty(dinobuf);
+		sfs_current_transaction_tag(dinobuf);
 	}
 
 	/*
@@ -506,10 +533,10 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	}
 
 	/* And load the inode. */
-	lock_acquire((*ret)->sv_lock);
+	rwlock_acquire_write((*ret)->sv_lock);
 	result = sfs_dinode_load(*ret);
 	if (result) {
-		lock_release((*ret)->sv_lock);
+		rwlock_release_write((*ret)->sv_lock);
 		/* this reclaims the inode */
 		VOP_DECREF(&(*ret)->sv_absvn);
 		return result;
@@ -175,6 +175,107 @@ sfs_writeblock(struct fs *fs, daddr_t block, void *fsbufdata,
 	return 0;
 }
 
+/*
+ * Set up a uio covering NBLOCKS consecutive disk blocks starting at
+ * BLOCK, one iovec per block.
+ */
+static
+void
+sfs_clusteruio(struct iovec *iov, struct uio *ku, void **data,
+	       daddr_t block, unsigned nblocks, enum uio_rw rw)
+{
+	unsigned i;
+
+	for (i=0; i<nblocks; i++) {
+		iov[i].iov_kbase = data[i];
+		iov[i].iov_len = SFS_BLOCKSIZE;
+	}
+	ku->uio_iov = iov;
+	ku->uio_iovcnt = nblocks;
+	ku->uio_offset = ((off_t)block) * SFS_BLOCKSIZE;
+	ku->uio_resid = nblocks * SFS_BLOCKSIZE;
+	ku->uio_segflg = UIO_SYSSPACE;
+	ku->uio_rw = rw;
+	ku->uio_space = NULL;
+}
+
+/*
+ * Read a run of consecutive blocks with a single device request.
+ *
+ * If the device fails part way through, the uio has been partly
+ * consumed and can't simply be reissued; fall back to reading the
+ * blocks one at a time, which gets the usual retry handling.
+ */
+int
+sfs_readblocks(struct fs *fs, daddr_t block, void **data,
+	       unsigned nblocks, size_t len)
+{
+	struct sfs_fs *sfs = fs->fs_data;
+	struct iovec iov[SFS_CLUSTERBLOCKS];
+	struct uio ku;
+	unsigned i;
+	int result;
+
+	KASSERT(len == SFS_BLOCKSIZE);
+	KASSERT(nblocks > 0 && nblocks <= SFS_CLUSTERBLOCKS);
+
+	sfs_clusteruio(iov, &ku, data, block, nblocks, UIO_READ);
+	result = DEVOP_IO(sfs->sfs_device, &ku);
+	if (result == 0) {
+		return 0;
+	}
+
+	for (i=0; i<nblocks; i++) {
+		result = sfs_readblock(fs, block + i, data[i], len);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write a run of consecutive blocks with a single device request.
+ *
+ * Journal blocks have ordering constraints that sfs_writeblock
+ * handles, so runs that touch the journal are written one block at
+ * a time. Likewise if the device fails part way through.
+ */
+int
+sfs_writeblocks(struct fs *fs, daddr_t block, void **data,
+		unsigned nblocks, size_t len)
+{
+	struct sfs_fs *sfs = fs->fs_data;
+	struct iovec iov[SFS_CLUSTERBLOCKS];
+	struct uio ku;
+	unsigned i;
+	int result;
+
+	KASSERT(len == SFS_BLOCKSIZE);
+	KASSERT(nblocks > 0 && nblocks <= SFS_CLUSTERBLOCKS);
+
+	for (i=0; i<nblocks; i++) {
+		if (sfs_block_is_journal(sfs, block + i)) {
+			goto oneatatime;
+		}
+	}
+
+	sfs_clusteruio(iov, &ku, data, block, nblocks, UIO_WRITE);
+	result = DEVOP_IO(sfs->sfs_device, &ku);
+	if (result == 0) {
+		return 0;
+	}
+
+ oneatatime:
+	for (i=0; i<nblocks; i++) {
+		result = sfs_writeblock(fs, block + i, NULL, data[i], len);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
 ////////////////////////////////////////////////////////////
 //
 // File-level I/O
@@ -207,7 +308,7 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	/* Allocate missing blocks if and only if we're writing */
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
 
-	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(rwlock_do_i_hold(sv->sv_lock));
 	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
 
 	/* Compute the block offset of this block in the file */
@@ -268,7 +369,7 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	 * If it was a write, mark the modified block dirty.
 	 */
 	if (uio->uio_rw == UIO_WRITE) {
-		buffer_update_lsns(iobuffer, curthread->t_tx->tx_highest_lsn);
+		sfs_current_transaction_tag(iobuffer);
 		buffer_mark_dirty(iobuffer);
 	}
 
@@ -296,7 +397,7 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	struct sfs_record *record;
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
 
-	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(rwlock_do_i_hold(sv->sv_lock));
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
@@ -356,7 +457,7 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 
 	if (uio->uio_rw == UIO_WRITE) {
 		buffer_mark_valid(iobuf);
-		buffer_update_lsns(iobuf, curthread->t_tx->tx_highest_lsn);
+		sfs_current_transaction_tag(iobuf);
 		buffer_mark_dirty(iobuf);
 	}
 
@@ -365,17 +466,233 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 }
 
 /*
- * Do I/O of a whole region of data, whether or not it's block-aligned.
+ * Do I/O (either read or write) of a run of NBLOCKS consecutive disk
+ * blocks, DISKBLOCK onward, that back consecutive whole blocks of the
+ * file. The buffers are obtained together so that blocks not in the
+ * cache are read with one device request, and on write the whole run
+ * is logged with a single journal record.
+ *
+ * Locking: must hold vnode lock.
+ *
+ * Requires up to NBLOCKS buffers.
+ */
+static
+int
+sfs_runio(struct sfs_vnode *sv, struct uio *uio, daddr_t diskblock,
+	  unsigned nblocks)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *iobufs[SFS_CLUSTERBLOCKS];
+	char *ioptrs[SFS_CLUSTERBLOCKS];
+	struct sfs_record *record;
+	unsigned i;
+	int result;
+
+	/* The buffer cache has to be able to hand us a whole run at once */
+	COMPILE_ASSERT(SFS_CLUSTERBLOCKS <= BUFFER_CLUSTER_MAX);
+
+	KASSERT(rwlock_do_i_hold(sv->sv_lock));
+	KASSERT(nblocks > 0 && nblocks <= SFS_CLUSTERBLOCKS);
+
+	result = buffer_get_cluster(&sfs->sfs_absfs, diskblock, nblocks,
+				    SFS_BLOCKSIZE, uio->uio_rw == UIO_READ,
+				    iobufs);
+	if (result) {
+		return result;
+	}
+
+	for (i=0; i<nblocks; i++) {
+		ioptrs[i] = buffer_map(iobufs[i]);
+	}
+
+	/*
+	 * Log the write to the journal
+	 */
+	if (uio->uio_rw == UIO_WRITE) {
+		// Log the checksums of the disk blocks *before* overwriting the data
+		record = sfs_record_create_user_cluster_write(diskblock,
+							      nblocks, ioptrs);
+		if (record == NULL) {
+			buffer_release_cluster(iobufs, nblocks);
+			return ENOMEM;
+		}
+		sfs_current_transaction_add_record(sfs, record, R_USER_CLUSTER_WRITE);
+	}
+
+	/*
+	 * Do the I/O into the buffers.
+	 */
+	for (i=0; i<nblocks; i++) {
+		result = uiomove(ioptrs[i], SFS_BLOCKSIZE, uio);
+		if (result) {
+			break;
+		}
+	}
+
+	/*
+	 * If writing, mark the blocks we completed dirty.
+	 */
+	if (uio->uio_rw == UIO_WRITE && i > 0) {
+		buffer_mark_dirty_cluster(iobufs, i,
+					  sfs_current_transaction_lsn(sfs));
+	}
+
+	buffer_release_cluster(iobufs, nblocks);
+	return result;
+}
+
+/*
+ * Give back the blocks of a cluster write that were allocated for it
+ * but never written: of the chunk of file blocks starting at
+ * FILEBLOCK, those from index FIRST up to N that are marked FRESH.
+ * Otherwise a failed write would leave zero-filled blocks in the
+ * file, possibly past EOF where nothing would ever reclaim them.
+ */
+static
+void
+sfs_clusterio_unalloc(struct sfs_vnode *sv, uint32_t fileblock,
+		      const daddr_t *diskblocks, const bool *fresh,
+		      unsigned first, unsigned n)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	unsigned i, j;
+	int result;
+
+	for (i=first; i<n; i=j) {
+		if (!fresh[i]) {
+			j = i + 1;
+			continue;
+		}
+		for (j=i; j<n && fresh[j]; j++) {
+			buffer_drop(&sfs->sfs_absfs, diskblocks[j],
+				    SFS_BLOCKSIZE);
+		}
+		result = sfs_idiscard(sv, fileblock + i, fileblock + j);
+		if (result) {
+			/* Leave the rest; they only read back as zeros */
+			kprintf("sfs: %s: could not release unwritten "
+				"blocks of file %u: %s\n",
+				sfs->sfs_sb.sb_volname, sv->sv_ino,
+				strerror(result));
+			return;
+		}
+	}
+}
+
+/*
+ * Do I/O of NBLOCKS whole blocks of the file, starting at the current
+ * (block-aligned) uio offset. Works in chunks of up to
+ * SFS_CLUSTERBLOCKS file blocks: maps the chunk, then hands each run
+ * of physically contiguous disk blocks to sfs_runio. Holes are filled
+ * with zeros when reading; when writing they are allocated up front
+ * so the new blocks can be clustered, and any of those the write
+ * fails to reach are released again.
  *
  * Locking: must hold vnode lock. May get/release sfs_freemaplock.
  *
- * Requires up to 3 buffers.
+ * Requires up to SFS_CLUSTERBLOCKS buffers, plus those needed by
+ * sfs_bmap and sfs_idiscard, which are not held during the I/O.
+ */
+static
+int
+sfs_clusterio(struct sfs_vnode *sv, struct uio *uio, uint32_t nblocks)
+{
+	daddr_t diskblocks[SFS_CLUSTERBLOCKS];
+	bool fresh[SFS_CLUSTERBLOCKS];
+	uint32_t fileblock;
+	unsigned chunk, i, j;
+	int result;
+	bool doalloc = (uio->uio_rw==UIO_WRITE);
+
+	KASSERT(rwlock_do_i_hold(sv->sv_lock));
+	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
+
+	while (nblocks > 0) {
+		chunk = nblocks < SFS_CLUSTERBLOCKS ?
+			nblocks : SFS_CLUSTERBLOCKS;
+
+		/*
+		 * Look up the disk blocks. If writing, allocate the
+		 * missing ones, remembering which they were.
+		 */
+		fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+		for (i=0; i<chunk; i++) {
+			fresh[i] = false;
+			result = sfs_bmap(sv, fileblock + i, false,
+					  &diskblocks[i]);
+			if (result == 0 && diskblocks[i] == 0 && doalloc) {
+				result = sfs_bmap(sv, fileblock + i, true,
+						  &diskblocks[i]);
+				fresh[i] = (result == 0);
+			}
+			if (result) {
+				sfs_clusterio_unalloc(sv, fileblock,
+						      diskblocks, fresh,
+						      0, i);
+				return result;
+			}
+		}
+
+		for (i=0; i<chunk; i=j) {
+			if (diskblocks[i] == 0) {
+				/*
+				 * No block - fill with zeros.
+				 *
+				 * We must be reading, or we would have
+				 * allocated a block above.
+				 */
+				KASSERT(uio->uio_rw == UIO_READ);
+				result = uiomovezeros(SFS_BLOCKSIZE, uio);
+				if (result) {
+					return result;
+				}
+				j = i + 1;
+				continue;
+			}
+
+			/* Find the end of the physically contiguous run */
+			for (j=i+1; j<chunk; j++) {
+				if (diskblocks[j] != diskblocks[i] + (j - i)) {
+					break;
+				}
+			}
+
+			result = sfs_runio(sv, uio, diskblocks[i], j - i);
+			if (result) {
+				if (doalloc) {
+					/*
+					 * Keep any block the write got
+					 * into, even partly; the file
+					 * length will cover it.
+					 */
+					sfs_clusterio_unalloc(sv, fileblock,
+						diskblocks, fresh,
+						DIVROUNDUP(uio->uio_offset,
+							   SFS_BLOCKSIZE)
+						- fileblock, chunk);
+				}
+				return result;
+			}
+		}
+
+		nblocks -= chunk;
+	}
+	return 0;
+}
+
+/*
+ * Do I/O of a whole region of data, whether or not it's block-aligned.
+ *
+ * Locking: must hold vnode lock, for writing if writing. May
+ * get/release sfs_freemaplock.
+ *
+ * Requires up to SFS_CLUSTERBLOCKS + 1 buffers.
  */
 int
 sfs_io(struct sfs_vnode *sv, struct uio *uio)
 {
 	uint32_t blkoff;
-	uint32_t nblocks, i;
+	uint32_t nblocks;
 	int result = 0;
 	uint32_t origresid, extraresid = 0;
 	struct sfs_dinode *inodeptr;
@@ -386,7 +703,9 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	off_t pos;
 	size_t len;
 
-	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(rwlock_do_i_hold(sv->sv_lock));
+	KASSERT(uio->uio_rw == UIO_READ ||
+		rwlock_do_i_hold_write(sv->sv_lock));
 
 	origresid = uio->uio_resid;
 
@@ -418,6 +737,13 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 			KASSERT(uio->uio_resid > extraresid);
 			uio->uio_resid -= extraresid;
 		}
+
+		/*
+		 * That's all a read needs from the inode; let other
+		 * readers of the file at it while we move the data.
+		 */
+		sfs_dinode_unload(sv);
+		inodeptr = NULL;
 	}
 
 	/*
@@ -453,11 +779,14 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	 */
 	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
 	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
-	for (i=0; i<nblocks; i++) {
+	if (nblocks == 1) {
 		result = sfs_blockio(sv, uio);
-		if (result) {
-			goto out;
-		}
+	}
+	else if (nblocks > 1) {
+		result = sfs_clusterio(sv, uio, nblocks);
+	}
+	if (result) {
+		goto out;
 	}
 
 	/*
@@ -473,10 +802,14 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	}
 
  out:
+	if (uio->uio_rw == UIO_READ) {
+		/* Add in any extra amount we couldn't read because of EOF */
+		uio->uio_resid += extraresid;
+		return result;
+	}
 
 	/* If writing and we did anything, adjust file length */
 	if (uio->uio_resid != origresid &&
-	    uio->uio_rw == UIO_WRITE &&
 	    uio->uio_offset > (off_t)inodeptr->sfi_size) {
 
 		/* Create the record */
@@ -494,14 +827,11 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 		sfs_current_transaction_add_record(sfs, record, R_META_UPDATE);
 
 		inodeptr->sfi_size = uio->uio_offset;
-		buffer_update_lsns(sv->sv_dinobuf, curthread->t_tx->tx_highest_lsn);
+		sfs_current_transaction_tag(sv->sv_dinobuf);
 		sfs_dinode_mark_dirty(sv);
 	}
 	sfs_dinode_unload(sv);
 
-	/* Add in any extra amount we couldn't read because of EOF */
-	uio->uio_resid += extraresid;
-
 	/* Done */
 	return result;
 }
@@ -539,7 +869,7 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	daddr_t block;
 	off_t pos;
 
-	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(rwlock_do_i_hold(sv->sv_lock));
 
 	/* Figure out which block of the vnode (directory, whatever) this is */
 	vnblock = actualpos / SFS_BLOCKSIZE;
@@ -598,7 +928,7 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 
 		/* Update the selected region */
 		memcpy(ioptr + blockoffset, data, len);
-		buffer_update_lsns(iobuf, curthread->t_tx->tx_highest_lsn);
+		sfs_current_transaction_tag(iobuf);
 		buffer_mark_dirty(iobuf);
 
 		/* Update the vnode size if needed */
@@ -620,7 +950,7 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 			sfs_current_transaction_add_record(sfs, record, R_META_UPDATE);
 
 			dino->sfi_size = endpos;
-			buffer_update_lsns(sv->sv_dinobuf, curthread->t_tx->tx_highest_lsn);
+			sfs_current_transaction_tag(sv->sv_dinobuf);
 			sfs_dinode_mark_dirty(sv);
 		}
 	}
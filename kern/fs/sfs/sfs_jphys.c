@@ -38,6 +38,7 @@
 #include <sfs.h>
 #include "sfsprivate.h"
 #include "sfs_transaction.h"
+#include "sfs_checkpoint.h"
 
 /*
  * Physical journal container.
@@ -166,6 +167,21 @@ sfs_jposition_eq(const struct sfs_jposition *a, const struct sfs_jposition *b)
 ////////////////////////////////////////////////////////////
 // writer interface
 
+/*
+ * Number of journal blocks between the in-memory tail and the head,
+ * inclusive. Caller holds jp_lsnmaplock.
+ */
+static
+uint32_t
+sfs_jphys_occupancy(struct sfs_fs *sfs)
+{
+	struct sfs_jphys *jp = sfs->sfs_jphys;
+	uint32_t nblocks = sfs->sfs_sb.sb_journalblocks;
+
+	KASSERT(spinlock_do_i_hold(&jp->jp_lsnmaplock));
+	return (jp->jp_headjblock + nblocks - jp->jp_memtailjblock) % nblocks + 1;
+}
+
 /*
  * Move to the next journal block. (If we don't need another journal
  * block yet, return without doing anything.)
@@ -181,6 +197,7 @@ void
 sfs_advance_journal(struct sfs_fs *sfs)
 {
 	struct sfs_jphys *jp = sfs->sfs_jphys;
+	uint32_t used;
 
 	/*
 	 * XXX we have to make sure here that the journal head never
@@ -239,7 +256,14 @@ sfs_advance_journal(struct sfs_fs *sfs)
 		      sfs->sfs_sb.sb_volname);
 	}
 	jp->jp_firstlsns[jp->jp_headjblock] = jp->jp_headfirstlsn;
+	used = sfs_jphys_occupancy(sfs);
 	spinlock_release(&jp->jp_lsnmaplock);
+
+	/* If the journal is getting full, wake the checkpointer. */
+	if (used * CHECKPOINT_THRESH_DENOM >=
+	    sfs->sfs_sb.sb_journalblocks * CHECKPOINT_THRESH_NUM) {
+		checkpoint_poke(sfs);
+	}
 }
 
 /*
@@ -375,60 +399,31 @@ sfs_pad_journal(struct sfs_fs *sfs)
 }
 
 /*
- * Write a journal entry into the physical journal.
+ * Put one journal entry into the journal head buffer. Caller holds
+ * jp_lock. ALREADY_GETTINGNEXT is as computed in
+ * sfs_jphys_write_internal below.
  *
- * TAILLSN is the tail LSN to apply to the tail reservation TRES.
- * TRES can be null in cases where no tail reservation is needed
- * (e.g. for trim records); TAILLSN can also be zero, in which case
- * the LSN of the current record is used.
- *
- * CODE is the journal record type code; REC is the record data, which
- * is of length LEN.
- *
- * Takes care of padding and block boundaries. Handles the record
- * header.
- *
- * Does not fail. If something happens while writing to the journal
- * such that we can't get a journal buffer to write into (see above)
- * we panic, as there's not much one can do to continue in that case.
+ * If this turns over the journal head, the caller becomes
+ * responsible for getting the next buffer (with sfs_getnextbuf)
+ * before it writes anything else or lets go of the lock.
  */
 static
 sfs_lsn_t
-sfs_jphys_write_internal(struct sfs_fs *sfs,
-			 void (*callback)(sfs_lsn_t newlsn,
-					  bool commit),
-			 struct sfs_jphys_writecontext *ctx,
-			 unsigned class, unsigned type,
-			 const void *rec, size_t len)
+sfs_jphys_put_record(struct sfs_fs *sfs, bool already_gettingnext,
+		     unsigned class, unsigned type,
+		     const void *rec, size_t len)
 {
 	struct sfs_jphys *jp = sfs->sfs_jphys;
 	struct sfs_jphys_header hdr;
 	sfs_lsn_t lsn;
 	size_t totallen;
-	bool already_gettingnext;
 
+	KASSERT(lock_do_i_hold(jp->jp_lock));
 	KASSERT(len % 2 == 0);
 
-	(void)ctx;
-
 	/* our total length includes a header */
 	totallen = len + sizeof(hdr);
 
-	/* lock the journal */
-	lock_acquire(jp->jp_lock);
-
-	/*
-	 * If we are already marked responsible for getting the next
-	 * journal head buffer, we must be here recursively. This
-	 * happens when e.g. sfs_getnextbuf triggers an eviction that
-	 * triggers a journal write. We need to *not* get the next
-	 * journal head buffer in this call, because we're already
-	 * doing so up the call stack and doing it here would make a
-	 * mess. And we must not wait for ourselves.
-	 */
-	already_gettingnext = jp->jp_nextbuf == NULL &&
-		jp->jp_gettingnext == curthread;
-
 	/*
 	 * If the journal head is turning over, wait until it
 	 * finishes. If we're the thread that was supposed to fetch
@@ -495,6 +490,60 @@ sfs_jphys_write_internal(struct sfs_fs *sfs,
 	sfs_put_journal(sfs, lsn, &hdr, sizeof(hdr));
 	sfs_put_journal(sfs, lsn, rec, len);
 
+	return lsn;
+}
+
+/*
+ * Write a journal entry into the physical journal.
+ *
+ * TAILLSN is the tail LSN to apply to the tail reservation TRES.
+ * TRES can be null in cases where no tail reservation is needed
+ * (e.g. for trim records); TAILLSN can also be zero, in which case
+ * the LSN of the current record is used.
+ *
+ * CODE is the journal record type code; REC is the record data, which
+ * is of length LEN.
+ *
+ * Takes care of padding and block boundaries. Handles the record
+ * header.
+ *
+ * Does not fail. If something happens while writing to the journal
+ * such that we can't get a journal buffer to write into (see above)
+ * we panic, as there's not much one can do to continue in that case.
+ */
+static
+sfs_lsn_t
+sfs_jphys_write_internal(struct sfs_fs *sfs,
+			 void (*callback)(sfs_lsn_t newlsn,
+					  bool commit),
+			 struct sfs_jphys_writecontext *ctx,
+			 unsigned class, unsigned type,
+			 const void *rec, size_t len)
+{
+	struct sfs_jphys *jp = sfs->sfs_jphys;
+	sfs_lsn_t lsn;
+	bool already_gettingnext;
+
+	(void)ctx;
+
+	/* lock the journal */
+	lock_acquire(jp->jp_lock);
+
+	/*
+	 * If we are already marked responsible for getting the next
+	 * journal head buffer, we must be here recursively. This
+	 * happens when e.g. sfs_getnextbuf triggers an eviction that
+	 * triggers a journal write. We need to *not* get the next
+	 * journal head buffer in this call, because we're already
+	 * doing so up the call stack and doing it here would make a
+	 * mess. And we must not wait for ourselves.
+	 */
+	already_gettingnext = jp->jp_nextbuf == NULL &&
+		jp->jp_gettingnext == curthread;
+
+	lsn = sfs_jphys_put_record(sfs, already_gettingnext,
+				   class, type, rec, len);
+
 	/* Call the callback, if any */
 	if (callback != NULL) {
 		callback(lsn, type == R_TX_COMMIT);
@@ -541,6 +590,57 @@ sfs_jphys_write(struct sfs_fs *sfs,
 					code, rec, len);
 }
 
+/*
+ * Write a run of client records, in order, taking the journal lock
+ * once for all of them. The LSN of each is handed back in LSNS. The
+ * LSNs are increasing but not necessarily consecutive: if the batch
+ * turns over the journal head we have to let go of the lock to get
+ * the next buffer (see sfs_getnextbuf), and someone else's records
+ * may get in then.
+ *
+ * CALLBACK is called for each record with the lock held, but always
+ * with COMMIT false; the caller is expected to see to that itself
+ * once it has finished with the LSNs.
+ */
+void
+sfs_jphys_writebatch(struct sfs_fs *sfs,
+		     void (*callback)(sfs_lsn_t newlsn,
+				      bool commit),
+		     const struct sfs_jphys_batchrec *recs, unsigned nrecs,
+		     sfs_lsn_t *lsns)
+{
+	struct sfs_jphys *jp = sfs->sfs_jphys;
+	unsigned i;
+
+	KASSERT(jp->jp_writermode);
+
+	lock_acquire(jp->jp_lock);
+
+	/* We can't be inside sfs_getnextbuf; see sfs_jphys_write_internal */
+	KASSERT(jp->jp_nextbuf != NULL || jp->jp_gettingnext != curthread);
+
+	for (i=0; i<nrecs; i++) {
+		if (jp->jp_nextbuf == NULL &&
+		    jp->jp_gettingnext == curthread) {
+			/* the previous record turned over the head */
+			sfs_getnextbuf(sfs);
+		}
+		lsns[i] = sfs_jphys_put_record(sfs, false, SFS_JPHYS_CLIENT,
+					       recs[i].jb_code, recs[i].jb_rec,
+					       recs[i].jb_len);
+		if (callback != NULL) {
+			callback(lsns[i], false);
+		}
+	}
+
+	if (jp->jp_nextbuf == NULL && jp->jp_gettingnext == curthread) {
+		sfs_getnextbuf(sfs);
+	}
+	KASSERT(jp->jp_nextbuf != NULL);
+
+	lock_release(jp->jp_lock);
+}
+
 // Update out transaction struct with the new LSN. The buffer
 // associated with this record's data will be updated when it
 // gets actually written to.
@@ -872,6 +972,26 @@ sfs_jphys_peeknextlsn(struct sfs_fs *sfs)
 	return nextlsn;
 }
 
+/*
+ * Return how many journal blocks are currently in use, i.e. between
+ * the (in-memory) tail and the head. Like sfs_jphys_peeknextlsn, the
+ * answer may be stale by the time the caller looks at it.
+ */
+uint32_t
+sfs_jphys_getoccupancy(struct sfs_fs *sfs)
+{
+	struct sfs_jphys *jp = sfs->sfs_jphys;
+	uint32_t ret;
+
+	lock_acquire(jp->jp_lock);
+	spinlock_acquire(&jp->jp_lsnmaplock);
+	ret = sfs_jphys_occupancy(sfs);
+	spinlock_release(&jp->jp_lsnmaplock);
+	lock_release(jp->jp_lock);
+
+	return ret;
+}
+
 /*
  * Trim the journal to a given LSN. The LSN specified is left in the
  * journal, but all LSNs before it are discarded and will no longer
@@ -992,6 +1112,10 @@ struct sfs_jiter {
 	/* buffer for current journal block */
 	struct buf *ji_buf;
 
+	/* read-ahead state (forward scans only) */
+	bool ji_readahead;	/* true to read journal blocks in clusters */
+	unsigned ji_raleft;	/* blocks already read ahead of ji_buf */
+
 	/* current record (valid if ji_read is true) */
 	unsigned ji_class;
 	unsigned ji_type;
@@ -1029,6 +1153,8 @@ sfs_jiter_create(struct sfs_fs *sfs,
 	ji->ji_pos = *tailpos;
 
 	ji->ji_buf = NULL;
+	ji->ji_readahead = false;
+	ji->ji_raleft = 0;
 
 	ji->ji_read = false;
 	ji->ji_done = false;
@@ -1138,6 +1264,48 @@ sfs_jiter_rec(struct sfs_jiter *ji, size_t *len_ret)
 	return (char *)buffer_map(ji->ji_buf) + offset;
 }
 
+/*
+ * Get the buffer for the current journal block during a forward scan,
+ * reading the following blocks along with it in one request. The
+ * extra buffers are released straight away; they stay in the cache
+ * for the next calls, which then just find them. The read-ahead stops
+ * at the end of the journal area rather than wrapping.
+ * Internal.
+ */
+static
+int
+sfs_jiter_readahead(struct sfs_fs *sfs, struct sfs_jiter *ji)
+{
+	struct buf *bufs[SFS_CLUSTERBLOCKS];
+	uint32_t jblock;
+	unsigned n;
+	int result;
+
+	jblock = ji->ji_pos.jp_jblock;
+	if (ji->ji_raleft > 0) {
+		/* already read in with an earlier block */
+		ji->ji_raleft--;
+		return buffer_read(&sfs->sfs_absfs,
+				   sfs->sfs_sb.sb_journalstart + jblock,
+				   SFS_BLOCKSIZE, &ji->ji_buf);
+	}
+
+	n = SFS_CLUSTERBLOCKS;
+	if (n > sfs->sfs_sb.sb_journalblocks - jblock) {
+		n = sfs->sfs_sb.sb_journalblocks - jblock;
+	}
+	result = buffer_get_cluster(&sfs->sfs_absfs,
+				    sfs->sfs_sb.sb_journalstart + jblock,
+				    n, SFS_BLOCKSIZE, true, bufs);
+	if (result) {
+		return result;
+	}
+	ji->ji_buf = bufs[0];
+	buffer_release_cluster(&bufs[1], n - 1);
+	ji->ji_raleft = n - 1;
+	return 0;
+}
+
 /*
  * Ensure that we have a buffer for the current journal block.
  * Internal.
@@ -1151,6 +1319,13 @@ sfs_jiter_getbuf(struct sfs_fs *sfs, struct sfs_jiter *ji)
 	if (ji->ji_buf != NULL) {
 		return 0;
 	}
+	if (ji->ji_readahead) {
+		result = sfs_jiter_readahead(sfs, ji);
+		if (result == 0) {
+			return 0;
+		}
+		/* fall back to reading just the one block */
+	}
 	result = buffer_read(&sfs->sfs_absfs,
 			     sfs->sfs_sb.sb_journalstart +
 			     ji->ji_pos.jp_jblock,
@@ -1544,6 +1719,9 @@ sfs_jiter_fwdcreate(struct sfs_fs *sfs, struct sfs_jiter **ji_ret)
 		return result;
 	}
 
+	/* recovery reads the whole journal in order; read ahead */
+	ji->ji_readahead = true;
+
 	*ji_ret = ji;
 	return 0;
 }
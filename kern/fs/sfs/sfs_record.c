@@ -2,14 +2,224 @@
 #include <kern/errno.h>
 #include <bitmap.h>
 #include <lib.h>
+#include <objcache.h>
 #include "sfs_record.h"
 #include "sfsprivate.h"
 #include "buf.h"
 
-sfs_lsn_t
-sfs_record_write_to_journal(struct sfs_fs *fs, struct sfs_record *record, enum sfs_record_type type)
+/*
+ * Record encoding
+ */
+
+/*
+ * Encode a meta update, keeping only the span of bytes that actually
+ * differs between the old and new values.
+ */
+static
+size_t
+sfs_record_encode_meta_update(const struct sfs_record *record, char *buf)
+{
+        const struct sfs_meta_update *mu = &record->meta_update;
+        struct sfs_disk_meta_update dmu;
+        uint32_t start, end;
+
+        start = 0;
+        end = mu->len;
+        while (start < end && mu->old_value[start] == mu->new_value[start]) {
+                start++;
+        }
+        while (end > start && mu->old_value[end - 1] == mu->new_value[end - 1]) {
+                end--;
+        }
+
+        dmu.sdm_txid = record->r_txid;
+        dmu.sdm_block = mu->block;
+        dmu.sdm_pos = mu->pos + start;
+        dmu.sdm_len = end - start;
+        memcpy(buf, &dmu, sizeof(dmu));
+        memcpy(buf + sizeof(dmu), mu->old_value + start, end - start);
+        memcpy(buf + sizeof(dmu) + (end - start), mu->new_value + start, end - start);
+
+        return sizeof(dmu) + 2 * (end - start);
+}
+
+/*
+ * Encode RECORD of type TYPE into BUF, which must hold at least
+ * SFS_RECORD_MAXENCODED bytes. Returns the encoded length, padded
+ * to SFS_RECORD_ALIGN.
+ */
+size_t
+sfs_record_encode(const struct sfs_record *record, enum sfs_record_type type, char *buf)
+{
+        struct sfs_disk_tx dt;
+        struct sfs_disk_freemap_update dfu;
+        struct sfs_disk_user_block_write dub;
+        struct sfs_disk_user_cluster_write duc;
+        size_t len, padded;
+
+        switch (type) {
+        case R_TX_BEGIN:
+        case R_TX_COMMIT:
+                dt.sdt_txid = record->r_txid;
+                memcpy(buf, &dt, sizeof(dt));
+                len = sizeof(dt);
+                break;
+        case R_FREEMAP_CAPTURE:
+        case R_FREEMAP_RELEASE:
+                dfu.sdf_txid = record->r_txid;
+                dfu.sdf_block = record->freemap_update.block;
+                memcpy(buf, &dfu, sizeof(dfu));
+                len = sizeof(dfu);
+                break;
+        case R_META_UPDATE:
+                len = sfs_record_encode_meta_update(record, buf);
+                break;
+        case R_USER_BLOCK_WRITE:
+                dub.sdu_txid = record->r_txid;
+                dub.sdu_block = record->user_block_write.block;
+                dub.sdu_checksum = record->user_block_write.checksum;
+                memcpy(buf, &dub, sizeof(dub));
+                len = sizeof(dub);
+                break;
+        case R_USER_CLUSTER_WRITE:
+                duc.sdc_txid = record->r_txid;
+                duc.sdc_block = record->user_cluster_write.block;
+                duc.sdc_nblocks = record->user_cluster_write.nblocks;
+                memcpy(buf, &duc, sizeof(duc));
+                len = duc.sdc_nblocks * sizeof(uint32_t);
+                memcpy(buf + sizeof(duc), record->user_cluster_write.checksums, len);
+                len += sizeof(duc);
+                break;
+        default:
+                panic("Encode unsupported for record type\n");
+        }
+
+        KASSERT(len <= SFS_RECORD_MAXENCODED);
+        padded = ROUNDUP(len, SFS_RECORD_ALIGN);
+        bzero(buf + len, padded - len);
+        return padded;
+}
+
+/*
+ * Decode the journal record at DATA (of length LEN, as returned by
+ * sfs_jiter_rec) into RECORD. DATA need not be aligned. Fields not
+ * used by TYPE are zeroed. Returns EINVAL if the record is malformed.
+ */
+int
+sfs_record_decode(const void *data, size_t len, enum sfs_record_type type, struct sfs_record *record)
+{
+        const char *ptr = data;
+        struct sfs_disk_tx dt;
+        struct sfs_disk_freemap_update dfu;
+        struct sfs_disk_meta_update dmu;
+        struct sfs_disk_user_block_write dub;
+        struct sfs_disk_user_cluster_write duc;
+
+        bzero(record, sizeof(*record));
+
+        switch (type) {
+        case R_TX_BEGIN:
+        case R_TX_COMMIT:
+                if (len < sizeof(dt)) {
+                        return EINVAL;
+                }
+                memcpy(&dt, ptr, sizeof(dt));
+                record->r_txid = dt.sdt_txid;
+                break;
+        case R_FREEMAP_CAPTURE:
+        case R_FREEMAP_RELEASE:
+                if (len < sizeof(dfu)) {
+                        return EINVAL;
+                }
+                memcpy(&dfu, ptr, sizeof(dfu));
+                record->r_txid = dfu.sdf_txid;
+                record->freemap_update.block = dfu.sdf_block;
+                break;
+        case R_META_UPDATE:
+                if (len < sizeof(dmu)) {
+                        return EINVAL;
+                }
+                memcpy(&dmu, ptr, sizeof(dmu));
+                if (dmu.sdm_len > SFS_MAX_META_UPDATE_SIZE ||
+                    len < sizeof(dmu) + 2 * dmu.sdm_len ||
+                    dmu.sdm_pos + dmu.sdm_len > SFS_BLOCKSIZE) {
+                        return EINVAL;
+                }
+                record->r_txid = dmu.sdm_txid;
+                record->meta_update.block = dmu.sdm_block;
+                record->meta_update.pos = dmu.sdm_pos;
+                record->meta_update.len = dmu.sdm_len;
+                ptr += sizeof(dmu);
+                memcpy(record->meta_update.old_value, ptr, dmu.sdm_len);
+                memcpy(record->meta_update.new_value, ptr + dmu.sdm_len, dmu.sdm_len);
+                break;
+        case R_USER_BLOCK_WRITE:
+                if (len < sizeof(dub)) {
+                        return EINVAL;
+                }
+                memcpy(&dub, ptr, sizeof(dub));
+                record->r_txid = dub.sdu_txid;
+                record->user_block_write.block = dub.sdu_block;
+                record->user_block_write.checksum = dub.sdu_checksum;
+                break;
+        case R_USER_CLUSTER_WRITE:
+                if (len < sizeof(duc)) {
+                        return EINVAL;
+                }
+                memcpy(&duc, ptr, sizeof(duc));
+                if (duc.sdc_nblocks == 0 || duc.sdc_nblocks > SFS_CLUSTERBLOCKS ||
+                    len < sizeof(duc) + duc.sdc_nblocks * sizeof(uint32_t)) {
+                        return EINVAL;
+                }
+                record->r_txid = duc.sdc_txid;
+                record->user_cluster_write.block = duc.sdc_block;
+                record->user_cluster_write.nblocks = duc.sdc_nblocks;
+                memcpy(record->user_cluster_write.checksums, ptr + sizeof(duc),
+                       duc.sdc_nblocks * sizeof(uint32_t));
+                break;
+        default:
+                return EINVAL;
+        }
+
+        return 0;
+}
+
+/*
+ * Records are made and thrown away for every journaled operation, so
+ * they get their own object cache.
+ */
+static struct objcache *sfs_record_cache;
+
+/*
+ * Set up the record cache. Called at mount time (under the vfs big
+ * lock, so two mounts can't race to do it).
+ */
+int
+sfs_record_init(void)
 {
-        return sfs_jphys_write(fs, sfs_jphys_write_callback, NULL, type, record, sizeof(struct sfs_record));
+        if (sfs_record_cache != NULL) {
+                return 0;
+        }
+        sfs_record_cache = objcache_create("sfs_record",
+                                           sizeof(struct sfs_record),
+                                           NULL, NULL);
+        if (sfs_record_cache == NULL) {
+                return ENOMEM;
+        }
+        return 0;
+}
+
+struct sfs_record *
+sfs_record_alloc(void)
+{
+        KASSERT(sfs_record_cache != NULL);
+        return objcache_alloc(sfs_record_cache);
+}
+
+void
+sfs_record_free(struct sfs_record *record)
+{
+        objcache_free(sfs_record_cache, record);
 }
 
 struct sfs_record *
@@ -20,7 +230,7 @@ sfs_record_create_meta_update(daddr_t block, off_t pos, size_t len, char *old_va
 
         KASSERT(pos + len <= SFS_BLOCKSIZE);
 
-        record = kmalloc(sizeof(struct sfs_record));
+        record = sfs_record_alloc();
         if (record == NULL) {
                 return NULL;
         }
@@ -40,23 +250,45 @@ sfs_record_create_meta_update(daddr_t block, off_t pos, size_t len, char *old_va
 }
 
 /*
- * Modified version of Fletcher's checksum, from Wikipedia
+ * Fletcher-32 over the block, used by recovery to tell whether a
+ * block still holds what it held when the record was made.
+ *
+ * The block is read a 32-bit word (two 16-bit halves) at a time, and
+ * the sums are only reduced every SFS_CHECKSUM_RUNWORDS words: that
+ * many (358 halves) is as far as they can go from reduced values
+ * without overflowing 32 bits.
  */
+#define SFS_CHECKSUM_RUNWORDS 179
+
 static
 uint32_t
-sfs_record_user_data_checksum(char *data)
+sfs_record_user_data_checksum(const char *data)
 {
-        uint32_t sum1, sum2;
-        uint32_t mask;
-        size_t i;
+        const uint32_t *words = (const uint32_t *)data;
+        uint32_t sum1, sum2, w;
+        unsigned i, end;
+
+        KASSERT(((uintptr_t)data & (sizeof(uint32_t) - 1)) == 0);
+        COMPILE_ASSERT(SFS_BLOCKSIZE % sizeof(uint32_t) == 0);
 
         sum1 = 0;
         sum2 = 0;
-        mask = (1 << 16) - 1;
 
-        for (i = 0; i < SFS_BLOCKSIZE; i++) {
-                sum1 = (sum1 + data[i]) % mask;
-                sum2 = (sum2 + sum1) % mask;
+        i = 0;
+        while (i < SFS_BLOCKSIZE / sizeof(uint32_t)) {
+                end = i + SFS_CHECKSUM_RUNWORDS;
+                if (end > SFS_BLOCKSIZE / sizeof(uint32_t)) {
+                        end = SFS_BLOCKSIZE / sizeof(uint32_t);
+                }
+                for (; i < end; i++) {
+                        w = words[i];
+                        sum1 += w >> 16;
+                        sum2 += sum1;
+                        sum1 += w & 0xffff;
+                        sum2 += sum1;
+                }
+                sum1 %= 0xffff;
+                sum2 %= 0xffff;
         }
 
         return (sum2 << 16) | sum1;
@@ -68,7 +300,7 @@ sfs_record_create_user_block_write(daddr_t block, char *data)
         struct sfs_record *record;
         struct sfs_user_block_write *user_block_write;
 
-        record = kmalloc(sizeof(struct sfs_record));
+        record = sfs_record_alloc();
         if (record == NULL) {
                 return NULL;
         }
@@ -80,6 +312,52 @@ sfs_record_create_user_block_write(daddr_t block, char *data)
         return record;
 }
 
+/*
+ * Same as above, for NBLOCKS consecutive disk blocks starting at
+ * BLOCK whose current contents are DATA[0..NBLOCKS).
+ */
+struct sfs_record *
+sfs_record_create_user_cluster_write(daddr_t block, unsigned nblocks, char **data)
+{
+        struct sfs_record *record;
+        struct sfs_user_cluster_write *user_cluster_write;
+        unsigned i;
+
+        KASSERT(nblocks > 0 && nblocks <= SFS_CLUSTERBLOCKS);
+
+        record = sfs_record_alloc();
+        if (record == NULL) {
+                return NULL;
+        }
+
+        user_cluster_write = &record->user_cluster_write;
+        user_cluster_write->block = block;
+        user_cluster_write->nblocks = nblocks;
+        for (i = 0; i < nblocks; i++) {
+                user_cluster_write->checksums[i] = sfs_record_user_data_checksum(data[i]);
+        }
+        for (; i < SFS_CLUSTERBLOCKS; i++) {
+                user_cluster_write->checksums[i] = 0;
+        }
+
+        return record;
+}
+
+/*
+ * Expand block INDEX of a cluster write record into the equivalent
+ * single-block user write record, for recovery.
+ */
+void
+sfs_record_user_cluster_block(const struct sfs_record *cluster, unsigned index,
+                              struct sfs_record *ret)
+{
+        KASSERT(index < cluster->user_cluster_write.nblocks);
+
+        ret->r_txid = cluster->r_txid;
+        ret->user_block_write.block = cluster->user_cluster_write.block + index;
+        ret->user_block_write.checksum = cluster->user_cluster_write.checksums[index];
+}
+
 /*
  * Assumes caller has reserved 1 buffer
  */
@@ -177,6 +455,7 @@ sfs_record_undo(struct sfs_fs *sfs, struct sfs_record record, enum sfs_record_ty
                 sfs_meta_update(sfs, record.meta_update, false);
                 break;
         case R_USER_BLOCK_WRITE:
+        case R_USER_CLUSTER_WRITE:
         case R_TX_BEGIN:
         case R_TX_COMMIT:
                 // NOOP
@@ -189,6 +468,9 @@ sfs_record_undo(struct sfs_fs *sfs, struct sfs_record record, enum sfs_record_ty
 void
 sfs_record_redo(struct sfs_fs *sfs, struct sfs_record record, enum sfs_record_type record_type)
 {
+        struct sfs_record block_record;
+        unsigned i;
+
         switch (record_type) {
         case R_FREEMAP_CAPTURE:
                 sfs_freemap_update(sfs, record.freemap_update, true);
@@ -201,6 +483,13 @@ sfs_record_redo(struct sfs_fs *sfs, struct sfs_record record, enum sfs_record_ty
                 break;
         case R_USER_BLOCK_WRITE:
                 sfs_record_redo_user_block_write(sfs, record.user_block_write);
+                break;
+        case R_USER_CLUSTER_WRITE:
+                for (i = 0; i < record.user_cluster_write.nblocks; i++) {
+                        sfs_record_user_cluster_block(&record, i, &block_record);
+                        sfs_record_redo_user_block_write(sfs, block_record.user_block_write);
+                }
+                break;
         case R_TX_BEGIN:
         case R_TX_COMMIT:
                 // NOOP
@@ -5,18 +5,33 @@
 #include <current.h>
 #include "sfsprivate.h"
 
+/*
+ * In-memory records come from an object cache; sfs_record_init sets
+ * it up (it's safe to call more than once).
+ */
+int sfs_record_init(void);
+struct sfs_record *sfs_record_alloc(void);
+void sfs_record_free(struct sfs_record *);
+
 struct sfs_record *sfs_record_create_meta_update(daddr_t block, off_t pos, size_t len, char *old_value, char *new_value);
 struct sfs_record *sfs_record_create_user_block_write(daddr_t, char *);
+struct sfs_record *sfs_record_create_user_cluster_write(daddr_t, unsigned, char **);
+void sfs_record_user_cluster_block(const struct sfs_record *cluster, unsigned index, struct sfs_record *ret);
 
 /*
  * Journal operations
  */
 
-sfs_lsn_t sfs_record_write_to_journal(struct sfs_fs *, struct sfs_record *, enum sfs_record_type);
+/*
+ * Encode a record in its on-disk form. The transaction code stages
+ * these and writes them to the journal in batches.
+ */
+size_t sfs_record_encode(const struct sfs_record *, enum sfs_record_type, char *buf);
 
 /*
  * Recovery operations
  */
 
+int sfs_record_decode(const void *data, size_t len, enum sfs_record_type, struct sfs_record *);
 void sfs_record_undo(struct sfs_fs *, struct sfs_record, enum sfs_record_type);
 void sfs_record_redo(struct sfs_fs *, struct sfs_record, enum sfs_record_type);
@@ -2,6 +2,35 @@
 #include "sfsprivate.h"
 #include "limits.h"
 #include "sfs_transaction.h"
+#include <buf.h>
+#include <objcache.h>
+
+static struct objcache *sfs_transaction_cache;
+
+/*
+ * Set up the object caches for transactions and records. Called at
+ * mount time, under the vfs big lock; does nothing after the first
+ * time.
+ */
+int
+sfs_transaction_init(void)
+{
+        int result;
+
+        result = sfs_record_init();
+        if (result) {
+                return result;
+        }
+        if (sfs_transaction_cache == NULL) {
+                sfs_transaction_cache = objcache_create("sfs_transaction",
+                                                        sizeof(struct sfs_transaction),
+                                                        NULL, NULL);
+                if (sfs_transaction_cache == NULL) {
+                        return ENOMEM;
+                }
+        }
+        return 0;
+}
 
 struct sfs_transaction_set *
 sfs_transaction_set_create(void)
@@ -20,6 +49,15 @@ sfs_transaction_set_create(void)
                 return NULL;
         }
 
+        tx_set->tx_commit_cv = cv_create("transaction commit cv");
+        if (tx_set->tx_commit_cv == NULL) {
+                lock_destroy(tx_set->tx_lock);
+                kfree(tx_set);
+                return NULL;
+        }
+        tx_set->tx_flushing = false;
+        tx_set->tx_durable_lsn = 0;
+
         for (i = 0; i < MAX_TRANSACTIONS; i++) {
                 tx_set->tx_transactions[i] = NULL;
         }
@@ -36,6 +74,8 @@ sfs_transaction_set_create(void)
 void
 sfs_transaction_set_destroy(struct sfs_transaction_set *tx)
 {
+        KASSERT(!tx->tx_flushing);
+        cv_destroy(tx->tx_commit_cv);
         lock_destroy(tx->tx_lock);
         kfree(tx);
 }
@@ -46,7 +86,7 @@ sfs_transaction_create(struct sfs_transaction_set *tx_tracker)
         struct sfs_transaction *tx;
         int i;
 
-        tx = kmalloc(sizeof(struct sfs_transaction));
+        tx = objcache_alloc(sfs_transaction_cache);
         if (tx == NULL) {
                 return NULL;
         }
@@ -62,6 +102,10 @@ sfs_transaction_create(struct sfs_transaction_set *tx_tracker)
                         tx->tx_committed = 0;
                         tx->tx_tracker = tx_tracker;
                         tx->tx_busy_bit = 0;
+                        tx->tx_fs = NULL;
+                        tx->tx_nstaged = 0;
+                        tx->tx_stagedbytes = 0;
+                        tx->tx_npending = 0;
 
                         curthread->t_tx = tx;
                         lock_release(tx_tracker->tx_lock);
@@ -71,7 +115,7 @@ sfs_transaction_create(struct sfs_transaction_set *tx_tracker)
 
         // could not find free slot for it
         lock_release(tx_tracker->tx_lock);
-        kfree(tx);
+        objcache_free(sfs_transaction_cache, tx);
         return NULL;
 }
 
@@ -86,7 +130,7 @@ sfs_transaction_destroy(struct sfs_transaction *tx)
         for (i = 0; i < MAX_TRANSACTIONS; i++) {
                 if (tx->tx_tracker->tx_transactions[i] == tx) {
                         tx->tx_tracker->tx_transactions[i] = NULL;
-                        kfree(tx);
+                        objcache_free(sfs_transaction_cache, tx);
                         return;
                 }
         }
@@ -127,19 +171,72 @@ sfs_transaction_release_busy_bit(struct sfs_transaction *tx)
         lock_release(tx->tx_tracker->tx_lock);
 }
 
+/*
+ * Write out the staged records in one batch and give the buffers
+ * tagged meanwhile their LSNs. The journal callback keeps
+ * tx_lowest_lsn/tx_highest_lsn current as the records go in, so the
+ * checkpointer never trims past them.
+ */
+static
+void
+sfs_transaction_flush(struct sfs_transaction *tx)
+{
+        sfs_lsn_t lsns[SFS_TX_STAGERECS];
+        struct sfs_tx_pending *tp;
+        unsigned i;
+
+        KASSERT(tx == curthread->t_tx);
+
+        if (tx->tx_nstaged == 0) {
+                KASSERT(tx->tx_npending == 0);
+                return;
+        }
+
+        sfs_jphys_writebatch(tx->tx_fs, sfs_jphys_write_callback,
+                             tx->tx_staged, tx->tx_nstaged, lsns);
+
+        for (i = 0; i < tx->tx_npending; i++) {
+                tp = &tx->tx_pending[i];
+                buffer_update_lsns(tp->tp_buf, lsns[tp->tp_first]);
+                buffer_update_lsns(tp->tp_buf, lsns[tp->tp_last]);
+        }
+
+        tx->tx_nstaged = 0;
+        tx->tx_stagedbytes = 0;
+        tx->tx_npending = 0;
+}
+
+/*
+ * Encode a record into the transaction's stage, making room first
+ * if need be.
+ */
 static
 void
 sfs_transaction_add_record(struct sfs_fs *sfs, struct sfs_transaction *tx, struct sfs_record *record, enum sfs_record_type type)
 {
-        sfs_lsn_t lsn;
+        char buf[SFS_RECORD_MAXENCODED + SFS_RECORD_ALIGN];
+        struct sfs_jphys_batchrec *jb;
+        size_t len;
 
-        lsn = sfs_record_write_to_journal(sfs, record, type);
+        KASSERT(tx->tx_fs == sfs);
 
-        tx->tx_lowest_lsn = (tx->tx_lowest_lsn == 0 ? lsn : tx->tx_lowest_lsn);
-        tx->tx_highest_lsn = lsn;
+        len = sfs_record_encode(record, type, buf);
+        KASSERT(len <= SFS_TX_STAGEBYTES);
+
+        if (tx->tx_nstaged == SFS_TX_STAGERECS ||
+            tx->tx_stagedbytes + len > SFS_TX_STAGEBYTES) {
+                sfs_transaction_flush(tx);
+        }
+
+        jb = &tx->tx_staged[tx->tx_nstaged++];
+        jb->jb_code = type;
+        jb->jb_rec = tx->tx_stage + tx->tx_stagedbytes;
+        jb->jb_len = len;
+        memcpy(tx->tx_stage + tx->tx_stagedbytes, buf, len);
+        tx->tx_stagedbytes += len;
 
         // We no longer need the record in memory
-        kfree(record);
+        sfs_record_free(record);
 }
 
 void
@@ -156,9 +253,10 @@ sfs_current_transaction_add_record(struct sfs_fs *sfs, struct sfs_record *record
                 }
 
                 curthread->t_tx = tx;
+                tx->tx_fs = sfs;
 
                 if (curthread->t_sfs_otrunc != 2) {
-                    begin_tx_record = kmalloc(sizeof(struct sfs_record));
+                    begin_tx_record = sfs_record_alloc();
                     if (begin_tx_record == NULL) {
                             panic("Could not create record\n");
                     }
@@ -172,19 +270,146 @@ sfs_current_transaction_add_record(struct sfs_fs *sfs, struct sfs_record *record
         sfs_transaction_add_record(sfs, curthread->t_tx, record, type);
 }
 
+void
+sfs_current_transaction_tag(struct buf *buf)
+{
+        struct sfs_transaction *tx = curthread->t_tx;
+        struct sfs_tx_pending *tp;
+        unsigned i;
+
+        KASSERT(tx != NULL);
+
+        if (tx->tx_nstaged == 0) {
+                buffer_update_lsns(buf, tx->tx_highest_lsn);
+                return;
+        }
+
+        for (i = 0; i < tx->tx_npending; i++) {
+                tp = &tx->tx_pending[i];
+                if (tp->tp_buf == buf) {
+                        tp->tp_last = tx->tx_nstaged - 1;
+                        return;
+                }
+        }
+
+        if (tx->tx_npending == SFS_TX_MAXPENDING) {
+                sfs_transaction_flush(tx);
+                buffer_update_lsns(buf, tx->tx_highest_lsn);
+                return;
+        }
+
+        tp = &tx->tx_pending[tx->tx_npending++];
+        tp->tp_buf = buf;
+        tp->tp_first = tp->tp_last = tx->tx_nstaged - 1;
+        buffer_lsn_pend(buf);
+}
+
+sfs_lsn_t
+sfs_current_transaction_lsn(struct sfs_fs *sfs)
+{
+        struct sfs_transaction *tx = curthread->t_tx;
+
+        KASSERT(tx != NULL);
+        KASSERT(tx->tx_fs == sfs);
+
+        sfs_transaction_flush(tx);
+        return tx->tx_highest_lsn;
+}
+
+/*
+ * The buffer cache calls this when we're about to let go of a buffer
+ * still waiting for its LSNs.
+ */
+void
+sfs_transaction_settle(struct fs *fs)
+{
+        struct sfs_transaction *tx = curthread->t_tx;
+
+        KASSERT(tx != NULL);
+        KASSERT(tx->tx_fs == fs->fs_data);
+
+        sfs_transaction_flush(tx);
+}
+
+/*
+ * Force the journal to disk through LSN, batching concurrent callers.
+ *
+ * This is only called from sfs_sync (so for fsync and sync). It does
+ * not make commits durable: sfs_current_transaction_commit doesn't
+ * force anything, so a committed transaction is only on disk once
+ * the next fsync or sync gets here or the journal buffer fills and is
+ * written out on its own.
+ *
+ * The first forcer to find no flush in progress becomes the leader
+ * and flushes everything written so far with a single
+ * sfs_jphys_flush. Forcers that arrive
+ * while that flush is in flight wait for it; if it didn't cover their
+ * LSN, one of them leads the next one. So a burst of fsyncs costs one
+ * journal write rather than one each.
+ */
+int
+sfs_transaction_force(struct sfs_fs *sfs, sfs_lsn_t lsn)
+{
+        struct sfs_transaction_set *tx_set = sfs->sfs_transaction_set;
+        sfs_lsn_t target;
+        int result = 0;
+
+        lock_acquire(tx_set->tx_lock);
+        while (tx_set->tx_durable_lsn < lsn) {
+                if (tx_set->tx_flushing) {
+                        cv_wait(tx_set->tx_commit_cv, tx_set->tx_lock);
+                        continue;
+                }
+
+                tx_set->tx_flushing = true;
+                lock_release(tx_set->tx_lock);
+
+                /* Everything written so far goes out with this flush */
+                target = sfs_jphys_peeknextlsn(sfs) - 1;
+                KASSERT(target >= lsn);
+                result = sfs_jphys_flush(sfs, target);
+
+                lock_acquire(tx_set->tx_lock);
+                tx_set->tx_flushing = false;
+                if (result == 0 && target > tx_set->tx_durable_lsn) {
+                        tx_set->tx_durable_lsn = target;
+                }
+                cv_broadcast(tx_set->tx_commit_cv, tx_set->tx_lock);
+                if (result) {
+                        break;
+                }
+        }
+        lock_release(tx_set->tx_lock);
+
+        return result;
+}
+
+/*
+ * Write the commit record. This doesn't force the journal, so the
+ * transaction isn't durable yet when it returns; callers hold the
+ * vnode lock and can't wait for disk I/O. fsync/sync force it later
+ * through sfs_transaction_force.
+ */
 int
 sfs_current_transaction_commit(struct sfs_fs *sfs)
 {
+        struct sfs_transaction_set *tx_set = sfs->sfs_transaction_set;
         struct sfs_record *record;
 
-        record = kmalloc(sizeof(struct sfs_record));
+        record = sfs_record_alloc();
         if (record == NULL) {
                 return ENOMEM;
         }
 
         KASSERT(curthread->t_tx);
         sfs_current_transaction_add_record(sfs, record, R_TX_COMMIT);
+
+        /* Get the staged records, commit included, into the journal */
+        (void)sfs_current_transaction_lsn(sfs);
+
+        lock_acquire(tx_set->tx_lock);
         curthread->t_tx->tx_committed = 1;
+        lock_release(tx_set->tx_lock);
         curthread->t_tx = NULL;
 
         return 0;
@@ -5,9 +5,28 @@
 
 #define MAX_TRANSACTIONS 64
 
+/*
+ * Records aren't written to the journal as they're made. Each
+ * transaction encodes them into its stage and writes the lot with
+ * one sfs_jphys_writebatch when the stage fills, when a buffer they
+ * cover is about to be released or written (see buffer_lsn_pend),
+ * when a real LSN is needed right away, or at commit.
+ */
+#define SFS_TX_STAGEBYTES 512	// bytes of encoded records
+#define SFS_TX_STAGERECS 24	// number of records
+#define SFS_TX_MAXPENDING 8	// buffers waiting for LSNs
+
+struct buf;
 struct sfs_transaction_set;
 struct sfs_record;
 
+/* A buffer tagged while records were staged */
+struct sfs_tx_pending {
+        struct buf *tp_buf;
+        unsigned tp_first;		// staged record it was first tagged with
+        unsigned tp_last;		// and the latest
+};
+
 struct sfs_transaction {
         txid_t tx_id;                   // equal to the slot number in the per-device array
         sfs_lsn_t tx_lowest_lsn;	// For checkpointing
@@ -15,6 +34,15 @@ struct sfs_transaction {
         uint32_t tx_committed:1;		// 0 when transaction has completed all side-effects
         struct sfs_transaction_set *tx_tracker;
         uint32_t tx_busy_bit:1;		// Locking, accessed via tx_lock
+
+        /* Staged records; touched only by the owning thread */
+        struct sfs_fs *tx_fs;
+        unsigned tx_nstaged;
+        size_t tx_stagedbytes;
+        struct sfs_jphys_batchrec tx_staged[SFS_TX_STAGERECS];
+        unsigned tx_npending;
+        struct sfs_tx_pending tx_pending[SFS_TX_MAXPENDING];
+        char tx_stage[SFS_TX_STAGEBYTES];
 };
 
 // Per-device struct that lives in the sfs_fs struct
@@ -22,12 +50,17 @@ struct sfs_transaction_set {
 	struct sfs_transaction *tx_transactions[MAX_TRANSACTIONS];
 	struct lock *tx_lock;
 	uint64_t tx_id_counter;
+
+	/* Shared journal forcing, protected by tx_lock */
+	struct cv *tx_commit_cv;	// Waiting for a leader's flush
+	bool tx_flushing;		// A leader is flushing the journal
+	sfs_lsn_t tx_durable_lsn;	// Journal known on disk up to here
 };
 
 struct sfs_transaction_set *sfs_transaction_set_create(void);
 void sfs_transaction_set_destroy(struct sfs_transaction_set *tx);
 
-void sfs_transaction_init(void);
+int sfs_transaction_init(void);
 struct sfs_transaction *sfs_transaction_create(struct sfs_transaction_set *tx_tracker);
 void sfs_transaction_destroy(struct sfs_transaction *tx);
 
@@ -39,3 +72,24 @@ void sfs_transaction_release_busy_bit(struct sfs_transaction *tx);
  */
 void sfs_current_transaction_add_record(struct sfs_fs *, struct sfs_record *, enum sfs_record_type);
 int sfs_current_transaction_commit(struct sfs_fs *);
+
+/*
+ * Record that a buffer was changed under the records added so far
+ * (this is what buffer_update_lsns with the current transaction's
+ * highest LSN used to do; if records are staged, the buffer gets its
+ * LSNs when they're written). sfs_current_transaction_lsn writes out
+ * the stage and returns the LSN of the last record, for things like
+ * the freemap that aren't buffers we hold.
+ */
+void sfs_current_transaction_tag(struct buf *);
+sfs_lsn_t sfs_current_transaction_lsn(struct sfs_fs *);
+
+/* Callback for buffer_lsn_register */
+void sfs_transaction_settle(struct fs *);
+
+/*
+ * Wait until the journal is on disk up to and including LSN, sharing
+ * the journal flush with anyone else forcing it (fsync, sync). Must
+ * not be called with a vnode lock held.
+ */
+int sfs_transaction_force(struct sfs_fs *, sfs_lsn_t lsn);
@@ -44,6 +44,7 @@
 #include <vfs.h>
 #include <thread.h>
 #include <buf.h>
+#include <textcache.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 #include "sfs_transaction.h"
@@ -52,7 +53,9 @@
 /*
  * Locking protocol for sfs:
  *    The following locks exist:
- *       vnode locks (sv_lock)
+ *       vnode locks (sv_lock, an rwlock; read, stat and lookup take it
+ *                    for reading, everything else for writing)
+ *       inode buffer locks (sv_dinolock, see sfs_dinode_load)
  *       vnode table lock (sfs_vnlock)
  *       freemap lock (sfs_freemaplock)
  *       rename lock (sfs_renamelock)
@@ -61,6 +64,7 @@
  *    Ordering constraints:
  *       rename lock       before  vnode locks
  *       vnode locks       before  vnode table lock
+ *       vnode locks       before  inode buffer locks
  *       vnode locks       before  buffer locks
  *       vnode table lock  before  freemap lock
  *       buffer lock       before  freemap lock
@@ -146,13 +150,13 @@ sfs_read(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	lock_acquire(sv->sv_lock);
+	rwlock_acquire_read(sv->sv_lock);
 	reserve_buffers(SFS_BLOCKSIZE);
 
 	result = sfs_io(sv, uio);
 
 	unreserve_buffers(SFS_BLOCKSIZE);
-	lock_release(sv->sv_lock);
+	rwlock_release_read(sv->sv_lock);
 
 	return result;
 }
@@ -175,7 +179,7 @@ sfs_write(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	lock_acquire(sv->sv_lock);
+	rwlock_acquire_write(sv->sv_lock);
 	reserve_buffers(SFS_BLOCKSIZE);
 
 	result = sfs_io(sv, uio);
@@ -184,7 +188,12 @@ sfs_write(struct vnode *v, struct uio *uio)
 	result = sfs_current_transaction_commit(sfs);
 
 	unreserve_buffers(SFS_BLOCKSIZE);
-	lock_release(sv->sv_lock);
+	rwlock_release_write(sv->sv_lock);
+
+	/* Don't leave processes running the old contents */
+	if (v->vn_textmaps > 0) {
+		textcache_invalidate(v);
+	}
 
 	return result;
 }
@@ -208,13 +217,13 @@ sfs_getdirentry(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_offset >= 0);
 	KASSERT(uio->uio_rw==UIO_READ);
-	lock_acquire(sv->sv_lock);
+	rwlock_acquire_write(sv->sv_lock);
 	reserve_buffers(SFS_BLOCKSIZE);
 
 	result = sfs_dinode_load(sv);
 	if (result) {
 		unreserve_buffers(SFS_BLOCKSIZE);
-		lock_release(sv->sv_lock);
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
@@ -222,7 +231,7 @@ sfs_getdirentry(struct vnode *v, struct uio *uio)
 	if (result) {
 		sfs_dinode_unload(sv);
 		unreserve_buffers(SFS_BLOCKSIZE);
-		lock_release(sv->sv_lock);
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
@@ -259,7 +268,7 @@ sfs_getdirentry(struct vnode *v, struct uio *uio)
 
 	unreserve_buffers(SFS_BLOCKSIZE);
 
-	lock_release(sv->sv_lock);
+	rwlock_release_write(sv->sv_lock);
 
 	/* Update the offset the way we want it */
 	uio->uio_offset = pos;
@@ -309,14 +318,14 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
-	lock_acquire(sv->sv_lock);
+	rwlock_acquire_read(sv->sv_lock);
 
 	reserve_buffers(SFS_BLOCKSIZE);
 
 	result = sfs_dinode_load(sv);
 	if (result) {
 		unreserve_buffers(SFS_BLOCKSIZE);
-		lock_release(sv->sv_lock);
+		rwlock_release_read(sv->sv_lock);
 		return result;
 	}
 
@@ -332,7 +341,7 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 
 	sfs_dinode_unload(sv);
 	unreserve_buffers(SFS_BLOCKSIZE);
-	lock_release(sv->sv_lock);
+	rwlock_release_read(sv->sv_lock);
 	return 0;
 }
 
@@ -416,7 +425,7 @@ sfs_truncate(struct vnode *v, off_t len)
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	int result;
 
-	lock_acquire(sv->sv_lock);
+	rwlock_acquire_write(sv->sv_lock);
 	reserve_buffers(SFS_BLOCKSIZE);
 
 	result = sfs_itrunc(sv, len);
@@ -424,14 +433,13 @@ sfs_truncate(struct vnode *v, off_t len)
 	/* Commit record (we commit here rather than in sfs_itrunc since
 	   sfs_itrunc is used for other sfs calls, like sfs_rmdir) */
 	result = sfs_current_transaction_commit(sfs);
-	if (result) {
-		unreserve_buffers(SFS_BLOCKSIZE);
-		lock_release(sv->sv_lock);
-		return result;
-	}
 
 	unreserve_buffers(SFS_BLOCKSIZE);
-	lock_release(sv->sv_lock);
+	rwlock_release_write(sv->sv_lock);
+
+	if (v->vn_textmaps > 0) {
+		textcache_invalidate(v);
+	}
 	return result;
 }
 
@@ -453,7 +461,7 @@ sfs_getonename(struct sfs_vnode *parent, uint32_t targetino,
 	size_t namelen;
 	int result;
 
-	KASSERT(lock_do_i_hold(parent->sv_lock));
+	KASSERT(rwlock_do_i_hold(parent->sv_lock));
 	KASSERT(targetino != SFS_NOINO);
 
 	result = sfs_dir_findino(parent, targetino, &sd, NULL);
@@ -512,10 +520,10 @@ sfs_namefile(struct vnode *vv, struct uio *uio)
 	VOP_INCREF(&sv->sv_absvn);
 
 	while (1) {
-		lock_acquire(sv->sv_lock);
+		rwlock_acquire_write(sv->sv_lock);
 		/* not allowed to lock child since we're going up the tree */
 		result = sfs_lookonce(sv, "..", &parent, NULL);
-		lock_release(sv->sv_lock);
+		rwlock_release_write(sv->sv_lock);
 
 		if (result) {
 			VOP_DECREF(&sv->sv_absvn);
@@ -531,9 +539,9 @@ sfs_namefile(struct vnode *vv, struct uio *uio)
 			break;
 		}
 
-		lock_acquire(parent->sv_lock);
+		rwlock_acquire_write(parent->sv_lock);
 		result = sfs_getonename(parent, sv->sv_ino, buf, &bufpos);
-		lock_release(parent->sv_lock);
+		rwlock_release_write(parent->sv_lock);
 
 		if (result) {
 			VOP_DECREF(&parent->sv_absvn);
@@ -594,13 +602,13 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	off_t pos;
 	size_t len;
 
-	lock_acquire(sv->sv_lock);
+	rwlock_acquire_write(sv->sv_lock);
 	reserve_buffers(SFS_BLOCKSIZE);
 
 	result = sfs_dinode_load(sv);
 	if (result) {
 		unreserve_buffers(SFS_BLOCKSIZE);
-		lock_release(sv->sv_lock);
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 	sv_dino = sfs_dinode_map(sv);
@@ -608,7 +616,7 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	if (sv_dino->sfi_linkcount == 0) {
 		sfs_dinode_unload(sv);
 		unreserve_buffers(SFS_BLOCKSIZE);
-		lock_release(sv->sv_lock);
+		rwlock_release_write(sv->sv_lock);
 		return ENOENT;
 	}
 
@@ -618,14 +626,14 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
 		unreserve_buffers(SFS_BLOCKSIZE);
-		lock_release(sv->sv_lock);
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
 		unreserve_buffers(SFS_BLOCKSIZE);
-		lock_release(sv->sv_lock);
+		rwlock_release_write(sv->sv_lock);
 		return EEXIST;
 	}
 
@@ -634,13 +642,13 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
 		if (result) {
 			unreserve_buffers(SFS_BLOCKSIZE);
-			lock_release(sv->sv_lock);
+			rwlock_release_write(sv->sv_lock);
 			return result;
 		}
 
 		*ret = &newguy->sv_absvn;
 		unreserve_buffers(SFS_BLOCKSIZE);
-		lock_release(sv->sv_lock);
+		rwlock_release_write(sv->sv_lock);
 		return 0;
 	}
 
@@ -648,7 +656,7 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
 	if (result) {
 		unreserve_buffers(SFS_BLOCKSIZE);
-		lock_release(sv->sv_lock);
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
@@ -683,7 +691,7 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 
 	/* Update the linkcount of the new file */
 	new_dino->sfi_linkcount++;
-	buffer_update_lsns(newguy->sv_dinobuf, curthread->t_tx->tx_highest_lsn);
+	sfs_current_transaction_tag(newguy->sv_dinobuf);
 
 	/* and consequently mark it dirty. */
 	sfs_dinode_mark_dirty(newguy);
@@ -711,8 +719,8 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 out:
 	sfs_dinode_unload(newguy);
 	unreserve_buffers(SFS_BLOCKSIZE);
-	lock_release(newguy->sv_lock);
-	lock_release(sv->sv_lock);
+	rwlock_release_write(newguy->sv_lock);
+	rwlock_release_write(sv->sv_lock);
 	return result;
 }
 
@@ -753,8 +761,8 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 	reserve_buffers(SFS_BLOCKSIZE);
 
 	/* directory must be locked first */
-	lock_acquire(sv->sv_lock);
-	lock_acquire(f->sv_lock);
+	rwlock_acquire_write(sv->sv_lock);
+	rwlock_acquire_write(f->sv_lock);
 
 	result = sfs_dinode_load(f);
 	if (result) {
@@ -786,7 +794,7 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 	sfs_current_transaction_add_record(sfs, record, R_META_UPDATE);
 
 	inodeptr->sfi_linkcount++;
-	buffer_update_lsns(f->sv_dinobuf, curthread->t_tx->tx_highest_lsn);
+	sfs_current_transaction_tag(f->sv_dinobuf);
 	sfs_dinode_mark_dirty(f);
 
 	/* Commit record */
@@ -801,8 +809,8 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 out1:
 	sfs_dinode_unload(f);
 out0:
-	lock_release(f->sv_lock);
-	lock_release(sv->sv_lock);
+	rwlock_release_write(f->sv_lock);
+	rwlock_release_write(sv->sv_lock);
 	unreserve_buffers(SFS_BLOCKSIZE);
 	return result;
 }
@@ -837,7 +845,7 @@ sfs_mkdir(struct vnode *v, const char *name, mode_t mode)
 
 	(void)mode;
 
-	lock_acquire(sv->sv_lock);
+	rwlock_acquire_write(sv->sv_lock);
 	reserve_buffers(SFS_BLOCKSIZE);
 
 	result = sfs_dinode_load(sv);
@@ -920,7 +928,7 @@ sfs_mkdir(struct vnode *v, const char *name, mode_t mode)
 	sfs_current_transaction_add_record(sfs, record, R_META_UPDATE);
 
 	new_inodeptr->sfi_linkcount += 2;
-	buffer_update_lsns(newguy->sv_dinobuf, curthread->t_tx->tx_highest_lsn);
+	sfs_current_transaction_tag(newguy->sv_dinobuf);
 
 	/* Create the link increment record for parent dir */
 	block = buffer_get_block_number(sv->sv_dinobuf);
@@ -937,7 +945,7 @@ sfs_mkdir(struct vnode *v, const char *name, mode_t mode)
 	sfs_current_transaction_add_record(sfs, record, R_META_UPDATE);
 
 	dir_inodeptr->sfi_linkcount++;
-	buffer_update_lsns(sv->sv_dinobuf, curthread->t_tx->tx_highest_lsn);
+	sfs_current_transaction_tag(sv->sv_dinobuf);
 
 	sfs_dinode_mark_dirty(newguy);
 	sfs_dinode_mark_dirty(sv);
@@ -945,8 +953,8 @@ sfs_mkdir(struct vnode *v, const char *name, mode_t mode)
 
 	sfs_dinode_unload(newguy);
 	sfs_dinode_unload(sv);
-	lock_release(newguy->sv_lock);
-	lock_release(sv->sv_lock);
+	rwlock_release_write(newguy->sv_lock);
+	rwlock_release_write(sv->sv_lock);
 	VOP_DECREF(&newguy->sv_absvn);
 
 	unreserve_buffers(SFS_BLOCKSIZE);
@@ -963,7 +971,7 @@ sfs_mkdir(struct vnode *v, const char *name, mode_t mode)
 
 die_uncreate:
 	sfs_dinode_unload(newguy);
-	lock_release(newguy->sv_lock);
+	rwlock_release_write(newguy->sv_lock);
 	VOP_DECREF(&newguy->sv_absvn);
 
 die_simple:
@@ -971,7 +979,7 @@ die_simple:
 
 die_early:
 	unreserve_buffers(SFS_BLOCKSIZE);
-	lock_release(sv->sv_lock);
+	rwlock_release_write(sv->sv_lock);
 	return result;
 }
 
@@ -1004,7 +1012,7 @@ sfs_rmdir(struct vnode *v, const char *name)
 		return EINVAL;
 	}
 
-	lock_acquire(sv->sv_lock);
+	rwlock_acquire_write(sv->sv_lock);
 	reserve_buffers(SFS_BLOCKSIZE);
 
 	result = sfs_dinode_load(sv);
@@ -1023,7 +1031,7 @@ sfs_rmdir(struct vnode *v, const char *name)
 		goto die_linkcount;
 	}
 
-	lock_acquire(victim->sv_lock);
+	rwlock_acquire_write(victim->sv_lock);
 	result = sfs_dinode_load(victim);
 	if (result) {
 		goto die_loadvictim;
@@ -1069,7 +1077,7 @@ sfs_rmdir(struct vnode *v, const char *name)
 	sfs_current_transaction_add_record(sfs, record, R_META_UPDATE);
 
 	dir_inodeptr->sfi_linkcount--;
-	buffer_update_lsns(sv->sv_dinobuf, curthread->t_tx->tx_highest_lsn);
+	sfs_current_transaction_tag(sv->sv_dinobuf);
 
 	/* Create the link decrement record for the victim dir */
 	block = buffer_get_block_number(victim->sv_dinobuf);
@@ -1086,7 +1094,7 @@ sfs_rmdir(struct vnode *v, const char *name)
 	sfs_current_transaction_add_record(sfs, record, R_META_UPDATE);
 
 	victim_inodeptr->sfi_linkcount -= 2;
-	buffer_update_lsns(victim->sv_dinobuf, curthread->t_tx->tx_highest_lsn);
+	sfs_current_transaction_tag(victim->sv_dinobuf);
 
 	sfs_dinode_mark_dirty(sv);
 	sfs_dinode_mark_dirty(victim);
@@ -1123,13 +1131,13 @@ die_error:
 die_total:
 	sfs_dinode_unload(victim);
 die_loadvictim:
-	lock_release(victim->sv_lock);
+	rwlock_release_write(victim->sv_lock);
  	VOP_DECREF(&victim->sv_absvn);
 die_linkcount:
 	sfs_dinode_unload(sv);
 die_loadsv:
  	unreserve_buffers(SFS_BLOCKSIZE);
- 	lock_release(sv->sv_lock);
+ 	rwlock_release_write(sv->sv_lock);
 
 	return result;
 }
@@ -1163,7 +1171,7 @@ sfs_remove(struct vnode *dir, const char *name)
 		return EISDIR;
 	}
 
-	lock_acquire(sv->sv_lock);
+	rwlock_acquire_write(sv->sv_lock);
 	reserve_buffers(SFS_BLOCKSIZE);
 
 	result = sfs_dinode_load(sv);
@@ -1183,10 +1191,10 @@ sfs_remove(struct vnode *dir, const char *name)
 		goto out_loadsv;
 	}
 
-	lock_acquire(victim->sv_lock);
+	rwlock_acquire_write(victim->sv_lock);
 	result = sfs_dinode_load(victim);
 	if (result) {
-		lock_release(victim->sv_lock);
+		rwlock_release_write(victim->sv_lock);
 		VOP_DECREF(&victim->sv_absvn);
 		goto out_loadsv;
 	}
@@ -1223,7 +1231,7 @@ sfs_remove(struct vnode *dir, const char *name)
 	sfs_current_transaction_add_record(sfs, record, R_META_UPDATE);
 
 	victim_inodeptr->sfi_linkcount--;
-	buffer_update_lsns(victim->sv_dinobuf, curthread->t_tx->tx_highest_lsn);
+	sfs_current_transaction_tag(victim->sv_dinobuf);
 
 	if (victim_inodeptr->sfi_linkcount == 0) {
 		graveyard_add(victim->sv_absvn.vn_fs->fs_data, victim->sv_ino);
@@ -1234,14 +1242,14 @@ sfs_remove(struct vnode *dir, const char *name)
 out_reference:
 	/* Discard the reference that sfs_lookonce got us */
 	sfs_dinode_unload(victim);
-	lock_release(victim->sv_lock);
+	rwlock_release_write(victim->sv_lock);
 	VOP_DECREF(&victim->sv_absvn);
 
 out_loadsv:
 	sfs_dinode_unload(sv);
 
 out_buffers:
-	lock_release(sv->sv_lock);
+	rwlock_release_write(sv->sv_lock);
 	unreserve_buffers(SFS_BLOCKSIZE);
 
 	/* Commit record */
@@ -1292,9 +1300,9 @@ check_parent(struct sfs_vnode *lookfor, struct sfs_vnode *failon,
 			*found = 1;
 		}
 
-		lock_acquire(child->sv_lock);
+		rwlock_acquire_write(child->sv_lock);
 		result = sfs_lookonce(child, "..", &up, NULL);
-		lock_release(child->sv_lock);
+		rwlock_release_write(child->sv_lock);
 
 		if (result) {
 			VOP_DECREF(&child->sv_absvn);
@@ -1391,17 +1399,17 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	 * Lock each directory temporarily. We'll check again later to
 	 * make sure they haven't disappeared and to find slots.
 	 */
-	lock_acquire(dir1->sv_lock);
+	rwlock_acquire_write(dir1->sv_lock);
 	result = sfs_lookonce(dir1, name1, &obj1, NULL);
-	lock_release(dir1->sv_lock);
+	rwlock_release_write(dir1->sv_lock);
 
 	if (result) {
 		goto out0;
 	}
 
-	lock_acquire(dir2->sv_lock);
+	rwlock_acquire_write(dir2->sv_lock);
 	result = sfs_lookonce(dir2, name2, &obj2, NULL);
-	lock_release(dir2->sv_lock);
+	rwlock_release_write(dir2->sv_lock);
 
 	if (result && result != ENOENT) {
 		goto out0;
@@ -1517,14 +1525,14 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 
 	if (dir1==dir2) {
 		/* This locks "both" dirs */
-		lock_acquire(dir1->sv_lock);
+		rwlock_acquire_write(dir1->sv_lock);
 		KASSERT(found_dir1);
 	}
 	else {
 		if (found_dir1) {
-			lock_acquire(dir1->sv_lock);
+			rwlock_acquire_write(dir1->sv_lock);
 		}
-		lock_acquire(dir2->sv_lock);
+		rwlock_acquire_write(dir2->sv_lock);
 	}
 
 	/*
@@ -1538,7 +1546,7 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	 * that obj1 and obj2 may now be the same even if they weren't
 	 * before.
 	 */
-	KASSERT(lock_do_i_hold(dir2->sv_lock));
+	KASSERT(rwlock_do_i_hold_write(dir2->sv_lock));
 	if (obj2) {
 		VOP_DECREF(&obj2->sv_absvn);
 		obj2 = NULL;
@@ -1546,12 +1554,12 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	result = sfs_lookonce(dir2, name2, &obj2, &slot2);
 	if (result==0) {
 		KASSERT(obj2 != NULL);
-		lock_acquire(obj2->sv_lock);
+		rwlock_acquire_write(obj2->sv_lock);
 		result = sfs_dinode_load(obj2);
 		if (result) {
 			/* ENOENT would confuse us below; but it can't be */
 			KASSERT(result != ENOENT);
-			lock_release(obj2->sv_lock);
+			rwlock_release_write(obj2->sv_lock);
 			VOP_DECREF(&obj2->sv_absvn);
 			/* continue to check below */
 		}
@@ -1569,7 +1577,7 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	}
 
 	if (!found_dir1) {
-		lock_acquire(dir1->sv_lock);
+		rwlock_acquire_write(dir1->sv_lock);
 	}
 
 	/* Postpone this check to simplify the error cleanup. */
@@ -1580,7 +1588,7 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	/*
 	 * Now reload obj1.
 	 */
-	KASSERT(lock_do_i_hold(dir1->sv_lock));
+	KASSERT(rwlock_do_i_hold_write(dir1->sv_lock));
 	VOP_DECREF(&obj1->sv_absvn);
 	obj1 = NULL;
 	result = sfs_lookonce(dir1, name1, &obj1, &slot1);
@@ -1598,10 +1606,10 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 		obj1 = NULL;
 		goto out1;
 	}
-	lock_acquire(obj1->sv_lock);
+	rwlock_acquire_write(obj1->sv_lock);
 	result = sfs_dinode_load(obj1);
 	if (result) {
-		lock_release(obj1->sv_lock);
+		rwlock_release_write(obj1->sv_lock);
 		VOP_DECREF(&obj1->sv_absvn);
 		obj1 = NULL;
 		goto out1;
@@ -1681,7 +1689,7 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 			sfs_current_transaction_add_record(sfs, record, R_META_UPDATE);
 
 			dir2_inodeptr->sfi_linkcount--;
-			buffer_update_lsns(dir2->sv_dinobuf, curthread->t_tx->tx_highest_lsn);
+			sfs_current_transaction_tag(dir2->sv_dinobuf);
 
 			if (dir2_inodeptr->sfi_linkcount == 0) {
 				graveyard_add(dir2->sv_absvn.vn_fs->fs_data, dir2->sv_ino);
@@ -1703,7 +1711,7 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 			sfs_current_transaction_add_record(sfs, record, R_META_UPDATE);
 
 			obj2_inodeptr->sfi_linkcount -= 2;
-			buffer_update_lsns(obj2->sv_dinobuf, curthread->t_tx->tx_highest_lsn);
+			sfs_current_transaction_tag(obj2->sv_dinobuf);
 
 			sfs_dinode_mark_dirty(dir2);
 			sfs_dinode_mark_dirty(obj2);
@@ -1743,7 +1751,7 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 			sfs_current_transaction_add_record(sfs, record, R_META_UPDATE);
 
 			obj2_inodeptr->sfi_linkcount--;
-			buffer_update_lsns(obj2->sv_dinobuf, curthread->t_tx->tx_highest_lsn);
+			sfs_current_transaction_tag(obj2->sv_dinobuf);
 
 			if (obj2_inodeptr->sfi_linkcount == 0) {
 				graveyard_add(obj2->sv_absvn.vn_fs->fs_data, obj2->sv_ino);
@@ -1754,7 +1762,7 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 
 		sfs_dinode_unload(obj2);
 
-		lock_release(obj2->sv_lock);
+		rwlock_release_write(obj2->sv_lock);
 		VOP_DECREF(&obj2->sv_absvn);
 		obj2 = NULL;
 	}
@@ -1791,7 +1799,7 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	sfs_current_transaction_add_record(sfs, record, R_META_UPDATE);
 
 	obj1_inodeptr->sfi_linkcount++;
-	buffer_update_lsns(obj1->sv_dinobuf, curthread->t_tx->tx_highest_lsn);
+	sfs_current_transaction_tag(obj1->sv_dinobuf);
 	sfs_dinode_mark_dirty(obj1);
 
 	if (obj1->sv_type == SFS_TYPE_DIR && dir1 != dir2) {
@@ -1832,7 +1840,7 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 		sfs_current_transaction_add_record(sfs, record, R_META_UPDATE);
 
 		dir1_inodeptr->sfi_linkcount--;
-		buffer_update_lsns(dir1->sv_dinobuf, curthread->t_tx->tx_highest_lsn);
+		sfs_current_transaction_tag(dir1->sv_dinobuf);
 
 		if (dir1_inodeptr->sfi_linkcount == 0) {
 			graveyard_add(dir1->sv_absvn.vn_fs->fs_data, dir1->sv_ino);
@@ -1856,7 +1864,7 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 		sfs_current_transaction_add_record(sfs, record, R_META_UPDATE);
 
 		dir2_inodeptr->sfi_linkcount++;
-		buffer_update_lsns(dir2->sv_dinobuf, curthread->t_tx->tx_highest_lsn);
+		sfs_current_transaction_tag(dir2->sv_dinobuf);
 		sfs_dinode_mark_dirty(dir2);
 	}
 
@@ -1881,7 +1889,7 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	sfs_current_transaction_add_record(sfs, record, R_META_UPDATE);
 
 	obj1_inodeptr->sfi_linkcount--;
-	buffer_update_lsns(obj1->sv_dinobuf, curthread->t_tx->tx_highest_lsn);
+	sfs_current_transaction_tag(obj1->sv_dinobuf);
 
 	if (obj1_inodeptr->sfi_linkcount == 0) {
 		graveyard_add(obj1->sv_absvn.vn_fs->fs_data, obj1->sv_ino);
@@ -1935,15 +1943,15 @@ sfs_rename(struct vnode *absdir1, const char *name1,
  	sfs_dinode_unload(dir2);
  out2:
  	sfs_dinode_unload(obj1);
-	lock_release(obj1->sv_lock);
+	rwlock_release_write(obj1->sv_lock);
  out1:
 	if (obj2) {
 		sfs_dinode_unload(obj2);
-		lock_release(obj2->sv_lock);
+		rwlock_release_write(obj2->sv_lock);
 	}
-	lock_release(dir1->sv_lock);
+	rwlock_release_write(dir1->sv_lock);
 	if (dir1 != dir2) {
-		lock_release(dir2->sv_lock);
+		rwlock_release_write(dir2->sv_lock);
 	}
  out0:
 	if (obj2 != NULL) {
@@ -1987,9 +1995,9 @@ sfs_lookparent_internal(struct vnode *v, char *path, struct vnode **ret,
 		*s = 0;
 		s++;
 
-		lock_acquire(sv->sv_lock);
+		rwlock_acquire_read(sv->sv_lock);
 		result = sfs_lookonce(sv, path, &next, NULL);
-		lock_release(sv->sv_lock);
+		rwlock_release_read(sv->sv_lock);
 
 		if (result) {
 			VOP_DECREF(&sv->sv_absvn);
@@ -2064,11 +2072,11 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	}
 
 	dir = dirv->vn_data;
-	lock_acquire(dir->sv_lock);
+	rwlock_acquire_read(dir->sv_lock);
 
 	result = sfs_lookonce(dir, name, &final, NULL);
 
-	lock_release(dir->sv_lock);
+	rwlock_release_read(dir->sv_lock);
 	VOP_DECREF(dirv);
 
 	if (result) {
@@ -2106,6 +2114,7 @@ const struct vnode_ops sfs_fileops = {
 	.vop_mmap = sfs_mmap,
 	.vop_truncate = sfs_truncate,
 	.vop_namefile = vopfail_uio_notdir,
+	.vop_poll = vopnop_poll_ready,
 
 	.vop_creat = vopfail_creat_notdir,
 	.vop_symlink = vopfail_symlink_notdir,
@@ -2140,6 +2149,7 @@ const struct vnode_ops sfs_dirops = {
 	.vop_mmap = vopfail_mmap_isdir,
 	.vop_truncate = vopfail_truncate_isdir,
 	.vop_namefile = sfs_namefile,
+	.vop_poll = vopnop_poll_ready,
 
 	.vop_creat = sfs_creat,
 	.vop_symlink = vopfail_symlink_nosys,
@@ -81,6 +81,8 @@ void sfs_unlock_freemap(struct sfs_fs *sfs);
 /* Functions in sfs_bmap.c */
 int sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock,
 		bool doalloc, daddr_t *diskblock);
+int sfs_idiscard(struct sfs_vnode *sv,
+		uint32_t startfileblock, uint32_t endfileblock);
 int sfs_itrunc(struct sfs_vnode *sv, off_t len);
 
 /* Functions in sfs_dir.c */
@@ -114,6 +116,10 @@ int sfs_getroot(struct fs *fs, struct vnode **ret);
 int sfs_readblock(struct fs *fs, daddr_t block, void *data, size_t len);
 int sfs_writeblock(struct fs *fs, daddr_t block, void *fsbufdata,
 		   void *data, size_t len);
+int sfs_readblocks(struct fs *fs, daddr_t block, void **data,
+		   unsigned nblocks, size_t len);
+int sfs_writeblocks(struct fs *fs, daddr_t block, void **data,
+		    unsigned nblocks, size_t len);
 int sfs_io(struct sfs_vnode *sv, struct uio *uio);
 int sfs_metaio(struct sfs_vnode *sv, off_t pos, void *data, size_t len,
 	       enum uio_rw rw);
@@ -132,6 +138,16 @@ sfs_lsn_t sfs_jphys_write(struct sfs_fs *sfs,
 				 bool commit),
 		struct sfs_jphys_writecontext *ctx,
 		unsigned code, const void *rec, size_t len);
+struct sfs_jphys_batchrec {
+	unsigned jb_code;		/* record type code */
+	const void *jb_rec;		/* record data */
+	size_t jb_len;			/* and its length */
+};
+void sfs_jphys_writebatch(struct sfs_fs *sfs,
+		void (*callback)(sfs_lsn_t newlsn,
+				 bool commit),
+		const struct sfs_jphys_batchrec *recs, unsigned nrecs,
+		sfs_lsn_t *lsns);
 /* Our callback function */
 void sfs_jphys_write_callback(sfs_lsn_t newlsn, bool commit);
 int sfs_jphys_flush(struct sfs_fs *sfs, sfs_lsn_t lsn);
@@ -141,6 +157,7 @@ int sfs_jphys_flushforjournalblock(struct sfs_fs *sfs, daddr_t diskblock);
 void sfs_wrote_journal_block(struct sfs_fs *sfs, daddr_t diskblock);
 /* interface for checkpointing */
 sfs_lsn_t sfs_jphys_peeknextlsn(struct sfs_fs *sfs);
+uint32_t sfs_jphys_getoccupancy(struct sfs_fs *sfs);
 void sfs_jphys_trim(struct sfs_fs *sfs, sfs_lsn_t taillsn);
 uint32_t sfs_jphys_getodometer(struct sfs_jphys *jp);
 void sfs_jphys_clearodometer(struct sfs_jphys *jp);
@@ -53,9 +53,27 @@ struct vnode;
 DECLARRAY(region, REGIONINLINE);
 DEFARRAY(region, REGIONINLINE);
 
+/* Region permissions */
+#define REGION_R 0x1
+#define REGION_W 0x2
+#define REGION_X 0x4
+
 struct region {
   vaddr_t r_base;
   vaddr_t r_end;
+  int r_perms;
+
+  // File backing, for segments of an executable: bytes
+  // [r_filestart, r_fileend) are read from r_vnode at r_offset
+  // onward when first touched. r_vnode is NULL for zero-fill.
+  struct vnode *r_vnode;
+  off_t r_offset;
+  vaddr_t r_filestart;
+  vaddr_t r_fileend;
+
+  // Read-only file-backed regions get their pages from the text
+  // cache, shared with every other process running the executable
+  bool r_shared;
 };
 
 struct addrspace {
@@ -109,6 +127,22 @@ struct addrspace {
  *    as_complete_load - this is called when loading from an executable
  *                is complete.
  *
+ *    as_map_file - make part of a region defined with as_define_region
+ *                read from a file on demand instead of zero-filled.
+ *
+ *    as_fill_page - read the file-backed parts of a page; called
+ *                from vm_fault.
+ *
+ *    as_protect - change the permissions of a range of pages.
+ *
+ *    as_va_readable - check whether an address may be read.
+ *
+ *    as_va_writeable - check whether an address may be written.
+ *
+ *    as_va_shared - check whether the page holding an address comes
+ *                from the shared text cache, and if so from which
+ *                file.
+ *
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
@@ -128,10 +162,21 @@ int               as_define_region(struct addrspace *as,
                                    int readable,
                                    int writeable,
                                    int executable);
+int               as_map_file(struct addrspace *as, vaddr_t vaddr,
+                              size_t memsize, size_t filesize,
+                              struct vnode *v, off_t offset);
+int               as_fill_page(struct addrspace *as, vaddr_t va,
+                               void *kpage, bool *fromfile);
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 bool              va_in_as_bounds(struct addrspace *as, vaddr_t va);
+int               as_protect(struct addrspace *as, vaddr_t vaddr,
+                             size_t len, int perms);
+bool              as_va_readable(struct addrspace *as, vaddr_t va);
+bool              as_va_writeable(struct addrspace *as, vaddr_t va);
+bool              as_va_shared(struct addrspace *as, vaddr_t va,
+                               struct vnode **ret);
 
 /*
  * Functions in loadelf.c
@@ -97,6 +97,27 @@ int buffer_read_fsmanaged(struct fs *fs, daddr_t block, size_t size,
 int buffer_flush(struct fs *fs, daddr_t block, size_t size);
 void buffer_drop(struct fs *fs, daddr_t block, size_t size);
 
+/*
+ * Clustered get operations.
+ *
+ * buffer_get_cluster gets buffers for NBLOCKS consecutive blocks
+ * starting at BLOCK and places them in BUFS, in order. If DOREAD is
+ * true, the contents are made valid as with buffer_read; any run of
+ * adjacent blocks that isn't already in the cache is read from disk
+ * with a single request. NBLOCKS may be at most BUFFER_CLUSTER_MAX.
+ *
+ * All the buffers are marked busy, and count against the caller's
+ * reservation. On failure no buffers are held.
+ *
+ * buffer_mark_dirty_cluster marks all the buffers valid and dirty and
+ * records LSN in them (see buffer_update_lsns) in one step, and
+ * buffer_release_cluster releases them all.
+ */
+#define BUFFER_CLUSTER_MAX	8
+
+int buffer_get_cluster(struct fs *fs, daddr_t block, unsigned nblocks,
+		       size_t size, bool doread, struct buf **bufs);
+
 /*
  * Release-a-buffer operations.
  *
@@ -109,6 +130,7 @@ void buffer_drop(struct fs *fs, daddr_t block, size_t size);
  */
 void buffer_release(struct buf *buf);
 void buffer_release_and_invalidate(struct buf *buf);
+void buffer_release_cluster(struct buf **bufs, unsigned nblocks);
 
 /*
  * Per-fs data
@@ -195,11 +217,30 @@ void unreserve_fsmanaged_buffers(unsigned count, size_t size);
 daddr_t buffer_get_block_number(struct buf *buf);
 struct fs *buffer_get_fs(struct buf *buf);
 void buffer_update_lsns(struct buf *buf, sfs_lsn_t new_lsn);
+void buffer_lsn_pend(struct buf *buf);
+void buffer_mark_dirty_cluster(struct buf **bufs, unsigned nblocks,
+			       sfs_lsn_t new_lsn);
 
 /* Find the mininum lowest_lsn across all buffers being
  * used by the file system fs */
 sfs_lsn_t buffer_get_min_low_lsn(struct fs *fs);
 
+/*
+ * buffer_lsn_register makes the buffer cache keep FS's buffers in
+ * lowest_lsn order, so buffer_get_min_low_lsn needn't scan. ADVANCED
+ * (may be NULL) is called whenever that minimum moves forward, e.g.
+ * when the syncer writes out the oldest buffer; it is called with
+ * the buffer cache locked, so it must not sleep or use buffers.
+ * SETTLE (may be NULL if the fs never uses buffer_lsn_pend) is called
+ * by a thread about to release or write a buffer it marked pending;
+ * it must give the buffer its LSNs. It is called unlocked.
+ * buffer_lsn_unregister undoes this after the fs's buffers have been
+ * dropped.
+ */
+int buffer_lsn_register(struct fs *fs, void (*advanced)(struct fs *),
+			void (*settle)(struct fs *));
+void buffer_lsn_unregister(struct fs *fs);
+
 
 
 /*
@@ -36,7 +36,17 @@ enum cme_state {
         // The page is not owned by the kernel,
         // and has been swapped to disk in the past
         S_DIRTY,
-        S_CLEAN
+        S_CLEAN,
+
+        // The page holds data read from an executable and has
+        // not been written since; it has no swap slot, and can
+        // be dropped and read in again instead of swapped out
+        S_FILE,
+
+        // The page is a shared text page in the text cache (see
+        // textcache.h); it belongs to no address space, cme_swap_id
+        // holds its cache entry, and it is dropped when evicted
+        S_TEXT
 };
 
 struct cme {
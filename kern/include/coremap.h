@@ -1,6 +1,25 @@
 #include <spinlock.h>
 #include <cme.h>
 
+/*
+ * Free-run index over the kernel portion of the coremap: one bit per
+ * slot, plus a segment tree over the bitmap words recording, for each
+ * range, the longest run of set bits and the runs touching either
+ * end. This lets us find the first run of n set bits in log time.
+ */
+struct cm_runnode {
+        unsigned int rn_prefix;         // run of set bits at the start
+        unsigned int rn_suffix;         // run of set bits at the end
+        unsigned int rn_longest;        // longest run anywhere
+};
+
+struct cm_runindex {
+        unsigned int ri_nwords;         // bitmap words
+        unsigned int ri_nleaves;        // power of 2 >= ri_nwords
+        uint32_t *ri_bits;
+        struct cm_runnode *ri_nodes;    // 1-based heap of 2*ri_nleaves
+};
+
 struct cm {
         unsigned int cm_size;
         // Slots above the kernel break will be reserved for
@@ -14,8 +33,16 @@ struct cm {
         struct spinlock cm_page_count_spinlock;
         int cm_allocated_pages; // # of pages allocated, either in swap or RAM
         unsigned int cm_total_pages;	 // # of pages in swap + RAM
+        // Below the kernel break: slots not owned by the kernel, and
+        // slots that are outright free
+        struct spinlock cm_runs_spinlock;
+        struct cm_runindex cm_avail_runs;
+        struct cm_runindex cm_free_runs;
 };
 
+// Returned by cm_capture_slots_for_kernel on failure
+#define CM_NOSLOT ((cme_id_t)-1)
+
 extern struct cm coremap;
 
 // We should always have at least as many pages allocated as
@@ -37,8 +64,11 @@ cme_id_t cm_capture_slot(void);
 /*
  * Finds n contiguous free slots in the kernel portion of the
  * coremap, acquires the lock on all of those slots, and returns
- * the index of the first slot. Panics if the kernel could not
- * find any such memory.
+ * the index of the first slot. Runs of free slots are preferred;
+ * failing that, user pages in the way are evicted. If no run of
+ * non-kernel slots is long enough, cached kernel heap memory is
+ * given back and the search retried; if that fails too, returns
+ * CM_NOSLOT.
  *
  * Expects the caller to call release every acquired lock by
  * callign cme_release_locks.
@@ -86,7 +116,8 @@ void cm_release_locks(cme_id_t start, cme_id_t end);
 /*
  * Returns true iff we acquired BOTH the pte lock and the
  * cme lock (in that order). Also returns true if the page
- * is owned by the kernel or is free.
+ * is owned by the kernel, is free, or is a shared text page,
+ * none of which have a pte to lock.
  */
 bool cm_attempt_lock_with_pte(cme_id_t i);
 void cm_release_lock_with_pte(cme_id_t cme_id);
@@ -35,6 +35,9 @@
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
+/* Number of run queue levels; one bit each in c_runqueue_mask */
+#define RUNQUEUE_LEVELS 32
+
 /*
  * Per-cpu structure
  *
@@ -60,13 +63,17 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	struct spinlock_qnode c_qnodes[SPINLOCK_QNODES]; /* For queued locks */
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueue[RUNQUEUE_LEVELS]; /* One per priority */
+	uint32_t c_runqueue_mask;	/* Bit N set if c_runqueue[N] nonempty */
+	unsigned c_runqueue_count;	/* Total threads on the run queues */
+	unsigned c_runqueue_ticks;	/* Calls to schedule(), for aging */
 	struct spinlock c_runqueue_lock;
 
 	/*
@@ -2,12 +2,14 @@
 #include <lib.h>
 #include <vnode.h>
 #include <synch.h>
+#include <spinlock.h>
 
 struct fd_file {
         struct vnode *fdf_vnode;
-        struct lock *fdf_lock;
+        struct lock *fdf_lock;          // held for I/O; protects fdf_offset
         int fdf_flags;
-        int fdf_refcount;
+        int fdf_refcount;               // fd table slots pointing at us
+        struct spinlock fdf_reflock;    // protects fdf_refcount
         off_t fdf_offset;
 };
 
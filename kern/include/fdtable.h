@@ -4,21 +4,39 @@
 
 #define FD_MAX __OPEN_MAX
 
+/*
+ * The open files themselves. After fork, parent and child share one
+ * of these until either of them changes its table, at which point
+ * that one gets a copy of its own; so an array shared by more than
+ * one table is never changed.
+ */
+struct fd_array {
+        struct fd_file *fda_files[FD_MAX];
+        unsigned fda_refcount;          // tables using this array
+        struct spinlock fda_lock;       // protects fda_refcount
+};
+
+/*
+ * Looking up a file takes no locks: only the process that owns a
+ * table changes it, and processes have a single thread, so nothing
+ * can change the array or close the file under a lookup. fdt_lock
+ * serialises installing and closing files.
+ */
 struct fd_table {
-        struct fd_file *fdt_table[FD_MAX];
+        struct fd_array *fdt_array;
         struct lock *fdt_lock;
 };
 
 struct fd_table *fd_table_create(void);
 void fd_table_destroy(struct fd_table *fd_table);
 
-/* For both of these functions, we assume that caller has a lock on the table */
 bool fd_in_range(int fd);
 bool valid_fd(struct fd_table *fd_table, int fd);
 
-/* Find a free pid in the a fd table and point it to the fd struct.
-   Return the file descriptor if found; otherwise, return -1 */
-int add_file_to_fd_table(struct fd_table *fd_table, struct fd_file *file);
+/* Find a free fd in the a fd table and point it to the fd struct.
+   Return 0 and set fd if found; otherwise, return an error code */
+int add_file_to_fd_table(struct fd_table *fd_table, struct fd_file *file, int *fd);
 struct fd_file *get_file_from_fd_table(struct fd_table *fd_table, int fd);
 void clone_fd_table(struct fd_table *src, struct fd_table *dest);
 int release_fd_from_fd_table(struct fd_table *fd_table, int fd);
+int dup_fd_in_fd_table(struct fd_table *fd_table, int old_fd, int new_fd);
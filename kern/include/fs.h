@@ -54,6 +54,8 @@ struct fs {
  *      fsop_unmount    - Attempt unmount of filesystem.
  *      fsop_readblock  - Read block from storage.
  *      fsop_writeblock - Write block to storage.
+ *      fsop_readblocks - Read a run of consecutive blocks from storage.
+ *      fsop_writeblocks - Write a run of consecutive blocks to storage.
  *      fsop_attachbuf  - Hook for initializing fs-specific buffer state.
  *      fsop_detachbuf  - Hook for cleaning up fs-specific buffer state.
  *
@@ -77,6 +79,13 @@ struct fs {
  * fsop_readblock and fsop_writeblock are called by the buffer cache to
  * read in and write out (respectively) blocks to physical storage.
  *
+ * fsop_readblocks and fsop_writeblocks are the same, but transfer
+ * NBLOCKS consecutive blocks starting at the given block number in
+ * one operation; the data for each block is found through the array
+ * of pointers passed in. These are optional; if they are NULL the
+ * buffer cache falls back to one fsop_readblock/fsop_writeblock call
+ * per block.
+ *
  * fsop_attachbuf is called when a new buffer is attached to the file
  * system, and can use buffer_set_fsdata to attach FS-specific
  * metadata to the buffer and perform any other desired setup.
@@ -96,6 +105,10 @@ struct fs_ops {
 	int           (*fsop_readblock)(struct fs *, daddr_t, void *, size_t);
 	int           (*fsop_writeblock)(struct fs *, daddr_t, void *bufdata,
 					void *, size_t);
+	int           (*fsop_readblocks)(struct fs *, daddr_t, void **data,
+					 unsigned nblocks, size_t);
+	int           (*fsop_writeblocks)(struct fs *, daddr_t, void **data,
+					  unsigned nblocks, size_t);
 	int           (*fsop_attachbuf)(struct fs *, daddr_t, struct buf *);
 	void          (*fsop_detachbuf)(struct fs *, daddr_t, struct buf *);
 };
@@ -112,6 +125,10 @@ struct fs_ops {
 #define FSOP_WRITEBLOCK(fs,bn,fsdata,ptr,sz) \
 				((fs)->fs_ops->fsop_writeblock(fs,bn,fsdata, \
 							       ptr,sz))
+#define FSOP_READBLOCKS(fs,bn,ptrs,n,sz) \
+				((fs)->fs_ops->fsop_readblocks(fs,bn,ptrs,n,sz))
+#define FSOP_WRITEBLOCKS(fs,bn,ptrs,n,sz) \
+				((fs)->fs_ops->fsop_writeblocks(fs,bn,ptrs,n,sz))
 #define FSOP_ATTACHBUF(fs, blk, buf) ((fs)->fs_ops->fsop_attachbuf(fs,blk,buf))
 #define FSOP_DETACHBUF(fs, blk, buf) ((fs)->fs_ops->fsop_detachbuf(fs,blk,buf))
 
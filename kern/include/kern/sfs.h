@@ -161,6 +161,9 @@ struct sfs_jphys_trim {
 
 #define SFS_MAX_META_UPDATE_SIZE 128
 
+/* Max number of consecutive blocks covered by one cluster write record */
+#define SFS_CLUSTERBLOCKS 8
+
 enum sfs_record_type {
         R_TX_BEGIN,
         R_TX_COMMIT,
@@ -169,7 +172,8 @@ enum sfs_record_type {
         R_FREEMAP_RELEASE,
 
         R_META_UPDATE,
-        R_USER_BLOCK_WRITE
+        R_USER_BLOCK_WRITE,
+        R_USER_CLUSTER_WRITE
 };
 
 struct sfs_freemap_update {
@@ -189,7 +193,14 @@ struct sfs_user_block_write {
         uint32_t checksum;
 };
 
-// Journal record (directly serialized)
+/* Equivalent to one sfs_user_block_write per block, for a disk run */
+struct sfs_user_cluster_write {
+        uint32_t block;
+        uint32_t nblocks;
+        uint32_t checksums[SFS_CLUSTERBLOCKS];
+};
+
+// Journal record (in-memory form; see below for the on-disk form)
 typedef uint32_t txid_t;
 
 struct sfs_record {
@@ -197,6 +208,54 @@ struct sfs_record {
         struct sfs_freemap_update freemap_update;
         struct sfs_meta_update meta_update;
         struct sfs_user_block_write user_block_write;
+        struct sfs_user_cluster_write user_cluster_write;
+};
+
+/*
+ * On-disk record encodings.
+ *
+ * struct sfs_record above is the in-memory form. In the journal each
+ * record type is written compactly: the transaction id followed by
+ * only the fields that type uses. A meta update carries just the
+ * bytes that changed, as sdm_len bytes of old value followed by
+ * sdm_len bytes of new value; a cluster write carries sdc_nblocks
+ * checksums. Encoded records are padded to a multiple of
+ * SFS_RECORD_ALIGN bytes.
+ */
+#define SFS_RECORD_ALIGN 4
+
+struct sfs_disk_tx {
+        uint32_t sdt_txid;
 };
 
+struct sfs_disk_freemap_update {
+        uint32_t sdf_txid;
+        uint32_t sdf_block;
+};
+
+struct sfs_disk_meta_update {
+        uint32_t sdm_txid;
+        uint32_t sdm_block;
+        uint16_t sdm_pos;
+        uint16_t sdm_len;
+        /* followed by old value, new value */
+};
+
+struct sfs_disk_user_block_write {
+        uint32_t sdu_txid;
+        uint32_t sdu_block;
+        uint32_t sdu_checksum;
+};
+
+struct sfs_disk_user_cluster_write {
+        uint32_t sdc_txid;
+        uint32_t sdc_block;
+        uint32_t sdc_nblocks;
+        /* followed by sdc_nblocks checksums */
+};
+
+/* Largest encoded record */
+#define SFS_RECORD_MAXENCODED \
+        (sizeof(struct sfs_disk_meta_update) + 2*SFS_MAX_META_UPDATE_SIZE)
+
 #endif /* _KERN_SFS_H_ */
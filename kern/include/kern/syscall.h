@@ -85,7 +85,7 @@
 #define SYS_sigreturn    32
 //#define SYS_sigaltstack 33
 //                              (resource tracking and usage)
-//#define SYS_wait4      34
+#define SYS_wait4      34
 //#define SYS_getrusage  35
 //                              (resource limits)
 //#define SYS_getrlimit  36
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2000, 2001
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _OBJCACHE_H_
+#define _OBJCACHE_H_
+
+/*
+ * Object caches: typed allocators for kernel objects that are made
+ * and thrown away constantly. Each cache carves pages ("slabs") into
+ * objects of one size and keeps freed objects around, already
+ * constructed, for the next allocation.
+ *
+ * The constructor, if any, runs once on each object when its slab
+ * is made; the destructor, if any, runs when the slab is given back
+ * to the VM system. Objects must therefore be freed in constructed
+ * state: whatever the constructor set up must be intact again.
+ *
+ * Objects may be at most OBJCACHE_MAXSIZE bytes.
+ *
+ * Functions:
+ *     objcache_create  - make a cache of objects of size SIZE.
+ *                        Returns NULL on error.
+ *     objcache_alloc   - get an object. Returns NULL if out of memory.
+ *     objcache_free    - give an object back to the cache it came from.
+ *     objcache_destroy - destroy a cache. All its objects must have
+ *                        been freed.
+ *     objcache_reclaim - give all caches' wholly free slabs back to
+ *                        the VM system.
+ *     objcache_printstats - print statistics for all caches.
+ */
+
+#define OBJCACHE_MAXSIZE 1024
+
+struct objcache; /* Opaque. */
+
+struct objcache *objcache_create(const char *name, size_t size,
+				 void (*ctor)(void *obj),
+				 void (*dtor)(void *obj));
+void *objcache_alloc(struct objcache *oc);
+void objcache_free(struct objcache *oc, void *obj);
+void objcache_destroy(struct objcache *oc);
+void objcache_reclaim(void);
+void objcache_printstats(void);
+
+
+#endif /* _OBJCACHE_H_ */
@@ -0,0 +1,95 @@
+#ifndef _POLLQ_H_
+#define _POLLQ_H_
+
+#include <spinlock.h>
+
+/*
+ * Wait queues for poll.
+ *
+ * Anything that can be polled (the console, say) has a pollq. Its
+ * VOP_POLL registers the poller on the pollq before checking whether
+ * it's ready, and it calls pollq_wakeup whenever it might have become
+ * ready, so a poller can't miss a wakeup between checking and going
+ * to sleep. Wakeups may come from interrupt handlers.
+ *
+ * A poller waits on many pollqs at once, until one of them wakes it
+ * or its timeout runs out. Timeouts are counted down in hardclock, so
+ * they're only accurate to a tick.
+ *
+ * Functions:
+ *     pollq_init      - set up an empty pollq.
+ *     pollq_cleanup   - tear down a pollq nobody is waiting on.
+ *     pollq_wakeup    - wake every poller waiting on PQ. Cheap if
+ *                       there are none.
+ *     poller_init     - set up a poller that expects to wait on
+ *                       MAXENTRIES pollqs (more are allocated as
+ *                       needed, e.g. for objects with a pollq each
+ *                       for reading and writing), timing out after
+ *                       TIMEOUT milliseconds, or never if TIMEOUT is
+ *                       negative. Returns ENOMEM on failure.
+ *     poller_cleanup  - take the poller off all its pollqs and tear
+ *                       it down.
+ *     poller_rescan   - call before checking whether anything is ready.
+ *     poller_wait     - sleep until something the poller is waiting on
+ *                       may have changed since poller_rescan, or it
+ *                       times out. After the first wait, pollers stop
+ *                       registering, since they're on every queue they
+ *                       need already. Returns ENOMEM without sleeping
+ *                       if a poll_register since poller_init couldn't
+ *                       get memory, as the poller might never be woken.
+ *     poller_timedout - whether the timeout has run out.
+ *     poll_register   - wait on PQ. Called by VOP_POLL, without any
+ *                       spinlocks held, as it may allocate; does
+ *                       nothing if PL is NULL.
+ *     pollq_tick      - count down timeouts. Called by hardclock.
+ */
+
+struct poller;
+struct poll_entry;
+
+struct pollq {
+	struct spinlock pq_lock;
+	struct poll_entry *pq_entries;
+};
+
+struct poll_entry {
+	struct poller *pe_poller;
+	struct pollq *pe_q;
+	struct poll_entry *pe_prev;	/* on pe_q's list */
+	struct poll_entry *pe_next;
+	struct poll_entry *pe_extra;	/* on pe_poller's pl_extra list */
+};
+
+struct poller {
+	struct spinlock pl_lock;	/* protects pl_woken, pl_timedout */
+	struct wchan *pl_wchan;
+	bool pl_woken;
+	bool pl_timedout;
+	int pl_ticks;			/* left before timing out; 0 if not
+					   counting down. Protected by the
+					   timer list lock */
+	struct poller *pl_timernext;
+	bool pl_registering;
+	struct poll_entry *pl_entries;
+	unsigned pl_nentries;
+	unsigned pl_maxentries;
+	struct poll_entry *pl_extra;	/* allocated past pl_maxentries */
+	int pl_error;			/* from poll_register */
+};
+
+void pollq_init(struct pollq *pq);
+void pollq_cleanup(struct pollq *pq);
+void pollq_wakeup(struct pollq *pq);
+
+int poller_init(struct poller *pl, unsigned maxentries, int timeout);
+void poller_cleanup(struct poller *pl);
+void poller_rescan(struct poller *pl);
+int poller_wait(struct poller *pl);
+bool poller_timedout(struct poller *pl);
+
+void poll_register(struct poller *pl, struct pollq *pq);
+
+void pollq_tick(void);
+
+
+#endif /* _POLLQ_H_ */
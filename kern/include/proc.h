@@ -37,6 +37,8 @@
  */
 
 #include <array.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 #include <spinlock.h>
 #include <fdtable.h>
 #include <synch.h>
@@ -68,17 +70,28 @@ struct vnode;
 struct proc {
 	/* These fields are all initialised by proc_create */
 	pid_t p_pid;                    /* This process's pid */
+	/* Parent and child links are protected by proc_table.pt_familylock */
 	pid_t p_parent_pid;             /* Parent's pid */
+	bool p_exited;                  /* Has called proc_exit */
 	char *p_name;                   /* Name of this process */
 	int p_exit_status;              /* exit status */
 	unsigned p_numthreads;          /* Number of threads in this process. If num_threads
 					   is 0, either a thread never ran in the process or
 					   the process has completed, so the proc can be reaped */
 	struct lock *p_lock;            /* Lock for this structure */
+	struct proc *p_reapnext;        /* Next orphan for the reaper */
 	struct spinlock p_addrspace_spinlock; /* special spinlock for p_addrspace */
 	struct semaphore *p_wait_sem;   /* Call V() when exited so parent can P() on it */
 	struct array *p_children;       /* Array for keeping track of children pids
 					   -1 indicates an open slot in the array */
+	struct cv *p_child_cv;          /* Signalled when a child exits */
+	struct proc *p_zombies;         /* Exited children not yet waited for,
+					   oldest first */
+	struct proc *p_zombies_tail;
+	struct proc *p_zombie_prev;     /* Links on our parent's p_zombies */
+	struct proc *p_zombie_next;
+	struct rusage p_rusage;         /* Resources used, including by the
+					   children we've waited for */
 
 	/* This is initialised by proc_create, but does not bind STDIN, STDOUT or STDERR */
 	struct fd_table *p_fd_table;    /* File descriptor table */
@@ -86,6 +99,8 @@ struct proc {
 	/* These fields are NOT initialised by proc_create */
 	struct addrspace *p_addrspace;  /* virtual address space */
 	struct vnode *p_cwd;            /* current working directory */
+	struct semaphore *p_vfork_sem;  /* If p_addrspace is borrowed from a
+					   vforking parent, V() to give it back */
 };
 
 /* This is the process structure for the kernel and for kernel-only threads. */
@@ -100,6 +115,10 @@ void proc_bootstrap(void);
 /* Call once during system startup to bind STDIN/OUT/ERR to kproc. */
 void kproc_stdio_bootstrap(void);
 
+/* Call once during system startup, once threads can be forked, to start
+   the thread that reaps orphaned processes. */
+void proc_reaper_bootstrap(void);
+
 /* Create a fresh process for use by runprogram(). */
 struct proc *proc_create_runprogram(const char *name);
 
@@ -130,19 +149,30 @@ struct addrspace *proc_getas(void);
 /* Change the address space of the current process, and return the old one. */
 struct addrspace *proc_setas(struct addrspace *);
 
+/* Let go of an address space borrowed by vfork. */
+void proc_vfork_release(struct proc *proc);
+
 /* Add a child pid to a parent's children array */
 int add_child_pid_to_parent(struct proc *parent, pid_t child_pid);
 
 /* Remove a child pid from a parent's children array */
 void remove_child_pid_from_parent(struct proc *parent, pid_t child_pid);
 
-/* Assign all nonzombie children to kproc, and kfree all zombies */
+/* Assign all running children to kproc, and hand exited ones to the reaper */
 void kproc_adopt_children(struct proc *proc);
 
 /* Check if proc has any children */
 bool proc_has_children(struct proc *proc);
 
-/* Check if pid is a child of proc */
-bool proc_has_child(struct proc *proc, pid_t pid);
+/* Find an exited child to wait for: pid, or any child if pid is WAIT_ANY.
+   Sleeps until there is one, unless nohang is set, in which case hands
+   back NULL. Returns ESRCH or ECHILD if there's nothing to wait for */
+int proc_wait_child(struct proc *parent, pid_t pid, bool nohang, struct proc **ret);
+
+/* Put back a child from proc_wait_child that couldn't be waited for after all */
+void proc_unwait_child(struct proc *parent, struct proc *child);
+
+/* Finish waiting for a child from proc_wait_child, and reap it */
+void proc_reap_child(struct proc *parent, struct proc *child);
 
 #endif /* _PROC_H_ */
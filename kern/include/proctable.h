@@ -6,7 +6,14 @@
 
 struct proc_table {
         struct proc *pt_table[PID_MAX];
+        // Free pids, in the order they were freed, so that a pid
+        // isn't reused until all the others have been
+        pid_t pt_freepids[PID_MAX];
+        unsigned pt_freehead;           // index of the next pid to hand out
+        unsigned pt_nfree;
         struct spinlock pt_spinlock;
+        // Protects parent and child links between processes; see proc.h
+        struct lock *pt_familylock;
 };
 
 /* This is the global process table */
@@ -16,7 +23,10 @@ void proc_table_init(void);
 /* Check if in range and actual process */
 int is_valid_pid(pid_t pid);
 
-/* Find a free pid in the global process table and assign it to proc. Return the
-   pid if found; otherwise, return -1 */
+/* Return the process with the given pid, or NULL */
+struct proc *proc_table_lookup(pid_t pid);
+
+/* Take the least recently freed pid and assign it to proc. Return the pid if
+   there is one; otherwise, return -1 */
 pid_t assign_proc_to_pid(struct proc *);
 void release_pid(pid_t pid);
@@ -61,7 +61,9 @@ struct sfs_vnode {
 	unsigned sv_type;		/* cache of sfi_type */
 	struct buf *sv_dinobuf;		/* buffer holding dinode */
 	uint32_t sv_dinobufcount;	/* # times dinobuf has been loaded */
-	struct lock *sv_lock;		/* lock for vnode */
+	struct thread *sv_dinoholder;	/* thread that loaded dinobuf */
+	struct lock *sv_dinolock;	/* held while dinobuf is loaded */
+	struct rwlock *sv_lock;		/* lock for vnode */
 };
 
 /*
@@ -82,6 +84,9 @@ struct sfs_fs {
 	struct lock *sfs_renamelock;	/* lock for sfs_rename() */
 	struct sfs_transaction_set *sfs_transaction_set; /* struct of active transactions on this volume */
 	struct sfs_jphys *sfs_jphys;	/* physical journal container */
+	struct spinlock sfs_checkpoint_lock; /* protects the following */
+	struct wchan *sfs_checkpoint_wchan; /* checkpointer/unmount sleep here */
+	bool sfs_checkpoint_kick;	/* something changed; reconsider */
 	int sfs_checkpoint_exit:1;	/* boolean to tell checkpointing thread to exit */
 };
 
@@ -47,11 +47,32 @@
 /* Get the machine-dependent bits. */
 #include <machine/spinlock.h>
 
+/*
+ * Queue node for queued spinlocks. Each waiting CPU spins on the
+ * sqn_wait field of its own node rather than on the shared lock word,
+ * and the releasing CPU hands the lock to the next node in line. Each
+ * cpu has SPINLOCK_QNODES of these, enough for all the queued locks it
+ * might hold at once plus the one it's waiting for.
+ */
+struct spinlock_qnode {
+	volatile spinlock_data_t sqn_next;  /* Next waiter's node. */
+	volatile spinlock_data_t sqn_wait;  /* Nonzero until it's our turn. */
+	bool sqn_inuse;			    /* Node allocated. */
+};
+
+#define SPINLOCK_QNODES 4
+
 /*
  * Basic spinlock.
  *
  * Note that spinlocks are held by CPUs, not by threads.
  *
+ * A spinlock is either plain (test-and-test-and-set on splk_lock) or
+ * queued (MCS: splk_lock points to the node at the tail of a queue of
+ * waiting CPUs), chosen at initialization. Queued locks are fair and
+ * don't bounce a shared cache line among the waiters, but cost a bit
+ * more when uncontended; use them for hot global locks.
+ *
  * This structure is made public so spinlocks do not have to be
  * malloc'd; however, code that uses spinlocks should not look inside
  * the structure directly but always use the spinlock API functions.
@@ -59,23 +80,33 @@
 struct spinlock {
 	volatile spinlock_data_t splk_lock; /* Memory word where we spin. */
 	struct cpu *splk_holder;	    /* CPU holding this lock. */
+	bool splk_queued;		    /* True for a queued lock. */
+	struct spinlock_qnode *splk_qnode;  /* Holder's node, if queued. */
 	HANGMAN_LOCKABLE(splk_hangman);     /* Deadlock detector hook. */
 };
 
 /*
- * Initializer for cases where a spinlock needs to be static or global.
+ * Initializers for cases where a spinlock needs to be static or global.
  */
 #ifdef OPT_HANGMAN
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL, \
-				  HANGMAN_LOCKABLE_INITIALIZER }
+#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL, false, \
+				  NULL, HANGMAN_LOCKABLE_INITIALIZER }
+#define SPINLOCK_QUEUED_INITIALIZER \
+				{ SPINLOCK_DATA_INITIALIZER, NULL, true, \
+				  NULL, HANGMAN_LOCKABLE_INITIALIZER }
 #else
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL, false, \
+				  NULL }
+#define SPINLOCK_QUEUED_INITIALIZER \
+				{ SPINLOCK_DATA_INITIALIZER, NULL, true, \
+				  NULL }
 #endif
 
 /*
  * Spinlock functions.
  *
  * init		Initialize the contents of a spinlock.
+ * init_queued	Same, but make it a queued spinlock.
  * cleanup	Opposite of init. Lock must be unlocked.
  *
  * acquire	Get the lock, spinning as necessary. Also disables interrupts.
@@ -85,6 +116,7 @@ struct spinlock {
  */
 
 void spinlock_init(struct spinlock *lk);
+void spinlock_init_queued(struct spinlock *lk);
 void spinlock_cleanup(struct spinlock *lk);
 
 void spinlock_acquire(struct spinlock *lk);
@@ -80,6 +80,15 @@ struct lock {
         struct wchan *lk_wchan;
         struct spinlock lk_lock;
 
+        /* Statistics, protected by lk_lock. */
+        unsigned lk_acquires;           /* Total acquisitions */
+        unsigned lk_contended;          /* ...that found it held */
+        unsigned lk_spinwins;           /* ...then got it by spinning */
+        unsigned lk_sleeps;             /* Times a waiter went to sleep */
+
+        /* All-locks list for lock_printstats. */
+        struct lock *lk_prev;
+        struct lock *lk_next;
 };
 
 struct lock *lock_create(const char *name);
@@ -88,7 +97,9 @@ void lock_destroy(struct lock *);
 /*
  * Operations:
  *    lock_acquire - Get the lock. Only one thread can hold the lock at the
- *                   same time.
+ *                   same time. If the holder is running on another cpu,
+ *                   spins for up to LOCK_SPIN_MAX rounds in the hope it
+ *                   lets go soon; otherwise sleeps.
  *    lock_release - Free the lock. Only the thread holding the lock may do
  *                   this.
  *    lock_do_i_hold - Return true if the current thread holds the lock;
@@ -100,6 +111,12 @@ void lock_acquire(struct lock *);
 void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 
+/*
+ * Print acquire/contention/sleep counts for every lock that has seen
+ * contention, plus totals over all locks.
+ */
+void lock_printstats(void);
+
 
 /*
  * Condition variable.
@@ -142,4 +159,57 @@ void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers may hold the lock at once, or one writer.
+ *
+ * Readers that arrive while a writer is waiting queue up behind it,
+ * so a stream of readers can't starve writers. When a writer lets go,
+ * a fair lock admits the readers that were waiting before the next
+ * writer, so writers can't starve readers either; a lock created
+ * with WRITERPREF instead hands over to the next waiting writer if
+ * there is one.
+ *
+ * The name field is for easier debugging. A copy of the name is
+ * made internally.
+ */
+struct rwlock {
+        char *rw_name;
+        struct wchan *rw_readwchan;     /* readers waiting */
+        struct wchan *rw_writewchan;    /* writers waiting */
+        struct spinlock rw_lock;        /* protects the fields below */
+
+        unsigned rw_readers;            /* number of readers holding it */
+        struct thread *rw_writer;       /* writer holding it, if any */
+        unsigned rw_readwaiting;        /* number of readers asleep */
+        unsigned rw_writewaiting;       /* number of writers asleep */
+        unsigned rw_readpasses;         /* readers let in ahead of writers */
+        bool rw_writerpref;             /* prefer writers over readers */
+};
+
+struct rwlock *rwlock_create(const char *name, bool writerpref);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading.
+ *    rwlock_release_read  - Let go of a read hold.
+ *    rwlock_acquire_write - Get the lock for writing, excluding everyone.
+ *    rwlock_release_write - Let go of a write hold.
+ *    rwlock_do_i_hold_write - Return true if the current thread holds
+ *                   the lock for writing.
+ *    rwlock_do_i_hold - Return true if the current thread holds the lock
+ *                   for writing or anyone holds it for reading. Readers
+ *                   aren't tracked individually, so this is only good
+ *                   for assertions.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+bool rwlock_do_i_hold(struct rwlock *);
+
+
 #endif /* _SYNCH_H_ */
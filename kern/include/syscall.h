@@ -58,8 +58,8 @@ int runprogram(char *progname, char **args, int argc);
 int _launch_program(char *progname, vaddr_t *stack_ptr, vaddr_t *entry_point);
 
 // Helper functions for both runprogram and execv
-int extract_args(userptr_t args, char *buf, struct array *argv, struct array *argv_lens, bool copy_args);
-void copy_args_to_stack(vaddr_t *stack_ptr, struct array *argv, struct array *argv_lens);
+int extract_args(userptr_t args, char *buf, size_t *len, int *argc, bool copy_args);
+int copy_args_to_stack(vaddr_t *stack_ptr, const char *buf, size_t len, int argc);
 
 
 /*
@@ -71,8 +71,11 @@ int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
 int sys_execv(userptr_t prog, userptr_t args);
 void sys__exit(int exitcode);
 int sys_fork(struct trapframe *parent_tf, pid_t *retval);
+int sys_vfork(struct trapframe *parent_tf, pid_t *retval);
 int sys_getpid(pid_t* retval);
 int sys_waitpid(pid_t pid, int *status, int options, pid_t *retval);
+int sys_wait4(pid_t pid, userptr_t status, int options, userptr_t rusage,
+	      pid_t *retval);
 
 /*
  * Prototypes for file system calls
@@ -84,6 +87,7 @@ int sys_read(int fd, userptr_t buf, size_t len, size_t *read);
 int sys_write(int fd, userptr_t buf, size_t len, size_t *wrote);
 int sys_lseek(int fd, off_t pos, int whence, off_t *new_pos);
 int sys_dup2(int old_fd, int new_fd);
+int sys_poll(userptr_t fds, unsigned nfds, int timeout, int *retval);
 int sys_chdir(userptr_t path);
 int sys___getcwd(userptr_t buf, size_t len, size_t *copied);
 
@@ -103,5 +107,6 @@ int sys_ftruncate(int fd, off_t len);
  */
 
 int sys_sbrk(int32_t amount, int32_t *retval);
+int sys_mprotect(userptr_t addr, size_t len, int prot);
 
 #endif /* _SYSCALL_H_ */
@@ -0,0 +1,59 @@
+#ifndef _TEXTCACHE_H_
+#define _TEXTCACHE_H_
+
+#include <cme.h>
+
+/*
+ * Shared text pages.
+ *
+ * The pages of an executable's read-only segments are the same in
+ * every process running it, so instead of each process reading in
+ * its own copy they are kept in one cache, keyed by vnode and
+ * virtual address, and mapped read-only by everybody. Cached pages
+ * are S_TEXT in the coremap: no process owns them and no page table
+ * entry points at them (the entries stay lazy, so every TLB miss
+ * looks the page up here), and eviction drops them rather than
+ * swapping them out.
+ *
+ * The cache holds no vnode references. Regions that use it register
+ * their vnode with textcache_map instead, and when the last of them
+ * goes away textcache_unmap throws out that vnode's pages, so a
+ * vnode that is later reused for another file can't find them.
+ *
+ * Functions:
+ *     textcache_bootstrap - set up the cache. Call after cm_init.
+ *     textcache_map       - note another region sharing V's pages.
+ *                           Returns ENOSPC if too many executables
+ *                           are in use; the region should then use
+ *                           private pages.
+ *     textcache_unmap     - undo textcache_map.
+ *     textcache_invalidate - throw out V's cached pages because the
+ *                           file was written or truncated; regions
+ *                           still mapping it fault the new contents
+ *                           back in. File systems call this after
+ *                           changing a file's data, but only if
+ *                           V->vn_textmaps (kept up to date by
+ *                           textcache_map and textcache_unmap, and
+ *                           safe to test unlocked) is nonzero, so
+ *                           ordinary writes don't touch the cache.
+ *     textcache_fault     - map the page of V at VA read-only into
+ *                           the TLB, reading it in through AS if
+ *                           it isn't cached, in which case MAJOR is
+ *                           set. Returns ENOSPC if the cache is full.
+ *     textcache_forget    - drop the entry for an S_TEXT page being
+ *                           evicted. The caller holds its cme lock.
+ */
+
+struct addrspace;
+struct vnode;
+
+void textcache_bootstrap(void);
+int textcache_map(struct vnode *v);
+void textcache_unmap(struct vnode *v);
+void textcache_invalidate(struct vnode *v);
+int textcache_fault(struct addrspace *as, struct vnode *v, vaddr_t va,
+		    bool *major);
+void textcache_forget(cme_id_t slot);
+
+
+#endif /* _TEXTCACHE_H_ */
@@ -58,10 +58,16 @@ struct cpu;
 /* Scheduling */
 #define USING_SCHEDULER 1
 
-#define PRIORITY_MIN -20 	// Lower bound
-#define PRIORITY_MAX 19 	// Upper bound
-#define PRIORITY_INIT 0		// What it starts out as
-#define COUNTER_BOUND 100 	// Number of schedule() calls before resetting everyone to 0
+/*
+ * Each priority is one run queue level (see struct cpu); higher runs
+ * first. Threads that use up their time slice drift down, threads
+ * that sleep drift up, and threads left waiting on a run queue for
+ * PRIORITY_AGE_TICKS calls to schedule() are boosted one level.
+ */
+#define PRIORITY_MIN 0 		// Lower bound
+#define PRIORITY_MAX 31 	// Upper bound (< RUNQUEUE_LEVELS)
+#define PRIORITY_INIT 16	// What it starts out as
+#define PRIORITY_AGE_TICKS 8	// Wait before a ready thread is boosted
 #define S_READY_DEC 1		// How much to decrement computation threads by
 #define S_SLEEP_INC 1		// How much to increment i/o threads by
 
@@ -144,7 +150,8 @@ struct thread {
 
 	/* Scheduling */
 #if USING_SCHEDULER
-	int t_priority;
+	int t_priority;			/* Current run queue level */
+	unsigned t_runqueue_stamp;	/* c_runqueue_ticks when queued */
 #endif
 };
 
@@ -202,15 +209,9 @@ __DEAD void thread_exit(void);
 void thread_yield(void);
 
 /*
- * Reshuffle the run queue. Called from the timer interrupt.
+ * Age the run queue levels. Called from the timer interrupt.
  */
 void schedule(void);
 
-/*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
- */
-void thread_consider_migration(void);
-
 
 #endif /* _THREAD_H_ */
@@ -17,5 +17,11 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
  */
 void tlb_set_writeable(vaddr_t va, cme_id_t cme_id, bool writeable);
 
+/*
+ * Map VA read-only to a shared text page. Assumes that the caller
+ * holds the core map entry lock.
+ */
+void tlb_add_readonly(vaddr_t va, cme_id_t cme_id);
+
 void tlb_remove(vaddr_t va);
 void tlb_flush(void);
@@ -33,6 +33,7 @@
 #include <spinlock.h>
 struct uio;
 struct stat;
+struct poller;
 
 
 /*
@@ -57,6 +58,9 @@ struct vnode {
 	void *vn_data;                  /* Filesystem-specific data */
 
 	const struct vnode_ops *vn_ops; /* Functions on this vnode */
+
+	volatile unsigned vn_textmaps;	/* Regions sharing its pages as text;
+					   see textcache.h */
 };
 
 /*
@@ -132,6 +136,12 @@ struct vnode {
  *                      uio. Need not work on objects that are not
  *                      directories.
  *
+ *    vop_poll        - Return which of EVENTS (POLLIN, POLLOUT; see
+ *                      kern/poll.h) could be done now without blocking.
+ *                      Unless PL is NULL, first register it with
+ *                      poll_register on whatever pollq is woken when
+ *                      that changes (one or several); see pollq.h.
+ *
  *****************************************
  *
  *    vop_creat       - Create a regular file named NAME in the passed
@@ -196,6 +206,7 @@ struct vnode_ops {
 	int (*vop_mmap)(struct vnode *file /* add stuff */);
 	int (*vop_truncate)(struct vnode *file, off_t len);
 	int (*vop_namefile)(struct vnode *file, struct uio *uio);
+	int (*vop_poll)(struct vnode *object, int events, struct poller *pl);
 
 
 	int (*vop_creat)(struct vnode *dir,
@@ -240,6 +251,7 @@ struct vnode_ops {
 #define VOP_MMAP(vn /*add stuff */)     (__VOP(vn, mmap)(vn /*add stuff */))
 #define VOP_TRUNCATE(vn, pos)           (__VOP(vn, truncate)(vn, pos))
 #define VOP_NAMEFILE(vn, uio)           (__VOP(vn, namefile)(vn, uio))
+#define VOP_POLL(vn, events, pl)        (__VOP(vn, poll)(vn, events, pl))
 
 #define VOP_CREAT(vn,nm,excl,mode,res)  (__VOP(vn, creat)(vn,nm,excl,mode,res))
 #define VOP_SYMLINK(vn, name, content)  (__VOP(vn, symlink)(vn, name, content))
@@ -312,5 +324,10 @@ int vopfail_lookup_notdir(struct vnode *vn, char *path, struct vnode **result);
 int vopfail_lookparent_notdir(struct vnode *vn, char *path,
 			      struct vnode **result, char *buf, size_t len);
 
+/*
+ * Common stub for vop_poll on objects that never block.
+ */
+int vopnop_poll_ready(struct vnode *vn, int events, struct poller *pl);
+
 
 #endif /* _VNODE_H_ */
@@ -151,6 +151,7 @@ boot(void)
 
 	kheap_nextgeneration();
 	daemon_init();
+	proc_reaper_bootstrap();
 
 	/*
 	 * Make sure various things aren't screwed up.
@@ -39,6 +39,7 @@
 #include <proc.h>
 #include <vfs.h>
 #include <buf.h>
+#include <objcache.h>
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
@@ -414,6 +415,36 @@ cmd_bufstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_lockstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		(void)args;
+		lock_printstats();
+	}
+	else {
+		kprintf("Usage: locks\n");
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_objcachestats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		(void)args;
+		objcache_printstats();
+	}
+	else {
+		kprintf("Usage: objs\n");
+	}
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -522,6 +553,8 @@ static const char *mainmenu[] = {
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
 	"[buf] Print buffer cache stats      ",
+	"[locks] Print sleep lock stats      ",
+	"[objs] Print object cache stats     ",
 #if OPT_SYNCHPROBS
     "[sp1] Elves                         ",
     "[sp2] Air Balloon                   ",
@@ -576,6 +609,8 @@ static struct {
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
 	{ "buf",        cmd_bufstats },
+	{ "locks",      cmd_lockstats },
+	{ "objs",       cmd_objcachestats },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -25,6 +25,7 @@ fd_file_create(struct vnode *vnode, int flags)
         file->fdf_flags = flags;
         file->fdf_offset = 0;
         file->fdf_refcount = 1;
+        spinlock_init(&file->fdf_reflock);
 
         return file;
 
@@ -39,16 +40,21 @@ void
 fd_file_destroy(struct fd_file *file)
 {
         vfs_close(file->fdf_vnode);
+        spinlock_cleanup(&file->fdf_reflock);
         lock_destroy(file->fdf_lock);
         kfree(file);
 }
 
+/*
+ * The refcount has its own spinlock rather than using fdf_lock, so
+ * that taking a reference doesn't wait for I/O on the file.
+ */
 void
 fd_file_reference(struct fd_file *file)
 {
-        lock_acquire(file->fdf_lock);
+        spinlock_acquire(&file->fdf_reflock);
         file->fdf_refcount++;
-        lock_release(file->fdf_lock);
+        spinlock_release(&file->fdf_reflock);
 }
 
 bool
@@ -60,14 +66,14 @@ fd_file_check_flag(struct fd_file *file, int flag)
 void
 fd_file_release(struct fd_file *file)
 {
-        lock_acquire(file->fdf_lock);
+        int refcount;
 
-        if (file->fdf_refcount == 1) {
-                lock_release(file->fdf_lock);
+        spinlock_acquire(&file->fdf_reflock);
+        refcount = --file->fdf_refcount;
+        spinlock_release(&file->fdf_reflock);
+
+        if (refcount == 0) {
                 fd_file_destroy(file);
-        } else {
-                file->fdf_refcount--;
-                lock_release(file->fdf_lock);
         }
 }
 
@@ -3,6 +3,94 @@
 #include <lib.h>
 #include <fdtable.h>
 
+static
+struct fd_array *
+fd_array_create(void)
+{
+        struct fd_array *fd_array;
+
+        fd_array = kmalloc(sizeof(struct fd_array));
+        if (fd_array == NULL) {
+                return NULL;
+        }
+
+        // Set all pointers to NULL initially
+        memset(fd_array->fda_files, 0, sizeof(fd_array->fda_files));
+        fd_array->fda_refcount = 1;
+        spinlock_init(&fd_array->fda_lock);
+
+        return fd_array;
+}
+
+// Drop a table's reference, closing the files if it was the last one
+static
+void
+fd_array_release(struct fd_array *fd_array)
+{
+        unsigned refcount;
+
+        spinlock_acquire(&fd_array->fda_lock);
+        KASSERT(fd_array->fda_refcount > 0);
+        refcount = --fd_array->fda_refcount;
+        spinlock_release(&fd_array->fda_lock);
+
+        if (refcount > 0) {
+                return;
+        }
+
+        for (int i = 0; i < FD_MAX; i++) {
+                if (fd_array->fda_files[i] != NULL) {
+                        fd_file_release(fd_array->fda_files[i]);
+                }
+        }
+
+        spinlock_cleanup(&fd_array->fda_lock);
+        kfree(fd_array);
+}
+
+/*
+ * Make sure fd_table has an array of its own that it can change,
+ * copying the shared one if need be. Expects caller to hold the
+ * fd_table lock.
+ *
+ * If the refcount is 1, nobody else has the array, and nobody else
+ * can get it, as only we can clone our table.
+ */
+static
+int
+fd_table_unshare(struct fd_table *fd_table)
+{
+        struct fd_array *old, *new;
+        unsigned refcount;
+
+        old = fd_table->fdt_array;
+
+        spinlock_acquire(&old->fda_lock);
+        refcount = old->fda_refcount;
+        spinlock_release(&old->fda_lock);
+
+        if (refcount == 1) {
+                return 0;
+        }
+
+        new = fd_array_create();
+        if (new == NULL) {
+                return ENOMEM;
+        }
+
+        for (int i = 0; i < FD_MAX; i++) {
+                if (old->fda_files[i] != NULL) {
+                        new->fda_files[i] = old->fda_files[i];
+                        fd_file_reference(old->fda_files[i]);
+                }
+        }
+
+        fd_table->fdt_array = new;
+        fd_array_release(old);
+
+        return 0;
+}
+
 struct fd_table *
 fd_table_create()
 {
@@ -10,15 +98,28 @@ fd_table_create()
 
         fd_table = kmalloc(sizeof(struct fd_table));
         if (fd_table == NULL) {
-                return NULL;
+                goto err1;
+        }
+
+        fd_table->fdt_array = fd_array_create();
+        if (fd_table->fdt_array == NULL) {
+                goto err2;
+        }
+
+        fd_table->fdt_lock = lock_create("fd_table lock");
+        if (fd_table->fdt_lock == NULL) {
+                goto err3;
         }
 
-	// Set all pointers to NULL initially
-	memset(fd_table->fdt_table, 0, sizeof(fd_table->fdt_table));
+        return fd_table;
 
-	fd_table->fdt_lock = lock_create("fd_table lock");
 
-	return fd_table;
+        err3:
+                fd_array_release(fd_table->fdt_array);
+        err2:
+                kfree(fd_table);
+        err1:
+                return NULL;
 };
 
 void
@@ -26,6 +127,7 @@ fd_table_destroy(struct fd_table *fd_table)
 {
         KASSERT(fd_table != NULL);
 
+        fd_array_release(fd_table->fdt_array);
         lock_destroy(fd_table->fdt_lock);
         kfree(fd_table);
 }
@@ -36,88 +138,152 @@ fd_in_range(int fd)
         return fd >= 0 && fd < FD_MAX;
 }
 
-// Expects caller to hold fd_table lock
 bool
 valid_fd(struct fd_table *fd_table, int fd)
 {
-        return fd_in_range(fd) && fd_table->fdt_table[fd] != NULL;
+        return get_file_from_fd_table(fd_table, fd) != NULL;
 }
 
 int
-add_file_to_fd_table(struct fd_table *fd_table, struct fd_file *file)
+add_file_to_fd_table(struct fd_table *fd_table, struct fd_file *file, int *fd)
 {
+        struct fd_array *fd_array;
+        int err;
+
         KASSERT(fd_table != NULL);
         KASSERT(file != NULL);
 
         lock_acquire(fd_table->fdt_lock);
 
+        err = fd_table_unshare(fd_table);
+        if (err) {
+                lock_release(fd_table->fdt_lock);
+                return err;
+        }
+
+        fd_array = fd_table->fdt_array;
         for (int i = 0; i < FD_MAX; i++) {
-                if (fd_table->fdt_table[i] == NULL) {
-                        fd_table->fdt_table[i] = file;
+                if (fd_array->fda_files[i] == NULL) {
+                        fd_array->fda_files[i] = file;
                         lock_release(fd_table->fdt_lock);
-                        return i;
+                        *fd = i;
+                        return 0;
                 }
         }
 
         lock_release(fd_table->fdt_lock);
-        return -1;
+        return EMFILE;
 }
 
 struct fd_file *
 get_file_from_fd_table(struct fd_table *fd_table, int fd)
 {
-        struct fd_file *file;
-
         KASSERT(fd_table != NULL);
 
         if (fd_in_range(fd)) {
-                lock_acquire(fd_table->fdt_lock);
-                file = fd_table->fdt_table[fd];
-                lock_release(fd_table->fdt_lock);
-                return file;
+                return fd_table->fdt_array->fda_files[fd];
         }
 
         return NULL;
 }
 
+/*
+ * Dest must be newly created. Rather than copying every slot, dest
+ * shares src's array until one of them changes its table.
+ */
 void
 clone_fd_table(struct fd_table *src, struct fd_table *dest)
 {
+        struct fd_array *fd_array;
+
         KASSERT(src != NULL);
         KASSERT(dest != NULL);
 
         lock_acquire(src->fdt_lock);
-        lock_acquire(dest->fdt_lock);
-
-        for (int i = 0; i < FD_MAX; i++) {
 
-                if (src->fdt_table[i] != NULL) {
-                        dest->fdt_table[i] = src->fdt_table[i];
-                        fd_file_reference(src->fdt_table[i]);
-                }
-        }
+        fd_array = src->fdt_array;
+        spinlock_acquire(&fd_array->fda_lock);
+        fd_array->fda_refcount++;
+        spinlock_release(&fd_array->fda_lock);
 
         lock_release(src->fdt_lock);
-        lock_release(dest->fdt_lock);
+
+        fd_array_release(dest->fdt_array);
+        dest->fdt_array = fd_array;
 }
 
 int
 release_fd_from_fd_table(struct fd_table *fd_table, int fd)
 {
+        struct fd_file *file;
         int result;
 
         KASSERT(fd_table != NULL);
 
         lock_acquire(fd_table->fdt_lock);
 
-        if (valid_fd(fd_table, fd)) {
-                fd_file_release(fd_table->fdt_table[fd]);
-                fd_table->fdt_table[fd] = NULL;
-                result = 0;
-        } else {
-                result = EBADF;
+        if (!valid_fd(fd_table, fd)) {
+                lock_release(fd_table->fdt_lock);
+                return EBADF;
+        }
+
+        result = fd_table_unshare(fd_table);
+        if (result) {
+                lock_release(fd_table->fdt_lock);
+                return result;
         }
 
+        file = fd_table->fdt_array->fda_files[fd];
+        fd_table->fdt_array->fda_files[fd] = NULL;
+
         lock_release(fd_table->fdt_lock);
-        return result;
+
+        fd_file_release(file);
+        return 0;
+}
+
+/*
+ * Make new_fd refer to the same file as old_fd, closing whatever
+ * new_fd referred to before.
+ */
+int
+dup_fd_in_fd_table(struct fd_table *fd_table, int old_fd, int new_fd)
+{
+        struct fd_file *old_file, *new_file;
+        int result;
+
+        KASSERT(fd_table != NULL);
+
+        lock_acquire(fd_table->fdt_lock);
+
+        old_file = get_file_from_fd_table(fd_table, old_fd);
+        if (old_file == NULL || !fd_in_range(new_fd)) {
+                lock_release(fd_table->fdt_lock);
+                return EBADF;
+        }
+
+        /* If old_fd is the same as new_fd, and if they are both valid,
+           do nothing */
+        if (old_fd == new_fd) {
+                lock_release(fd_table->fdt_lock);
+                return 0;
+        }
+
+        result = fd_table_unshare(fd_table);
+        if (result) {
+                lock_release(fd_table->fdt_lock);
+                return result;
+        }
+
+        new_file = fd_table->fdt_array->fda_files[new_fd];
+        fd_file_reference(old_file);
+        fd_table->fdt_array->fda_files[new_fd] = old_file;
+
+        lock_release(fd_table->fdt_lock);
+
+        if (new_file != NULL) {
+                fd_file_release(new_file);
+        }
+
+        return 0;
 }
@@ -43,12 +43,14 @@
 #include <kern/fcntl.h>
 #include <kern/unistd.h>
 #include <kern/errno.h>
+#include <kern/wait.h>
 #include <proc.h>
 #include <proctable.h>
 #include <current.h>
 #include <addrspace.h>
 #include <vnode.h>
 #include <vfs.h>
+#include <thread.h>
 #include <current.h>
 
 /*
@@ -73,6 +75,13 @@ proc_create(const char *name, int *err) {
 	}
 
 	proc->p_parent_pid = -1; // To be set by caller
+	proc->p_exited = false;
+	proc->p_reapnext = NULL;
+	proc->p_zombies = NULL;
+	proc->p_zombies_tail = NULL;
+	proc->p_zombie_prev = NULL;
+	proc->p_zombie_next = NULL;
+	bzero(&proc->p_rusage, sizeof(proc->p_rusage));
 
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
@@ -111,17 +120,26 @@ proc_create(const char *name, int *err) {
 		*err = ENOMEM;
 		goto err7;
 	}
+
+	proc->p_child_cv = cv_create("proc child cv");
+	if (proc->p_child_cv == NULL) {
+		*err = ENOMEM;
+		goto err8;
+	}
 	spinlock_init(&proc->p_addrspace_spinlock);
 
 	proc->p_numthreads = 0;
 	proc->p_exit_status = -1;
 	proc->p_addrspace = NULL;
 	proc->p_cwd = NULL;
+	proc->p_vfork_sem = NULL;
 
 	*err = 0;
 	return proc;
 
 
+	err8:
+		lock_destroy(proc->p_lock);
 	err7:
 		sem_destroy(proc->p_wait_sem);
 	err6:
@@ -202,19 +220,27 @@ proc_cleanup(struct proc *proc)
 		 */
 		struct addrspace *as;
 
-		if (proc == curproc) {
-			as = proc_getas();
-			as_deactivate();
+		if (proc->p_vfork_sem != NULL) {
+			/* Borrowed from our parent, who still needs it */
+			spinlock_acquire(&proc->p_addrspace_spinlock);
+			proc->p_addrspace = NULL;
+			spinlock_release(&proc->p_addrspace_spinlock);
+			proc_vfork_release(proc);
 		}
 		else {
-			as = proc->p_addrspace;
-			proc->p_addrspace = NULL;
+			if (proc == curproc) {
+				as = proc_getas();
+				as_deactivate();
+			}
+			else {
+				as = proc->p_addrspace;
+				proc->p_addrspace = NULL;
+			}
+			as_destroy(as);
 		}
-		as_destroy(as);
 	}
 
 	spinlock_cleanup(&proc->p_addrspace_spinlock);
-	lock_destroy(proc->p_lock);
 	array_destroy(proc->p_children);
 	fd_table_destroy(proc->p_fd_table);
 }
@@ -228,6 +254,10 @@ proc_reap(struct proc *proc)
 {
 	KASSERT(proc->p_numthreads == 0);
 
+	/* An exiting parent may lock us to check whether we've exited,
+	   so the lock has to last as long as the proc */
+	lock_destroy(proc->p_lock);
+	cv_destroy(proc->p_child_cv);
 	sem_destroy(proc->p_wait_sem);
 	release_pid(proc->p_pid);
 	kfree(proc->p_name);
@@ -249,6 +279,131 @@ proc_destroy(struct proc *proc)
 	proc_reap(proc);
 }
 
+/*
+ * Reaper for orphans.
+ *
+ * Nobody will waitpid for a process whose parent has exited, so once
+ * it has exited too it goes on this queue, and the reaper thread
+ * waits for it to finish dying and reaps it.
+ */
+static struct {
+	struct lock *r_lock;
+	struct cv *r_cv;
+	struct proc *r_queue;           /* Linked through p_reapnext */
+} reaper;
+
+static
+void
+proc_reaper_thread(void *data1, unsigned long data2)
+{
+	struct proc *proc;
+
+	(void)data1;
+	(void)data2;
+
+	while (true) {
+		lock_acquire(reaper.r_lock);
+		while (reaper.r_queue == NULL) {
+			cv_wait(reaper.r_cv, reaper.r_lock);
+		}
+		proc = reaper.r_queue;
+		reaper.r_queue = proc->p_reapnext;
+		lock_release(reaper.r_lock);
+
+		/* Wait for thread_exit to be done with it */
+		P(proc->p_wait_sem);
+
+		lock_acquire(proc_table.pt_familylock);
+		if (proc->p_parent_pid == kproc->p_pid) {
+			remove_child_pid_from_parent(kproc, proc->p_pid);
+		}
+		lock_release(proc_table.pt_familylock);
+
+		proc_reap(proc);
+	}
+}
+
+void
+proc_reaper_bootstrap(void)
+{
+	int err;
+
+	reaper.r_lock = lock_create("reaper lock");
+	if (reaper.r_lock == NULL) {
+		panic("proc_reaper_bootstrap: could not create lock\n");
+	}
+
+	reaper.r_cv = cv_create("reaper cv");
+	if (reaper.r_cv == NULL) {
+		panic("proc_reaper_bootstrap: could not create cv\n");
+	}
+
+	reaper.r_queue = NULL;
+
+	err = thread_fork("reaper", NULL, proc_reaper_thread, NULL, 0);
+	if (err) {
+		panic("proc_reaper_bootstrap: could not launch thread\n");
+	}
+}
+
+/*
+ * Hand an exited orphan to the reaper.
+ */
+static
+void
+proc_reaper_add(struct proc *proc)
+{
+	KASSERT(proc->p_exited);
+
+	lock_acquire(reaper.r_lock);
+	proc->p_reapnext = reaper.r_queue;
+	reaper.r_queue = proc;
+	cv_signal(reaper.r_cv, reaper.r_lock);
+	lock_release(reaper.r_lock);
+}
+
+/*
+ * Exited children waiting for their parent, oldest first. Call with
+ * the family lock held.
+ */
+static
+void
+proc_zombie_append(struct proc *parent, struct proc *child)
+{
+	child->p_zombie_prev = parent->p_zombies_tail;
+	child->p_zombie_next = NULL;
+
+	if (parent->p_zombies_tail != NULL) {
+		parent->p_zombies_tail->p_zombie_next = child;
+	}
+	else {
+		parent->p_zombies = child;
+	}
+	parent->p_zombies_tail = child;
+}
+
+static
+void
+proc_zombie_remove(struct proc *parent, struct proc *child)
+{
+	if (child->p_zombie_prev != NULL) {
+		child->p_zombie_prev->p_zombie_next = child->p_zombie_next;
+	}
+	else {
+		parent->p_zombies = child->p_zombie_next;
+	}
+
+	if (child->p_zombie_next != NULL) {
+		child->p_zombie_next->p_zombie_prev = child->p_zombie_prev;
+	}
+	else {
+		parent->p_zombies_tail = child->p_zombie_prev;
+	}
+
+	child->p_zombie_prev = NULL;
+	child->p_zombie_next = NULL;
+}
+
 /*
  * Exit a proc structure.
  *
@@ -258,15 +413,32 @@ proc_destroy(struct proc *proc)
 void
 proc_exit(struct proc *proc, int exitcode)
 {
+	struct proc *parent;
+
 	KASSERT(proc->p_numthreads == 1);
 
-	lock_acquire(proc->p_lock);
+	lock_acquire(proc_table.pt_familylock);
 
 	/* kproc should adopt all the children *before* we call proc_destroy */
 	kproc_adopt_children(proc);
 	proc->p_exit_status = exitcode;
+	proc->p_exited = true;
 
-	lock_release(proc->p_lock);
+	/* If our parent has gone, nobody will wait for us, so the reaper
+	   does. Otherwise queue up for our parent's waitpid. Either way,
+	   whoever reaps us waits for thread_exit first */
+	if (proc->p_parent_pid == kproc->p_pid) {
+		proc_reaper_add(proc);
+	}
+	else if (proc->p_parent_pid >= 0) {
+		parent = proc_table_lookup(proc->p_parent_pid);
+		KASSERT(parent != NULL);
+
+		proc_zombie_append(parent, proc);
+		cv_broadcast(parent->p_child_cv, proc_table.pt_familylock);
+	}
+
+	lock_release(proc_table.pt_familylock);
 
 	/* Cleanup everything except the proc struct itself, which contains
 	   the exit status */
@@ -299,7 +471,7 @@ proc_bootstrap(void)
 void
 kproc_stdio_bootstrap(void)
 {
-	int err1, err2, err3;
+	int err1, err2, err3, fd;
 	struct vnode *stdin, *stdout, *stderr;
 	struct fd_file *stdin_f, *stdout_f, *stderr_f;
 
@@ -323,9 +495,17 @@ kproc_stdio_bootstrap(void)
 		panic("fd_file_create for STDIO failed\n");
         }
 
-	curproc->p_fd_table->fdt_table[STDIN_FILENO] = stdin_f;
-	curproc->p_fd_table->fdt_table[STDOUT_FILENO] = stdout_f;
-	curproc->p_fd_table->fdt_table[STDERR_FILENO] = stderr_f;
+	/* The table is empty, so these get the lowest fds in order */
+	err1 = add_file_to_fd_table(curproc->p_fd_table, stdin_f, &fd);
+	KASSERT(err1 || fd == STDIN_FILENO);
+	err2 = add_file_to_fd_table(curproc->p_fd_table, stdout_f, &fd);
+	KASSERT(err2 || fd == STDOUT_FILENO);
+	err3 = add_file_to_fd_table(curproc->p_fd_table, stderr_f, &fd);
+	KASSERT(err3 || fd == STDERR_FILENO);
+
+	if (err1 || err2 || err3) {
+		panic("Could not add STDIO to the fd table\n");
+	}
 }
 
 /*
@@ -466,7 +646,24 @@ proc_setas(struct addrspace *newas)
 	return oldas;
 }
 
-// Expects caller to hold the process lock
+/*
+ * Wake up the parent that vforked PROC. Call once PROC no longer
+ * uses the parent's address space: after execv has switched to a
+ * new one, or at exit.
+ */
+void
+proc_vfork_release(struct proc *proc)
+{
+	struct semaphore *sem;
+
+	sem = proc->p_vfork_sem;
+	KASSERT(sem != NULL);
+
+	proc->p_vfork_sem = NULL;
+	V(sem);
+}
+
+// Expects caller to hold the family lock
 // Return 0 on success, ENOMEM on error
 int
 add_child_pid_to_parent(struct proc *parent, pid_t child_pid)
@@ -485,7 +682,7 @@ add_child_pid_to_parent(struct proc *parent, pid_t child_pid)
 	return array_add(parent->p_children, (void *)child_pid, NULL);
 }
 
-/* Expects caller to hold the process lock, and assumes that the
+/* Expects caller to hold the family lock, and assumes that the
    child_pid is actually in the children array */
 void
 remove_child_pid_from_parent(struct proc *parent, pid_t child_pid)
@@ -500,23 +697,9 @@ remove_child_pid_from_parent(struct proc *parent, pid_t child_pid)
 	}
 }
 
-static
-void
-kproc_adopt_process(struct proc *proc)
-{
-	lock_acquire(proc->p_lock);
-	lock_acquire(kproc->p_lock);
-
-	proc->p_parent_pid = kproc->p_pid;
-	array_add(kproc->p_children, (void*)proc->p_pid, NULL);
-
-	lock_release(kproc->p_lock);
-	lock_release(proc->p_lock);
-}
-
 /*
- * Expects caller to hold the process lock, but not the kproc lock,
- * the proc_table spinlock, or the child locks
+ * Expects caller to hold the family lock, but not the proc_table
+ * spinlock
  */
 void
 kproc_adopt_children(struct proc *proc)
@@ -525,27 +708,32 @@ kproc_adopt_children(struct proc *proc)
 	pid_t pid;
 	struct proc *child_proc;
 
-	spinlock_acquire(&proc_table.pt_spinlock);
-
 	for (i = 0; i < proc->p_children->num; i++) {
 		pid = (pid_t)array_get(proc->p_children, i);
-		if (pid != (pid_t)-1) {
-			child_proc = proc_table.pt_table[pid];
+		if (pid == (pid_t)-1) {
+			continue;
+		}
 
-			if (child_proc->p_numthreads == 0) {
-				proc_reap(child_proc);
-			} else {
-				kproc_adopt_process(child_proc);
-			}
+		// Our children can't go away until we've let go of them
+		spinlock_acquire(&proc_table.pt_spinlock);
+		child_proc = proc_table.pt_table[pid];
+		spinlock_release(&proc_table.pt_spinlock);
+		KASSERT(child_proc != NULL);
 
-			array_set(proc->p_children, i, (void *)-1);
+		if (child_proc->p_exited) {
+			proc_zombie_remove(proc, child_proc);
+			proc_reaper_add(child_proc);
+		}
+		else {
+			child_proc->p_parent_pid = kproc->p_pid;
+			array_add(kproc->p_children, (void*)pid, NULL);
 		}
-	}
 
-	spinlock_release(&proc_table.pt_spinlock);
+		array_set(proc->p_children, i, (void *)-1);
+	}
 }
 
-// Expects caller to hold the process lock
+// Expects caller to hold the family lock
 bool
 proc_has_children(struct proc *proc)
 {
@@ -562,17 +750,92 @@ proc_has_children(struct proc *proc)
 	return false;
 };
 
-// Expects caller to hold the process lock
-bool
-proc_has_child(struct proc *proc, pid_t pid)
+/*
+ * Exited children are queued on their parent, so waiting for any
+ * child just takes the oldest one, and whether PID is our child is
+ * a matter of looking at its parent pid. Either way, once we've
+ * taken the child off the queue nobody else can wait for it.
+ */
+int
+proc_wait_child(struct proc *parent, pid_t pid, bool nohang, struct proc **ret)
 {
-	unsigned i;
+	struct proc *child;
+	int err;
 
-	for (i = 0; i < proc->p_children->num; i++) {
-		if ((pid_t) array_get(proc->p_children, i) == pid) {
-			return true;
+	if (pid != WAIT_ANY && (pid < PID_MIN || pid >= PID_MAX)) {
+		return ESRCH;
+	}
+
+	err = 0;
+	lock_acquire(proc_table.pt_familylock);
+
+	while (true) {
+		if (pid == WAIT_ANY) {
+			child = parent->p_zombies;
+			if (child == NULL && !proc_has_children(parent)) {
+				err = ECHILD;
+				break;
+			}
+		}
+		else {
+			child = proc_table_lookup(pid);
+			if (child == NULL) {
+				err = ESRCH;
+				break;
+			}
+			if (child->p_parent_pid != parent->p_pid) {
+				err = ECHILD;
+				break;
+			}
+			if (!child->p_exited) {
+				child = NULL;
+			}
+		}
+
+		if (child != NULL) {
+			proc_zombie_remove(parent, child);
+			break;
 		}
+
+		if (nohang) {
+			break;
+		}
+
+		cv_wait(parent->p_child_cv, proc_table.pt_familylock);
 	}
 
-	return false;
+	lock_release(proc_table.pt_familylock);
+
+	if (err) {
+		return err;
+	}
+
+	if (child != NULL) {
+		/* Wait for thread_exit to be done with it */
+		P(child->p_wait_sem);
+	}
+
+	*ret = child;
+	return 0;
+}
+
+void
+proc_unwait_child(struct proc *parent, struct proc *child)
+{
+	lock_acquire(proc_table.pt_familylock);
+	proc_zombie_append(parent, child);
+	lock_release(proc_table.pt_familylock);
+
+	// Undo our P() call
+	V(child->p_wait_sem);
+}
+
+void
+proc_reap_child(struct proc *parent, struct proc *child)
+{
+	lock_acquire(proc_table.pt_familylock);
+	remove_child_pid_from_parent(parent, child->p_pid);
+	lock_release(proc_table.pt_familylock);
+
+	proc_reap(child);
 }
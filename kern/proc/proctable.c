@@ -5,7 +5,22 @@
 void
 proc_table_init()
 {
-        spinlock_init(&proc_table.pt_spinlock);
+        pid_t pid;
+
+        spinlock_init_queued(&proc_table.pt_spinlock);
+
+        // kproc gets pid 0
+        for (pid = 0; pid < PID_MAX; pid++) {
+                proc_table.pt_table[pid] = NULL;
+                proc_table.pt_freepids[pid] = pid;
+        }
+        proc_table.pt_freehead = 0;
+        proc_table.pt_nfree = PID_MAX;
+
+        proc_table.pt_familylock = lock_create("proc family lock");
+        if (proc_table.pt_familylock == NULL) {
+                panic("Could not create proc family lock\n");
+        }
 }
 
 int is_valid_pid(pid_t pid)
@@ -29,47 +44,64 @@ int is_valid_pid(pid_t pid)
         return err;
 }
 
-/*
- * Looks for a pid that is NULL, or a pid that belongs to an
- * inactive process whose parent is kproc.
- */
+struct proc *
+proc_table_lookup(pid_t pid)
+{
+        struct proc *proc;
+
+        if (pid < 0 || pid >= PID_MAX) {
+                return NULL;
+        }
+
+        spinlock_acquire(&proc_table.pt_spinlock);
+        proc = proc_table.pt_table[pid];
+        spinlock_release(&proc_table.pt_spinlock);
+
+        return proc;
+}
+
 pid_t
 assign_proc_to_pid(struct proc *proc)
 {
-        struct proc *pt_proc;
+        pid_t pid;
 
         KASSERT(proc != NULL);
 
         spinlock_acquire(&proc_table.pt_spinlock);
 
-        for (pid_t i = 0; i < PID_MAX; i++) {
-                pt_proc = proc_table.pt_table[i];
-
-                if (pt_proc != NULL
-                    && pt_proc->p_numthreads == 0
-                    && pt_proc->p_parent_pid == kproc->p_pid) {
-                        proc_reap(pt_proc);
-                        proc_table.pt_table[i] = NULL;
-                }
-
-                if (pt_proc == NULL) {
-                        proc->p_pid = i;
-                        proc_table.pt_table[i] = proc;
-                        spinlock_release(&proc_table.pt_spinlock);
-                        return i;
-                }
+        if (proc_table.pt_nfree == 0) {
+                spinlock_release(&proc_table.pt_spinlock);
+                return -1;
         }
 
+        pid = proc_table.pt_freepids[proc_table.pt_freehead];
+        proc_table.pt_freehead = (proc_table.pt_freehead + 1) % PID_MAX;
+        proc_table.pt_nfree--;
+
+        KASSERT(proc_table.pt_table[pid] == NULL);
+        proc->p_pid = pid;
+        proc_table.pt_table[pid] = proc;
+
         spinlock_release(&proc_table.pt_spinlock);
-        return -1;
+        return pid;
 }
 
 void
 release_pid(pid_t pid)
 {
+        unsigned tail;
+
         KASSERT(pid >= 0 && pid < PID_MAX);
 
         spinlock_acquire(&proc_table.pt_spinlock);
+
+        KASSERT(proc_table.pt_table[pid] != NULL);
+        KASSERT(proc_table.pt_nfree < PID_MAX);
         proc_table.pt_table[pid] = NULL;
+
+        tail = (proc_table.pt_freehead + proc_table.pt_nfree) % PID_MAX;
+        proc_table.pt_freepids[tail] = pid;
+        proc_table.pt_nfree++;
+
         spinlock_release(&proc_table.pt_spinlock);
 }
@@ -9,129 +9,151 @@
 #include <syscall.h>
 #include <test.h>
 #include <copyinout.h>
-#include <array.h>
 #include <limits.h>
+#include <kern/wait.h>
+#include <kern/signal.h>
 
-/* Returns 0 if we successfully copied the user's arguments into buf;
-   otherwise, returns error code. argv will contain pointers to the starts
-   of each argument, and argv_lens will contain the lengths
+/* Number of argv pointers moved per copyin or copyout */
+#define ARGV_CHUNK 64
 
-   If copy is set to false, as in the case of runprogram, extract_args will
-   simply save the addresses and lengths and verify that we don'y exceed
-   ARG_MAX, since the arguments already exist in the kernel space */
+/* Returns 0 if we successfully copied the user's arguments into buf;
+   otherwise, returns error code. The strings are packed into buf back to
+   back, as they will be on the new stack, so that copy_args_to_stack can
+   copy them out in one go. len is set to the bytes used and argc to the
+   number of arguments.
+
+   The user's argv array is copied in a chunk at a time rather than a
+   pointer at a time. Chunks stop at page boundaries, so we don't fault on
+   memory past the end of the array.
+
+   If copy is set to false, as in the case of runprogram, the arguments
+   already exist in kernel space, so extract_args simply packs them and
+   verifies that we don't exceed ARG_MAX */
 int
-extract_args(userptr_t args, char *buf, struct array *argv, struct array *argv_lens, bool copy_args)
+extract_args(userptr_t args, char *buf, size_t *len, int *argc, bool copy_args)
 {
-	void *test_ptr;
-	int arg, i, result;
-	size_t pos, copied, rem;
+	userptr_t chunk[ARGV_CHUNK];
 	char **args_p;
+	unsigned n, i;
+	size_t pos, copied;
+	int result;
+
+	pos = 0;
+	*argc = 0;
+	*len = 0;
 
 	if (args == NULL) {
 		return 0;
 	}
 
-	args_p = (char **)args;
-
-	// Verify args if if they live in userland
-	if (copy_args) {
-		i = 0;
-		test_ptr = NULL;
-		do {
-			result = copyin((const_userptr_t)args_p, &test_ptr, 4);
-			if (result) {
-				return result;
-			}
-			else if (i > ARG_MAX) {
+	if (!copy_args) {
+		args_p = (char **)args;
+		for (i = 0; args_p[i] != NULL; i++) {
+			copied = strlen(args_p[i]) + 1;
+			if (ARG_MAX - pos < copied) {
 				return E2BIG;
 			}
-			else {
-				args_p += sizeof(userptr_t);
-			}
-			i++;
-		} while (test_ptr != NULL);
-
-		args_p = (char **)args;
+			memcpy(&buf[pos], args_p[i], copied);
+			pos += copied;
+		}
 
+		*argc = i;
+		*len = pos;
+		return 0;
 	}
-	pos = 0;
-	arg = 0;
-	while (args_p[arg] != NULL) {
-		rem = ARG_MAX - pos;
-		if (copy_args) {
-			result = copyinstr((const_userptr_t) args_p[arg], &buf[pos], rem, &copied);
 
+	while (true) {
+		n = (PAGE_SIZE - (vaddr_t)args % PAGE_SIZE) / sizeof(userptr_t);
+		if (n == 0) {
+			// A pointer straddling two pages
+			n = 1;
+		}
+		else if (n > ARGV_CHUNK) {
+			n = ARGV_CHUNK;
+		}
+
+		result = copyin((const_userptr_t)args, chunk, n * sizeof(userptr_t));
+		if (result) {
+			return result;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (chunk[i] == NULL) {
+				*len = pos;
+				return 0;
+			}
+
+			// Every argument takes at least a byte, so this also
+			// bounds argc
+			result = copyinstr((const_userptr_t)chunk[i], &buf[pos],
+					   ARG_MAX - pos, &copied);
 			switch (result) {
+			case 0:
+				break;
 			case EFAULT:
 				return EFAULT;
 			case ENAMETOOLONG:
 				return E2BIG;
 			default:
-				if (result != 0) {
-					panic("Unexpected error from copyinstr in extract_args\n");
-				}
-			};
-			result = array_add(argv, &buf[pos], NULL);
+				panic("Unexpected error from copyinstr in extract_args\n");
+			}
+
+			pos += copied;
+			(*argc)++;
 		}
-		else {
-			copied = strlen(args_p[arg]) + 1;
 
-			if (rem < copied) {
-				return E2BIG;
-			}
-			result = array_add(argv, args_p[arg], NULL);
+		args = (userptr_t)((vaddr_t)args + n * sizeof(userptr_t));
+	}
+}
+
+/* Lay out the arguments packed by extract_args on the new stack: the
+   strings at the top, and the NULL terminated argv array below them. The
+   strings are copied out in one go, and argv a chunk at a time as we work
+   out where each string went. Leaves stack_ptr pointing at argv */
+int
+copy_args_to_stack(vaddr_t *stack_ptr, const char *buf, size_t len, int argc)
+{
+	userptr_t chunk[ARGV_CHUNK];
+	vaddr_t strings, argv;
+	size_t pos;
+	int i, j, n, result;
+
+	strings = *stack_ptr - ROUNDUP(len, 4);
+	argv = strings - (argc + 1) * sizeof(userptr_t);
+
+	result = copyout(buf, (userptr_t)strings, len);
+	if (result) {
+		return result;
+	}
 
+	pos = 0;
+	for (i = 0; i <= argc; i += n) {
+		n = argc + 1 - i;
+		if (n > ARGV_CHUNK) {
+			n = ARGV_CHUNK;
 		}
 
-		if (result) {
-			return result;
+		for (j = 0; j < n; j++) {
+			if (i + j == argc) {
+				chunk[j] = NULL;
+			}
+			else {
+				chunk[j] = (userptr_t)(strings + pos);
+				pos += strlen(&buf[pos]) + 1;
+			}
 		}
 
-		result = array_add(argv_lens, (void*)copied, NULL);
+		result = copyout(chunk, (userptr_t)(argv + i * sizeof(userptr_t)),
+				 n * sizeof(userptr_t));
 		if (result) {
 			return result;
 		}
-
-		pos += copied;
-		arg++;
 	}
 
+	*stack_ptr = argv;
 	return 0;
 }
 
-void
-copy_args_to_stack(vaddr_t *stack_ptr, struct array *argv, struct array *argv_lens)
-{
-	int argc, i, len, padding;
-	char* start_ptr;
-	userptr_t arg_ptr;
-
-	argc = argv->num;
-
-	for (i = argc - 1; i >= 0; --i) {
-		len = (int) array_get(argv_lens, i);
-		start_ptr = array_get(argv, i);
-		padding = len % 4 == 0 ? 0 : 4 - (len % 4);
-		*stack_ptr -= len + padding;
-		copyoutstr((const char*) start_ptr, (userptr_t) *stack_ptr, len, NULL);
-
-		// Rather than allocating an new array, we reuse the argv_lens array to store pointers
-		// to the start of each argument on the stack
-		array_set(argv_lens, i, (void*) *stack_ptr);
-	}
-
-	// NULL terminate the arg pointers
-	*stack_ptr -= 4;
-	arg_ptr = NULL;
-	copyout((const void*) &arg_ptr, (userptr_t) *stack_ptr, 4);
-
-	for (i = argc - 1; i >= 0; --i) {
-		*stack_ptr -= 4;
-		arg_ptr = (userptr_t) array_get(argv_lens, i);
-		copyout((const void*) &arg_ptr, (userptr_t) *stack_ptr, 4);
-	}
-}
-
 int
 _launch_program(char *progname, vaddr_t *stack_ptr, vaddr_t *entry_point)
 {
@@ -179,7 +201,11 @@ _launch_program(char *progname, vaddr_t *stack_ptr, vaddr_t *entry_point)
 	/* Clean up */
 	vfs_close(v);
 
-	if (old_as != NULL) {
+	if (curproc->p_vfork_sem != NULL) {
+		// The old address space was our parent's
+		proc_vfork_release(curproc);
+	}
+	else if (old_as != NULL) {
 		as_destroy(old_as);
 	}
 
@@ -203,7 +229,7 @@ sys_execv(userptr_t progname, userptr_t args)
 {
 	int argc, result;
 	char *arg_buf, *progname_buf, *old_progname;
-	struct array *argv, *argv_lens;
+	size_t arg_len;
 	vaddr_t entry_point, stack_ptr;
 
 	if (progname == NULL || args == NULL) {
@@ -216,35 +242,22 @@ sys_execv(userptr_t progname, userptr_t args)
 		goto err1;
 	}
 
-	argv = array_create();
-	if (!argv) {
-		result = ENOMEM;
-		goto err2;
-	}
-
-	argv_lens = array_create();
-	if (!argv_lens) {
-		result = ENOMEM;
-		goto err3;
-	}
-
-	result = extract_args(args, arg_buf, argv, argv_lens, true);
+	result = extract_args(args, arg_buf, &arg_len, &argc, true);
 	if (result != 0) {
-		goto err4;
+		goto err2;
 	}
-	argc = argv->num;
 
 	// Check user's program path
 	progname_buf = kmalloc(PATH_MAX);
 	if (progname_buf == NULL) {
 		result = ENOMEM;
-		goto err4;
+		goto err2;
 	}
 
 	result = copyinstr(progname, progname_buf, PATH_MAX, NULL);
 	if (result) {
 		result = EFAULT;
-		goto err5;
+		goto err3;
 	}
 
 	old_progname = curproc->p_name;
@@ -252,19 +265,20 @@ sys_execv(userptr_t progname, userptr_t args)
 
 	result = _launch_program(progname_buf, &stack_ptr, &entry_point);
 	if (result) {
-		goto err6;
+		goto err4;
 	}
 
-	copy_args_to_stack(&stack_ptr, argv, argv_lens);
+	result = copy_args_to_stack(&stack_ptr, arg_buf, arg_len, argc);
 
 	// Cleanup
 	kfree(arg_buf);
-	array_zero_out(argv, false);
-	array_destroy(argv);
-	array_zero_out(argv_lens, false);
-	array_destroy(argv_lens);
 	kfree(old_progname);
 
+	if (result) {
+		// The old program is gone, so there's nothing to return to
+		proc_exit(curproc, _MKWAIT_SIG(SIGSEGV));
+	}
+
 	/* Warp to user mode. */
 	enter_new_process(argc, (userptr_t) stack_ptr, NULL, stack_ptr, entry_point);
 
@@ -273,16 +287,10 @@ sys_execv(userptr_t progname, userptr_t args)
 	return -1;
 
 
-	err6:
-		curproc->p_name = old_progname;
-	err5:
-		kfree(progname_buf);
 	err4:
-		array_zero_out(argv_lens, false);
-		array_destroy(argv_lens);
+		curproc->p_name = old_progname;
 	err3:
-		array_zero_out(argv, false);
-		array_destroy(argv);
+		kfree(progname_buf);
 	err2:
 		kfree(arg_buf);
 	err1:
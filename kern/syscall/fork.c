@@ -15,6 +15,7 @@
 #include <mips/trapframe.h>
 #include <limits.h>
 #include <proc.h>
+#include <proctable.h>
 
 
 // Child V()'s on signal_to_parent to let parent know it is
@@ -43,13 +44,22 @@ child_finish_setup(void *ptr, unsigned long n)
 	mips_usermode(&copied_child_tf);
 }
 
-int sys_fork(struct trapframe *parent_tf, pid_t *retval)
+/*
+ * Create a child running a copy of PARENT_TF. If SHARE_AS is false,
+ * the child gets a copy of our address space (fork). Otherwise it
+ * borrows ours, and we sleep until it gives it back by calling
+ * execv or exiting (vfork).
+ */
+static
+int
+fork_common(struct trapframe *parent_tf, bool share_as, pid_t *retval)
 {
 	int err;
 	struct proc *child_proc;
 	struct addrspace *child_as;
 	struct trapframe *child_tf;
 	struct setup_data* sd;
+	struct semaphore *vfork_sem;
 
 	lock_acquire(curproc->p_lock);
 
@@ -59,8 +69,10 @@ int sys_fork(struct trapframe *parent_tf, pid_t *retval)
 		goto err1;
 	}
 
+	lock_acquire(proc_table.pt_familylock);
 	child_proc->p_parent_pid = curproc->p_pid;
 	err = add_child_pid_to_parent(curproc, child_proc->p_pid);
+	lock_release(proc_table.pt_familylock);
 	if (err) {
 		goto err2;
 	}
@@ -92,13 +104,25 @@ int sys_fork(struct trapframe *parent_tf, pid_t *retval)
 
 	clone_fd_table(curproc->p_fd_table, child_proc->p_fd_table);
 
-	err = as_copy(curproc->p_addrspace, &child_as);
-	if (err) {
-		err = ENOMEM;
-		goto err6;
+	if (share_as) {
+		vfork_sem = sem_create("vfork", 0);
+		if (vfork_sem == NULL) {
+			err = ENOMEM;
+			goto err6;
+		}
+		child_as = curproc->p_addrspace;
+	}
+	else {
+		vfork_sem = NULL;
+		err = as_copy(curproc->p_addrspace, &child_as);
+		if (err) {
+			err = ENOMEM;
+			goto err6;
+		}
 	}
 
 	child_proc->p_addrspace = child_as;
+	child_proc->p_vfork_sem = vfork_sem;
 
 	child_proc->p_cwd = curproc->p_cwd;
 	VOP_INCREF(child_proc->p_cwd);
@@ -115,11 +139,26 @@ int sys_fork(struct trapframe *parent_tf, pid_t *retval)
 
 	lock_release(curproc->p_lock);
 
+	if (vfork_sem != NULL) {
+		// The child may be running on our user stack; stay out
+		// of its way until it's done with our address space
+		P(vfork_sem);
+		sem_destroy(vfork_sem);
+	}
+
 	*retval = child_proc->p_pid;
 	return 0;
 
 	err7:
-		as_destroy(child_as);
+		if (vfork_sem != NULL) {
+			child_proc->p_addrspace = NULL;
+			child_proc->p_vfork_sem = NULL;
+			sem_destroy(vfork_sem);
+		}
+		else {
+			as_destroy(child_as);
+			child_proc->p_addrspace = NULL;
+		}
 	err6:
 		kfree(child_tf);
 	err5:
@@ -127,10 +166,29 @@ int sys_fork(struct trapframe *parent_tf, pid_t *retval)
 	err4:
 		kfree(sd);
 	err3:
+		lock_acquire(proc_table.pt_familylock);
 		remove_child_pid_from_parent(curproc, child_proc->p_pid);
+		lock_release(proc_table.pt_familylock);
 	err2:
 		proc_destroy(child_proc);
 	err1:
 		lock_release(curproc->p_lock);
 		return err;
 }
+
+int
+sys_fork(struct trapframe *parent_tf, pid_t *retval)
+{
+	return fork_common(parent_tf, false, retval);
+}
+
+/*
+ * Like fork, but the child runs in our address space, and we don't
+ * return until it calls execv or exits. This skips copying the
+ * address space when the child is just going to exec something.
+ */
+int
+sys_vfork(struct trapframe *parent_tf, pid_t *retval)
+{
+	return fork_common(parent_tf, true, retval);
+}
@@ -42,8 +42,8 @@
  * circumstances, as_prepare_load and as_complete_load probably don't
  * need to do anything.
  *
- * If you wanted to support memory-mapped executables you would need
- * to rearrange this to map each segment.
+ * Without dumbvm, "loading" a chunk just maps it: the pages are read
+ * from the executable by vm_fault when they are first touched.
  *
  * To support dynamically linked executables with shared libraries
  * you'd need to change this to load the "ELF interpreter" (dynamic
@@ -58,6 +58,7 @@
 #include <current.h>
 #include <addrspace.h>
 #include <vnode.h>
+#include <stat.h>
 #include <elf.h>
 
 /*
@@ -69,11 +70,11 @@
  * FILESIZE may be less than MEMSIZE; if so the remaining portion of
  * the in-memory segment should be zero-filled.
  *
- * Note that uiomove will catch it if someone tries to load an
- * executable whose load address is in kernel space. If you should
- * change this code to not use uiomove, be sure to check for this case
- * explicitly.
+ * With dumbvm, uiomove will catch it if someone tries to load an
+ * executable whose load address is in kernel space. Otherwise the
+ * segment is only mapped, and we check for this case explicitly.
  */
+#if OPT_DUMBVM
 static
 int
 load_segment(struct addrspace *as, struct vnode *v,
@@ -144,6 +145,44 @@ load_segment(struct addrspace *as, struct vnode *v,
 
 	return result;
 }
+#else
+static
+int
+load_segment(struct addrspace *as, struct vnode *v,
+	     off_t offset, vaddr_t vaddr,
+	     size_t memsize, size_t filesize,
+	     int is_executable)
+{
+	struct stat st;
+	int result;
+
+	(void)is_executable;
+
+	if (filesize > memsize) {
+		kprintf("ELF: warning: segment filesize > segment memsize\n");
+		filesize = memsize;
+	}
+
+	if (vaddr + memsize < vaddr || vaddr + memsize > USERSPACETOP) {
+		return ENOEXEC;
+	}
+
+	/* Catch truncated files now rather than at fault time */
+	result = VOP_STAT(v, &st);
+	if (result) {
+		return result;
+	}
+	if (offset + filesize > st.st_size) {
+		kprintf("ELF: short segment - file truncated?\n");
+		return ENOEXEC;
+	}
+
+	DEBUG(DB_EXEC, "ELF: Mapping %lu bytes at 0x%lx\n",
+	      (unsigned long) filesize, (unsigned long) vaddr);
+
+	return as_map_file(as, vaddr, memsize, filesize, v, offset);
+}
+#endif
 
 /*
  * Load an ELF executable user program into the current address space.
@@ -0,0 +1,55 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <syscall.h>
+#include <addrspace.h>
+#include <proc.h>
+#include <current.h>
+#include <machine/vm.h>
+
+/*
+ * Addr must be page aligned, otherwise mprotect will return
+ * EINVAL. Len is rounded up to a whole number of pages, all of
+ * which must belong to segments of the executable; the heap and
+ * stack can't be protected.
+ */
+int
+sys_mprotect(userptr_t addr, size_t len, int prot)
+{
+        vaddr_t start, end;
+        int perms;
+
+        start = (vaddr_t)addr;
+
+        if (start % PAGE_SIZE != 0) {
+                return EINVAL;
+        }
+
+        if (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) {
+                return EINVAL;
+        }
+
+        if (start >= USERSPACETOP || len > USERSPACETOP - start) {
+                return ENOMEM;
+        }
+
+        if (len == 0) {
+                return 0;
+        }
+
+        end = ROUNDUP(start + len, PAGE_SIZE);
+
+        perms = 0;
+        if (prot & PROT_READ) {
+                perms |= REGION_R;
+        }
+        if (prot & PROT_WRITE) {
+                perms |= REGION_W;
+        }
+        if (prot & PROT_EXEC) {
+                perms |= REGION_X;
+        }
+
+        return as_protect(curproc->p_addrspace, start, end - start, perms);
+}
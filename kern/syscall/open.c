@@ -44,17 +44,17 @@ sys_open(userptr_t filename, int flags, int *fd)
 		goto err3;
 	}
 
-	*fd = add_file_to_fd_table(curproc->p_fd_table, file);
-	if (*fd < 0) {
-		err = EMFILE;
-		goto err4;
+	err = add_file_to_fd_table(curproc->p_fd_table, file, fd);
+	if (err) {
+		// Closes the vnode too
+		fd_file_destroy(file);
+		goto err2;
 	}
 
+	kfree(filename_buf);
 	return 0;
 
 
-	err4:
-		fd_file_destroy(file);
 	err3:
 		/* N.B. if the file was created, then vfs_close will not
 		   delete it */
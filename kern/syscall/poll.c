@@ -0,0 +1,110 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/poll.h>
+#include <lib.h>
+#include <copyinout.h>
+#include <vnode.h>
+#include <pollq.h>
+#include <syscall.h>
+#include <proc.h>
+#include <current.h>
+
+/*
+ * Check one descriptor, registering the poller on the first pass.
+ */
+static
+short
+poll_fd(struct poller *pl, struct pollfd *pfd)
+{
+        struct fd_file *file;
+
+        if (pfd->fd < 0) {
+                return 0;
+        }
+
+        file = get_file_from_fd_table(curproc->p_fd_table, pfd->fd);
+        if (file == NULL) {
+                return POLLNVAL;
+        }
+
+        return VOP_POLL(file->fdf_vnode, pfd->events & (POLLIN | POLLOUT), pl);
+}
+
+/*
+ * Wait until at least one of the descriptors is ready, or TIMEOUT
+ * milliseconds pass; a negative TIMEOUT waits forever. Instead of
+ * checking again and again, we sleep on the pollq of everything we're
+ * polling, and only look again when one of them wakes us.
+ */
+int
+sys_poll(userptr_t fds, unsigned nfds, int timeout, int *retval)
+{
+        struct pollfd *kfds;
+        struct poller pl;
+        unsigned i;
+        int nready, err;
+
+        if (nfds > FD_MAX) {
+                return EINVAL;
+        }
+
+        kfds = NULL;
+        if (nfds > 0) {
+                kfds = kmalloc(nfds * sizeof(struct pollfd));
+                if (kfds == NULL) {
+                        err = ENOMEM;
+                        goto err1;
+                }
+
+                err = copyin(fds, kfds, nfds * sizeof(struct pollfd));
+                if (err) {
+                        goto err2;
+                }
+        }
+
+        err = poller_init(&pl, nfds, timeout);
+        if (err) {
+                goto err2;
+        }
+
+        while (true) {
+                poller_rescan(&pl);
+
+                nready = 0;
+                for (i = 0; i < nfds; i++) {
+                        kfds[i].revents = poll_fd(&pl, &kfds[i]);
+                        if (kfds[i].revents != 0) {
+                                nready++;
+                        }
+                }
+
+                if (nready > 0 || poller_timedout(&pl)) {
+                        break;
+                }
+
+                err = poller_wait(&pl);
+                if (err) {
+                        poller_cleanup(&pl);
+                        goto err2;
+                }
+        }
+
+        poller_cleanup(&pl);
+
+        if (nfds > 0) {
+                err = copyout(kfds, fds, nfds * sizeof(struct pollfd));
+                if (err) {
+                        goto err2;
+                }
+                kfree(kfds);
+        }
+
+        *retval = nready;
+        return 0;
+
+
+        err2:
+                kfree(kfds);
+        err1:
+                return err;
+}
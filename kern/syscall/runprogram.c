@@ -39,6 +39,7 @@
 #include <proc.h>
 #include <kern/errno.h>
 #include <copyinout.h>
+#include <limits.h>
 
 /*
  * Load program "progname" and start running it in usermode.
@@ -49,43 +50,35 @@
 int
 runprogram(char *progname, char **args, int argc)
 {
-	(void) argc;
-
 	vaddr_t stack_ptr, entry_point;
+	size_t arg_len;
+	char *arg_buf;
 	int result;
 
-	struct array *argv;
-	struct array *argv_lens;
-
 	KASSERT(proc_getas() == NULL);
-	result = _launch_program(progname, &stack_ptr, &entry_point);
-	if (result) {
-		goto err1;
-	}
 
-	argv = array_create();
-	if (!argv) {
+	arg_buf = kmalloc(ARG_MAX);
+	if (arg_buf == NULL) {
 		result = ENOMEM;
 		goto err1;
 	}
 
-	argv_lens = array_create();
-	if (!argv_lens) {
-		result = ENOMEM;
+	result = extract_args((userptr_t) args, arg_buf, &arg_len, &argc, false);
+	if (result) {
 		goto err2;
 	}
 
-	result = extract_args((userptr_t) args, NULL, argv, argv_lens, false);
+	result = _launch_program(progname, &stack_ptr, &entry_point);
 	if (result) {
-		goto err3;
+		goto err2;
 	}
 
-	copy_args_to_stack(&stack_ptr, argv, argv_lens);
+	result = copy_args_to_stack(&stack_ptr, arg_buf, arg_len, argc);
+	if (result) {
+		goto err2;
+	}
 
-	array_zero_out(argv, false);
-	array_destroy(argv);
-	array_zero_out(argv_lens, false);
-	array_destroy(argv_lens);
+	kfree(arg_buf);
 
 	enter_new_process(argc /*argc*/, (userptr_t)stack_ptr /*userspace addr of argv*/,
 		  NULL /*userspace addr of environment*/, stack_ptr, entry_point);
@@ -93,12 +86,8 @@ runprogram(char *progname, char **args, int argc)
 	panic("runprogram should never return");
 	return -1;
 
-	err3:
-		array_zero_out(argv, false);
-		array_destroy(argv);
 	err2:
-		array_zero_out(argv_lens, false);
-		array_destroy(argv_lens);
+		kfree(arg_buf);
 	err1:
 		return result;
 }
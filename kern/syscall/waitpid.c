@@ -11,62 +11,98 @@
 #include <proc.h>
 #include <proctable.h>
 #include <spinlock.h>
+#include <spl.h>
 
-int
-sys_waitpid(pid_t pid, int *status, int options, pid_t *retval)
+/* Add the resources in FROM to TO */
+static
+void
+rusage_add(struct rusage *to, const struct rusage *from)
 {
-	int err;
-
-	// Lock current proc struct
-	lock_acquire(curproc->p_lock);
+	to->ru_utime.tv_sec += from->ru_utime.tv_sec;
+	to->ru_utime.tv_usec += from->ru_utime.tv_usec;
+	if (to->ru_utime.tv_usec >= 1000000) {
+		to->ru_utime.tv_sec++;
+		to->ru_utime.tv_usec -= 1000000;
+	}
 
-	// Don't support any options
-	if (options != 0) {
-		err = EINVAL;
-		goto err1;
+	to->ru_stime.tv_sec += from->ru_stime.tv_sec;
+	to->ru_stime.tv_usec += from->ru_stime.tv_usec;
+	if (to->ru_stime.tv_usec >= 1000000) {
+		to->ru_stime.tv_sec++;
+		to->ru_stime.tv_usec -= 1000000;
 	}
 
-	// Validate passed in pid
-	if (!(is_valid_pid(pid))) {
-		err = ESRCH;
-		goto err1;
+	to->ru_minflt += from->ru_minflt;
+	to->ru_majflt += from->ru_majflt;
+	to->ru_nvcsw += from->ru_nvcsw;
+	to->ru_nivcsw += from->ru_nivcsw;
+}
+
+/*
+ * Pid may be WAIT_ANY to wait for whichever child exits first. With
+ * WNOHANG, returns 0 straight away if no child it could wait for has
+ * exited yet. If rusage isn't NULL, the child's resource usage is
+ * copied out, including that of the children it waited for.
+ */
+int
+sys_wait4(pid_t pid, userptr_t status, int options, userptr_t rusage,
+	  pid_t *retval)
+{
+	struct proc *child;
+	int err, spl;
+
+	// WNOHANG is the only option we support
+	if (options & ~WNOHANG) {
+		return EINVAL;
 	}
 
-	if (!proc_has_child(curproc, pid)) {
-		err = ECHILD;
-		goto err1;
+	err = proc_wait_child(curproc, pid, (options & WNOHANG) != 0, &child);
+	if (err) {
+		return err;
 	}
 
-	P(proc_table.pt_table[pid]->p_wait_sem);
+	if (child == NULL) {
+		// No child has exited yet
+		*retval = 0;
+		return 0;
+	}
 
 	// Save exit value to status if not NULL
 	if (status) {
-		err = copyout(&(proc_table.pt_table[pid]->p_exit_status),
-			(userptr_t)status, sizeof(int));
+		err = copyout(&child->p_exit_status, status, sizeof(int));
 		if (err) {
-			goto err2;
+			goto err1;
 		}
+	}
 
-	} else {
-		err = 0;
+	if (rusage) {
+		err = copyout(&child->p_rusage, rusage, sizeof(struct rusage));
+		if (err) {
+			goto err1;
+		}
 	}
 
-	// Finish cleaning up the child proc
-	proc_reap(proc_table.pt_table[pid]);
+	*retval = child->p_pid;
 
-	// Remove pid from array of children
-	remove_child_pid_from_parent(curproc, pid);
+	// hardclock charges our time behind our back
+	spl = splhigh();
+	rusage_add(&curproc->p_rusage, &child->p_rusage);
+	splx(spl);
 
-	lock_release(curproc->p_lock);
+	// Finish cleaning up the child proc
+	proc_reap_child(curproc, child);
 
-	*retval = pid;
-	return err;
+	return 0;
 
 
-	err2:
-		// Undo our P() call
-		V(proc_table.pt_table[pid]->p_wait_sem);
 	err1:
-		lock_release(curproc->p_lock);
+		// Let it be waited for again
+		proc_unwait_child(curproc, child);
 		return err;
 }
+
+int
+sys_waitpid(pid_t pid, int *status, int options, pid_t *retval)
+{
+	return sys_wait4(pid, (userptr_t)status, options, NULL, retval);
+}
@@ -34,6 +34,8 @@
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
+#include <proc.h>
+#include <pollq.h>
 
 /*
  * Time handling.
@@ -51,7 +53,6 @@
  * the scheduler.
  */
 #define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
-#define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
 
 /*
  * Once a second, everything waiting on lbolt is awakened by CPU 0.
@@ -92,14 +93,30 @@ timerclock(void)
 void
 hardclock(void)
 {
+	struct proc *proc;
+
 	/*
 	 * Collect statistics here as desired.
 	 */
 
-	curcpu->c_hardclocks++;
-	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
-		thread_consider_migration();
+	/* Charge the tick to the process it interrupted. We can't
+	   tell user from kernel time here, so it all counts as user
+	   time. */
+	proc = curthread->t_proc;
+	if (proc != NULL && proc != kproc) {
+		proc->p_rusage.ru_utime.tv_usec += 1000000 / HZ;
+		if (proc->p_rusage.ru_utime.tv_usec >= 1000000) {
+			proc->p_rusage.ru_utime.tv_sec++;
+			proc->p_rusage.ru_utime.tv_usec -= 1000000;
+		}
+	}
+
+	/* Count down poll timeouts, on one cpu so they run at HZ */
+	if (curcpu->c_number == 0) {
+		pollq_tick();
 	}
+
+	curcpu->c_hardclocks++;
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
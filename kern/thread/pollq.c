@@ -0,0 +1,256 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <clock.h>
+#include <pollq.h>
+
+/* Pollers counting down a timeout, linked through pl_timernext */
+static struct spinlock poll_timerlock = SPINLOCK_INITIALIZER;
+static struct poller *poll_timers;
+
+void
+pollq_init(struct pollq *pq)
+{
+	spinlock_init(&pq->pq_lock);
+	pq->pq_entries = NULL;
+}
+
+void
+pollq_cleanup(struct pollq *pq)
+{
+	KASSERT(pq->pq_entries == NULL);
+	spinlock_cleanup(&pq->pq_lock);
+}
+
+void
+pollq_wakeup(struct pollq *pq)
+{
+	struct poll_entry *pe;
+	struct poller *pl;
+
+	/*
+	 * Nobody polling is the common case; skip the locks. A poller
+	 * registers before checking the object's state, and the caller
+	 * changed that state under its own lock, so if we can't see
+	 * the poller's entry yet, it will see the new state.
+	 */
+	if (pq->pq_entries == NULL) {
+		return;
+	}
+
+	spinlock_acquire(&pq->pq_lock);
+	for (pe = pq->pq_entries; pe != NULL; pe = pe->pe_next) {
+		pl = pe->pe_poller;
+
+		spinlock_acquire(&pl->pl_lock);
+		pl->pl_woken = true;
+		wchan_wakeall(pl->pl_wchan, &pl->pl_lock);
+		spinlock_release(&pl->pl_lock);
+	}
+	spinlock_release(&pq->pq_lock);
+}
+
+int
+poller_init(struct poller *pl, unsigned maxentries, int timeout)
+{
+	pl->pl_wchan = wchan_create("poll");
+	if (pl->pl_wchan == NULL) {
+		return ENOMEM;
+	}
+
+	pl->pl_entries = NULL;
+	if (maxentries > 0) {
+		pl->pl_entries = kmalloc(maxentries * sizeof(struct poll_entry));
+		if (pl->pl_entries == NULL) {
+			wchan_destroy(pl->pl_wchan);
+			return ENOMEM;
+		}
+	}
+
+	spinlock_init(&pl->pl_lock);
+	pl->pl_woken = false;
+	pl->pl_timedout = false;
+	pl->pl_ticks = 0;
+	pl->pl_timernext = NULL;
+	pl->pl_registering = true;
+	pl->pl_nentries = 0;
+	pl->pl_maxentries = maxentries;
+	pl->pl_extra = NULL;
+	pl->pl_error = 0;
+
+	if (timeout > 0) {
+		// Round up, so we never wait less than asked
+		pl->pl_ticks = ((unsigned)timeout * HZ + 999) / 1000;
+
+		spinlock_acquire(&poll_timerlock);
+		pl->pl_timernext = poll_timers;
+		poll_timers = pl;
+		spinlock_release(&poll_timerlock);
+	}
+	else if (timeout == 0) {
+		pl->pl_timedout = true;
+	}
+
+	return 0;
+}
+
+/*
+ * Take PE off its pollq.
+ */
+static
+void
+poll_entry_unlink(struct poll_entry *pe)
+{
+	spinlock_acquire(&pe->pe_q->pq_lock);
+	if (pe->pe_prev != NULL) {
+		pe->pe_prev->pe_next = pe->pe_next;
+	}
+	else {
+		pe->pe_q->pq_entries = pe->pe_next;
+	}
+	if (pe->pe_next != NULL) {
+		pe->pe_next->pe_prev = pe->pe_prev;
+	}
+	spinlock_release(&pe->pe_q->pq_lock);
+}
+
+void
+poller_cleanup(struct poller *pl)
+{
+	struct poll_entry *pe;
+	struct poller **link;
+	unsigned i;
+
+	spinlock_acquire(&poll_timerlock);
+	if (pl->pl_ticks > 0) {
+		link = &poll_timers;
+		while (*link != pl) {
+			KASSERT(*link != NULL);
+			link = &(*link)->pl_timernext;
+		}
+		*link = pl->pl_timernext;
+		pl->pl_ticks = 0;
+	}
+	spinlock_release(&poll_timerlock);
+
+	for (i = 0; i < pl->pl_nentries; i++) {
+		poll_entry_unlink(&pl->pl_entries[i]);
+	}
+	while (pl->pl_extra != NULL) {
+		pe = pl->pl_extra;
+		pl->pl_extra = pe->pe_extra;
+		poll_entry_unlink(pe);
+		kfree(pe);
+	}
+
+	if (pl->pl_entries != NULL) {
+		kfree(pl->pl_entries);
+	}
+	spinlock_cleanup(&pl->pl_lock);
+	wchan_destroy(pl->pl_wchan);
+}
+
+void
+poller_rescan(struct poller *pl)
+{
+	spinlock_acquire(&pl->pl_lock);
+	pl->pl_woken = false;
+	spinlock_release(&pl->pl_lock);
+}
+
+int
+poller_wait(struct poller *pl)
+{
+	if (pl->pl_error) {
+		return pl->pl_error;
+	}
+
+	spinlock_acquire(&pl->pl_lock);
+	while (!pl->pl_woken && !pl->pl_timedout) {
+		wchan_sleep(pl->pl_wchan, &pl->pl_lock);
+	}
+	spinlock_release(&pl->pl_lock);
+
+	pl->pl_registering = false;
+	return 0;
+}
+
+bool
+poller_timedout(struct poller *pl)
+{
+	bool timedout;
+
+	spinlock_acquire(&pl->pl_lock);
+	timedout = pl->pl_timedout;
+	spinlock_release(&pl->pl_lock);
+
+	return timedout;
+}
+
+void
+poll_register(struct poller *pl, struct pollq *pq)
+{
+	struct poll_entry *pe;
+
+	if (pl == NULL || !pl->pl_registering) {
+		return;
+	}
+
+	if (pl->pl_nentries < pl->pl_maxentries) {
+		pe = &pl->pl_entries[pl->pl_nentries++];
+	}
+	else {
+		// Some object has more than one pollq; make room. The
+		// entry is linked into PQ, so it can't move later.
+		pe = kmalloc(sizeof(*pe));
+		if (pe == NULL) {
+			pl->pl_error = ENOMEM;
+			return;
+		}
+		pe->pe_extra = pl->pl_extra;
+		pl->pl_extra = pe;
+	}
+	pe->pe_poller = pl;
+	pe->pe_q = pq;
+	pe->pe_prev = NULL;
+
+	spinlock_acquire(&pq->pq_lock);
+	pe->pe_next = pq->pq_entries;
+	if (pe->pe_next != NULL) {
+		pe->pe_next->pe_prev = pe;
+	}
+	pq->pq_entries = pe;
+	spinlock_release(&pq->pq_lock);
+}
+
+void
+pollq_tick(void)
+{
+	struct poller *pl, **link;
+
+	// Racy, but a poller added just now will be seen next tick
+	if (poll_timers == NULL) {
+		return;
+	}
+
+	spinlock_acquire(&poll_timerlock);
+	link = &poll_timers;
+	while ((pl = *link) != NULL) {
+		KASSERT(pl->pl_ticks > 0);
+		pl->pl_ticks--;
+		if (pl->pl_ticks > 0) {
+			link = &pl->pl_timernext;
+			continue;
+		}
+
+		*link = pl->pl_timernext;
+
+		spinlock_acquire(&pl->pl_lock);
+		pl->pl_timedout = true;
+		wchan_wakeall(pl->pl_wchan, &pl->pl_lock);
+		spinlock_release(&pl->pl_lock);
+	}
+	spinlock_release(&poll_timerlock);
+}
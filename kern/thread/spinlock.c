@@ -43,6 +43,11 @@
  * Spinlocks.
  */
 
+/*
+ * Queue nodes for use before curcpu is set up. There's only one cpu
+ * running then.
+ */
+static struct spinlock_qnode spinlock_bootqnodes[SPINLOCK_QNODES];
 
 /*
  * Initialize spinlock.
@@ -52,9 +57,97 @@ spinlock_init(struct spinlock *splk)
 {
 	spinlock_data_set(&splk->splk_lock, 0);
 	splk->splk_holder = NULL;
+	splk->splk_queued = false;
+	splk->splk_qnode = NULL;
 	HANGMAN_LOCKABLEINIT(&splk->splk_hangman, "spinlock");
 }
 
+/*
+ * Initialize queued spinlock.
+ */
+void
+spinlock_init_queued(struct spinlock *splk)
+{
+	spinlock_init(splk);
+	splk->splk_queued = true;
+}
+
+/*
+ * Get a free queue node from the array NODES (per-cpu, so no locking
+ * needed with interrupts off).
+ */
+static
+struct spinlock_qnode *
+spinlock_qnode_get(struct spinlock_qnode *nodes)
+{
+	unsigned i;
+
+	for (i=0; i<SPINLOCK_QNODES; i++) {
+		if (!nodes[i].sqn_inuse) {
+			nodes[i].sqn_inuse = true;
+			return &nodes[i];
+		}
+	}
+	panic("Too many queued spinlocks held at once\n");
+}
+
+/*
+ * Wait for a queued lock: put our node on the tail of the queue and,
+ * if there was someone ahead of us, link in behind them and spin on
+ * our own node until they hand the lock over.
+ */
+static
+void
+spinlock_acquire_queued(struct spinlock *splk, struct spinlock_qnode *node)
+{
+	struct spinlock_qnode *prev;
+
+	spinlock_data_set(&node->sqn_next, 0);
+	spinlock_data_set(&node->sqn_wait, 1);
+	membar_store_store();
+
+	prev = (struct spinlock_qnode *)
+		spinlock_data_swap(&splk->splk_lock, (spinlock_data_t)node);
+	if (prev != NULL) {
+		spinlock_data_set(&prev->sqn_next, (spinlock_data_t)node);
+		while (spinlock_data_get(&node->sqn_wait) != 0) {
+			/* spin */
+		}
+	}
+	splk->splk_qnode = node;
+}
+
+/*
+ * Let go of a queued lock: if nobody is behind us, swing the tail
+ * back to empty; otherwise (including when someone is in the middle
+ * of joining) wait for them to link in and hand over.
+ */
+static
+void
+spinlock_release_queued(struct spinlock *splk)
+{
+	struct spinlock_qnode *node, *next;
+
+	node = splk->splk_qnode;
+	KASSERT(node != NULL);
+	splk->splk_qnode = NULL;
+	membar_any_store();
+
+	if (spinlock_data_get(&node->sqn_next) == 0) {
+		if (spinlock_data_cas(&splk->splk_lock,
+				      (spinlock_data_t)node, 0)) {
+			node->sqn_inuse = false;
+			return;
+		}
+		while (spinlock_data_get(&node->sqn_next) == 0) {
+			/* spin */
+		}
+	}
+	next = (struct spinlock_qnode *)spinlock_data_get(&node->sqn_next);
+	spinlock_data_set(&next->sqn_wait, 0);
+	node->sqn_inuse = false;
+}
+
 /*
  * Clean up spinlock.
  */
@@ -77,6 +170,8 @@ spinlock_acquire(struct spinlock *splk)
 {
 	struct cpu *mycpu;
 
+	COMPILE_ASSERT(sizeof(spinlock_data_t) == sizeof(void *));
+
 	splraise(IPL_NONE, IPL_HIGH);
 
 	/* this must work before curcpu initialization */
@@ -93,24 +188,30 @@ spinlock_acquire(struct spinlock *splk)
 		mycpu = NULL;
 	}
 
-	while (1) {
-		/*
-		 * Do test-test-and-set, that is, read first before
-		 * doing test-and-set, to reduce bus contention.
-		 *
-		 * Test-and-set is a machine-level atomic operation
-		 * that writes 1 into the lock word and returns the
-		 * previous value. If that value was 0, the lock was
-		 * previously unheld and we now own it. If it was 1,
-		 * we don't.
-		 */
-		if (spinlock_data_get(&splk->splk_lock) != 0) {
-			continue;
-		}
-		if (spinlock_data_testandset(&splk->splk_lock) != 0) {
-			continue;
+	if (splk->splk_queued) {
+		spinlock_acquire_queued(splk, spinlock_qnode_get(
+			mycpu != NULL ? mycpu->c_qnodes : spinlock_bootqnodes));
+	}
+	else {
+		while (1) {
+			/*
+			 * Do test-test-and-set, that is, read first before
+			 * doing test-and-set, to reduce bus contention.
+			 *
+			 * Test-and-set is a machine-level atomic operation
+			 * that writes 1 into the lock word and returns the
+			 * previous value. If that value was 0, the lock was
+			 * previously unheld and we now own it. If it was 1,
+			 * we don't.
+			 */
+			if (spinlock_data_get(&splk->splk_lock) != 0) {
+				continue;
+			}
+			if (spinlock_data_testandset(&splk->splk_lock) != 0) {
+				continue;
+			}
+			break;
 		}
-		break;
 	}
 
 	membar_store_any();
@@ -136,8 +237,13 @@ spinlock_release(struct spinlock *splk)
 	}
 
 	splk->splk_holder = NULL;
-	membar_any_store();
-	spinlock_data_set(&splk->splk_lock, 0);
+	if (splk->splk_queued) {
+		spinlock_release_queued(splk);
+	}
+	else {
+		membar_any_store();
+		spinlock_data_set(&splk->splk_lock, 0);
+	}
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
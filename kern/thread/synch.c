@@ -35,8 +35,10 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <membar.h>
 #include <wchan.h>
 #include <thread.h>
+#include <cpu.h>
 #include <current.h>
 #include <synch.h>
 
@@ -138,6 +140,41 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/*
+ * Adaptive locking.
+ *
+ * Many lock holds are short, and if the holder is running on another
+ * cpu it is likely to let go sooner than it takes to sleep and be
+ * woken up again. So a waiter that sees the holder running elsewhere
+ * spins, outside lk_lock, for up to LOCK_SPIN_MAX rounds before it
+ * gives up and sleeps. On a single cpu the holder is never running
+ * while we are, so this always sleeps straight away.
+ */
+#define LOCK_SPIN_MAX 1000
+
+/* List of all locks, for lock_printstats. */
+static struct spinlock lock_list_lock = SPINLOCK_INITIALIZER;
+static struct lock *lock_list;
+
+/*
+ * Check if the holder of LOCK is running on another cpu. This is
+ * only a hint: the holder's state is read without its run queue lock.
+ * The holder can't let go and exit while we hold lk_lock, though, so
+ * it's at least safe to look at.
+ */
+static
+bool
+lock_holder_running(struct lock *lock)
+{
+        struct thread *holder;
+
+        KASSERT(spinlock_do_i_hold(&lock->lk_lock));
+
+        holder = lock->lk_holder;
+        return holder != NULL && holder->t_state == S_RUN &&
+                holder->t_cpu != curcpu->c_self;
+}
+
 struct lock *
 lock_create(const char *name)
 {
@@ -167,6 +204,20 @@ lock_create(const char *name)
         spinlock_init(&lock->lk_lock);
         lock->lk_holder = NULL;
 
+        lock->lk_acquires = 0;
+        lock->lk_contended = 0;
+        lock->lk_spinwins = 0;
+        lock->lk_sleeps = 0;
+
+        spinlock_acquire(&lock_list_lock);
+        lock->lk_prev = NULL;
+        lock->lk_next = lock_list;
+        if (lock_list != NULL) {
+                lock_list->lk_prev = lock;
+        }
+        lock_list = lock;
+        spinlock_release(&lock_list_lock);
+
         return lock;
 }
 
@@ -176,6 +227,19 @@ lock_destroy(struct lock *lock)
         KASSERT(lock != NULL);
         KASSERT(lock->lk_holder == NULL);
 
+        spinlock_acquire(&lock_list_lock);
+        if (lock->lk_prev != NULL) {
+                lock->lk_prev->lk_next = lock->lk_next;
+        }
+        else {
+                KASSERT(lock_list == lock);
+                lock_list = lock->lk_next;
+        }
+        if (lock->lk_next != NULL) {
+                lock->lk_next->lk_prev = lock->lk_prev;
+        }
+        spinlock_release(&lock_list_lock);
+
         spinlock_cleanup(&lock->lk_lock);
         wchan_destroy(lock->lk_wchan);
 
@@ -186,6 +250,9 @@ lock_destroy(struct lock *lock)
 void
 lock_acquire(struct lock *lock)
 {
+        unsigned spins;
+        bool slept;
+
 	/* Call this before waiting for a lock */
 	HANGMAN_WAIT(&curthread->t_hangman, &lock->lk_hangman);
 
@@ -193,8 +260,32 @@ lock_acquire(struct lock *lock)
         KASSERT(!curthread->t_in_interrupt);
 
         spinlock_acquire(&lock->lk_lock);
-        while (lock->lk_holder) {
-                wchan_sleep(lock->lk_wchan, &lock->lk_lock);
+        lock->lk_acquires++;
+        if (lock->lk_holder) {
+                lock->lk_contended++;
+                spins = 0;
+                slept = false;
+                while (lock->lk_holder) {
+                        if (spins < LOCK_SPIN_MAX &&
+                            lock_holder_running(lock)) {
+                                /* Wait without lk_lock so it can let go. */
+                                spinlock_release(&lock->lk_lock);
+                                while (lock->lk_holder != NULL &&
+                                       spins < LOCK_SPIN_MAX) {
+                                        /* Make sure we really reload it */
+                                        membar_load_load();
+                                        spins++;
+                                }
+                                spinlock_acquire(&lock->lk_lock);
+                                continue;
+                        }
+                        lock->lk_sleeps++;
+                        slept = true;
+                        wchan_sleep(lock->lk_wchan, &lock->lk_lock);
+                }
+                if (!slept) {
+                        lock->lk_spinwins++;
+                }
         }
         KASSERT(!lock->lk_holder);
         lock->lk_holder = curthread;
@@ -236,6 +327,37 @@ lock_do_i_hold(struct lock *lock)
         return result;
 }
 
+void
+lock_printstats(void)
+{
+        struct lock *lock;
+        unsigned acquires, contended, spinwins, sleeps;
+
+        acquires = contended = spinwins = sleeps = 0;
+
+        spinlock_acquire(&lock_list_lock);
+        kprintf("Contended locks:\n");
+        for (lock = lock_list; lock != NULL; lock = lock->lk_next) {
+                acquires += lock->lk_acquires;
+                contended += lock->lk_contended;
+                spinwins += lock->lk_spinwins;
+                sleeps += lock->lk_sleeps;
+                if (lock->lk_contended == 0) {
+                        continue;
+                }
+                kprintf("   %s: %u acquires, %u contended "
+                        "(%u won by spinning), %u sleeps\n",
+                        lock->lk_name, lock->lk_acquires,
+                        lock->lk_contended, lock->lk_spinwins,
+                        lock->lk_sleeps);
+        }
+        spinlock_release(&lock_list_lock);
+
+        kprintf("All locks: %u acquires, %u contended "
+                "(%u won by spinning), %u sleeps\n",
+                acquires, contended, spinwins, sleeps);
+}
+
 ////////////////////////////////////////////////////////////
 //
 // CV
@@ -317,3 +439,173 @@ cv_broadcast(struct cv *cv, struct lock *lock)
     	wchan_wakeall(cv->cv_wchan, &cv->cv_lock);
         spinlock_release(&cv->cv_lock);
 }
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name, bool writerpref)
+{
+        struct rwlock *rw;
+
+        rw = kmalloc(sizeof(*rw));
+        if (rw == NULL) {
+                return NULL;
+        }
+
+        rw->rw_name = kstrdup(name);
+        if (rw->rw_name == NULL) {
+                kfree(rw);
+                return NULL;
+        }
+
+        rw->rw_readwchan = wchan_create(rw->rw_name);
+        if (rw->rw_readwchan == NULL) {
+                kfree(rw->rw_name);
+                kfree(rw);
+                return NULL;
+        }
+
+        rw->rw_writewchan = wchan_create(rw->rw_name);
+        if (rw->rw_writewchan == NULL) {
+                wchan_destroy(rw->rw_readwchan);
+                kfree(rw->rw_name);
+                kfree(rw);
+                return NULL;
+        }
+
+        spinlock_init(&rw->rw_lock);
+        rw->rw_readers = 0;
+        rw->rw_writer = NULL;
+        rw->rw_readwaiting = 0;
+        rw->rw_writewaiting = 0;
+        rw->rw_readpasses = 0;
+        rw->rw_writerpref = writerpref;
+
+        return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+        KASSERT(rw->rw_readers == 0);
+        KASSERT(rw->rw_writer == NULL);
+        KASSERT(rw->rw_readwaiting == 0);
+        KASSERT(rw->rw_writewaiting == 0);
+
+        spinlock_cleanup(&rw->rw_lock);
+        wchan_destroy(rw->rw_writewchan);
+        wchan_destroy(rw->rw_readwchan);
+
+        kfree(rw->rw_name);
+        kfree(rw);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+        KASSERT(!curthread->t_in_interrupt);
+
+        spinlock_acquire(&rw->rw_lock);
+        KASSERT(rw->rw_writer != curthread);
+        /* Queue behind waiting writers, unless we've been let past. */
+        while (rw->rw_writer != NULL ||
+               (rw->rw_writewaiting > 0 && rw->rw_readpasses == 0)) {
+                rw->rw_readwaiting++;
+                wchan_sleep(rw->rw_readwchan, &rw->rw_lock);
+                rw->rw_readwaiting--;
+        }
+        if (rw->rw_readpasses > 0) {
+                rw->rw_readpasses--;
+        }
+        rw->rw_readers++;
+        spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+
+        spinlock_acquire(&rw->rw_lock);
+        KASSERT(rw->rw_readers > 0);
+        rw->rw_readers--;
+        if (rw->rw_readers == 0 && rw->rw_writewaiting > 0) {
+                wchan_wakeone(rw->rw_writewchan, &rw->rw_lock);
+        }
+        spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+        KASSERT(!curthread->t_in_interrupt);
+
+        spinlock_acquire(&rw->rw_lock);
+        KASSERT(rw->rw_writer != curthread);
+        /* Readers that have been let past go first. */
+        while (rw->rw_writer != NULL || rw->rw_readers > 0 ||
+               rw->rw_readpasses > 0) {
+                rw->rw_writewaiting++;
+                wchan_sleep(rw->rw_writewchan, &rw->rw_lock);
+                rw->rw_writewaiting--;
+        }
+        rw->rw_writer = curthread;
+        spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+
+        spinlock_acquire(&rw->rw_lock);
+        KASSERT(rw->rw_writer == curthread);
+        rw->rw_writer = NULL;
+
+        if (rw->rw_readwaiting > 0 &&
+            (!rw->rw_writerpref || rw->rw_writewaiting == 0)) {
+                /*
+                 * Let in everyone who was waiting to read, even if
+                 * writers are waiting too; they go next.
+                 */
+                rw->rw_readpasses = rw->rw_readwaiting;
+                wchan_wakeall(rw->rw_readwchan, &rw->rw_lock);
+        }
+        else if (rw->rw_writewaiting > 0) {
+                wchan_wakeone(rw->rw_writewchan, &rw->rw_lock);
+        }
+        spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+        bool result;
+
+        KASSERT(rw != NULL);
+
+        spinlock_acquire(&rw->rw_lock);
+        result = (rw->rw_writer == curthread);
+        spinlock_release(&rw->rw_lock);
+
+        return result;
+}
+
+bool
+rwlock_do_i_hold(struct rwlock *rw)
+{
+        bool result;
+
+        KASSERT(rw != NULL);
+
+        spinlock_acquire(&rw->rw_lock);
+        result = (rw->rw_writer == curthread || rw->rw_readers > 0);
+        spinlock_release(&rw->rw_lock);
+
+        return result;
+}
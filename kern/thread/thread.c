@@ -149,11 +149,152 @@ thread_create(const char *name)
 	thread->t_sfs_otrunc = 0;
 
 	/* Scheduling */
+#if USING_SCHEDULER
 	thread->t_priority = PRIORITY_INIT;
+	thread->t_runqueue_stamp = 0;
+#endif
 
 	return thread;
 }
 
+/*
+ * Run queues.
+ *
+ * Each cpu has one threadlist per priority level plus a bitmap of the
+ * nonempty levels, so queueing a thread and finding the next one to
+ * run take constant time no matter how many threads are runnable.
+ * Within a level threads run in FIFO order.
+ *
+ * All of these must be called with the cpu's run queue lock held.
+ */
+
+/* Table for the de Bruijn bit-index multiply in runqueue_lowbit. */
+static const unsigned char runqueue_debruijn[32] = {
+	0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+	31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9,
+};
+
+/*
+ * Return the index of the lowest set bit in MASK, which must be
+ * nonzero.
+ */
+static
+unsigned
+runqueue_lowbit(uint32_t mask)
+{
+	KASSERT(mask != 0);
+	return runqueue_debruijn[((mask & -mask) * 0x077cb531U) >> 27];
+}
+
+/*
+ * Return the index of the highest set bit in MASK, which must be
+ * nonzero.
+ */
+static
+unsigned
+runqueue_highbit(uint32_t mask)
+{
+	KASSERT(mask != 0);
+	/* smear the top bit downwards, then keep only the top bit */
+	mask |= mask >> 1;
+	mask |= mask >> 2;
+	mask |= mask >> 4;
+	mask |= mask >> 8;
+	mask |= mask >> 16;
+	return runqueue_lowbit(mask - (mask >> 1));
+}
+
+/*
+ * Return the run queue level for thread T.
+ */
+static
+unsigned
+runqueue_level(struct thread *t)
+{
+#if USING_SCHEDULER
+	KASSERT(t->t_priority >= PRIORITY_MIN);
+	KASSERT(t->t_priority <= PRIORITY_MAX);
+	return t->t_priority;
+#else
+	(void)t;
+	return PRIORITY_INIT;
+#endif
+}
+
+static
+void
+runqueue_init(struct cpu *c)
+{
+	unsigned i;
+
+	COMPILE_ASSERT(PRIORITY_MIN >= 0);
+	COMPILE_ASSERT(PRIORITY_MAX < RUNQUEUE_LEVELS);
+	COMPILE_ASSERT(RUNQUEUE_LEVELS <= 32);
+
+	for (i=0; i<RUNQUEUE_LEVELS; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
+	c->c_runqueue_mask = 0;
+	c->c_runqueue_count = 0;
+	c->c_runqueue_ticks = 0;
+}
+
+/*
+ * Add T to the tail of its level on cpu C.
+ */
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	unsigned level;
+
+	level = runqueue_level(t);
+	threadlist_addtail(&c->c_runqueue[level], t);
+	c->c_runqueue_mask |= (uint32_t)1 << level;
+	c->c_runqueue_count++;
+#if USING_SCHEDULER
+	t->t_runqueue_stamp = c->c_runqueue_ticks;
+#endif
+}
+
+/*
+ * Take the head (oldest) or tail (newest) thread off level LEVEL of
+ * cpu C, which must be nonempty.
+ */
+static
+struct thread *
+runqueue_remlevel(struct cpu *c, unsigned level, bool fromtail)
+{
+	struct threadlist *tl;
+	struct thread *t;
+
+	tl = &c->c_runqueue[level];
+	t = fromtail ? threadlist_remtail(tl) : threadlist_remhead(tl);
+	KASSERT(t != NULL);
+	if (threadlist_isempty(tl)) {
+		c->c_runqueue_mask &= ~((uint32_t)1 << level);
+	}
+	KASSERT(c->c_runqueue_count > 0);
+	c->c_runqueue_count--;
+	return t;
+}
+
+/*
+ * Take the thread that should run next off cpu C's run queue: the
+ * oldest one at the highest nonempty level. Returns NULL if there are
+ * none.
+ */
+static
+struct thread *
+runqueue_remnext(struct cpu *c)
+{
+	if (c->c_runqueue_mask == 0) {
+		return NULL;
+	}
+	return runqueue_remlevel(c, runqueue_highbit(c->c_runqueue_mask),
+				 false);
+}
+
 /*
  * Create a CPU structure. This is used for the bootup CPU and
  * also for secondary CPUs.
@@ -167,6 +308,7 @@ cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
 	int result;
+	unsigned i;
 	char namebuf[16];
 
 	c = kmalloc(sizeof(*c));
@@ -181,10 +323,13 @@ cpu_create(unsigned hardware_number)
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
+	for (i=0; i<SPINLOCK_QNODES; i++) {
+		c->c_qnodes[i].sqn_inuse = false;
+	}
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
-	spinlock_init(&c->c_runqueue_lock);
+	runqueue_init(c);
+	spinlock_init_queued(&c->c_runqueue_lock);
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
@@ -333,9 +478,8 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = &curcpu->c_runqueue.tl_tail;
-	curcpu->c_runqueue.tl_tail.tln_prev = &curcpu->c_runqueue.tl_head;
+	curcpu->c_runqueue_mask = 0;
+	curcpu->c_runqueue_count = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -447,6 +591,109 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Load balancing.
+ *
+ * Rather than having busy CPUs periodically push threads away, a CPU
+ * that runs out of work steals a thread from the CPU with the most
+ * threads waiting, straight from the idle loop in thread_switch. When
+ * a thread is queued on a busy CPU, an idle CPU is poked so it comes
+ * round its idle loop and steals right away instead of waiting for
+ * its next timer interrupt.
+ *
+ * Migrating threads isn't free because of cache affinity; a thread's
+ * working cache set will end up having to be moved to the other CPU.
+ * So we only steal from a CPU that is busy running something else
+ * (an idle one is about to run its own threads), and we take the
+ * thread that has been waiting longest at the lowest level, which is
+ * the least likely to still have anything in that CPU's cache.
+ */
+
+/*
+ * Poke one idle CPU, other than BUSY, to come and look for work.
+ *
+ * c_isidle is read without the run queue lock; this is only a hint,
+ * and the worst that happens is a wasted or a missed IPI.
+ */
+static
+void
+thread_unidle_one(struct cpu *busy)
+{
+	struct cpu *c;
+	unsigned i, numcpus;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == busy || c == curcpu->c_self) {
+			continue;
+		}
+		if (c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
+		}
+	}
+}
+
+/*
+ * Steal a thread for the current cpu, which must have nothing to run
+ * and must not be holding its own run queue lock. Returns the thread,
+ * already assigned to this cpu but on no run queue, or NULL if there
+ * was nothing worth taking.
+ */
+static
+struct thread *
+thread_steal(void)
+{
+	struct cpu *c, *victim;
+	struct thread *t;
+	unsigned i, numcpus, level, most;
+
+	/* Find the most loaded cpu, without locking; recheck below. */
+	victim = NULL;
+	most = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self || c->c_isidle) {
+			continue;
+		}
+		if (c->c_runqueue_count > most) {
+			most = c->c_runqueue_count;
+			victim = c;
+		}
+	}
+	if (victim == NULL) {
+		return NULL;
+	}
+
+	spinlock_acquire(&victim->c_runqueue_lock);
+	if (victim->c_isidle || victim->c_runqueue_mask == 0) {
+		spinlock_release(&victim->c_runqueue_lock);
+		return NULL;
+	}
+	level = runqueue_lowbit(victim->c_runqueue_mask);
+	t = victim->c_runqueue[level].tl_head.tln_next->tln_self;
+	if (t == victim->c_curthread) {
+		/*
+		 * A thread that went to sleep while its cpu went idle
+		 * stays curthread there until the cpu unidles, even
+		 * if it has been woken up and requeued in the
+		 * meantime. Taking it would mean running it on two
+		 * cpus at once. Leave it alone.
+		 */
+		spinlock_release(&victim->c_runqueue_lock);
+		return NULL;
+	}
+	t = runqueue_remlevel(victim, level, false);
+	t->t_cpu = curcpu->c_self;
+	spinlock_release(&victim->c_runqueue_lock);
+
+	DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+	      t->t_name, victim->c_number, curcpu->c_number);
+	return t;
+}
+
 /*
  * Make a thread runnable.
  *
@@ -471,7 +718,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 
 	/* Target thread is now ready to run; put it on the run queue. */
 	target->t_state = S_READY;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_add(targetcpu, target);
 
 	if (targetcpu->c_isidle && targetcpu != curcpu->c_self) {
 		/*
@@ -480,6 +727,13 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
 	}
+	else if (!targetcpu->c_isidle) {
+		/*
+		 * Target processor is busy; get an idle one, if any,
+		 * to come and steal work.
+		 */
+		thread_unidle_one(targetcpu);
+	}
 
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
@@ -582,13 +836,15 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 #if USING_SCHEDULER
 	switch (newstate) {
 		case S_READY:
-			if (cur->t_priority >= PRIORITY_MIN) {
-				cur->t_priority -= S_READY_DEC;
+			cur->t_priority -= S_READY_DEC;
+			if (cur->t_priority < PRIORITY_MIN) {
+				cur->t_priority = PRIORITY_MIN;
 			}
 			break;
 		case S_SLEEP:
-			if (cur->t_priority <= PRIORITY_MAX) {
-				cur->t_priority += S_SLEEP_INC;
+			cur->t_priority += S_SLEEP_INC;
+			if (cur->t_priority > PRIORITY_MAX) {
+				cur->t_priority = PRIORITY_MAX;
 			}
 			break;
 		default:
@@ -612,12 +868,23 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	if (newstate == S_READY && curcpu->c_runqueue_count == 0) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
 	}
 
+	/* Count the switch against the process: sleeping is voluntary,
+	   being preempted (or yielding) isn't */
+	if (cur->t_proc != NULL && cur->t_proc != kproc) {
+		if (newstate == S_SLEEP) {
+			cur->t_proc->p_rusage.ru_nvcsw++;
+		}
+		else if (newstate == S_READY) {
+			cur->t_proc->p_rusage.ru_nivcsw++;
+		}
+	}
+
 	/* Put the thread in the right place. */
 	switch (newstate) {
 	    case S_RUN:
@@ -646,7 +913,8 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	cur->t_state = newstate;
 
 	/*
-	 * Get the next thread. While there isn't one, call cpu_idle().
+	 * Get the next thread. While there isn't one, try to steal one
+	 * from another cpu, and failing that call cpu_idle().
 	 * curcpu->c_isidle must be true when cpu_idle is
 	 * called. Unlock the runqueue while idling too, to make sure
 	 * things can be added to it.
@@ -665,10 +933,13 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remnext(curcpu->c_self);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			next = thread_steal();
+			if (next == NULL) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -846,172 +1117,48 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is called periodically from hardclock(). Picking the next
+ * thread is done by the run queues themselves; all that's left here
+ * is aging. The oldest thread on each level below the top nonempty
+ * one is boosted a level if it has been waiting PRIORITY_AGE_TICKS or
+ * more, so CPU-bound threads that have sunk to the bottom still get
+ * to run. This looks at no more than one thread per level.
  */
 
 void
 schedule(void)
 {
 #if USING_SCHEDULER
-
-	int max_seen, cur_priority;
-	struct threadlistnode *cur = curcpu->c_runqueue.tl_head.tln_next;
-	struct thread *move_to_head;
-
-	static int reset_counter = 0;
-
-	// Reset the priorities if end of cycle and return
-	reset_counter++;
-	if (reset_counter == COUNTER_BOUND) {
-		while (cur->tln_next) {
-			cur->tln_self->t_priority = PRIORITY_INIT;
-			cur = cur->tln_next;
-		}
-		reset_counter = 0;
-		return;
-	}
-
-	// Need to schedule otherwise
-	move_to_head = NULL;
-	cur = curcpu->c_runqueue.tl_head.tln_next;
-	max_seen = PRIORITY_MIN;
-	while (cur->tln_next)
-	{
-		cur_priority =  cur->tln_self->t_priority;
-		if (cur_priority > max_seen) {
-			max_seen = cur_priority;
-			move_to_head = cur->tln_self;
-		}
-		cur = cur->tln_next;
-	}
-	if (move_to_head) {
-		threadlist_remove(&(curcpu->c_runqueue), move_to_head);
-		threadlist_addhead(&(curcpu->c_runqueue), move_to_head);
-	}
-#endif
-}
-
-/*
- * Thread migration.
- *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
- *
- * Migrating threads isn't free because of cache affinity; a thread's
- * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
- *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
- */
-void
-thread_consider_migration(void)
-{
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
-	struct cpu *c;
-	struct threadlist victims;
+	struct cpu *c = curcpu->c_self;
 	struct thread *t;
+	uint32_t mask;
+	unsigned level;
 
-	my_count = total_count = 0;
-	numcpus = cpuarray_num(&allcpus);
-	for (i=0; i<numcpus; i++) {
-		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
-		}
-		spinlock_release(&c->c_runqueue_lock);
-	}
+	spinlock_acquire(&c->c_runqueue_lock);
+	c->c_runqueue_ticks++;
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
-		return;
+	mask = c->c_runqueue_mask;
+	if (mask != 0) {
+		/* the top level is going to run anyway */
+		mask &= ~((uint32_t)1 << runqueue_highbit(mask));
 	}
+	while (mask != 0) {
+		level = runqueue_lowbit(mask);
+		mask &= ~((uint32_t)1 << level);
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
-	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
-	}
-	spinlock_release(&curcpu->c_runqueue_lock);
-
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
+		t = c->c_runqueue[level].tl_head.tln_next->tln_self;
+		if (c->c_runqueue_ticks - t->t_runqueue_stamp <
+		    PRIORITY_AGE_TICKS) {
 			continue;
 		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
-
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
-		}
-		spinlock_release(&c->c_runqueue_lock);
-	}
-
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
-		}
-		spinlock_release(&curcpu->c_runqueue_lock);
+		t = runqueue_remlevel(c, level, false);
+		KASSERT(t->t_priority < PRIORITY_MAX);
+		t->t_priority++;
+		runqueue_add(c, t);
 	}
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+	spinlock_release(&c->c_runqueue_lock);
+#endif
 }
 
 ////////////////////////////////////////////////////////////
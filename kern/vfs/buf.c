@@ -94,6 +94,7 @@ struct buf {
 	unsigned b_valid:1;	/* contains real data */
 	unsigned b_dirty:1;	/* data needs to be written to disk */
 	unsigned b_fsmanaged:1;	/* managed by file system */
+	unsigned b_lsnpending:1; /* fs owes us an LSN; see buffer_lsn_pend */
 	struct thread *b_holder; /* who did buffer_mark_busy() */
 	struct timespec b_timestamp; /* when it became dirty */
 
@@ -110,8 +111,28 @@ struct buf {
 	/* for checkpointing */
 	sfs_lsn_t b_lowest_lsn;
 	sfs_lsn_t b_highest_lsn;
+	struct buflsnlist *b_lsnlist;	/* list we're on, if any */
+	struct buf *b_lsnprev;		/* neighbours on that list */
+	struct buf *b_lsnnext;
 };
 
+/*
+ * Per-fs list of buffers that carry an LSN, ordered by b_lowest_lsn,
+ * so the minimum is always at the head. LSNs are handed out in
+ * increasing order, so insertion (done from the tail) is normally
+ * O(1); removal always is.
+ */
+struct buflsnlist {
+	struct fs *bl_fs;
+	struct buf *bl_head;
+	struct buf *bl_tail;
+	void (*bl_advanced)(struct fs *); /* called when min advances */
+	void (*bl_settle)(struct fs *);	/* called to resolve b_lsnpending */
+};
+
+DECLARRAY(buflsnlist, static __UNUSED inline);
+DEFARRAY(buflsnlist, static __UNUSED inline);
+
 /*
  * Buffer hash table.
  */
@@ -154,6 +175,11 @@ static unsigned dirty_buffers_thresh;     /* size limit before compacting */
 
 static struct bufarray detached_buffers;
 
+/*
+ * LSN tracking for checkpointing, one list per registered fs.
+ */
+static struct buflsnlistarray buffer_lsnlists;
+
 /*
  * Epochs and generations.
  *
@@ -187,6 +213,8 @@ static unsigned num_read_gets;
 static unsigned num_total_writeouts;
 static unsigned num_total_evictions;
 static unsigned num_dirty_evictions;
+static unsigned num_cluster_reads;
+static unsigned num_cluster_writes;
 
 /*
  * Syncer state. (This is file-static so it's easily visible from the
@@ -217,8 +245,22 @@ static struct cv *buffer_reserve_cv;
  * factor buffer reservation calls into some of these decisions somehow.
  */
 
-/* Number of buffers to reserve for each file system operation. */
-#define RESERVE_BUFFERS		8
+/*
+ * Number of buffers to reserve for each file system operation.
+ *
+ * RESERVE_BUFFERS_OP covers the operations that work a block at a
+ * time (the "Requires up to N buffers" notes in sfs, stacked for the
+ * worst of them, such as a directory operation that truncates). A
+ * clustered write holds the file's inode buffer plus one whole
+ * cluster (see buffer_get_cluster and sfs_runio); the buffers
+ * sfs_bmap uses to find the blocks are released before the cluster
+ * is fetched, so they don't add to it. Reserve whichever of the two
+ * is larger.
+ */
+#define RESERVE_BUFFERS_OP	8
+#define RESERVE_BUFFERS_CLUSTER	(BUFFER_CLUSTER_MAX + 1)
+#define RESERVE_BUFFERS		(RESERVE_BUFFERS_OP > RESERVE_BUFFERS_CLUSTER ? \
+				 RESERVE_BUFFERS_OP : RESERVE_BUFFERS_CLUSTER)
 
 /* Factor for choosing attached_buffers_thresh. */
 #define ATTACHED_THRESH_NUM	3
@@ -719,6 +761,151 @@ buffer_insert_dirty(struct buf *b)
 	KASSERT(result == 0);
 }
 
+////////////////////////////////////////////////////////////
+// LSN tracking
+
+/*
+ * Find the LSN list for FS, or NULL if FS didn't register one.
+ */
+static
+struct buflsnlist *
+buffer_lsnlist_get(struct fs *fs)
+{
+	struct buflsnlist *bl;
+	unsigned i, num;
+
+	num = buflsnlistarray_num(&buffer_lsnlists);
+	for (i=0; i<num; i++) {
+		bl = buflsnlistarray_get(&buffer_lsnlists, i);
+		if (bl->bl_fs == fs) {
+			return bl;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Record that a change logged at NEW_LSN was made to a buffer. The
+ * first such change (since the buffer was last written) puts it on
+ * its fs's LSN list.
+ */
+static
+void
+buffer_lsn_set(struct buf *b, sfs_lsn_t new_lsn)
+{
+	struct buflsnlist *bl;
+	struct buf *prev;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	b->b_lsnpending = 0;
+	b->b_highest_lsn = new_lsn;
+	if (b->b_lowest_lsn != 0 || new_lsn == 0) {
+		return;
+	}
+	b->b_lowest_lsn = new_lsn;
+
+	bl = buffer_lsnlist_get(b->b_fs);
+	if (bl == NULL) {
+		return;
+	}
+	KASSERT(b->b_lsnlist == NULL);
+
+	/* Walk back from the tail to find our place */
+	prev = bl->bl_tail;
+	while (prev != NULL && prev->b_lowest_lsn > new_lsn) {
+		prev = prev->b_lsnprev;
+	}
+
+	b->b_lsnlist = bl;
+	b->b_lsnprev = prev;
+	if (prev == NULL) {
+		b->b_lsnnext = bl->bl_head;
+		bl->bl_head = b;
+	}
+	else {
+		b->b_lsnnext = prev->b_lsnnext;
+		prev->b_lsnnext = b;
+	}
+	if (b->b_lsnnext == NULL) {
+		bl->bl_tail = b;
+	}
+	else {
+		b->b_lsnnext->b_lsnprev = b;
+	}
+}
+
+/*
+ * The buffer's logged changes are on disk (or it's being dropped);
+ * take it off its LSN list. If it was the oldest, the fs's minimum
+ * has advanced; tell the fs.
+ */
+static
+void
+buffer_lsn_clear(struct buf *b)
+{
+	struct buflsnlist *bl;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	b->b_lowest_lsn = 0;
+	b->b_highest_lsn = 0;
+
+	bl = b->b_lsnlist;
+	if (bl == NULL) {
+		return;
+	}
+
+	if (b->b_lsnprev == NULL) {
+		bl->bl_head = b->b_lsnnext;
+	}
+	else {
+		b->b_lsnprev->b_lsnnext = b->b_lsnnext;
+	}
+	if (b->b_lsnnext == NULL) {
+		bl->bl_tail = b->b_lsnprev;
+	}
+	else {
+		b->b_lsnnext->b_lsnprev = b->b_lsnprev;
+	}
+
+	b->b_lsnlist = NULL;
+	if (b->b_lsnprev == NULL && bl->bl_advanced != NULL) {
+		bl->bl_advanced(bl->bl_fs);
+	}
+	b->b_lsnprev = NULL;
+	b->b_lsnnext = NULL;
+}
+
+/*
+ * If the fs still owes B an LSN (see buffer_lsn_pend), have it
+ * write out the journal records it's holding back so B gets tagged
+ * before anyone else can see it. Only B's holder can have marked
+ * it, so the flag needs no lock to check. Must not be called with
+ * the buffer lock held, as the fs will write to the journal.
+ */
+static
+void
+buffer_lsn_settle(struct buf *b)
+{
+	struct buflsnlist *bl;
+	void (*settle)(struct fs *);
+
+	KASSERT(b->b_busy);
+	if (!b->b_lsnpending) {
+		return;
+	}
+
+	lock_acquire(buffer_lock);
+	bl = buffer_lsnlist_get(b->b_fs);
+	KASSERT(bl != NULL && bl->bl_settle != NULL);
+	settle = bl->bl_settle;
+	lock_release(buffer_lock);
+
+	settle(b->b_fs);
+	KASSERT(!b->b_lsnpending);
+}
+
 ////////////////////////////////////////////////////////////
 // ops on buffers
 
@@ -757,6 +944,7 @@ buffer_create(void)
 	b->b_valid = 0;
 	b->b_dirty = 0;
 	b->b_fsmanaged = 0;
+	b->b_lsnpending = 0;
 	b->b_holder = NULL;
 	b->b_timestamp.tv_sec = 0;
 	b->b_timestamp.tv_nsec = 0;
@@ -766,6 +954,9 @@ buffer_create(void)
 	b->b_fsdata = NULL;
 	b->b_lowest_lsn = 0;
 	b->b_highest_lsn = 0;
+	b->b_lsnlist = NULL;
+	b->b_lsnprev = NULL;
+	b->b_lsnnext = NULL;
 	num_total_buffers++;
 	return b;
 }
@@ -808,6 +999,7 @@ buffer_detach(struct buf *b)
 	KASSERT(b->b_attached == 1);
 	KASSERT(b->b_busy == 0);
 	bufhash_remove(&buffer_hash, b);
+	buffer_lsn_clear(b);
 
 	if (b->b_fsdata != NULL) {
 		kprintf("vfs: %s left behind fs-specific buffer data\n",
@@ -864,6 +1056,7 @@ void
 buffer_unmark_busy(struct buf *b)
 {
 	KASSERT(b->b_busy != 0);
+	KASSERT(!b->b_lsnpending);
 	b->b_busy = 0;
 	if (b->b_fsmanaged) {
 		b->b_fsmanaged = false;
@@ -927,6 +1120,7 @@ buffer_writeout_internal(struct buf *b)
 	KASSERT(b->b_valid);
 	KASSERT(b->b_busy);
 	KASSERT(b->b_fs != NULL);
+	KASSERT(!b->b_lsnpending);
 
 	if (!b->b_dirty) {
 		return 0;
@@ -942,8 +1136,7 @@ buffer_writeout_internal(struct buf *b)
 				 b->b_data, b->b_size);
 	lock_acquire(buffer_lock);
 	if (result == 0) {
-		b->b_lowest_lsn = 0;
-		b->b_highest_lsn = 0;
+		buffer_lsn_clear(b);
 		dirty_buffers_count--;
 		b->b_dirty = 0;
 		buffer_remove_dirty(b);
@@ -956,12 +1149,123 @@ buffer_writeout(struct buf *b)
 {
 	int result;
 
+	buffer_lsn_settle(b);
 	lock_acquire(buffer_lock);
 	result = buffer_writeout_internal(b);
 	lock_release(buffer_lock);
 	return result;
 }
 
+/*
+ * I/O: disk to a run of buffers for consecutive blocks, none of which
+ * is valid yet. If the file system supports it, this is one request.
+ */
+static
+int
+buffer_readin_run(struct buf **bufs, unsigned nbufs)
+{
+	void *datav[BUFFER_CLUSTER_MAX];
+	struct fs *fs;
+	unsigned i;
+	int result;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(nbufs > 0 && nbufs <= BUFFER_CLUSTER_MAX);
+
+	fs = bufs[0]->b_fs;
+	if (nbufs == 1 || fs->fs_ops->fsop_readblocks == NULL) {
+		for (i=0; i<nbufs; i++) {
+			result = buffer_readin(bufs[i]);
+			if (result) {
+				return result;
+			}
+		}
+		return 0;
+	}
+
+	for (i=0; i<nbufs; i++) {
+		KASSERT(bufs[i]->b_attached);
+		KASSERT(bufs[i]->b_busy);
+		KASSERT(!bufs[i]->b_valid);
+		KASSERT(bufs[i]->b_fs == fs);
+		KASSERT(bufs[i]->b_physblock == bufs[0]->b_physblock + i);
+		datav[i] = bufs[i]->b_data;
+	}
+
+	num_cluster_reads++;
+	lock_release(buffer_lock);
+	result = FSOP_READBLOCKS(fs, bufs[0]->b_physblock, datav, nbufs,
+				 bufs[0]->b_size);
+	lock_acquire(buffer_lock);
+	if (result == 0) {
+		for (i=0; i<nbufs; i++) {
+			bufs[i]->b_valid = 1;
+		}
+	}
+	return result;
+}
+
+/*
+ * I/O: a run of buffers for consecutive blocks to disk. The first
+ * buffer is dirty (and was picked by the caller); the rest were
+ * picked up by buffer_gather_cluster. All are marked busy.
+ *
+ * Like buffer_writeout_internal, releases the lock to do I/O.
+ */
+static
+int
+buffer_writeout_cluster_internal(struct buf **bufs, unsigned nbufs)
+{
+	void *datav[BUFFER_CLUSTER_MAX];
+	struct fs *fs;
+	sfs_lsn_t maxlsn;
+	unsigned i;
+	int result;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(nbufs > 0 && nbufs <= BUFFER_CLUSTER_MAX);
+
+	if (nbufs == 1) {
+		return buffer_writeout_internal(bufs[0]);
+	}
+
+	fs = bufs[0]->b_fs;
+	maxlsn = 0;
+	for (i=0; i<nbufs; i++) {
+		KASSERT(bufs[i]->b_attached);
+		KASSERT(bufs[i]->b_valid);
+		KASSERT(bufs[i]->b_dirty);
+		KASSERT(bufs[i]->b_busy);
+		KASSERT(bufs[i]->b_fs == fs);
+		KASSERT(bufs[i]->b_physblock == bufs[0]->b_physblock + i);
+		if (bufs[i]->b_highest_lsn > maxlsn) {
+			maxlsn = bufs[i]->b_highest_lsn;
+		}
+		datav[i] = bufs[i]->b_data;
+	}
+
+	/* One journal flush covers the whole cluster */
+	lock_release(buffer_lock);
+	sfs_jphys_flush(fs->fs_data, maxlsn);
+	lock_acquire(buffer_lock);
+
+	num_total_writeouts += nbufs;
+	num_cluster_writes++;
+	lock_release(buffer_lock);
+	result = FSOP_WRITEBLOCKS(fs, bufs[0]->b_physblock, datav, nbufs,
+				  bufs[0]->b_size);
+	lock_acquire(buffer_lock);
+	if (result == 0) {
+		for (i=0; i<nbufs; i++) {
+			buffer_lsn_clear(bufs[i]);
+			dirty_buffers_count--;
+			bufs[i]->b_dirty = 0;
+			buffer_remove_dirty(bufs[i]);
+		}
+	}
+	return result;
+}
+
 /*
  * Fetch buffer pointer (external op)
  *
@@ -998,18 +1302,18 @@ buffer_is_valid(struct buf *b)
 }
 
 /*
- * Mark buffer dirty (external op, for after messing with buffer pointer)
+ * Mark buffer dirty (internal version; buffer_lock must be held)
  */
+static
 void
-buffer_mark_dirty(struct buf *b)
+buffer_mark_dirty_internal(struct buf *b)
 {
+	KASSERT(lock_do_i_hold(buffer_lock));
 	KASSERT(b->b_busy);
 	KASSERT(b->b_valid);
 
-	lock_acquire(buffer_lock);
 	if (b->b_dirty) {
 		/* nothing to do */
-		lock_release(buffer_lock);
 		return;
 	}
 
@@ -1022,6 +1326,16 @@ buffer_mark_dirty(struct buf *b)
 	buffer_insert_dirty(b);
 	dirty_buffers_count++;
 	/* Here we might prod the syncer, but currently it doesn't need it */
+}
+
+/*
+ * Mark buffer dirty (external op, for after messing with buffer pointer)
+ */
+void
+buffer_mark_dirty(struct buf *b)
+{
+	lock_acquire(buffer_lock);
+	buffer_mark_dirty_internal(b);
 	lock_release(buffer_lock);
 }
 
@@ -1038,6 +1352,43 @@ buffer_mark_valid(struct buf *b)
 ////////////////////////////////////////////////////////////
 // buffer get/release
 
+/*
+ * Collect the dirty buffers that immediately follow B on disk and
+ * that nobody is using, so they can be written in the same request
+ * as B. They are marked busy. Returns the number of buffers placed in
+ * BUFS, including B itself.
+ */
+static
+unsigned
+buffer_gather_cluster(struct buf *b, struct buf **bufs)
+{
+	struct buf *nb;
+	unsigned n;
+	int result;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(b->b_busy);
+
+	bufs[0] = b;
+	if (b->b_fs->fs_ops->fsop_writeblocks == NULL) {
+		return 1;
+	}
+
+	for (n=1; n<BUFFER_CLUSTER_MAX; n++) {
+		nb = bufhash_get(&buffer_hash, b->b_fs, b->b_physblock + n);
+		if (nb == NULL || nb->b_busy || !nb->b_valid || !nb->b_dirty) {
+			break;
+		}
+		/* fsmanaged buffers are always busy */
+		KASSERT(nb->b_fsmanaged == 0);
+		result = buffer_mark_busy(nb);
+		/* not busy, won't sleep, can't fail */
+		KASSERT(result == 0);
+		bufs[n] = nb;
+	}
+	return n;
+}
+
 /*
  * Write a buffer out.
  *
@@ -1051,6 +1402,8 @@ static
 int
 buffer_sync(struct buf *b)
 {
+	struct buf *bufs[BUFFER_CLUSTER_MAX];
+	unsigned nbufs;
 	int result;
 
 	KASSERT(b->b_valid == 1);
@@ -1077,7 +1430,10 @@ buffer_sync(struct buf *b)
 		return 0;
 	}
 
-	result = buffer_writeout_internal(b);
+	/* Take along any dirty neighbors so they go out in one request */
+	nbufs = buffer_gather_cluster(b, bufs);
+
+	result = buffer_writeout_cluster_internal(bufs, nbufs);
 	/*
 	 * The caller needs to be able to distinguish buffer_mark_busy
 	 * failing (which requires specific handling) from any failure
@@ -1086,7 +1442,9 @@ buffer_sync(struct buf *b)
 	 */
 	KASSERT(result != EDEADBUF);
 
-	buffer_unmark_busy(b);
+	while (nbufs > 0) {
+		buffer_unmark_busy(bufs[--nbufs]);
+	}
 
 	return result;
 }
@@ -1469,6 +1827,61 @@ buffer_read_fsmanaged(struct fs *fs, daddr_t block, size_t size,
 	return result;
 }
 
+/*
+ * Get buffers for a run of consecutive blocks, reading in the ones
+ * that aren't valid (if DOREAD is set) with as few requests as
+ * possible. On failure, nothing is held.
+ */
+int
+buffer_get_cluster(struct fs *fs, daddr_t block, unsigned nblocks,
+		   size_t size, bool doread, struct buf **bufs)
+{
+	unsigned i, j;
+	int result;
+
+	KASSERT(nblocks > 0 && nblocks <= BUFFER_CLUSTER_MAX);
+
+	lock_acquire(buffer_lock);
+
+	/* Ascending block order, so cluster getters can't deadlock */
+	for (i=0; i<nblocks; i++) {
+		result = buffer_get_internal(fs, block + i, size,
+					     false/*fsmanaged*/, &bufs[i]);
+		if (result) {
+			goto fail;
+		}
+	}
+
+	if (doread) {
+		for (i=0; i<nblocks; i=j) {
+			if (bufs[i]->b_valid) {
+				j = i + 1;
+				continue;
+			}
+			for (j=i+1; j<nblocks && !bufs[j]->b_valid; j++) {
+				/* find the end of the invalid run */
+			}
+			num_read_gets += j - i;
+			/* may lose (and then re-acquire) lock here */
+			result = buffer_readin_run(&bufs[i], j - i);
+			if (result) {
+				i = nblocks;
+				goto fail;
+			}
+		}
+	}
+
+	lock_release(buffer_lock);
+	return 0;
+
+ fail:
+	while (i > 0) {
+		buffer_release_internal(bufs[--i]);
+	}
+	lock_release(buffer_lock);
+	return result;
+}
+
 /*
  * Shortcut combination of buffer_get and buffer_writeout that writes
  * out any existing buffer if it's dirty and otherwise does nothing.
@@ -1596,17 +2009,37 @@ buffer_release_internal(struct buf *b)
 void
 buffer_release(struct buf *b)
 {
+	buffer_lsn_settle(b);
 	lock_acquire(buffer_lock);
 	buffer_release_internal(b);
 	lock_release(buffer_lock);
 }
 
+/*
+ * Let go of all the buffers obtained with buffer_get_cluster.
+ */
+void
+buffer_release_cluster(struct buf **bufs, unsigned nblocks)
+{
+	unsigned i;
+
+	for (i=0; i<nblocks; i++) {
+		buffer_lsn_settle(bufs[i]);
+	}
+	lock_acquire(buffer_lock);
+	for (i=0; i<nblocks; i++) {
+		buffer_release_internal(bufs[i]);
+	}
+	lock_release(buffer_lock);
+}
+
 /*
  * Same as buffer_release, but also invalidates the buffer.
  */
 void
 buffer_release_and_invalidate(struct buf *b)
 {
+	buffer_lsn_settle(b);
 	lock_acquire(buffer_lock);
 	bufcheck();
 
@@ -2234,42 +2667,126 @@ void
 buffer_update_lsns(struct buf *buf, sfs_lsn_t new_lsn)
 {
 	lock_acquire(buffer_lock);
-	buf->b_lowest_lsn = (buf->b_lowest_lsn == 0 ? new_lsn : buf->b_lowest_lsn);
-	buf->b_highest_lsn = new_lsn;
+	buffer_lsn_set(buf, new_lsn);
 	lock_release(buffer_lock);
 }
 
 /*
- * Return lowest nonzero lsn from buffers, ULLONG_MAX if all are 0
+ * Note that BUF has been changed under journal records that don't
+ * have LSNs yet. The buffer can't be written or released until the
+ * fs supplies one with buffer_update_lsns; if it's still pending by
+ * then the fs's settle callback is called to force the issue.
+ */
+void
+buffer_lsn_pend(struct buf *buf)
+{
+	lock_acquire(buffer_lock);
+	KASSERT(buf->b_busy);
+	KASSERT(buf->b_holder == curthread);
+	KASSERT(buffer_lsnlist_get(buf->b_fs) != NULL);
+	buf->b_lsnpending = 1;
+	lock_release(buffer_lock);
+}
+
+/*
+ * Mark a whole cluster valid and dirty and update its LSNs, taking
+ * the buffer lock only once.
+ */
+void
+buffer_mark_dirty_cluster(struct buf **bufs, unsigned nblocks,
+			  sfs_lsn_t new_lsn)
+{
+	struct buf *b;
+	unsigned i;
+
+	lock_acquire(buffer_lock);
+	for (i=0; i<nblocks; i++) {
+		b = bufs[i];
+		KASSERT(b->b_busy);
+		b->b_valid = 1;
+		buffer_lsn_set(b, new_lsn);
+		buffer_mark_dirty_internal(b);
+	}
+	lock_release(buffer_lock);
+}
+
+/*
+ * Return lowest nonzero lsn from buffers, ULLONG_MAX if all are 0.
+ * This is just the head of the fs's LSN list.
  */
 sfs_lsn_t
 buffer_get_min_low_lsn(struct fs *fs)
 {
-	unsigned i, nbufs;
+	struct buflsnlist *bl;
 	sfs_lsn_t min_buf_lowest_lsn;
-	struct buf *b;
 
 	KASSERT(fs != NULL);
 
 	lock_acquire(buffer_lock);
-	bufcheck();
 
-	nbufs = bufarray_num(&dirty_buffers);
-	min_buf_lowest_lsn = ULLONG_MAX;
+	bl = buffer_lsnlist_get(fs);
+	KASSERT(bl != NULL);
+	min_buf_lowest_lsn = bl->bl_head == NULL ? ULLONG_MAX :
+		bl->bl_head->b_lowest_lsn;
 
-	for (i = 0; i < nbufs; i++) {
-		b = bufarray_get(&dirty_buffers, i);
-		if (b == NULL || b->b_fs != fs) {
-			continue;
-		}
+	lock_release(buffer_lock);
+	return min_buf_lowest_lsn;
+}
 
-		if (b->b_lowest_lsn < min_buf_lowest_lsn) {
-			min_buf_lowest_lsn = b->b_lowest_lsn;
-		}
+/*
+ * Start tracking LSNs for FS.
+ */
+int
+buffer_lsn_register(struct fs *fs, void (*advanced)(struct fs *),
+		    void (*settle)(struct fs *))
+{
+	struct buflsnlist *bl;
+	int result;
+
+	bl = kmalloc(sizeof(*bl));
+	if (bl == NULL) {
+		return ENOMEM;
 	}
+	bl->bl_fs = fs;
+	bl->bl_head = bl->bl_tail = NULL;
+	bl->bl_advanced = advanced;
+	bl->bl_settle = settle;
 
+	lock_acquire(buffer_lock);
+	KASSERT(buffer_lsnlist_get(fs) == NULL);
+	result = buflsnlistarray_add(&buffer_lsnlists, bl, NULL);
 	lock_release(buffer_lock);
-	return min_buf_lowest_lsn;
+
+	if (result) {
+		kfree(bl);
+	}
+	return result;
+}
+
+/*
+ * Stop tracking LSNs for FS. Its buffers should all have been
+ * written out or dropped already.
+ */
+void
+buffer_lsn_unregister(struct fs *fs)
+{
+	struct buflsnlist *bl;
+	unsigned i, num;
+
+	lock_acquire(buffer_lock);
+	num = buflsnlistarray_num(&buffer_lsnlists);
+	for (i=0; i<num; i++) {
+		bl = buflsnlistarray_get(&buffer_lsnlists, i);
+		if (bl->bl_fs == fs) {
+			break;
+		}
+	}
+	KASSERT(i < num);
+	KASSERT(bl->bl_head == NULL);
+	buflsnlistarray_remove(&buffer_lsnlists, i);
+	lock_release(buffer_lock);
+
+	kfree(bl);
 }
 
 
@@ -2296,6 +2813,8 @@ buffer_printstats(void)
 		num_total_writeouts);
 	kprintf("   %u evictions (%u when dirty)\n",
 		num_total_evictions, num_dirty_evictions);
+	kprintf("   %u clustered reads, %u clustered writes\n",
+		num_cluster_reads, num_cluster_writes);
 
 	lock_release(buffer_lock);
 }
@@ -2330,6 +2849,10 @@ buffer_bootstrap(void)
 	num_total_writeouts = 0;
 	num_total_evictions = 0;
 	num_dirty_evictions = 0;
+	num_cluster_reads = 0;
+	num_cluster_writes = 0;
+
+	buflsnlistarray_init(&buffer_lsnlists);
 
 	bufarray_init(&detached_buffers);
 	bufarray_init(&attached_buffers);
@@ -150,6 +150,21 @@ dev_ioctl(struct vnode *v, int op, userptr_t data)
 	return DEVOP_IOCTL(d, op, data);
 }
 
+/*
+ * Called for poll(). Devices with no poll operation never block.
+ */
+static
+int
+dev_poll(struct vnode *v, int events, struct poller *pl)
+{
+	struct device *d = v->vn_data;
+
+	if (d->d_ops->devop_poll == NULL) {
+		return vopnop_poll_ready(v, events, pl);
+	}
+	return DEVOP_POLL(d, events, pl);
+}
+
 /*
  * Called for stat().
  * Set the type and the size (block devices only).
@@ -339,6 +354,7 @@ static const struct vnode_ops dev_vnode_ops = {
 	.vop_mmap = dev_mmap,
 	.vop_truncate = dev_truncate,
 	.vop_namefile = dev_namefile,
+	.vop_poll = dev_poll,
 	.vop_creat = vopfail_creat_notdir,
 	.vop_symlink = vopfail_symlink_notdir,
 	.vop_mkdir = vopfail_mkdir_notdir,
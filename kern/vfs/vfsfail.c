@@ -29,6 +29,7 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/poll.h>
 #include <vnode.h>
 
 /*
@@ -262,3 +263,14 @@ vopfail_lookparent_notdir(struct vnode *vn, char *path, struct vnode **result,
 	return ENOTDIR;
 }
 
+
+////////////////////////////////////////////////////////////
+// poll
+
+int
+vopnop_poll_ready(struct vnode *vn, int events, struct poller *pl)
+{
+	(void)vn;
+	(void)pl;
+	return events & (POLLIN | POLLOUT);
+}
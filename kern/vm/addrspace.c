@@ -33,10 +33,13 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <array.h>
+#include <uio.h>
+#include <vnode.h>
 #include <addrspace.h>
 #include <pagetable.h>
 #include <current.h>
 #include <proc.h>
+#include <textcache.h>
 
 // Forward declaration, implemented in vm/tlb.c
 void tlb_flush(void);
@@ -91,6 +94,12 @@ as_destroy_regions(struct addrspace *as)
 
 	for (i = 0; i < regionarray_num(as->as_regions); i++) {
 		region = regionarray_get(as->as_regions, i);
+		if (region->r_shared) {
+			textcache_unmap(region->r_vnode);
+		}
+		if (region->r_vnode != NULL) {
+			VOP_DECREF(region->r_vnode);
+		}
 		kfree(region);
 	}
 }
@@ -111,12 +120,21 @@ as_copy_regions(struct addrspace *old, struct addrspace *new)
 			goto err1;
 		}
 
+		*new_region = *old_region;
 		err = regionarray_add(new->as_regions, new_region, NULL);
 		if (err) {
+			kfree(new_region);
 			goto err1;
 		}
 
-		*new_region = *old_region;
+		if (new_region->r_vnode != NULL) {
+			VOP_INCREF(new_region->r_vnode);
+		}
+		if (new_region->r_shared &&
+		    textcache_map(new_region->r_vnode) != 0) {
+			// Fall back to private copies of the pages
+			new_region->r_shared = false;
+		}
 	}
 
 	return 0;
@@ -231,19 +249,15 @@ va_round_up_to_page(vaddr_t va)
  * VADDR+MEMSIZE.
  *
  * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
- * write, or execute permission should be set on the segment. At the
- * moment, these are ignored. When you write the VM system, you may
- * want to implement them.
+ * write, or execute permission should be set on the segment. They
+ * are enforced by vm_fault, except that execute permission can't
+ * be told apart from read permission: the MIPS TLB doesn't know
+ * instruction fetches from reads.
  */
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 		 int readable, int writeable, int executable)
 {
-	// Ignore permissions
-	(void)readable;
-	(void)writeable;
-	(void)executable;
-
 	int err;
 	unsigned int n_region_pages;
 	struct region *region;
@@ -258,6 +272,14 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 	// and uses up the remainder of its last page
 	region->r_base = va_round_down_to_page(vaddr);
 	region->r_end = va_round_up_to_page(vaddr + memsize);
+	region->r_perms = (readable ? REGION_R : 0) |
+		(writeable ? REGION_W : 0) |
+		(executable ? REGION_X : 0);
+	region->r_vnode = NULL;
+	region->r_offset = 0;
+	region->r_filestart = 0;
+	region->r_fileend = 0;
+	region->r_shared = false;
 
 	err = regionarray_add(as->as_regions, region, NULL);
 	if (err) {
@@ -286,6 +308,106 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 		return err;
 }
 
+/*
+ * Back the first FILESIZE bytes of the segment at VADDR of size
+ * MEMSIZE (which must already have been set up with
+ * as_define_region) with the file V, starting at OFFSET. Nothing is
+ * read now; vm_fault calls as_fill_page when the pages are first
+ * touched. Takes a reference to V.
+ *
+ * Read-only segments share their pages with every other process
+ * running the same executable, if the text cache has room for it.
+ */
+int
+as_map_file(struct addrspace *as, vaddr_t vaddr, size_t memsize,
+	    size_t filesize, struct vnode *v, off_t offset)
+{
+	unsigned int i;
+	struct region *region;
+
+	KASSERT(filesize <= memsize);
+
+	if (filesize == 0) {
+		return 0;
+	}
+
+	// Neighbouring segments can share a page, so look for the
+	// region that was defined for exactly this one
+	for (i = 0; i < regionarray_num(as->as_regions); i++) {
+		region = regionarray_get(as->as_regions, i);
+
+		if (region->r_base != va_round_down_to_page(vaddr) ||
+		    region->r_end != va_round_up_to_page(vaddr + memsize) ||
+		    region->r_vnode != NULL) {
+			continue;
+		}
+
+		VOP_INCREF(v);
+		region->r_vnode = v;
+		region->r_offset = offset;
+		region->r_filestart = vaddr;
+		region->r_fileend = vaddr + filesize;
+
+		if (!(region->r_perms & REGION_W) && textcache_map(v) == 0) {
+			region->r_shared = true;
+		}
+		return 0;
+	}
+
+	return EINVAL;
+}
+
+/*
+ * Read the file-backed parts of the page containing VA into KPAGE,
+ * which the caller has zeroed. Segments can share a page where one
+ * ends and the next begins, so this looks at every region. Sets
+ * *FROMFILE if any of the page came from a file.
+ */
+int
+as_fill_page(struct addrspace *as, vaddr_t va, void *kpage, bool *fromfile)
+{
+	unsigned int i;
+	struct region *region;
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t page, start, end;
+	int result;
+
+	page = va_round_down_to_page(va);
+	*fromfile = false;
+
+	for (i = 0; i < regionarray_num(as->as_regions); i++) {
+		region = regionarray_get(as->as_regions, i);
+
+		if (region->r_vnode == NULL ||
+		    region->r_fileend <= page ||
+		    region->r_filestart >= page + PAGE_SIZE) {
+			continue;
+		}
+
+		start = region->r_filestart > page ? region->r_filestart : page;
+		end = region->r_fileend < page + PAGE_SIZE ?
+			region->r_fileend : page + PAGE_SIZE;
+
+		uio_kinit(&iov, &ku, (char *)kpage + (start - page),
+			  end - start,
+			  region->r_offset + (start - region->r_filestart),
+			  UIO_READ);
+		result = VOP_READ(region->r_vnode, &ku);
+		if (result) {
+			return result;
+		}
+		if (ku.uio_resid != 0) {
+			/* the executable shrank under us */
+			return EIO;
+		}
+
+		*fromfile = true;
+	}
+
+	return 0;
+}
+
 int
 as_prepare_load(struct addrspace *as)
 {
@@ -356,3 +478,238 @@ va_in_as_bounds(struct addrspace *as, vaddr_t va)
 
 	return false;
 }
+
+/*
+ * Reads are allowed from the heap and stack, and from any page that
+ * a region with some permission covers at least part of.
+ */
+bool
+as_va_readable(struct addrspace *as, vaddr_t va)
+{
+	unsigned int i;
+	struct region *region;
+
+	for (i = 0; i < regionarray_num(as->as_regions); i++) {
+		region = regionarray_get(as->as_regions, i);
+
+		if (region->r_perms != 0 &&
+		    va_in_region(va, region->r_base, region->r_end)) {
+			return true;
+		}
+	}
+
+	if (va_in_region(va, as->as_heap_base, as->as_heap_end)) {
+		return true;
+	}
+
+	if (va_in_region(va, as->as_stack_end, USERSTACK)) {
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Writes are allowed to the heap and stack, and to any page that a
+ * writeable region covers at least part of.
+ */
+bool
+as_va_writeable(struct addrspace *as, vaddr_t va)
+{
+	unsigned int i;
+	struct region *region;
+
+	for (i = 0; i < regionarray_num(as->as_regions); i++) {
+		region = regionarray_get(as->as_regions, i);
+
+		if ((region->r_perms & REGION_W) &&
+		    va_in_region(va, region->r_base, region->r_end)) {
+			return true;
+		}
+	}
+
+	if (va_in_region(va, as->as_heap_base, as->as_heap_end)) {
+		return true;
+	}
+
+	if (va_in_region(va, as->as_stack_end, USERSTACK)) {
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * The page holding VA is shared if a shared region covers it and no
+ * writeable one does; if so, hand back the file it comes from.
+ */
+bool
+as_va_shared(struct addrspace *as, vaddr_t va, struct vnode **ret)
+{
+	unsigned int i;
+	struct region *region;
+
+	*ret = NULL;
+
+	for (i = 0; i < regionarray_num(as->as_regions); i++) {
+		region = regionarray_get(as->as_regions, i);
+
+		if (!va_in_region(va, region->r_base, region->r_end)) {
+			continue;
+		}
+		if (region->r_perms & REGION_W) {
+			return false;
+		}
+		if (region->r_shared) {
+			*ret = region->r_vnode;
+		}
+	}
+
+	return *ret != NULL;
+}
+
+/*
+ * Trim REGION's file backing to the part inside the region, and drop
+ * it altogether if there's none left.
+ */
+static
+void
+region_clip_file(struct region *region)
+{
+	if (region->r_vnode == NULL) {
+		return;
+	}
+
+	if (region->r_filestart < region->r_base) {
+		region->r_offset += region->r_base - region->r_filestart;
+		region->r_filestart = region->r_base;
+	}
+	if (region->r_fileend > region->r_end) {
+		region->r_fileend = region->r_end;
+	}
+
+	if (region->r_filestart >= region->r_fileend) {
+		if (region->r_shared) {
+			textcache_unmap(region->r_vnode);
+		}
+		VOP_DECREF(region->r_vnode);
+		region->r_vnode = NULL;
+		region->r_offset = 0;
+		region->r_filestart = 0;
+		region->r_fileend = 0;
+		region->r_shared = false;
+	}
+}
+
+/*
+ * Split every region that VA (page aligned) falls strictly inside
+ * into the part below VA and the part from VA on.
+ */
+static
+int
+as_split_regions(struct addrspace *as, vaddr_t va)
+{
+	int err;
+	unsigned int i;
+	struct region *region, *upper;
+
+	for (i = 0; i < regionarray_num(as->as_regions); i++) {
+		region = regionarray_get(as->as_regions, i);
+
+		if (va <= region->r_base || va >= region->r_end) {
+			continue;
+		}
+
+		upper = kmalloc(sizeof(struct region));
+		if (upper == NULL) {
+			return ENOMEM;
+		}
+
+		*upper = *region;
+		upper->r_base = va;
+		err = regionarray_add(as->as_regions, upper, NULL);
+		if (err) {
+			kfree(upper);
+			return err;
+		}
+		region->r_end = va;
+
+		if (upper->r_vnode != NULL) {
+			VOP_INCREF(upper->r_vnode);
+		}
+		if (upper->r_shared && textcache_map(upper->r_vnode) != 0) {
+			upper->r_shared = false;
+		}
+
+		region_clip_file(region);
+		region_clip_file(upper);
+	}
+
+	return 0;
+}
+
+/*
+ * Give the pages in [VADDR, VADDR+LEN), which must be page aligned
+ * and lie entirely within regions, the permissions PERMS (REGION_*
+ * bits). Regions the range starts or ends partway through are split.
+ * Returns ENOMEM if part of the range isn't in any region.
+ */
+int
+as_protect(struct addrspace *as, vaddr_t vaddr, size_t len, int perms)
+{
+	int err;
+	unsigned int i;
+	struct region *region;
+	vaddr_t va, end;
+
+	KASSERT(vaddr % PAGE_SIZE == 0);
+	KASSERT(len % PAGE_SIZE == 0);
+
+	end = vaddr + len;
+
+	// Check the whole range before changing anything
+	for (va = vaddr; va < end; va += PAGE_SIZE) {
+		for (i = 0; i < regionarray_num(as->as_regions); i++) {
+			region = regionarray_get(as->as_regions, i);
+			if (va_in_region(va, region->r_base, region->r_end)) {
+				break;
+			}
+		}
+		if (i == regionarray_num(as->as_regions)) {
+			return ENOMEM;
+		}
+	}
+
+	// Splitting on its own doesn't change anything visible, so
+	// there's nothing to undo if the second one fails
+	err = as_split_regions(as, vaddr);
+	if (err) {
+		return err;
+	}
+	err = as_split_regions(as, end);
+	if (err) {
+		return err;
+	}
+
+	for (i = 0; i < regionarray_num(as->as_regions); i++) {
+		region = regionarray_get(as->as_regions, i);
+
+		if (region->r_base < vaddr || region->r_end > end) {
+			continue;
+		}
+
+		region->r_perms = perms;
+
+		// Pages that can be written can't be shared
+		if ((perms & REGION_W) && region->r_shared) {
+			textcache_unmap(region->r_vnode);
+			region->r_shared = false;
+		}
+	}
+
+	// The TLB may hold entries the old permissions allowed; only
+	// this CPU can have any, since as_activate flushes the TLB
+	tlb_flush();
+
+	return 0;
+}
@@ -10,6 +10,8 @@
 #include <cpu.h>
 #include <pagetable.h>
 #include <daemon.h>
+#include <objcache.h>
+#include <textcache.h>
 
 // Global coremap struct
 struct cm coremap;
@@ -18,16 +20,301 @@ struct cm coremap;
 void tlb_remove(vaddr_t va);
 void tlb_set_writeable(vaddr_t va, cme_id_t cme_id, bool writeable);
 
+////////////////////////////////////////////////////////////
+// Free-run index
+
+static
+unsigned int
+cm_runs_nwords(unsigned int nslots)
+{
+	return DIVROUNDUP(nslots, 32);
+}
+
+static
+unsigned int
+cm_runs_nleaves(unsigned int nslots)
+{
+	unsigned int nleaves;
+
+	nleaves = 1;
+	while (nleaves < cm_runs_nwords(nslots)) {
+		nleaves *= 2;
+	}
+	return nleaves;
+}
+
+/*
+ * Bytes of storage needed for an index over NSLOTS slots.
+ */
+static
+size_t
+cm_runs_size(unsigned int nslots)
+{
+	return cm_runs_nwords(nslots) * sizeof(uint32_t) +
+		2 * cm_runs_nleaves(nslots) * sizeof(struct cm_runnode);
+}
+
+/*
+ * Recompute the leaf node for bitmap word WORD.
+ */
+static
+void
+cm_runs_leaf(struct cm_runindex *ri, unsigned int word)
+{
+	struct cm_runnode *rn;
+	uint32_t bits;
+	unsigned int i, run;
+
+	rn = &ri->ri_nodes[ri->ri_nleaves + word];
+	bits = (word < ri->ri_nwords) ? ri->ri_bits[word] : 0;
+
+	rn->rn_longest = 0;
+	run = 0;
+	for (i = 0; i < 32; i++) {
+		if (bits & ((uint32_t)1 << i)) {
+			run++;
+			if (run > rn->rn_longest) {
+				rn->rn_longest = run;
+			}
+		}
+		else {
+			run = 0;
+		}
+	}
+	rn->rn_suffix = run;
+
+	i = 0;
+	while (i < 32 && (bits & ((uint32_t)1 << i))) {
+		i++;
+	}
+	rn->rn_prefix = i;
+}
+
+/*
+ * Recompute interior node NODE from its children, each of which
+ * covers HALF slots.
+ */
+static
+void
+cm_runs_pull(struct cm_runindex *ri, unsigned int node, unsigned int half)
+{
+	struct cm_runnode *rn, *l, *r;
+
+	rn = &ri->ri_nodes[node];
+	l = &ri->ri_nodes[2 * node];
+	r = &ri->ri_nodes[2 * node + 1];
+
+	rn->rn_prefix = (l->rn_prefix == half) ?
+		half + r->rn_prefix : l->rn_prefix;
+	rn->rn_suffix = (r->rn_suffix == half) ?
+		half + l->rn_suffix : r->rn_suffix;
+	rn->rn_longest = l->rn_suffix + r->rn_prefix;
+	if (l->rn_longest > rn->rn_longest) {
+		rn->rn_longest = l->rn_longest;
+	}
+	if (r->rn_longest > rn->rn_longest) {
+		rn->rn_longest = r->rn_longest;
+	}
+}
+
+/*
+ * Set up an index over NSLOTS slots in the memory at MEM, with slots
+ * [first, end) set.
+ */
+static
+void
+cm_runs_init(struct cm_runindex *ri, unsigned int nslots, void *mem,
+	     unsigned int first, unsigned int end)
+{
+	unsigned int i, width, half;
+
+	KASSERT(end <= nslots);
+
+	ri->ri_nwords = cm_runs_nwords(nslots);
+	ri->ri_nleaves = cm_runs_nleaves(nslots);
+	ri->ri_bits = mem;
+	ri->ri_nodes = (struct cm_runnode *)(ri->ri_bits + ri->ri_nwords);
+
+	memset(ri->ri_bits, 0, ri->ri_nwords * sizeof(uint32_t));
+	for (i = first; i < end; i++) {
+		ri->ri_bits[i / 32] |= (uint32_t)1 << (i % 32);
+	}
+
+	for (i = 0; i < ri->ri_nleaves; i++) {
+		cm_runs_leaf(ri, i);
+	}
+	half = 32;
+	for (width = ri->ri_nleaves / 2; width >= 1; width /= 2) {
+		for (i = width; i < 2 * width; i++) {
+			cm_runs_pull(ri, i, half);
+		}
+		half *= 2;
+	}
+}
+
+/*
+ * Set or clear the bit for SLOT and fix up the tree above it.
+ */
+static
+void
+cm_runs_update(struct cm_runindex *ri, unsigned int slot, bool set)
+{
+	unsigned int word, node, half;
+	uint32_t mask;
+
+	word = slot / 32;
+	mask = (uint32_t)1 << (slot % 32);
+	KASSERT(word < ri->ri_nwords);
+
+	if (((ri->ri_bits[word] & mask) != 0) == set) {
+		return;
+	}
+	if (set) {
+		ri->ri_bits[word] |= mask;
+	}
+	else {
+		ri->ri_bits[word] &= ~mask;
+	}
+
+	cm_runs_leaf(ri, word);
+	half = 32;
+	for (node = (ri->ri_nleaves + word) / 2; node >= 1; node /= 2) {
+		cm_runs_pull(ri, node, half);
+		half *= 2;
+	}
+}
+
+/*
+ * Find the first run of NSLOTS set bits. Returns CM_NOSLOT if there
+ * isn't one.
+ */
+static
+cme_id_t
+cm_runs_find(struct cm_runindex *ri, unsigned int nslots)
+{
+	struct cm_runnode *l, *r;
+	unsigned int node, offset, span, half, i, run;
+	uint32_t bits;
+
+	if (ri->ri_nodes[1].rn_longest < nslots) {
+		return CM_NOSLOT;
+	}
+
+	node = 1;
+	offset = 0;
+	span = ri->ri_nleaves * 32;
+	while (node < ri->ri_nleaves) {
+		half = span / 2;
+		l = &ri->ri_nodes[2 * node];
+		r = &ri->ri_nodes[2 * node + 1];
+		if (l->rn_longest >= nslots) {
+			node = 2 * node;
+		}
+		else if (l->rn_suffix + r->rn_prefix >= nslots) {
+			return offset + half - l->rn_suffix;
+		}
+		else {
+			node = 2 * node + 1;
+			offset += half;
+		}
+		span = half;
+	}
+
+	/* The run is inside this word */
+	bits = ri->ri_bits[node - ri->ri_nleaves];
+	run = 0;
+	for (i = 0; i < 32; i++) {
+		if (bits & ((uint32_t)1 << i)) {
+			run++;
+			if (run == nslots) {
+				return offset + i + 1 - nslots;
+			}
+		}
+		else {
+			run = 0;
+		}
+	}
+	panic("cm_runs_find: index is inconsistent\n");
+	return CM_NOSLOT;
+}
+
+/*
+ * Find the first run of NSLOTS set bits that starts at or after FROM.
+ * Returns CM_NOSLOT if there isn't one. Used to carry on past a run
+ * that turned out to be unusable; this walks the bits rather than the
+ * tree, skipping empty words, as it's off the common path.
+ */
+static
+cme_id_t
+cm_runs_find_from(struct cm_runindex *ri, unsigned int nslots,
+		  unsigned int from)
+{
+	unsigned int i, run, end;
+	uint32_t bits;
+
+	if (from == 0) {
+		return cm_runs_find(ri, nslots);
+	}
+	if (ri->ri_nodes[1].rn_longest < nslots) {
+		return CM_NOSLOT;
+	}
+
+	run = 0;
+	end = ri->ri_nwords * 32;
+	for (i = from; i < end; i++) {
+		bits = ri->ri_bits[i / 32];
+		if (i % 32 == 0 && bits == 0) {
+			run = 0;
+			i += 31;
+			continue;
+		}
+		if (bits & ((uint32_t)1 << (i % 32))) {
+			run++;
+			if (run == nslots) {
+				return i + 1 - nslots;
+			}
+		}
+		else {
+			run = 0;
+		}
+	}
+	return CM_NOSLOT;
+}
+
+/*
+ * Record whether SLOT is available to the kernel (not a kernel page)
+ * and whether it is outright free.
+ */
+static
+void
+cm_runs_set(cme_id_t slot, bool avail, bool free)
+{
+	if (slot >= coremap.cm_kernel_break) {
+		return;
+	}
+
+	spinlock_acquire(&coremap.cm_runs_spinlock);
+	cm_runs_update(&coremap.cm_avail_runs, slot, avail);
+	cm_runs_update(&coremap.cm_free_runs, slot, free);
+	spinlock_release(&coremap.cm_runs_spinlock);
+}
+
+////////////////////////////////////////////////////////////
+
 void
 cm_init()
 {
 	unsigned int i, ncoremap_bytes, ncoremap_pages, ncmes;
+	size_t nruns_bytes;
 	paddr_t ram_size, start;
 
 	ram_size = ram_getsize();
 	ncmes = (ram_size / PAGE_SIZE);
 	ncoremap_bytes = ncmes * sizeof(struct cme);;
-	ncoremap_pages = DIVROUNDUP(ncoremap_bytes, PAGE_SIZE);
+	// The run indexes live right after the cmes
+	nruns_bytes = cm_runs_size(ncmes);
+	ncoremap_pages = DIVROUNDUP(ncoremap_bytes + 2 * nruns_bytes,
+				    PAGE_SIZE);
 
 	start = ram_stealmem(ncoremap_pages);
 	if (start == 0) {
@@ -42,9 +329,18 @@ cm_init()
 	coremap.cm_kernel_break = (coremap.cm_size / 10) * 8;
 	KASSERT(coremap.cm_kernel_break > 0);
 
-	spinlock_init(&coremap.cm_busy_spinlock);
+	spinlock_init_queued(&coremap.cm_busy_spinlock);
 	spinlock_init(&coremap.cm_page_count_spinlock);
 
+	// Everything below the break but the coremap itself starts free
+	spinlock_init(&coremap.cm_runs_spinlock);
+	cm_runs_init(&coremap.cm_avail_runs, ncmes,
+		     (char *)coremap.cmes + ncoremap_bytes,
+		     ncoremap_pages, coremap.cm_kernel_break);
+	cm_runs_init(&coremap.cm_free_runs, ncmes,
+		     (char *)coremap.cmes + ncoremap_bytes + nruns_bytes,
+		     ncoremap_pages, coremap.cm_kernel_break);
+
 	spinlock_init(&coremap.cm_clock_busy_spinlock);
         coremap.cm_clock_busy = false;
 	coremap.cm_clock_hand = 0;
@@ -119,6 +415,7 @@ cm_capture_slot()
 
 		if (entry.cme_state == S_FREE || (entry.cme_recent == 0 && entry.cme_state != S_KERNEL)) {
 		        cm_evict_page(slot);
+			cm_runs_set(slot, true, false);
 			cm_release_clock_lock();
 
 			return slot;
@@ -144,6 +441,7 @@ cm_capture_slot()
 
 		if (entry.cme_state != S_KERNEL) {
 		        cm_evict_page(slot);
+			cm_runs_set(slot, true, false);
 			cm_release_clock_lock();
 
 			return slot;
@@ -156,40 +454,94 @@ cm_capture_slot()
 	return 0;
 }
 
+/*
+ * Lock slots [start, start + nslots) for the kernel. Fails, leaving
+ * nothing locked, if one of them is busy or has become a kernel page;
+ * the first such slot is handed back in BUSY.
+ */
+static
+bool
+cm_try_capture_run(cme_id_t start, unsigned int nslots, cme_id_t *busy)
+{
+	unsigned int j;
+
+	for (j = 0; j < nslots; j++) {
+		if (!cm_attempt_lock_with_pte(start + j)) {
+			break;
+		}
+
+		if (coremap.cmes[start + j].cme_state == S_KERNEL) {
+			cm_release_lock_with_pte(start + j);
+			break;
+		}
+	}
+
+	if (j < nslots) {
+		cm_release_locks_with_ptes(start, start + j);
+		*busy = start + j;
+		return false;
+	}
+	return true;
+}
+
 cme_id_t
 cm_capture_slots_for_kernel(unsigned int nslots)
 {
-	cme_id_t i, j;
+	cme_id_t start, i, busy;
+	unsigned int from = 0;
+	bool reclaimed = false;
 
 	KASSERT(coremap.cm_kernel_break > nslots);
 
 	cm_acquire_clock_lock();
-	i = 0;
 
-	while (i < coremap.cm_kernel_break - nslots) {
-		for (j = 0; j < nslots; j++) {
-			if (!cm_attempt_lock_with_pte(i + j)) {
-				break;
-			}
+	while (1) {
+		// Prefer a run that needs no evictions
+		spinlock_acquire(&coremap.cm_runs_spinlock);
+		start = cm_runs_find_from(&coremap.cm_free_runs, nslots, from);
+		if (start == CM_NOSLOT) {
+			start = cm_runs_find_from(&coremap.cm_avail_runs,
+						  nslots, from);
+		}
+		spinlock_release(&coremap.cm_runs_spinlock);
 
-			if (coremap.cmes[i + j].cme_state == S_KERNEL) {
-				cm_release_lock_with_pte(i + j);
+		if (start == CM_NOSLOT) {
+			// That was a full pass over memory
+			if (reclaimed) {
 				break;
 			}
+
+			// Kernel pages are directly mapped and can't be
+			// moved, so the only way to make a longer run is
+			// to have the kernel heap give back pages it's
+			// holding onto. Try that once, then make one
+			// more pass from the bottom.
+			cm_release_clock_lock();
+			kheap_reclaim();
+			objcache_reclaim();
+			cm_acquire_clock_lock();
+			reclaimed = true;
+			from = 0;
+			continue;
 		}
 
-		if (j == nslots) {
-			cm_evict_pages(i, i + j);
+		if (cm_try_capture_run(start, nslots, &busy)) {
+			cm_evict_pages(start, start + nslots);
+			for (i = start; i < start + nslots; i++) {
+				cm_runs_set(i, false, false);
+			}
 			cm_release_clock_lock();
-			return i;
-		} else {
-			cm_release_locks_with_ptes(i, i + j);
-			i += j + 1;
+			return start;
 		}
+
+		// Something in the run was busy; no run containing it
+		// will do right now, so carry on past it
+		KASSERT(busy >= start && busy < start + nslots);
+		from = busy + 1;
 	}
 
-	panic("Could not capture contiguous slots for kernel allocation\n");
-	return 0;
+	cm_release_clock_lock();
+	return CM_NOSLOT;
 }
 
 static
@@ -228,6 +580,11 @@ cm_tlb_shootdown(vaddr_t va, cme_id_t cme_id, enum tlbshootdown_type type)
  * In the latter case, we find a free swap slot and set its index on
  * the page table entry. Finally, we update the page table entry to
  * indicate that it is no longer present in main memory.
+ *
+ * Pages still holding what was read from an executable are just
+ * dropped; the page table entry goes back to lazy, and the next
+ * fault reads them in again. Shared text pages have no page table
+ * entry at all and are just taken out of the text cache.
  */
 void
 cm_evict_page(cme_id_t cme_id)
@@ -243,6 +600,16 @@ cm_evict_page(cme_id_t cme_id)
 		return;
 	}
 
+	if (cme->cme_state == S_TEXT) {
+		textcache_forget(cme_id);
+
+		// Any process running the executable may have it mapped
+		va = OFFSETS_TO_VA(cme->cme_l1_offset, cme->cme_l2_offset);
+		tlb_remove(va);
+		cm_tlb_shootdown(va, cme_id, TS_EVICT);
+		return;
+	}
+
         as = cme->cme_as;
 	KASSERT(as != NULL);
 
@@ -276,6 +643,14 @@ cm_evict_page(cme_id_t cme_id)
 		pte_set_swap_id(pte, cme->cme_swap_id);
 		swap_out(swap_id, cme_id);
 		break;
+	case S_FILE:
+		cme->cme_state = S_CLEAN;
+		pte->pte_state = S_LAZY;
+		pt_release_lock(as->as_pt, pte);
+		return;
+	case S_TEXT:
+		// Handled above
+		break;
 	}
 
 	cme->cme_state = S_CLEAN;
@@ -327,7 +702,8 @@ cm_free_page(cme_id_t cme_id)
 	cme = &coremap.cmes[cme_id];
 
 	// We do not need to send a TLB shootdown since there is no shared
-	// user memory
+	// user memory (shared text pages are evicted, which shoots them
+	// down, before they're freed)
 	tlb_remove(OFFSETS_TO_VA(cme->cme_l1_offset, cme->cme_l2_offset));
 
 	switch(cme->cme_state) {
@@ -337,6 +713,8 @@ cm_free_page(cme_id_t cme_id)
 		// Kernel memory is directly mapped, so can't be in swap
 		break;
 	case S_UNSWAPPED:
+	case S_FILE:
+	case S_TEXT:
 		// The page has never left main memory, so there is no
 		// swap entry to release
 		break;
@@ -347,6 +725,7 @@ cm_free_page(cme_id_t cme_id)
 	}
 
 	cme->cme_state = S_FREE;
+	cm_runs_set(cme_id, true, true);
 }
 
 bool
@@ -427,7 +806,8 @@ cm_attempt_lock_with_pte(cme_id_t cme_id)
 	cme = &coremap.cmes[cme_id];
 	old_cme = *cme;
 
-	if (cme->cme_state == S_KERNEL || cme->cme_state == S_FREE) {
+	if (cme->cme_state == S_KERNEL || cme->cme_state == S_FREE ||
+	    cme->cme_state == S_TEXT) {
 		return true;
 	}
 
@@ -464,6 +844,7 @@ cm_release_lock_with_pte(cme_id_t cme_id)
 	switch(cme->cme_state) {
 	case S_KERNEL:
 	case S_FREE:
+	case S_TEXT:
 		cm_release_lock(cme_id);
 		return;
 	}
@@ -30,6 +30,9 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
 #include <machine/vm.h>
 
@@ -160,13 +163,58 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the whole subpage allocator. Most traffic
+ * never gets this far; see the per-cpu magazine layer below.
  */
 
-static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
+static struct spinlock kmalloc_spinlock = SPINLOCK_QUEUED_INITIALIZER;
+
+////////////////////////////////////////
+
+/*
+ * Block type of each physical page, so kfree can find the size of a
+ * block without taking kmalloc_spinlock and walking allbase. Entries
+ * are 0 for pages that aren't subpage pages and blocktype+1 for ones
+ * that are. They're written under kmalloc_spinlock when a subpage
+ * page is made or released; reading one for a block that's still
+ * allocated needs no lock, because the block pins its page.
+ *
+ * As with NUM_PAGEREFPAGES below, we size this for System/161's 16M
+ * RAM limit. Pages past the end just don't get recorded and kfree
+ * falls back to the slow path for them.
+ */
+
+#define PAGETYPE_MAXPAGES ((16*1024*1024) / PAGE_SIZE)
+
+static uint8_t pagetypes[PAGETYPE_MAXPAGES];
+
+static
+void
+pagetype_set(vaddr_t pageaddr, int blktype)
+{
+	paddr_t ppn;
+
+	ppn = KVADDR_TO_PADDR(pageaddr) / PAGE_SIZE;
+	if (ppn < PAGETYPE_MAXPAGES) {
+		pagetypes[ppn] = blktype + 1;
+	}
+}
+
+/*
+ * Returns the block type of the subpage page holding ADDR, or -1.
+ */
+static
+int
+pagetype_get(vaddr_t addr)
+{
+	paddr_t ppn;
+
+	ppn = KVADDR_TO_PADDR(addr) / PAGE_SIZE;
+	if (ppn >= PAGETYPE_MAXPAGES) {
+		return -1;
+	}
+	return (int)pagetypes[ppn] - 1;
+}
 
 ////////////////////////////////////////
 
@@ -993,6 +1041,7 @@ subpage_kmalloc(size_t sz
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
 	pr->nfree = PAGE_SIZE / sizes[blktype];
+	pagetype_set(prpage, blktype);
 
 	/*
 	 * Note: fl is volatile because the MIPS toolchain we were
@@ -1143,6 +1192,7 @@ subpage_kfree(void *ptr)
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
 		freepageref(pr);
+		pagetype_set(prpage, -1);
 		/* Call free_kpages without kmalloc_spinlock. */
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
@@ -1163,6 +1213,342 @@ subpage_kfree(void *ptr)
 //
 ////////////////////////////////////////////////////////////
 
+////////////////////////////////////////////////////////////
+//
+// Per-cpu magazine layer.
+//
+// In front of the subpage allocator each cpu keeps two magazines
+// per block size: small stacks of free blocks that it can hand out
+// and take back with interrupts off and no lock at all. When both
+// are exhausted (or both full) the cpu swaps a magazine with the
+// depot, which keeps lists of full and empty magazines per block
+// size under its own spinlock. Only when the depot can't help does
+// the request go through to the subpage allocator and
+// kmalloc_spinlock.
+//
+// Blocks sitting in magazines are still allocated as far as the
+// subpage allocator is concerned, so they aren't deadbeefed and they
+// keep their pages from being released. To bound that, magazines
+// hold at most a page's worth of blocks and the depot keeps at most
+// DEPOT_MAXFULL full ones per size; past that a full magazine is
+// emptied back into the subpage allocator.
+//
+// With GUARDS or LABELS every block carries per-allocation state
+// that has to be set up and checked by the subpage allocator, so the
+// magazine layer is compiled out.
+//
+
+#if !defined(GUARDS) && !defined(LABELS)
+#define MAGAZINES
+#endif
+
+#ifdef MAGAZINES
+
+/*
+ * MAGAZINE_ROUNDS is chosen so a magazine exactly fills a 128-byte
+ * block on a 32-bit machine. System/161 supports at most 32 cpus.
+ */
+#define MAGAZINE_ROUNDS 30
+#define MAGAZINE_MAXCPUS 32
+#define DEPOT_MAXFULL 4
+
+struct magazine {
+	struct magazine *mag_next;
+	unsigned mag_rounds;
+	void *mag_objs[MAGAZINE_ROUNDS];
+};
+
+struct magcache {
+	struct magazine *mc_loaded;
+	struct magazine *mc_previous;
+};
+
+struct depot {
+	struct magazine *dp_full;
+	struct magazine *dp_empty;
+	unsigned dp_nfull;
+};
+
+static struct magcache magcaches[MAGAZINE_MAXCPUS][NSIZES];
+static struct depot depots[NSIZES];
+static struct spinlock depot_spinlock = SPINLOCK_INITIALIZER;
+
+/*
+ * Number of blocks a magazine for block type BLKTYPE holds.
+ */
+static
+unsigned
+magazine_capacity(unsigned blktype)
+{
+	unsigned perpage;
+
+	perpage = PAGE_SIZE / sizes[blktype];
+	return perpage < MAGAZINE_ROUNDS ? perpage : MAGAZINE_ROUNDS;
+}
+
+/*
+ * Get the current cpu's cache for block type BLKTYPE, or NULL if we
+ * don't have one. Interrupts must be off.
+ */
+static
+struct magcache *
+magcache_get(unsigned blktype)
+{
+	if (!CURCPU_EXISTS() || curcpu->c_number >= MAGAZINE_MAXCPUS) {
+		return NULL;
+	}
+	return &magcaches[curcpu->c_number][blktype];
+}
+
+/*
+ * Make a new empty magazine and put it in the depot. This may sleep,
+ * so only the kmalloc path calls it.
+ */
+static
+bool
+magazine_create(unsigned blktype)
+{
+	struct magazine *mag;
+
+	mag = subpage_kmalloc(sizeof(*mag));
+	if (mag == NULL) {
+		return false;
+	}
+	mag->mag_rounds = 0;
+
+	spinlock_acquire(&depot_spinlock);
+	mag->mag_next = depots[blktype].dp_empty;
+	depots[blktype].dp_empty = mag;
+	spinlock_release(&depot_spinlock);
+	return true;
+}
+
+/*
+ * Hand all the blocks in a full magazine back to the subpage
+ * allocator and put the magazine in the depot as an empty one.
+ */
+static
+void
+magazine_drain(struct magazine *mag, unsigned blktype)
+{
+	unsigned i;
+
+	for (i=0; i<mag->mag_rounds; i++) {
+		if (subpage_kfree(mag->mag_objs[i])) {
+			panic("kfree: magazine held a foreign block %p\n",
+			      mag->mag_objs[i]);
+		}
+	}
+	mag->mag_rounds = 0;
+
+	spinlock_acquire(&depot_spinlock);
+	mag->mag_next = depots[blktype].dp_empty;
+	depots[blktype].dp_empty = mag;
+	spinlock_release(&depot_spinlock);
+}
+
+/*
+ * Get a block of type BLKTYPE from the current cpu's magazines.
+ * Returns NULL if there isn't one cached anywhere.
+ */
+static
+void *
+magazine_alloc(unsigned blktype)
+{
+	struct magcache *mc;
+	struct magazine *mag;
+	void *ret;
+	int s;
+
+	s = splhigh();
+	mc = magcache_get(blktype);
+	if (mc == NULL) {
+		splx(s);
+		return NULL;
+	}
+
+	if (mc->mc_loaded == NULL || mc->mc_loaded->mag_rounds == 0) {
+		if (mc->mc_previous != NULL &&
+		    mc->mc_previous->mag_rounds > 0) {
+			mag = mc->mc_previous;
+			mc->mc_previous = mc->mc_loaded;
+			mc->mc_loaded = mag;
+		}
+		else {
+			/* Trade an empty magazine for a full one. */
+			spinlock_acquire(&depot_spinlock);
+			mag = depots[blktype].dp_full;
+			if (mag != NULL) {
+				depots[blktype].dp_full = mag->mag_next;
+				depots[blktype].dp_nfull--;
+				if (mc->mc_previous != NULL) {
+					mc->mc_previous->mag_next =
+						depots[blktype].dp_empty;
+					depots[blktype].dp_empty =
+						mc->mc_previous;
+				}
+			}
+			spinlock_release(&depot_spinlock);
+
+			if (mag == NULL) {
+				splx(s);
+				/*
+				 * Nothing cached. Since we're allowed
+				 * to sleep here, stock the depot with
+				 * an empty magazine if it has none, so
+				 * kfree never needs to make one.
+				 */
+				if (depots[blktype].dp_empty == NULL) {
+					(void)magazine_create(blktype);
+				}
+				return NULL;
+			}
+			mc->mc_previous = mc->mc_loaded;
+			mc->mc_loaded = mag;
+		}
+	}
+
+	mag = mc->mc_loaded;
+	ret = mag->mag_objs[--mag->mag_rounds];
+	splx(s);
+	return ret;
+}
+
+/*
+ * Put block PTR of type BLKTYPE into the current cpu's magazines.
+ * Returns false if it couldn't be cached and should be freed to the
+ * subpage allocator instead.
+ */
+static
+bool
+magazine_free(void *ptr, unsigned blktype)
+{
+	struct magcache *mc;
+	struct magazine *mag, *drain;
+	unsigned capacity;
+	int s;
+
+	capacity = magazine_capacity(blktype);
+
+	drain = NULL;
+	s = splhigh();
+	mc = magcache_get(blktype);
+	if (mc == NULL) {
+		splx(s);
+		return false;
+	}
+
+	if (mc->mc_loaded == NULL || mc->mc_loaded->mag_rounds == capacity) {
+		if (mc->mc_previous != NULL &&
+		    mc->mc_previous->mag_rounds < capacity) {
+			mag = mc->mc_previous;
+			mc->mc_previous = mc->mc_loaded;
+			mc->mc_loaded = mag;
+		}
+		else {
+			/* Trade a full magazine for an empty one. */
+			spinlock_acquire(&depot_spinlock);
+			mag = depots[blktype].dp_empty;
+			if (mag != NULL) {
+				depots[blktype].dp_empty = mag->mag_next;
+				if (mc->mc_previous == NULL) {
+					/* nothing to give back */
+				}
+				else if (depots[blktype].dp_nfull <
+					 DEPOT_MAXFULL) {
+					mc->mc_previous->mag_next =
+						depots[blktype].dp_full;
+					depots[blktype].dp_full =
+						mc->mc_previous;
+					depots[blktype].dp_nfull++;
+				}
+				else {
+					drain = mc->mc_previous;
+				}
+			}
+			spinlock_release(&depot_spinlock);
+
+			if (mag == NULL) {
+				splx(s);
+				/*
+				 * No empty magazines anywhere. Don't
+				 * make one here: that may need to get
+				 * a page, and kfree must not sleep.
+				 * The block goes to the subpage
+				 * allocator instead.
+				 */
+				return false;
+			}
+			mc->mc_previous = mc->mc_loaded;
+			mc->mc_loaded = mag;
+		}
+	}
+
+	mag = mc->mc_loaded;
+	KASSERT(mag->mag_rounds < capacity);
+	mag->mag_objs[mag->mag_rounds++] = ptr;
+	splx(s);
+
+	if (drain != NULL) {
+		magazine_drain(drain, blktype);
+	}
+	return true;
+}
+
+#endif /* MAGAZINES */
+
+/*
+ * Give the blocks cached in the depot and in this cpu's magazines
+ * back to the subpage allocator. Other cpus' magazines can't be
+ * touched from here and are left alone.
+ */
+void
+kheap_reclaim(void)
+{
+#ifdef MAGAZINES
+	struct magcache *mc;
+	struct magazine *mag, *loaded, *previous;
+	unsigned i;
+	int s;
+
+	for (i=0; i<NSIZES; i++) {
+		s = splhigh();
+		mc = magcache_get(i);
+		loaded = previous = NULL;
+		if (mc != NULL) {
+			loaded = mc->mc_loaded;
+			previous = mc->mc_previous;
+			mc->mc_loaded = mc->mc_previous = NULL;
+		}
+		splx(s);
+
+		if (loaded != NULL) {
+			magazine_drain(loaded, i);
+		}
+		if (previous != NULL) {
+			magazine_drain(previous, i);
+		}
+
+		while (1) {
+			spinlock_acquire(&depot_spinlock);
+			mag = depots[i].dp_full;
+			if (mag != NULL) {
+				depots[i].dp_full = mag->mag_next;
+				depots[i].dp_nfull--;
+			}
+			spinlock_release(&depot_spinlock);
+			if (mag == NULL) {
+				break;
+			}
+			magazine_drain(mag, i);
+		}
+	}
+#endif
+}
+
+//
+////////////////////////////////////////////////////////////
+
 /*
  * Allocate a block of size SZ. Redirect either to subpage_kmalloc or
  * alloc_kpages depending on how big SZ is.
@@ -1199,6 +1585,17 @@ kmalloc(size_t sz)
 		return (void *)address;
 	}
 
+#ifdef MAGAZINES
+	{
+		void *ptr;
+
+		ptr = magazine_alloc(blocktype(sz));
+		if (ptr != NULL) {
+			return ptr;
+		}
+	}
+#endif
+
 #ifdef LABELS
 	return subpage_kmalloc(sz, label);
 #else
@@ -1212,12 +1609,29 @@ kmalloc(size_t sz)
 void
 kfree(void *ptr)
 {
+#ifdef MAGAZINES
+	int blktype;
+#endif
+
 	/*
-	 * Try subpage first; if that fails, assume it's a big allocation.
+	 * Try the magazines, then subpage; if that fails, assume it's a
+	 * big allocation.
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+#ifdef MAGAZINES
+	blktype = pagetype_get((vaddr_t)ptr);
+	if (blktype >= 0) {
+		if (((vaddr_t)ptr % PAGE_SIZE) % sizes[blktype] != 0) {
+			panic("kfree: subpage free of invalid addr %p\n", ptr);
+		}
+		if (magazine_free(ptr, blktype)) {
+			return;
+		}
+	}
+#endif
+	if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
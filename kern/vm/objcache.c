@@ -0,0 +1,437 @@
+/*
+ * Copyright (c) 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Object caches (slab allocator).
+ *
+ * Each slab is one page, laid out as a struct objslab header, a
+ * stack of the indexes of the slab's free objects, and then the
+ * objects themselves. Because the free list is kept outside the
+ * objects, a free object's contents are left exactly as the caller
+ * (or the constructor) left them.
+ *
+ * A cache keeps its slabs on three lists: partial (some objects
+ * free), full (none free), and empty (all free). Allocation prefers
+ * partial slabs so empty ones stay empty and can be given back; up to
+ * OBJCACHE_MAXEMPTY empty slabs are kept on hand to absorb bursts.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <objcache.h>
+
+#define OBJCACHE_ALIGN    8
+#define OBJCACHE_MAXEMPTY 1
+
+struct objslab {
+	struct objcache *os_cache;
+	struct objslab *os_next;
+	struct objslab *os_prev;
+	unsigned os_nfree;
+	/* followed by uint16_t freestack[oc_perslab], then the objects */
+};
+
+#define OS_FREESTACK(os) ((uint16_t *)((os) + 1))
+#define OS_OBJ(oc, os, i) \
+	((void *)((vaddr_t)(os) + (oc)->oc_firstobj + (i) * (oc)->oc_objsize))
+
+struct objcache {
+	char *oc_name;
+	size_t oc_objsize;		/* object size, rounded up */
+	unsigned oc_perslab;		/* objects per slab */
+	size_t oc_firstobj;		/* offset of first object in slab */
+	void (*oc_ctor)(void *obj);
+	void (*oc_dtor)(void *obj);
+	struct objcache *oc_next;	/* on allcaches */
+
+	struct spinlock oc_lock;	/* protects the following */
+	struct objslab *oc_partial;
+	struct objslab *oc_full;
+	struct objslab *oc_empty;
+	unsigned oc_nempty;
+
+	/* statistics, also protected by oc_lock */
+	unsigned oc_nslabs;		/* slabs currently held */
+	unsigned oc_inuse;		/* objects currently allocated */
+	unsigned long oc_allocs;	/* objcache_alloc calls */
+	unsigned long oc_frees;		/* objcache_free calls */
+	unsigned long oc_slabsmade;	/* slabs gotten from the VM system */
+	unsigned long oc_slabsfreed;	/* slabs given back */
+};
+
+static struct objcache *allcaches;
+static struct spinlock allcaches_lock = SPINLOCK_INITIALIZER;
+
+////////////////////////////////////////////////////////////
+// slab lists
+
+static
+void
+objslab_insert(struct objslab **list, struct objslab *os)
+{
+	os->os_prev = NULL;
+	os->os_next = *list;
+	if (*list != NULL) {
+		(*list)->os_prev = os;
+	}
+	*list = os;
+}
+
+static
+void
+objslab_remove(struct objslab **list, struct objslab *os)
+{
+	if (os->os_prev != NULL) {
+		os->os_prev->os_next = os->os_next;
+	}
+	else {
+		KASSERT(*list == os);
+		*list = os->os_next;
+	}
+	if (os->os_next != NULL) {
+		os->os_next->os_prev = os->os_prev;
+	}
+	os->os_next = os->os_prev = NULL;
+}
+
+////////////////////////////////////////////////////////////
+// slabs
+
+/*
+ * Get a page from the VM system and make it into a slab of
+ * constructed objects. Called without the cache lock, as both
+ * alloc_kpages and the constructor may sleep.
+ */
+static
+struct objslab *
+objslab_create(struct objcache *oc)
+{
+	struct objslab *os;
+	vaddr_t va;
+	unsigned i;
+
+	va = alloc_kpages(1);
+	if (va == 0) {
+		return NULL;
+	}
+	os = (struct objslab *)va;
+	os->os_cache = oc;
+	os->os_next = os->os_prev = NULL;
+	os->os_nfree = oc->oc_perslab;
+	for (i=0; i<oc->oc_perslab; i++) {
+		/* hand out low indexes first */
+		OS_FREESTACK(os)[i] = oc->oc_perslab - 1 - i;
+		if (oc->oc_ctor != NULL) {
+			oc->oc_ctor(OS_OBJ(oc, os, i));
+		}
+	}
+	return os;
+}
+
+/*
+ * Destroy an empty slab and give its page back. Called without the
+ * cache lock.
+ */
+static
+void
+objslab_destroy(struct objcache *oc, struct objslab *os)
+{
+	unsigned i;
+
+	KASSERT(os->os_nfree == oc->oc_perslab);
+	if (oc->oc_dtor != NULL) {
+		for (i=0; i<oc->oc_perslab; i++) {
+			oc->oc_dtor(OS_OBJ(oc, os, i));
+		}
+	}
+	free_kpages((vaddr_t)os);
+}
+
+////////////////////////////////////////////////////////////
+// caches
+
+/*
+ * Create a cache.
+ */
+struct objcache *
+objcache_create(const char *name, size_t size,
+		void (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct objcache *oc;
+	size_t objsize, firstobj;
+	unsigned perslab;
+
+	KASSERT(size > 0 && size <= OBJCACHE_MAXSIZE);
+
+	objsize = ROUNDUP(size, OBJCACHE_ALIGN);
+	perslab = (PAGE_SIZE - sizeof(struct objslab)) /
+		(objsize + sizeof(uint16_t));
+	while (1) {
+		firstobj = ROUNDUP(sizeof(struct objslab) +
+				   perslab * sizeof(uint16_t),
+				   OBJCACHE_ALIGN);
+		if (firstobj + perslab * objsize <= PAGE_SIZE) {
+			break;
+		}
+		perslab--;
+	}
+	KASSERT(perslab > 0);
+
+	oc = kmalloc(sizeof(*oc));
+	if (oc == NULL) {
+		return NULL;
+	}
+	oc->oc_name = kstrdup(name);
+	if (oc->oc_name == NULL) {
+		kfree(oc);
+		return NULL;
+	}
+	oc->oc_objsize = objsize;
+	oc->oc_perslab = perslab;
+	oc->oc_firstobj = firstobj;
+	oc->oc_ctor = ctor;
+	oc->oc_dtor = dtor;
+
+	spinlock_init(&oc->oc_lock);
+	oc->oc_partial = NULL;
+	oc->oc_full = NULL;
+	oc->oc_empty = NULL;
+	oc->oc_nempty = 0;
+
+	oc->oc_nslabs = 0;
+	oc->oc_inuse = 0;
+	oc->oc_allocs = 0;
+	oc->oc_frees = 0;
+	oc->oc_slabsmade = 0;
+	oc->oc_slabsfreed = 0;
+
+	spinlock_acquire(&allcaches_lock);
+	oc->oc_next = allcaches;
+	allcaches = oc;
+	spinlock_release(&allcaches_lock);
+
+	return oc;
+}
+
+/*
+ * Destroy a cache. Everything must have been freed.
+ */
+void
+objcache_destroy(struct objcache *oc)
+{
+	struct objcache **ocp;
+	struct objslab *os;
+
+	spinlock_acquire(&allcaches_lock);
+	for (ocp = &allcaches; *ocp != oc; ocp = &(*ocp)->oc_next) {
+		KASSERT(*ocp != NULL);
+	}
+	*ocp = oc->oc_next;
+	spinlock_release(&allcaches_lock);
+
+	KASSERT(oc->oc_partial == NULL);
+	KASSERT(oc->oc_full == NULL);
+	KASSERT(oc->oc_inuse == 0);
+
+	while (oc->oc_empty != NULL) {
+		os = oc->oc_empty;
+		objslab_remove(&oc->oc_empty, os);
+		objslab_destroy(oc, os);
+	}
+
+	spinlock_cleanup(&oc->oc_lock);
+	kfree(oc->oc_name);
+	kfree(oc);
+}
+
+/*
+ * Allocate an object.
+ */
+void *
+objcache_alloc(struct objcache *oc)
+{
+	struct objslab *os, *newslab;
+	void *ret;
+
+	spinlock_acquire(&oc->oc_lock);
+	while (1) {
+		if (oc->oc_partial != NULL) {
+			os = oc->oc_partial;
+			break;
+		}
+		if (oc->oc_empty != NULL) {
+			os = oc->oc_empty;
+			objslab_remove(&oc->oc_empty, os);
+			oc->oc_nempty--;
+			objslab_insert(&oc->oc_partial, os);
+			break;
+		}
+
+		/*
+		 * Need a new slab. Drop the lock to make it; somebody
+		 * else may free something in the meantime, in which
+		 * case we just keep the new slab as an empty one.
+		 */
+		spinlock_release(&oc->oc_lock);
+		newslab = objslab_create(oc);
+		if (newslab == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&oc->oc_lock);
+		objslab_insert(&oc->oc_empty, newslab);
+		oc->oc_nempty++;
+		oc->oc_nslabs++;
+		oc->oc_slabsmade++;
+	}
+
+	KASSERT(os->os_nfree > 0);
+	os->os_nfree--;
+	ret = OS_OBJ(oc, os, OS_FREESTACK(os)[os->os_nfree]);
+	if (os->os_nfree == 0) {
+		objslab_remove(&oc->oc_partial, os);
+		objslab_insert(&oc->oc_full, os);
+	}
+	oc->oc_inuse++;
+	oc->oc_allocs++;
+	spinlock_release(&oc->oc_lock);
+
+	return ret;
+}
+
+/*
+ * Free an object.
+ */
+void
+objcache_free(struct objcache *oc, void *obj)
+{
+	struct objslab *os, *victim = NULL;
+	vaddr_t offset;
+	unsigned index;
+
+	os = (struct objslab *)((vaddr_t)obj & PAGE_FRAME);
+	KASSERT(os->os_cache == oc);
+	offset = (vaddr_t)obj - (vaddr_t)os - oc->oc_firstobj;
+	index = offset / oc->oc_objsize;
+	if ((vaddr_t)obj < (vaddr_t)os + oc->oc_firstobj ||
+	    offset % oc->oc_objsize != 0 || index >= oc->oc_perslab) {
+		panic("objcache_free: %s: invalid object %p\n",
+		      oc->oc_name, obj);
+	}
+
+	spinlock_acquire(&oc->oc_lock);
+	KASSERT(os->os_nfree < oc->oc_perslab);
+	OS_FREESTACK(os)[os->os_nfree++] = index;
+	if (os->os_nfree == 1) {
+		objslab_remove(&oc->oc_full, os);
+		objslab_insert(&oc->oc_partial, os);
+	}
+	if (os->os_nfree == oc->oc_perslab) {
+		objslab_remove(&oc->oc_partial, os);
+		if (oc->oc_nempty < OBJCACHE_MAXEMPTY) {
+			objslab_insert(&oc->oc_empty, os);
+			oc->oc_nempty++;
+		}
+		else {
+			victim = os;
+			oc->oc_nslabs--;
+			oc->oc_slabsfreed++;
+		}
+	}
+	KASSERT(oc->oc_inuse > 0);
+	oc->oc_inuse--;
+	oc->oc_frees++;
+	spinlock_release(&oc->oc_lock);
+
+	if (victim != NULL) {
+		objslab_destroy(oc, victim);
+	}
+}
+
+/*
+ * Give back every cache's empty slabs. The slabs are collected under
+ * the locks and destroyed afterwards, as destructors may sleep. (This
+ * must not race with objcache_destroy; caches are expected to live
+ * as long as the subsystems that make them.)
+ */
+void
+objcache_reclaim(void)
+{
+	struct objcache *oc;
+	struct objslab *victims, *os;
+
+	victims = NULL;
+	spinlock_acquire(&allcaches_lock);
+	for (oc = allcaches; oc != NULL; oc = oc->oc_next) {
+		spinlock_acquire(&oc->oc_lock);
+		while (oc->oc_empty != NULL) {
+			os = oc->oc_empty;
+			objslab_remove(&oc->oc_empty, os);
+			oc->oc_nempty--;
+			oc->oc_nslabs--;
+			oc->oc_slabsfreed++;
+			os->os_next = victims;
+			victims = os;
+		}
+		spinlock_release(&oc->oc_lock);
+	}
+	spinlock_release(&allcaches_lock);
+
+	while (victims != NULL) {
+		os = victims;
+		victims = os->os_next;
+		objslab_destroy(os->os_cache, os);
+	}
+}
+
+/*
+ * Print statistics for all caches.
+ */
+void
+objcache_printstats(void)
+{
+	struct objcache *oc;
+
+	kprintf("%-16s %5s %4s %6s %6s %10s %10s %7s %7s\n",
+		"cache", "size", "per", "slabs", "inuse",
+		"allocs", "frees", "made", "freed");
+
+	spinlock_acquire(&allcaches_lock);
+	for (oc = allcaches; oc != NULL; oc = oc->oc_next) {
+		spinlock_acquire(&oc->oc_lock);
+		kprintf("%-16s %5zu %4u %6u %6u %10lu %10lu %7lu %7lu\n",
+			oc->oc_name, oc->oc_objsize, oc->oc_perslab,
+			oc->oc_nslabs, oc->oc_inuse,
+			oc->oc_allocs, oc->oc_frees,
+			oc->oc_slabsmade, oc->oc_slabsfreed);
+		spinlock_release(&oc->oc_lock);
+	}
+	spinlock_release(&allcaches_lock);
+}
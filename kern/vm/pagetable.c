@@ -190,8 +190,13 @@ pagetable_clone(struct pagetable *old_pt, struct pagetable *new_pt)
 			case S_LAZY:
 				break;
 			case S_PRESENT:
-				new_slot = pagetable_assign_swap_slot_to_pte(new_pte);
 				old_cme_id = PA_TO_CME_ID(pte_get_pa(old_pte));
+				if (coremap.cmes[old_cme_id].cme_state == S_FILE) {
+					// The child can read it from the file
+					new_pte->pte_state = S_LAZY;
+					break;
+				}
+				new_slot = pagetable_assign_swap_slot_to_pte(new_pte);
 				swap_out(new_slot, old_cme_id);
 				new_pte->pte_state = S_SWAPPED;
 				break;
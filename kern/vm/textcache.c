@@ -0,0 +1,359 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <thread.h>
+#include <addrspace.h>
+#include <coremap.h>
+#include <tlb.h>
+#include <vnode.h>
+#include <textcache.h>
+
+#define TC_PAGES	1024	// pages cached at once
+#define TC_BUCKETS	256
+#define TC_VNODES	32	// executables in use at once
+#define TC_NONE		((unsigned int)-1)
+
+struct tc_page {
+	struct vnode *tp_vnode;		// NULL if the entry is unused
+	vaddr_t tp_va;			// page aligned
+	cme_id_t tp_slot;
+	unsigned int tp_next;		// hash chain, or the free list
+};
+
+struct tc_mapping {
+	struct vnode *tm_vnode;		// NULL if the entry is unused
+	unsigned int tm_count;		// regions sharing its pages
+};
+
+// Protected by tc_spinlock. An S_TEXT cme keeps the index of its
+// entry in cme_swap_id. tc_generation goes up whenever a file's
+// pages are invalidated, so a fault that read a page in from before
+// the change doesn't put it in the cache afterwards.
+static struct spinlock tc_spinlock;
+static unsigned int tc_generation;
+static struct tc_page tc_pages[TC_PAGES];
+static unsigned int tc_buckets[TC_BUCKETS];
+static unsigned int tc_freelist;
+
+// Protected by tc_maplock
+static struct lock *tc_maplock;
+static struct tc_mapping tc_mappings[TC_VNODES];
+
+void
+textcache_bootstrap(void)
+{
+	unsigned int i;
+
+	spinlock_init(&tc_spinlock);
+
+	for (i = 0; i < TC_BUCKETS; i++) {
+		tc_buckets[i] = TC_NONE;
+	}
+
+	for (i = 0; i < TC_PAGES; i++) {
+		tc_pages[i].tp_vnode = NULL;
+		tc_pages[i].tp_next = (i + 1 < TC_PAGES) ? i + 1 : TC_NONE;
+	}
+	tc_freelist = 0;
+	tc_generation = 0;
+
+	for (i = 0; i < TC_VNODES; i++) {
+		tc_mappings[i].tm_vnode = NULL;
+		tc_mappings[i].tm_count = 0;
+	}
+
+	tc_maplock = lock_create("textcache");
+	if (tc_maplock == NULL) {
+		panic("Could not create textcache lock\n");
+	}
+}
+
+static
+unsigned int
+tc_hash(struct vnode *v, vaddr_t va)
+{
+	return (((uintptr_t)v >> 4) ^ (va / PAGE_SIZE)) % TC_BUCKETS;
+}
+
+/*
+ * Find the entry for page VA of V. Call with tc_spinlock held.
+ */
+static
+unsigned int
+tc_lookup(struct vnode *v, vaddr_t va)
+{
+	unsigned int ix;
+
+	ix = tc_buckets[tc_hash(v, va)];
+	while (ix != TC_NONE) {
+		if (tc_pages[ix].tp_vnode == v && tc_pages[ix].tp_va == va) {
+			return ix;
+		}
+		ix = tc_pages[ix].tp_next;
+	}
+	return TC_NONE;
+}
+
+/*
+ * Take entry IX off its hash chain and free it. Call with
+ * tc_spinlock held.
+ */
+static
+void
+tc_remove(unsigned int ix)
+{
+	struct tc_page *tp;
+	unsigned int *link;
+
+	tp = &tc_pages[ix];
+	KASSERT(tp->tp_vnode != NULL);
+
+	link = &tc_buckets[tc_hash(tp->tp_vnode, tp->tp_va)];
+	while (*link != ix) {
+		KASSERT(*link != TC_NONE);
+		link = &tc_pages[*link].tp_next;
+	}
+	*link = tp->tp_next;
+
+	tp->tp_vnode = NULL;
+	tp->tp_next = tc_freelist;
+	tc_freelist = ix;
+}
+
+/*
+ * Evict and free every cached page of V.
+ */
+static
+void
+tc_purge(struct vnode *v)
+{
+	unsigned int i;
+	cme_id_t slot;
+
+	spinlock_acquire(&tc_spinlock);
+	i = 0;
+	while (i < TC_PAGES) {
+		if (tc_pages[i].tp_vnode != v) {
+			i++;
+			continue;
+		}
+
+		slot = tc_pages[i].tp_slot;
+		if (!cm_attempt_lock(slot)) {
+			// Somebody is evicting it; let them finish
+			spinlock_release(&tc_spinlock);
+			thread_yield();
+			spinlock_acquire(&tc_spinlock);
+			continue;
+		}
+		spinlock_release(&tc_spinlock);
+
+		// Takes the entry out of the cache
+		cm_evict_page(slot);
+		cm_free_page(slot);
+		cm_release_lock(slot);
+
+		spinlock_acquire(&tc_spinlock);
+		i++;
+	}
+	spinlock_release(&tc_spinlock);
+}
+
+int
+textcache_map(struct vnode *v)
+{
+	unsigned int i, unused;
+
+	KASSERT(v != NULL);
+
+	lock_acquire(tc_maplock);
+
+	unused = TC_NONE;
+	for (i = 0; i < TC_VNODES; i++) {
+		if (tc_mappings[i].tm_vnode == v) {
+			tc_mappings[i].tm_count++;
+			v->vn_textmaps = tc_mappings[i].tm_count;
+			lock_release(tc_maplock);
+			return 0;
+		}
+		if (tc_mappings[i].tm_vnode == NULL && unused == TC_NONE) {
+			unused = i;
+		}
+	}
+
+	if (unused == TC_NONE) {
+		lock_release(tc_maplock);
+		return ENOSPC;
+	}
+
+	tc_mappings[unused].tm_vnode = v;
+	tc_mappings[unused].tm_count = 1;
+	v->vn_textmaps = 1;
+
+	lock_release(tc_maplock);
+	return 0;
+}
+
+void
+textcache_unmap(struct vnode *v)
+{
+	unsigned int i;
+
+	lock_acquire(tc_maplock);
+
+	for (i = 0; i < TC_VNODES; i++) {
+		if (tc_mappings[i].tm_vnode == v) {
+			break;
+		}
+	}
+	KASSERT(i < TC_VNODES);
+	KASSERT(tc_mappings[i].tm_count > 0);
+
+	tc_mappings[i].tm_count--;
+	v->vn_textmaps = tc_mappings[i].tm_count;
+	if (tc_mappings[i].tm_count == 0) {
+		tc_mappings[i].tm_vnode = NULL;
+
+		// Nobody can fault V's pages in any more, and holding
+		// the lock keeps anybody from mapping V again until
+		// they're all gone
+		tc_purge(v);
+	}
+
+	lock_release(tc_maplock);
+}
+
+void
+textcache_invalidate(struct vnode *v)
+{
+	unsigned int i;
+
+	lock_acquire(tc_maplock);
+
+	for (i = 0; i < TC_VNODES; i++) {
+		if (tc_mappings[i].tm_vnode == v) {
+			break;
+		}
+	}
+	if (i == TC_VNODES) {
+		// Not running; nothing can be cached
+		lock_release(tc_maplock);
+		return;
+	}
+
+	spinlock_acquire(&tc_spinlock);
+	tc_generation++;
+	spinlock_release(&tc_spinlock);
+
+	tc_purge(v);
+
+	lock_release(tc_maplock);
+}
+
+int
+textcache_fault(struct addrspace *as, struct vnode *v, vaddr_t va, bool *major)
+{
+	unsigned int ix, bucket, gen;
+	cme_id_t slot;
+	void *kpage;
+	bool fromfile;
+	int result;
+
+	va &= PAGE_FRAME;
+	*major = false;
+
+	while (1) {
+		spinlock_acquire(&tc_spinlock);
+
+		ix = tc_lookup(v, va);
+		if (ix != TC_NONE) {
+			slot = tc_pages[ix].tp_slot;
+			if (!cm_attempt_lock(slot)) {
+				// It's being evicted; look again once
+				// that's done
+				spinlock_release(&tc_spinlock);
+				thread_yield();
+				continue;
+			}
+			spinlock_release(&tc_spinlock);
+
+			coremap.cmes[slot].cme_recent = 1;
+			tlb_add_readonly(va, slot);
+			cm_release_lock(slot);
+			return 0;
+		}
+
+		if (tc_freelist == TC_NONE) {
+			spinlock_release(&tc_spinlock);
+			return ENOSPC;
+		}
+
+		gen = tc_generation;
+		spinlock_release(&tc_spinlock);
+
+		// Read it in. The slot stays locked, so it can't be
+		// evicted before it's in the cache.
+		slot = cm_capture_slot();
+		coremap.cmes[slot] = cme_create(NULL, va, S_TEXT);
+
+		kpage = (void *)PADDR_TO_KVADDR(CME_ID_TO_PA(slot));
+		memset(kpage, 0, PAGE_SIZE);
+
+		result = as_fill_page(as, va, kpage, &fromfile);
+		if (result) {
+			cm_free_page(slot);
+			cm_release_lock(slot);
+			return result;
+		}
+
+		spinlock_acquire(&tc_spinlock);
+
+		if (tc_lookup(v, va) != TC_NONE || tc_freelist == TC_NONE ||
+		    tc_generation != gen) {
+			// Somebody else got there first, or what we
+			// read may already be out of date
+			spinlock_release(&tc_spinlock);
+			cm_free_page(slot);
+			cm_release_lock(slot);
+			continue;
+		}
+
+		ix = tc_freelist;
+		tc_freelist = tc_pages[ix].tp_next;
+
+		bucket = tc_hash(v, va);
+		tc_pages[ix].tp_vnode = v;
+		tc_pages[ix].tp_va = va;
+		tc_pages[ix].tp_slot = slot;
+		tc_pages[ix].tp_next = tc_buckets[bucket];
+		tc_buckets[bucket] = ix;
+
+		coremap.cmes[slot].cme_swap_id = ix;
+
+		spinlock_release(&tc_spinlock);
+
+		tlb_add_readonly(va, slot);
+		cm_release_lock(slot);
+		*major = true;
+		return 0;
+	}
+}
+
+void
+textcache_forget(cme_id_t slot)
+{
+	unsigned int ix;
+
+	KASSERT(coremap.cmes[slot].cme_state == S_TEXT);
+	KASSERT(coremap.cmes[slot].cme_busy == 1);
+
+	ix = coremap.cmes[slot].cme_swap_id;
+
+	spinlock_acquire(&tc_spinlock);
+	KASSERT(ix < TC_PAGES);
+	KASSERT(tc_pages[ix].tp_slot == slot);
+	tc_remove(ix);
+	spinlock_release(&tc_spinlock);
+}
@@ -8,6 +8,7 @@
 #include <machine/tlb.h>
 #include <proc.h>
 #include <kern/errno.h>
+#include <textcache.h>
 
 /*
  * Implements the Least Recently Added (LRA) algorithm
@@ -34,11 +35,13 @@ tlb_add(uint32_t entryhi, uint32_t entrylo)
 }
 
 /*
- * Assumes that the caller holds the core map entry lock.
+ * Assumes that the caller holds the core map entry lock. The entry
+ * is writeable only if WRITEABLE and a write wouldn't change the
+ * page's state.
  */
 static
 void
-tlb_add_readable(vaddr_t va, struct pte *pte, cme_id_t cme_id)
+tlb_add_readable(vaddr_t va, struct pte *pte, cme_id_t cme_id, bool writeable)
 {
         KASSERT(curthread != NULL);
         KASSERT(pte->pte_state == S_PRESENT);
@@ -52,11 +55,16 @@ tlb_add_readable(vaddr_t va, struct pte *pte, cme_id_t cme_id)
 
         switch (cme->cme_state) {
         case S_CLEAN:
+        case S_FILE:
                 entrylo = CME_ID_TO_RONLY_TLBLO(cme_id);
                 break;
         case S_UNSWAPPED:
         case S_DIRTY:
-                entrylo = CME_ID_TO_WRITEABLE_TLBLO(cme_id);
+                if (writeable) {
+                        entrylo = CME_ID_TO_WRITEABLE_TLBLO(cme_id);
+                } else {
+                        entrylo = CME_ID_TO_RONLY_TLBLO(cme_id);
+                }
                 break;
         case S_KERNEL:
                 panic("Tried to add a kernel page to the TLB\n");
@@ -85,6 +93,10 @@ tlb_add_writeable(vaddr_t va, struct pte *pte, cme_id_t cme_id)
         if (cme->cme_state == S_CLEAN) {
             cme->cme_state = S_DIRTY;
         }
+        else if (cme->cme_state == S_FILE) {
+            // Its contents now exist only in memory
+            cme->cme_state = S_UNSWAPPED;
+        }
 
         entryhi = VA_TO_TLBHI(va);
         entrylo = CME_ID_TO_WRITEABLE_TLBLO(cme_id);
@@ -92,6 +104,15 @@ tlb_add_writeable(vaddr_t va, struct pte *pte, cme_id_t cme_id)
         tlb_add(entryhi, entrylo);
 }
 
+void
+tlb_add_readonly(vaddr_t va, cme_id_t cme_id)
+{
+        KASSERT(curthread != NULL);
+        KASSERT(coremap.cmes[cme_id].cme_state == S_TEXT);
+
+        tlb_add(VA_TO_TLBHI(va), CME_ID_TO_RONLY_TLBLO(cme_id));
+}
+
 void
 tlb_set_writeable(vaddr_t va, cme_id_t cme_id, bool writeable)
 {
@@ -113,6 +134,15 @@ tlb_set_writeable(vaddr_t va, cme_id_t cme_id, bool writeable)
                         entrylo = CME_ID_TO_RONLY_TLBLO(cme_id);
                 }
 
+                break;
+        case S_FILE:
+                if (writeable) {
+                        entrylo = CME_ID_TO_WRITEABLE_TLBLO(cme_id);
+                        cme->cme_state = S_UNSWAPPED;
+                } else {
+                        entrylo = CME_ID_TO_RONLY_TLBLO(cme_id);
+                }
+
                 break;
         case S_UNSWAPPED:
         case S_DIRTY:
@@ -199,16 +229,19 @@ vm_tlbshootdown(const struct tlbshootdown *ts)
  * in the core map and assign it to the page table entry.
  *
  * If the page was in the swap space on disk, we copy it into
- * physical memory and set its swap_id on our core map entry.
+ * physical memory and set its swap_id on our core map entry. If it
+ * has never been touched, it is zero-filled, except for any part
+ * that comes from the executable, which is read in now.
  *
  * Finally, we set the present bit to indicate the page
- * is now accessible in main memory.
+ * is now accessible in main memory, and hand back the locked slot.
+ * MAJOR is set if we had to read the page from disk.
  *
  * Assumes that the caller has validated the virtual address.
  */
 static
-cme_id_t
-ensure_in_memory(struct pte *pte, vaddr_t va)
+int
+ensure_in_memory(struct pte *pte, vaddr_t va, cme_id_t *ret, bool *major)
 {
         KASSERT(curproc != NULL);
 
@@ -216,15 +249,20 @@ ensure_in_memory(struct pte *pte, vaddr_t va)
         cme_id_t slot;
         paddr_t pa;
         struct addrspace *as;
+        bool fromfile;
+        int result;
 
         if (pte->pte_state == S_INVALID) {
                 panic("Cannot ensure than an invalid pte is in memory\n");
         }
 
+        *major = false;
+
         if (pte->pte_state == S_PRESENT) {
                 slot = PA_TO_CME_ID(pte_get_pa(pte));
                 cm_acquire_lock(slot);
-                return slot;
+                *ret = slot;
+                return 0;
         }
 
         slot = cm_capture_slot();
@@ -240,6 +278,20 @@ ensure_in_memory(struct pte *pte, vaddr_t va)
                 // Zero out the memory on the newly allocated page
                 memset((void *)PADDR_TO_KVADDR(pa), 0, PAGE_SIZE);
 
+                result = as_fill_page(as, va, (void *)PADDR_TO_KVADDR(pa),
+                                      &fromfile);
+                if (result) {
+                        // Give the slot back; the pte stays lazy
+                        coremap.cmes[slot] = cme;
+                        cm_free_page(slot);
+                        cm_release_lock(slot);
+                        return result;
+                }
+                if (fromfile) {
+                        cme.cme_state = S_FILE;
+                        *major = true;
+                }
+
                 coremap.cmes[slot] = cme;
                 break;
         case S_SWAPPED:
@@ -247,6 +299,7 @@ ensure_in_memory(struct pte *pte, vaddr_t va)
                 cme.cme_swap_id = pte_get_swap_id(pte);
 
                 swap_in(cme.cme_swap_id, slot);
+                *major = true;
 
                 coremap.cmes[slot] = cme;
                 break;
@@ -255,7 +308,27 @@ ensure_in_memory(struct pte *pte, vaddr_t va)
         pte->pte_state = S_PRESENT;
         pte_set_pa(pte, pa);
 
-        return slot;
+        *ret = slot;
+        return 0;
+}
+
+/*
+ * Charge a fault to the current process. Interrupts are off so that
+ * hardclock doesn't update its usage at the same time.
+ */
+static
+void
+vm_count_fault(bool major)
+{
+        int spl;
+
+        spl = splhigh();
+        if (major) {
+                curproc->p_rusage.ru_majflt++;
+        } else {
+                curproc->p_rusage.ru_minflt++;
+        }
+        splx(spl);
 }
 
 /*
@@ -267,8 +340,11 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 {
         struct addrspace *as;
         struct pte *pte;
+        struct vnode *v;
         cme_id_t cme_id;
         paddr_t pa;
+        bool writeable, major;
+        int result;
 
         if (curproc == NULL) {
                 /*
@@ -292,17 +368,50 @@ vm_fault(int faulttype, vaddr_t faultaddress)
                 return EFAULT;
         }
 
+        writeable = as_va_writeable(as, faultaddress);
+
+        if (faulttype == VM_FAULT_READ) {
+                if (!as_va_readable(as, faultaddress)) {
+                        return EFAULT;
+                }
+        } else if (!writeable) {
+                return EFAULT;
+        }
+
         pte = pagetable_get_pte_from_va(as->as_pt, faultaddress);
         if (pte == NULL || pte->pte_state == S_INVALID) {
                 return EFAULT;
         }
 
         pt_acquire_lock(as->as_pt, pte);
-        cme_id = ensure_in_memory(pte, faultaddress);
+
+        // Shared text pages stay lazy in the page table, and come
+        // from the text cache on every TLB miss. If it's full, give
+        // the process a page of its own.
+        if (pte->pte_state == S_LAZY && as_va_shared(as, faultaddress, &v)) {
+                pt_release_lock(as->as_pt, pte);
+
+                result = textcache_fault(as, v, faultaddress, &major);
+                if (result != ENOSPC) {
+                        if (!result) {
+                                vm_count_fault(major);
+                        }
+                        return result;
+                }
+
+                pt_acquire_lock(as->as_pt, pte);
+        }
+
+        result = ensure_in_memory(pte, faultaddress, &cme_id, &major);
+        if (result) {
+                pt_release_lock(as->as_pt, pte);
+                return result;
+        }
+        vm_count_fault(major);
 
         switch (faulttype) {
         case VM_FAULT_READ:
-                tlb_add_readable(faultaddress, pte, cme_id);
+                tlb_add_readable(faultaddress, pte, cme_id, writeable);
                 break;
         case VM_FAULT_WRITE:
                 tlb_add_writeable(faultaddress, pte, cme_id);
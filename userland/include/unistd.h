@@ -40,9 +40,12 @@
  */
 #include <kern/fcntl.h>
 #include <kern/ioctl.h>
+#include <kern/mman.h>
+#include <kern/poll.h>
 #include <kern/reboot.h>
 #include <kern/seek.h>
 #include <kern/time.h>
+#include <kern/resource.h>	/* after kern/time.h, for struct timeval */
 #include <kern/unistd.h>
 #include <kern/wait.h>
 
@@ -140,11 +143,15 @@ int link(const char *oldfile, const char *newfile);
 int chdir(const char *path);
 
 /* Optional. */
+pid_t vfork(void);
+pid_t wait4(pid_t pid, int *returncode, int flags, struct rusage *usage);
 void *sbrk(__intptr_t change);
+int mprotect(void *addr, size_t len, int prot);
 ssize_t getdirentry(int filehandle, char *buf, size_t buflen);
 int symlink(const char *target, const char *linkname);
 ssize_t readlink(const char *path, char *buf, size_t buflen);
 int dup2(int filehandle, int newhandle);
+int poll(struct pollfd *fds, unsigned nfds, int timeout);
 int pipe(int filehandles[2]);
 int __time(time_t *seconds, unsigned long *nanoseconds);
 ssize_t __getcwd(char *buf, size_t buflen);
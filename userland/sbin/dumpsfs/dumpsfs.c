@@ -364,13 +364,20 @@ dump_client_record(uint32_t myblock, unsigned myoffset, uint64_t mylsn,
 		   unsigned type, void *data, size_t len)
 {
 	char buf[64];
-	struct sfs_record record;
-	uint32_t i;
-
-	copyandzero(&record, sizeof(struct sfs_record), data, len);
+	const char *ptr = data;
+	struct sfs_disk_tx dt;
+	struct sfs_disk_freemap_update dfu;
+	struct sfs_disk_meta_update dmu;
+	struct sfs_disk_user_block_write dub;
+	struct sfs_disk_user_cluster_write duc;
+	uint32_t checksum;
+	unsigned i, n;
+
+	/* every encoding starts with the transaction id */
+	copyandzero(&dt, sizeof(dt), data, len < sizeof(dt) ? len : sizeof(dt));
 
 	snprintf(buf, sizeof(buf), "[%u.%u]:", myblock, myoffset);
-	printf("    %-8s %-8llu %u ", buf, (unsigned long long)mylsn, (unsigned)SWAP32(record.r_txid));
+	printf("    %-8s %-8llu %u ", buf, (unsigned long long)mylsn, (unsigned)SWAP32(dt.sdt_txid));
 
 	switch (type) {
         case R_TX_BEGIN:
@@ -380,32 +387,56 @@ dump_client_record(uint32_t myblock, unsigned myoffset, uint64_t mylsn,
 		printf("TX_COMMIT\n");
 		break;
         case R_FREEMAP_CAPTURE:
-		printf("FREEMAP_CAPTURE ");
-		printf("block:%u\n", (unsigned)SWAP32(record.freemap_update.block));
-		break;
         case R_FREEMAP_RELEASE:
-		printf("FREEMAP_RELEASE ");
-		printf("block:%u\n", (unsigned)SWAP32(record.freemap_update.block));
+		printf(type == R_FREEMAP_CAPTURE ?
+		       "FREEMAP_CAPTURE " : "FREEMAP_RELEASE ");
+		copyandzero(&dfu, sizeof(dfu), data,
+			    len < sizeof(dfu) ? len : sizeof(dfu));
+		printf("block:%u\n", (unsigned)SWAP32(dfu.sdf_block));
 		break;
         case R_META_UPDATE:
 		printf("META_UPDATE ");
-		printf("block:%u ", (unsigned)SWAP32(record.meta_update.block));
-		printf("pos:%u ", (unsigned)SWAP32(record.meta_update.pos));
-		printf("len:%u ", (unsigned)SWAP32(record.meta_update.len));
+		copyandzero(&dmu, sizeof(dmu), data,
+			    len < sizeof(dmu) ? len : sizeof(dmu));
+		n = SWAP16(dmu.sdm_len);
+		printf("block:%u ", (unsigned)SWAP32(dmu.sdm_block));
+		printf("pos:%u ", (unsigned)SWAP16(dmu.sdm_pos));
+		printf("len:%u ", n);
+		if (len < sizeof(dmu) + 2 * n) {
+			printf("[truncated]\n");
+			break;
+		}
+		ptr += sizeof(dmu);
 		printf("old:");
-		for (i = 0; i < (unsigned)SWAP32(record.meta_update.len); i++) {
-			printf("%c", record.meta_update.old_value[i]);
+		for (i = 0; i < n; i++) {
+			printf("%c", ptr[i]);
 		}
 		printf(" new:");
-		for (i = 0; i < (unsigned)SWAP32(record.meta_update.len); i++) {
-			printf("%c", record.meta_update.new_value[i]);
+		for (i = 0; i < n; i++) {
+			printf("%c", ptr[n + i]);
 		}
 		printf("\n");
 		break;
         case R_USER_BLOCK_WRITE:
 		printf("USER_BLOCK_WRITE ");
-		printf("block:%u ", (unsigned)SWAP32(record.user_block_write.block));
-		printf("checksum:%u\n", (unsigned)SWAP32(record.user_block_write.checksum));
+		copyandzero(&dub, sizeof(dub), data,
+			    len < sizeof(dub) ? len : sizeof(dub));
+		printf("block:%u ", (unsigned)SWAP32(dub.sdu_block));
+		printf("checksum:%u\n", (unsigned)SWAP32(dub.sdu_checksum));
+		break;
+        case R_USER_CLUSTER_WRITE:
+		printf("USER_CLUSTER_WRITE ");
+		copyandzero(&duc, sizeof(duc), data,
+			    len < sizeof(duc) ? len : sizeof(duc));
+		n = SWAP32(duc.sdc_nblocks);
+		printf("block:%u ", (unsigned)SWAP32(duc.sdc_block));
+		printf("nblocks:%u checksums:", n);
+		ptr += sizeof(duc);
+		for (i = 0; i < n && sizeof(duc) + (i + 1) * sizeof(checksum) <= len; i++) {
+			memcpy(&checksum, ptr + i * sizeof(checksum), sizeof(checksum));
+			printf(" %u", (unsigned)SWAP32(checksum));
+		}
+		printf("\n");
 		break;
 	default:
 		/* XXX hexdump it */
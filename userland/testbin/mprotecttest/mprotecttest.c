@@ -0,0 +1,94 @@
+/*
+ * mprotecttest - test mprotect().
+ *
+ * Makes a page of the data segment read-only and checks that reading
+ * it still works but writing it kills the process, and that making
+ * it writable again lets writes through. The write that should fault
+ * is done in a child so we can see how it died.
+ */
+
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <err.h>
+
+#define PAGE_SIZE 4096
+
+/*
+ * Room for a whole page in the data segment. mprotect only works on
+ * the executable's segments, not the heap or stack. Initialized so
+ * it's in .data rather than .bss.
+ */
+static char area[3 * PAGE_SIZE] = { 1 };
+
+/*
+ * Get a page-aligned page of the data segment.
+ */
+static
+volatile char *
+getpage(void)
+{
+	uintptr_t addr;
+
+	addr = ((uintptr_t)area + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1);
+	return (volatile char *)addr;
+}
+
+static
+void
+doprotect(volatile char *page, int prot)
+{
+	if (mprotect((void *)page, PAGE_SIZE, prot) < 0) {
+		err(1, "mprotect");
+	}
+}
+
+int
+main(void)
+{
+	volatile char *page;
+	pid_t pid;
+	int status;
+
+	page = getpage();
+	page[0] = 'a';
+	page[PAGE_SIZE - 1] = 'z';
+
+	printf("Making the page read-only...\n");
+	doprotect(page, PROT_READ);
+	if (page[0] != 'a' || page[PAGE_SIZE - 1] != 'z') {
+		errx(1, "FAILED: read-only page lost its contents");
+	}
+
+	printf("Writing to it in a child; the child should die...\n");
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		page[PAGE_SIZE / 2] = 'x';
+		/* Not reached, we hope */
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFSIGNALED(status)) {
+		errx(1, "FAILED: write to read-only page did not fault");
+	}
+	printf("Child died with signal %d\n", WTERMSIG(status));
+
+	if (page[PAGE_SIZE / 2] != 0) {
+		errx(1, "FAILED: child's faulting write changed the page");
+	}
+
+	printf("Making the page writable again...\n");
+	doprotect(page, PROT_READ | PROT_WRITE);
+	page[PAGE_SIZE / 2] = 'x';
+	if (page[PAGE_SIZE / 2] != 'x' || page[0] != 'a') {
+		errx(1, "FAILED: page not writable after mprotect");
+	}
+
+	printf("mprotecttest: passed\n");
+	return 0;
+}
@@ -0,0 +1,146 @@
+/*
+ * polltest - test poll().
+ *
+ * Checks that a zero timeout returns at once, that a finite timeout
+ * runs out (polling the console for input, so don't type while it's
+ * running), that the console is writable straight away, and that a
+ * closed descriptor comes back with POLLNVAL.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <err.h>
+
+#define TIMEOUT		1000	/* milliseconds */
+#define SLACK		100	/* timeouts are only good to a tick */
+#define SPAREFD		10
+
+/*
+ * Milliseconds since some fixed point.
+ */
+static
+unsigned long
+now_ms(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	if (__time(&secs, &nsecs) < 0) {
+		err(1, "__time");
+	}
+	return (unsigned long)secs * 1000 + nsecs / 1000000;
+}
+
+/*
+ * Poll one descriptor, returning what poll did and how long it took.
+ */
+static
+int
+pollone(int fd, short events, int timeout, short *revents,
+	unsigned long *elapsed)
+{
+	struct pollfd pfd;
+	unsigned long start;
+	int result;
+
+	pfd.fd = fd;
+	pfd.events = events;
+	pfd.revents = 0;
+
+	start = now_ms();
+	result = poll(&pfd, 1, timeout);
+	*elapsed = now_ms() - start;
+	if (result < 0) {
+		err(1, "poll");
+	}
+
+	*revents = pfd.revents;
+	return result;
+}
+
+static
+void
+test_zero(void)
+{
+	unsigned long elapsed;
+	short revents;
+
+	printf("Timeout 0...\n");
+	pollone(STDIN_FILENO, POLLIN, 0, &revents, &elapsed);
+	if (elapsed >= SLACK) {
+		errx(1, "FAILED: poll with no timeout took %lu ms", elapsed);
+	}
+}
+
+static
+void
+test_timeout(void)
+{
+	unsigned long elapsed;
+	short revents;
+	int result;
+
+	printf("Timeout %d ms...\n", TIMEOUT);
+	result = pollone(STDIN_FILENO, POLLIN, TIMEOUT, &revents, &elapsed);
+	if (result != 0) {
+		printf("Console input was ready; skipping\n");
+		return;
+	}
+	if (revents != 0) {
+		errx(1, "FAILED: timed-out poll set revents 0x%x", revents);
+	}
+	if (elapsed + SLACK < TIMEOUT) {
+		errx(1, "FAILED: %d ms timeout ran out after %lu ms",
+		     TIMEOUT, elapsed);
+	}
+	printf("Timed out after %lu ms\n", elapsed);
+}
+
+static
+void
+test_writable(void)
+{
+	unsigned long elapsed;
+	short revents;
+	int result;
+
+	printf("Console output...\n");
+	result = pollone(STDOUT_FILENO, POLLOUT, INFTIM, &revents, &elapsed);
+	if (result != 1 || revents != POLLOUT) {
+		errx(1, "FAILED: console not writable (result %d, "
+		     "revents 0x%x)", result, revents);
+	}
+}
+
+static
+void
+test_closed(void)
+{
+	unsigned long elapsed;
+	short revents;
+	int result;
+
+	printf("Closed descriptor...\n");
+	if (dup2(STDOUT_FILENO, SPAREFD) < 0) {
+		err(1, "dup2");
+	}
+	if (close(SPAREFD) < 0) {
+		err(1, "close");
+	}
+	result = pollone(SPAREFD, POLLIN, INFTIM, &revents, &elapsed);
+	if (result != 1 || revents != POLLNVAL) {
+		errx(1, "FAILED: closed fd gave result %d, revents 0x%x",
+		     result, revents);
+	}
+}
+
+int
+main(void)
+{
+	test_zero();
+	test_timeout();
+	test_writable();
+	test_closed();
+	printf("polltest: passed\n");
+	return 0;
+}
@@ -0,0 +1,115 @@
+/*
+ * vforktest - test vfork().
+ *
+ * The child of vfork runs in its parent's address space, and the
+ * parent doesn't return from vfork until the child calls execv or
+ * _exit. Check both: the child takes its time and leaves marks in a
+ * global, and the parent must find the last mark when it resumes.
+ *
+ * The child is on the parent's stack, so it must not return from the
+ * function that called vfork; it only calls _exit or execv.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <err.h>
+
+#define EXECPROG	"/bin/true"
+
+static volatile int mark;
+
+/*
+ * Take about SECS seconds.
+ */
+static
+void
+spin(time_t secs)
+{
+	time_t start, now;
+	unsigned long nsecs;
+
+	__time(&start, &nsecs);
+	do {
+		__time(&now, &nsecs);
+	} while (now - start < secs);
+}
+
+static
+void
+reap(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (WIFSIGNALED(status)) {
+		errx(1, "FAILED: child: Signal %d", WTERMSIG(status));
+	}
+	if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+		errx(1, "FAILED: child: Exit %d", WEXITSTATUS(status));
+	}
+}
+
+static
+void
+test_exit(void)
+{
+	pid_t pid;
+
+	printf("vfork, child exits after a while...\n");
+	mark = 0;
+	pid = vfork();
+	if (pid < 0) {
+		err(1, "vfork");
+	}
+	if (pid == 0) {
+		mark = 1;
+		spin(1);
+		mark = 2;
+		_exit(0);
+	}
+	if (mark != 2) {
+		errx(1, "FAILED: parent resumed before the child exited "
+		     "(mark %d)", mark);
+	}
+	reap(pid);
+}
+
+static
+void
+test_execv(void)
+{
+	char *args[2];
+	pid_t pid;
+
+	printf("vfork, child runs %s...\n", EXECPROG);
+	mark = 0;
+	pid = vfork();
+	if (pid < 0) {
+		err(1, "vfork");
+	}
+	if (pid == 0) {
+		spin(1);
+		mark = 3;
+		args[0] = (char *)EXECPROG;
+		args[1] = NULL;
+		execv(EXECPROG, args);
+		/* execv failed */
+		_exit(1);
+	}
+	if (mark != 3) {
+		errx(1, "FAILED: parent resumed before the child exec'd "
+		     "(mark %d)", mark);
+	}
+	reap(pid);
+}
+
+int
+main(void)
+{
+	test_exit();
+	test_execv();
+	printf("vforktest: passed\n");
+	return 0;
+}
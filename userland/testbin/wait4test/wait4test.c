@@ -0,0 +1,117 @@
+/*
+ * wait4test - test wait4() and WNOHANG.
+ *
+ * Starts a child that burns CPU for a couple of seconds and checks
+ * that waiting for it with WNOHANG returns 0 while it's still
+ * running, that a blocking wait4 then collects its exit status, and
+ * that the rusage handed back shows the CPU time it used. Finally
+ * checks that WAIT_ANY collects a child too.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <err.h>
+
+#define SPINSECS	2
+#define EXITCODE	3
+
+/*
+ * Use up CPU for about SECS seconds.
+ */
+static
+void
+spin(time_t secs)
+{
+	time_t start, now;
+	unsigned long nsecs;
+
+	__time(&start, &nsecs);
+	do {
+		__time(&now, &nsecs);
+	} while (now - start < secs);
+}
+
+static
+pid_t
+dofork(void)
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	return pid;
+}
+
+static
+void
+checkstatus(int status)
+{
+	if (WIFSIGNALED(status)) {
+		errx(1, "FAILED: child: Signal %d", WTERMSIG(status));
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != EXITCODE) {
+		errx(1, "FAILED: child: Exit %d, expected %d",
+		     WEXITSTATUS(status), EXITCODE);
+	}
+}
+
+int
+main(void)
+{
+	struct rusage ru;
+	pid_t pid, result;
+	int status;
+
+	pid = dofork();
+	if (pid == 0) {
+		spin(SPINSECS);
+		_exit(EXITCODE);
+	}
+
+	printf("Polling child %d with WNOHANG...\n", pid);
+	result = wait4(pid, &status, WNOHANG, &ru);
+	if (result < 0) {
+		err(1, "wait4 WNOHANG");
+	}
+	if (result != 0) {
+		errx(1, "FAILED: WNOHANG returned %d for a running child",
+		     result);
+	}
+
+	printf("Waiting for it...\n");
+	result = wait4(pid, &status, 0, &ru);
+	if (result < 0) {
+		err(1, "wait4");
+	}
+	if (result != pid) {
+		errx(1, "FAILED: wait4 returned %d, expected %d", result, pid);
+	}
+	checkstatus(status);
+
+	printf("Child used %lu.%06lu s user, %lu.%06lu s system\n",
+	       (unsigned long)ru.ru_utime.tv_sec,
+	       (unsigned long)ru.ru_utime.tv_usec,
+	       (unsigned long)ru.ru_stime.tv_sec,
+	       (unsigned long)ru.ru_stime.tv_usec);
+	if (ru.ru_utime.tv_sec == 0 && ru.ru_utime.tv_usec == 0 &&
+	    ru.ru_stime.tv_sec == 0 && ru.ru_stime.tv_usec == 0) {
+		errx(1, "FAILED: rusage shows no CPU time");
+	}
+
+	printf("Waiting for any child...\n");
+	pid = dofork();
+	if (pid == 0) {
+		_exit(EXITCODE);
+	}
+	result = wait4(WAIT_ANY, &status, 0, NULL);
+	if (result != pid) {
+		errx(1, "FAILED: wait4(WAIT_ANY) returned %d, expected %d",
+		     result, pid);
+	}
+	checkstatus(status);
+
+	printf("wait4test: passed\n");
+	return 0;
+}